@@ -0,0 +1,96 @@
+#!/usr/bin/env bash
+
+# Generates scripts of N statements (short-running, so that most of the time is
+# spent compiling), compiles each into a bytecode file (`--compile-only`), and
+# reports the best wall time out of a number of runs of the script from source,
+# from the bytecode file, and from source using the compile cache (`--cache-dir`,
+# after a first run has stored the compiled program). The outputs are checked to
+# be the same.
+#
+# Usage: ./benchmarks/bytecode_file_startup.sh [path to cthusly]
+#   (Defaults to ./bin/cthusly.)
+#
+# Environment variables:
+#   SIZES  The sizes (N) to generate scripts of (default: "100 1000 10000")
+#   RUNS   The number of runs per script (default: 10)
+
+root_dir="$(cd "$(dirname "${BASH_SOURCE[0]}")/.." && pwd)"
+cthusly="${1:-$root_dir/bin/cthusly}"
+sizes="${SIZES:-100 1000 10000}"
+runs="${RUNS:-10}"
+
+if [ ! -x "$cthusly" ]; then
+  echo -e "\nConfiguration error: $cthusly was not found. Please build the project first."
+  exit 1
+fi
+
+script_dir="$(mktemp -d)"
+trap 'rm -rf "$script_dir"' EXIT
+
+# Print a script of `$1` statements, using variables, texts, and control flow.
+generate_script() {
+  awk -v n="$1" '
+    BEGIN {
+      print "var total: 0"
+      print "var label: \"\""
+      for (i = 0; i < n; i++) {
+        kind = i % 4
+        if (kind == 0)
+          print "total: total + " i " * 2"
+        else if (kind == 1)
+          print "label: \"statement number " i "\""
+        else if (kind == 2) {
+          print "if total > " i
+          print "  total: total - " i
+          print "end"
+        }
+        else
+          print "total +: " i % 10
+      }
+      print "@out total"
+      print "@out label"
+    }
+  '
+}
+
+# Print the best (lowest) wall time in milliseconds out of `$runs` runs.
+best_time_ms() {
+  local best=""
+  for ((run = 0; run < runs; run++)); do
+    local start=$(date +%s%N)
+    "$@" > /dev/null 2>&1
+    local end=$(date +%s%N)
+    local elapsed=$(((end - start) / 1000000))
+    if [ -z "$best" ] || [ "$elapsed" -lt "$best" ]; then
+      best=$elapsed
+    fi
+  done
+  echo "$best"
+}
+
+cache_dir="$script_dir/cache"
+
+printf "%8s %12s %12s %12s %14s %12s\n" "N" "Source (B)" "Bytecode (B)" "Source (ms)" "Bytecode (ms)" "Cached (ms)"
+for size in $sizes; do
+  script="$script_dir/script-$size.th"
+  bytecode_file="$script_dir/script-$size.thbc"
+  generate_script "$size" > "$script"
+  if ! "$cthusly" --compile-only -o "$bytecode_file" "$script"; then
+    echo "script-$size.th: The script could not be compiled."
+    exit 1
+  fi
+
+  output=$("$cthusly" "$script" 2>&1)
+  if [ "$output" != "$("$cthusly" "$bytecode_file" 2>&1)" ] || [ "$output" != "$("$cthusly" --cache-dir "$cache_dir" "$script" 2>&1)" ]; then
+    echo "script-$size.th: The outputs from source, the bytecode file, and the compile cache differ."
+    exit 1
+  fi
+
+  printf "%8d %12d %12d %12d %14d %12d\n" \
+    "$size" \
+    "$(wc -c < "$script")" \
+    "$(wc -c < "$bytecode_file")" \
+    "$(best_time_ms "$cthusly" "$script")" \
+    "$(best_time_ms "$cthusly" "$bytecode_file")" \
+    "$(best_time_ms "$cthusly" --cache-dir "$cache_dir" "$script")"
+done
@@ -0,0 +1,54 @@
+#!/usr/bin/env bash
+
+# Differential test - Runs programs with the default interpreter and with the
+# given cthusly options (e.g. `--jit`), and reports any program whose output
+# (stdout and stderr) or exit code differs.
+#
+# Usage: ./benchmarks/compare_outputs.sh [cthusly options...] [-- paths...]
+#   (Uses `--jit` if no options are provided, and runs every program in
+#   `benchmarks/programs` if no paths are provided.)
+#
+# Environment variables:
+#   CTHUSLY   The executable to use (default: bin/cthusly)
+
+root_dir="$(cd "$(dirname "${BASH_SOURCE[0]}")/.." && pwd)"
+cthusly="${CTHUSLY:-$root_dir/bin/cthusly}"
+
+if [ ! -x "$cthusly" ]; then
+  echo -e "\nThe executable was not found ($cthusly). Please build the project first."
+  exit 1
+fi
+
+options=()
+while [ $# -gt 0 ] && [ "$1" != "--" ]; do
+  options+=("$1")
+  shift
+done
+[ "$1" == "--" ] && shift
+[ ${#options[@]} -eq 0 ] && options=("--jit")
+
+paths=("$@")
+[ ${#paths[@]} -eq 0 ] && paths=("$root_dir"/benchmarks/programs/*.th)
+
+expected_output="$(mktemp)"
+actual_output="$(mktemp)"
+trap 'rm -f "$expected_output" "$actual_output"' EXIT
+
+failures=0
+for path in "${paths[@]}"; do
+  "$cthusly" "$path" > "$expected_output" 2>&1
+  expected_exit_code=$?
+  "$cthusly" "${options[@]}" "$path" > "$actual_output" 2>&1
+  actual_exit_code=$?
+
+  if [ $expected_exit_code -ne $actual_exit_code ] || ! cmp -s "$expected_output" "$actual_output"; then
+    echo "FAILED: $(basename "$path") (exit code $expected_exit_code vs $actual_exit_code)"
+    diff "$expected_output" "$actual_output" | head -20
+    failures=$((failures + 1))
+  else
+    echo "ok:     $(basename "$path")"
+  fi
+done
+
+echo -e "\n$((${#paths[@]} - failures)) of ${#paths[@]} programs behave the same with: ${options[*]}"
+[ $failures -eq 0 ]
@@ -0,0 +1,89 @@
+#!/usr/bin/env bash
+
+# Generates a corpus of scripts that use constant expressions the way programs
+# tend to (unit conversions, negative numbers, texts split over several literals,
+# and constant conditions), compiles and runs each with `--stats`, and reports
+# the number of instructions removed by constant folding next to the size of
+# the bytecode that remains.
+#
+# Usage: ./benchmarks/constant_folding_report.sh [path to cthusly]
+#   (Defaults to ./bin/cthusly.)
+#
+# Environment variables:
+#   SCRIPTS  The number of scripts to generate (default: 20)
+
+root_dir="$(cd "$(dirname "${BASH_SOURCE[0]}")/.." && pwd)"
+cthusly="${1:-$root_dir/bin/cthusly}"
+script_count="${SCRIPTS:-20}"
+
+if [ ! -x "$cthusly" ]; then
+  echo -e "\nConfiguration error: $cthusly was not found. Please build the project first."
+  exit 1
+fi
+
+corpus_dir="$(mktemp -d)"
+trap 'rm -rf "$corpus_dir"' EXIT
+
+# Print a script of `$2` random statements (seeded by `$1`).
+generate_script() {
+  awk -v seed="$1" -v statement_count="$2" '
+    function number() {
+      return numbers[int(rand() * number_count)]
+    }
+    BEGIN {
+      srand(seed)
+      number_count = split("1 2 3 5 10 60 100 0.5", numbers, " ")
+
+      print "var total: 0"
+      print "var label: \"\""
+      print "var is_verbose: false"
+      for (i = 0; i < statement_count; i++) {
+        kind = int(rand() * 7)
+        if (kind == 0)
+          print "total: total + " number() " * 60 * 60"
+        else if (kind == 1)
+          print "total +: -(" number() " * " number() ") + " number()
+        else if (kind == 2)
+          print "label: \"total (in seconds): \" + \"pending\""
+        else if (kind == 3) {
+          print "if not is_verbose and total > 1000 * " number()
+          print "  total: total mod (" number() " + 1)"
+          print "end"
+        }
+        else if (kind == 4) {
+          print "foreach i in 1.." number()
+          print "  total +: i * (1 / " number() ")"
+          print "end"
+        }
+        else if (kind == 5)
+          print "is_verbose: (" number() " > " number() ") and (1 = 1)"
+        else
+          print "@out total"
+      }
+      print "@out label"
+      print "@out total"
+    }
+  '
+}
+
+printf "%-12s %16s %22s\n" "Script" "Bytecode (bytes)" "Instructions removed"
+total_bytecode=0
+total_removed=0
+for ((i = 1; i <= script_count; i++)); do
+  script="$corpus_dir/generated_$i.th"
+  generate_script "$i" $((20 * i)) > "$script"
+
+  stats=$("$cthusly" --stats "$script" 2>&1 > /dev/null)
+  bytecode=$(echo "$stats" | awk -F: '/Bytecode \(bytes\)/ { gsub(/ /, "", $2); print $2 }')
+  removed=$(echo "$stats" | awk -F: '/Instructions removed by folding/ { gsub(/ /, "", $2); print $2 }')
+  if [ -z "$bytecode" ] || [ -z "$removed" ]; then
+    echo "generated_$i.th: No stats were reported."
+    exit 1
+  fi
+
+  total_bytecode=$((total_bytecode + bytecode))
+  total_removed=$((total_removed + removed))
+  printf "%-12s %16d %22d\n" "generated_$i" "$bytecode" "$removed"
+done
+
+printf "%-12s %16d %22d\n" "Total" "$total_bytecode" "$total_removed"
@@ -0,0 +1,96 @@
+#!/usr/bin/env bash
+
+# Generates a corpus of scripts that use literals the way programs tend to
+# (the same small numbers and texts in many places), compiles and runs each
+# with `--stats`, and reports the number of literals compiled versus the size
+# of the constant pool. (Before literals with equal values shared a constant,
+# the pool held one constant per literal.)
+#
+# Usage: ./benchmarks/constant_pool_report.sh [path to cthusly]
+#   (Defaults to ./bin/cthusly.)
+#
+# Environment variables:
+#   SCRIPTS  The number of scripts to generate (default: 20)
+
+root_dir="$(cd "$(dirname "${BASH_SOURCE[0]}")/.." && pwd)"
+cthusly="${1:-$root_dir/bin/cthusly}"
+script_count="${SCRIPTS:-20}"
+# The number of constants that a program may use (see CONSTANTS_MAX in src/compiler.c).
+constants_max=256
+
+if [ ! -x "$cthusly" ]; then
+  echo -e "\nConfiguration error: $cthusly was not found. Please build the project first."
+  exit 1
+fi
+
+corpus_dir="$(mktemp -d)"
+trap 'rm -rf "$corpus_dir"' EXIT
+
+# Print a script of `$2` random statements (seeded by `$1`).
+generate_script() {
+  awk -v seed="$1" -v statement_count="$2" '
+    function number() {
+      return numbers[int(rand() * number_count)]
+    }
+    function text() {
+      return "\"" texts[int(rand() * text_count)] "\""
+    }
+    BEGIN {
+      srand(seed)
+      number_count = split("0 1 2 3 5 10 100 1000 0.5 42", numbers, " ")
+      text_count = split("ok|error|total|count|result|pending review|completed successfully|item-|separator", texts, "|")
+
+      print "var total: 0"
+      print "var label: \"\""
+      for (i = 0; i < statement_count; i++) {
+        kind = int(rand() * 6)
+        if (kind == 0)
+          print "total: total + " number() " * " number()
+        else if (kind == 1)
+          print "total +: " number()
+        else if (kind == 2)
+          print "label: " text() " + " text()
+        else if (kind == 3) {
+          print "if total > " number()
+          print "  total: total mod (" number() " + 1)"
+          print "end"
+        }
+        else if (kind == 4) {
+          print "foreach i in " number() ".." number()
+          print "  total +: i * " number()
+          print "end"
+        }
+        else
+          print "@out label = " text()
+      }
+      print "@out total"
+    }
+  '
+}
+
+printf "%-12s %10s %10s %10s\n" "Script" "Literals" "Constants" "Reduction"
+total_literals=0
+total_constants=0
+over_limit_before=0
+over_limit_after=0
+for ((i = 1; i <= script_count; i++)); do
+  script="$corpus_dir/generated_$i.th"
+  generate_script "$i" $((20 * i)) > "$script"
+
+  stats=$("$cthusly" --stats "$script" 2>&1 > /dev/null)
+  literals=$(echo "$stats" | awk -F: '/Literals compiled/ { gsub(/ /, "", $2); print $2 }')
+  constants=$(echo "$stats" | awk -F: '/Constants \(distinct literals\)/ { gsub(/ /, "", $2); print $2 }')
+  if [ -z "$literals" ] || [ -z "$constants" ]; then
+    echo "generated_$i.th: No stats were reported."
+    exit 1
+  fi
+
+  total_literals=$((total_literals + literals))
+  total_constants=$((total_constants + constants))
+  [ "$literals" -gt "$constants_max" ] && over_limit_before=$((over_limit_before + 1))
+  [ "$constants" -gt "$constants_max" ] && over_limit_after=$((over_limit_after + 1))
+  printf "%-12s %10d %10d %9.1fx\n" "generated_$i" "$literals" "$constants" "$(awk "BEGIN { print $literals / $constants }")"
+done
+
+printf "%-12s %10d %10d %9.1fx\n" "Total" "$total_literals" "$total_constants" "$(awk "BEGIN { print $total_literals / $total_constants }")"
+echo -e "\nScripts exceeding the $constants_max-constant limit: $over_limit_before with one constant per literal, $over_limit_after when shared."
@@ -0,0 +1,143 @@
+#!/usr/bin/env bash
+
+# Generates a corpus of scripts the way templates produce them: feature flags
+# substituted as constant conditions (`if false`, `if true ... else`, `while
+# false`) guarding blocks inside a hot loop. Each script is compiled and run at
+# -O0 (every block compiled) and -O1 (dead branches not compiled), with the
+# interpreter and the JIT, and the size of the bytecode and the best wall time
+# are reported. The outputs are checked to be the same.
+#
+# The instruction-cache misses of the runs are also reported when `perf` is
+# available (the loop bodies shrink, and so does the code the JIT generates).
+#
+# Usage: ./benchmarks/dead_branch_report.sh [path to cthusly]
+#   (Defaults to ./bin/cthusly.)
+#
+# Environment variables:
+#   SCRIPTS  The number of scripts to generate (default: 8)
+#   RUNS     The number of runs per script and configuration (default: 3)
+
+root_dir="$(cd "$(dirname "${BASH_SOURCE[0]}")/.." && pwd)"
+cthusly="${1:-$root_dir/bin/cthusly}"
+script_count="${SCRIPTS:-8}"
+runs="${RUNS:-3}"
+
+if [ ! -x "$cthusly" ]; then
+  echo -e "\nConfiguration error: $cthusly was not found. Please build the project first."
+  exit 1
+fi
+
+has_perf=false
+if command -v perf > /dev/null 2>&1 && perf stat -e L1-icache-load-misses true > /dev/null 2>&1; then
+  has_perf=true
+fi
+
+corpus_dir="$(mktemp -d)"
+trap 'rm -rf "$corpus_dir"' EXIT
+
+# Print a script with `$2` flag-guarded blocks in a loop (seeded by `$1`).
+generate_script() {
+  awk -v seed="$1" -v block_count="$2" '
+    function flag() {
+      return rand() < 0.5 ? "true" : "false"
+    }
+    function guarded_statements(indent,    j) {
+      for (j = 0; j < 3; j++) {
+        kind = int(rand() * 3)
+        if (kind == 0)
+          print indent "total: (total + i * " int(rand() * 9 + 1) ") mod 100003"
+        else if (kind == 1)
+          print indent "count +: 1"
+        else
+          print indent "total: (total * 3 + count) mod 100003"
+      }
+    }
+    BEGIN {
+      srand(seed)
+      print "var total: 0"
+      print "var count: 0"
+      print "foreach i in 1..20000"
+      for (b = 0; b < block_count; b++) {
+        kind = int(rand() * 3)
+        if (kind == 0) {
+          print "  if " flag()
+          print "    var feature_" b ": i"
+          guarded_statements("    ")
+          print "  end"
+        }
+        else if (kind == 1) {
+          print "  if " flag()
+          guarded_statements("    ")
+          print "  else"
+          guarded_statements("    ")
+          print "  end"
+        }
+        else {
+          print "  while false"
+          guarded_statements("    ")
+          print "  end"
+        }
+      }
+      print "end"
+      print "@out total"
+      print "@out count"
+    }
+  '
+}
+
+# Print the best (lowest) wall time in milliseconds out of `$runs` runs.
+best_time_ms() {
+  local best=""
+  for ((run = 0; run < runs; run++)); do
+    local start=$(date +%s%N)
+    "$@" > /dev/null 2>&1
+    local end=$(date +%s%N)
+    local elapsed=$(((end - start) / 1000000))
+    if [ -z "$best" ] || [ "$elapsed" -lt "$best" ]; then
+      best=$elapsed
+    fi
+  done
+  echo "$best"
+}
+
+# Print the number of L1 instruction-cache misses of a run (or "-" without `perf`).
+icache_misses() {
+  if [ "$has_perf" != true ]; then
+    echo "-"
+    return
+  fi
+  perf stat -x, -e L1-icache-load-misses "$@" 2>&1 > /dev/null | awk -F, '/L1-icache-load-misses/ { print $1 }'
+}
+
+# Print the size of the bytecode that `$1` compiles into at optimization level `$2`.
+bytecode_size() {
+  "$cthusly" "$2" --stats "$1" 2>&1 > /dev/null | awk -F: '/Bytecode \(bytes\)/ { gsub(/ /, "", $2); print $2 }'
+}
+
+printf "%-12s %-7s %15s %9s %9s %15s %15s\n" "Script" "Level" "Bytecode (bytes)" "VM (ms)" "JIT (ms)" "VM i-misses" "JIT i-misses"
+for ((i = 1; i <= script_count; i++)); do
+  script="$corpus_dir/generated_$i.th"
+  generate_script "$i" $((10 * i)) > "$script"
+  expected=$("$cthusly" -O0 "$script" 2> /dev/null)
+
+  for level in -O0 -O1; do
+    for engine in "" --jit; do
+      output=$("$cthusly" "$level" $engine "$script" 2> /dev/null)
+      if [ "$output" != "$expected" ]; then
+        printf "\ngenerated_%d.th (%s %s): The output differs from that at -O0.\n" "$i" "$level" "$engine"
+        exit 1
+      fi
+    done
+
+    printf "%-12s %-7s %15d %9d %9d %15s %15s\n" "generated_$i" "$level" \
+      "$(bytecode_size "$script" "$level")" \
+      "$(best_time_ms "$cthusly" "$level" "$script")" \
+      "$(best_time_ms "$cthusly" "$level" --jit "$script")" \
+      "$(icache_misses "$cthusly" "$level" "$script")" \
+      "$(icache_misses "$cthusly" "$level" --jit "$script")"
+  done
+done
+
+if [ "$has_perf" != true ]; then
+  echo -e "\n(The instruction-cache misses are not reported since perf is not available.)"
+fi
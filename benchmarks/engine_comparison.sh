@@ -0,0 +1,104 @@
+#!/usr/bin/env bash
+
+# Runs each benchmark program with the stack-based interpreter (`--engine=stack`)
+# and the register-based engine (`--engine=reg`), and reports the number of
+# instructions of the program in each format, the number of instructions each
+# engine executed (dispatched), and the best wall time out of a number of runs,
+# along with the change from the stack to the register engine. The outputs are
+# checked to be the same, both at the given optimization level and at `-O0`.
+#
+# (The executed instructions are counted with `--stats` by a build with the
+# `PROFILE_DISPATCH` macro defined, see src/common.h, which the script builds in
+# `benchmarks/build/profile-dispatch`. The wall times are measured with the given
+# build, without `--stats`.)
+#
+# Usage: ./benchmarks/engine_comparison.sh [path to cthusly] [-- paths...]
+#   (Defaults to ./bin/cthusly and the programs in benchmarks/programs.)
+#
+# Environment variables:
+#   RUNS   The number of runs per program and engine (default: 5)
+#   LEVEL  The optimization level to compile at (default: -O1)
+
+root_dir="$(cd "$(dirname "${BASH_SOURCE[0]}")/.." && pwd)"
+cthusly="$root_dir/bin/cthusly"
+if [ $# -gt 0 ] && [ "$1" != "--" ]; then
+  cthusly="$1"
+  shift
+fi
+[ "$1" == "--" ] && shift
+paths=("$@")
+[ ${#paths[@]} -eq 0 ] && paths=("$root_dir"/benchmarks/programs/*.th)
+runs="${RUNS:-5}"
+level="${LEVEL:--O1}"
+
+if [ ! -x "$cthusly" ]; then
+  echo -e "\nConfiguration error: $cthusly was not found. Please build the project first."
+  exit 1
+fi
+
+# The instrumented build counting the executed instructions.
+counting_dir="$root_dir/benchmarks/build/profile-dispatch"
+counting_cthusly="$counting_dir/bin/cthusly"
+echo -e "\nBuilding the instrumented configuration..."
+cmake -S "$root_dir" -B "$counting_dir" -DCMAKE_BUILD_TYPE=Release -DEXECUTABLE_OUTPUT_PATH="$counting_dir/bin" \
+  -DPROFILE_DISPATCH=ON > /dev/null || exit 1
+cmake --build "$counting_dir" > /dev/null || exit 1
+echo -e "Done!\n"
+
+# Print the best (lowest) wall time in milliseconds out of `$runs` runs.
+best_time_ms() {
+  local best=""
+  for ((run = 0; run < runs; run++)); do
+    local start=$(date +%s%N)
+    "$@" > /dev/null 2>&1
+    local end=$(date +%s%N)
+    local elapsed=$(((end - start) / 1000000))
+    if [ -z "$best" ] || [ "$elapsed" -lt "$best" ]; then
+      best=$elapsed
+    fi
+  done
+  echo "$best"
+}
+
+# Print the value of the `--stats` line starting with `$1` when running `$2` with
+# the engine `$3` using the build `$4` (or "-" if not shown).
+stat() {
+  local value
+  value=$("$4" "$level" "--engine=$3" --stats "$2" 2>&1 > /dev/null \
+    | awk -F: -v name="$1" 'index($1, name) { gsub(/ /, "", $2); print $2 }')
+  echo "${value:--}"
+}
+
+# Print the change from `$1` to `$2` as a percentage (or "-" if unknown).
+change() {
+  if [ "$1" == "-" ] || [ "$2" == "-" ] || [ "$1" -eq 0 ]; then
+    echo "-"
+    return
+  fi
+  awk "BEGIN { printf \"%.1f%%\", 100 * ($2 - $1) / $1 }"
+}
+
+printf "%-22s %10s %10s %8s %12s %12s %8s %10s %10s %8s\n" \
+  "Program" "Stack ins." "Reg. ins." "Change" "Stack exec." "Reg. exec." "Change" "Stack (ms)" "Reg. (ms)" "Change"
+for path in "${paths[@]}"; do
+  for check_level in "$level" -O0; do
+    expected=$("$cthusly" "$check_level" --engine=stack "$path" 2>&1)
+    output=$("$cthusly" "$check_level" --engine=reg "$path" 2>&1)
+    if [ "$output" != "$expected" ]; then
+      printf "\n%s: The output of the register engine differs from that of the stack engine at %s.\n" \
+        "$(basename "$path")" "$check_level"
+      exit 1
+    fi
+  done
+
+  stack_instructions=$(stat "Bytecode instructions translated" "$path" reg "$cthusly")
+  register_instructions=$(stat "Register instructions" "$path" reg "$cthusly")
+  stack_executed=$(stat "Instructions executed" "$path" stack "$counting_cthusly")
+  register_executed=$(stat "Instructions executed" "$path" reg "$counting_cthusly")
+  stack_time=$(best_time_ms "$cthusly" "$level" --engine=stack "$path")
+  register_time=$(best_time_ms "$cthusly" "$level" --engine=reg "$path")
+  printf "%-22s %10s %10s %8s %12s %12s %8s %10d %10d %8s\n" "$(basename "$path")" \
+    "$stack_instructions" "$register_instructions" "$(change "$stack_instructions" "$register_instructions")" \
+    "$stack_executed" "$register_executed" "$(change "$stack_executed" "$register_executed")" \
+    "$stack_time" "$register_time" "$(change "$stack_time" "$register_time")"
+done
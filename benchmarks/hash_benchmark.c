@@ -0,0 +1,456 @@
+// Compares the text hash function (`hash_text()` in src/text_hash.c) with the
+// byte-at-a-time FNV-1 hash it replaced, on generated corpora of identifiers
+// and texts. Reports the hashing throughput of each variant of the block loop
+// and the probe lengths of an intern table filled with each corpus (along with
+// the probe lengths of a uniformly distributed hash for reference). Probe lengths
+// are given both for the previous layout of the table (linear probing, counting
+// the entries visited) and the current one (group probing, counting the groups
+// visited and the keys compared, see src/table.c).
+//
+// Usage: ./bin/hash_benchmark
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "table.h"
+#include "text_hash.h"
+
+/// The number of bytes to hash per measurement (the corpus is hashed repeatedly).
+#define BYTES_PER_MEASUREMENT (256 * 1024 * 1024)
+/// The maximum load factor of the previous layout of the intern table.
+#define LINEAR_MAX_LOAD 0.75
+
+typedef struct {
+  const char* name;
+  char** texts;
+  int* lengths;
+  int count;
+  int capacity;
+  size_t total_length;
+} Corpus;
+
+typedef uint32_t (*HashFunction)(const char* chars, int length);
+
+static const char* WORDS[] = {
+  "user", "count", "index", "buffer", "size", "value", "key", "name", "node", "list",
+  "item", "total", "result", "error", "state", "next", "prev", "head", "tail", "data",
+  "input", "output", "line", "column", "token", "text", "length", "offset", "start", "end",
+  "min", "max", "sum", "avg", "temp", "flag", "is", "has", "get", "set",
+  "parse", "read", "write", "open", "close", "file", "path", "config", "option", "mode",
+  "table", "entry", "hash", "cache", "queue", "stack", "frame", "scope", "block", "loop",
+  "the", "a", "of", "and",
+};
+#define WORD_COUNT ((int)(sizeof(WORDS) / sizeof(WORDS[0])))
+
+// ---------------------------------------------------
+// CORPORA
+// ---------------------------------------------------
+
+static uint64_t random_state = 0x2545f4914f6cdd1du;
+
+static uint32_t next_random(void) {
+  // xorshift64*
+  random_state ^= random_state >> 12;
+  random_state ^= random_state << 25;
+  random_state ^= random_state >> 27;
+
+  return (uint32_t)((random_state * 0x2545f4914f6cdd1du) >> 32);
+}
+
+static void corpus_add(Corpus* corpus, const char* chars, int length) {
+  if (corpus->count == corpus->capacity) {
+    corpus->capacity = corpus->capacity == 0 ? 1024 : corpus->capacity * 2;
+    corpus->texts = realloc(corpus->texts, sizeof(char*) * corpus->capacity);
+    corpus->lengths = realloc(corpus->lengths, sizeof(int) * corpus->capacity);
+  }
+
+  char* text = malloc(length + 1);
+  memcpy(text, chars, length);
+  text[length] = '\0';
+  corpus->texts[corpus->count] = text;
+  corpus->lengths[corpus->count] = length;
+  corpus->count++;
+  corpus->total_length += length;
+}
+
+static void corpus_free(Corpus* corpus) {
+  for (int i = 0; i < corpus->count; i++)
+    free(corpus->texts[i]);
+  free(corpus->texts);
+  free(corpus->lengths);
+}
+
+/// Unique snake_case identifiers of two words and an optional number (e.g. `user_count3`).
+static Corpus make_identifiers(int count) {
+  Corpus corpus = { .name = "identifiers" };
+  char buffer[64];
+  for (int i = 0; i < count; i++) {
+    int suffix = i / (WORD_COUNT * WORD_COUNT);
+    int length = suffix == 0
+      ? snprintf(buffer, sizeof(buffer), "%s_%s", WORDS[i % WORD_COUNT], WORDS[(i / WORD_COUNT) % WORD_COUNT])
+      : snprintf(buffer, sizeof(buffer), "%s_%s%d", WORDS[i % WORD_COUNT], WORDS[(i / WORD_COUNT) % WORD_COUNT], suffix);
+    corpus_add(&corpus, buffer, length);
+  }
+
+  return corpus;
+}
+
+/// Keys differing only in a sequential number (e.g. `key_000042`).
+static Corpus make_numbered_keys(int count) {
+  Corpus corpus = { .name = "numbered keys" };
+  char buffer[32];
+  for (int i = 0; i < count; i++) {
+    int length = snprintf(buffer, sizeof(buffer), "key_%06d", i);
+    corpus_add(&corpus, buffer, length);
+  }
+
+  return corpus;
+}
+
+/// Texts of random words separated by spaces, of roughly `min_words` to `max_words` words.
+static Corpus make_sentences(const char* name, int count, int min_words, int max_words) {
+  Corpus corpus = { .name = name };
+  int capacity = max_words * 8 + 1;
+  char* buffer = malloc(capacity);
+  for (int i = 0; i < count; i++) {
+    int word_count = min_words + (int)(next_random() % (uint32_t)(max_words - min_words + 1));
+    int length = 0;
+    for (int w = 0; w < word_count; w++) {
+      const char* word = WORDS[next_random() % WORD_COUNT];
+      int word_length = (int)strlen(word);
+      if (length + word_length + 1 >= capacity)
+        break;
+      if (w > 0)
+        buffer[length++] = ' ';
+      memcpy(buffer + length, word, word_length);
+      length += word_length;
+    }
+    corpus_add(&corpus, buffer, length);
+  }
+  free(buffer);
+
+  return corpus;
+}
+
+// ---------------------------------------------------
+// MEASUREMENTS
+// ---------------------------------------------------
+
+/// The FNV-1 hash previously used for texts.
+static uint32_t hash_fnv1(const char* chars, int length) {
+  uint32_t hash_code = 2166136261u;
+  for (int i = 0; i < length; i++) {
+    hash_code ^= (uint8_t)chars[i];
+    hash_code *= 16777619u;
+  }
+
+  return hash_code;
+}
+
+/// A reference for the probe lengths expected from a uniformly distributed hash
+/// (64-bit FNV-1a, whose collisions are negligible here, passed through the
+/// SplitMix64 finalizer). It is too slow to be used for interning.
+static uint32_t hash_uniform(const char* chars, int length) {
+  uint64_t hash_code = 14695981039346656037u;
+  for (int i = 0; i < length; i++) {
+    hash_code ^= (uint8_t)chars[i];
+    hash_code *= 1099511628211u;
+  }
+  hash_code = (hash_code ^ (hash_code >> 30)) * 0xbf58476d1ce4e5b9u;
+  hash_code = (hash_code ^ (hash_code >> 27)) * 0x94d049bb133111ebu;
+
+  return (uint32_t)(hash_code ^ (hash_code >> 31));
+}
+
+static double get_seconds(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/// Returns the throughput in MB/s.
+static double measure_throughput(Corpus* corpus, HashFunction hash) {
+  int repetitions = (int)(BYTES_PER_MEASUREMENT / (corpus->total_length + 1)) + 1;
+  // (The function is called through a volatile pointer so that no hash function
+  // is inlined into the loop, and the sum keeps the calls from being optimized away.)
+  HashFunction volatile function = hash;
+  volatile uint32_t sink = 0;
+  uint32_t sum = 0;
+
+  double start = get_seconds();
+  for (int r = 0; r < repetitions; r++) {
+    for (int i = 0; i < corpus->count; i++)
+      sum += function(corpus->texts[i], corpus->lengths[i]);
+  }
+  double seconds = get_seconds() - start;
+  sink = sum;
+  (void)sink;
+
+  return (double)corpus->total_length * repetitions / (1024 * 1024) / seconds;
+}
+
+typedef struct {
+  /// The entries visited per lookup with linear probing (the previous layout of
+  /// the intern table, with `hash % capacity` indexing and a load factor of 3/4).
+  double linear_average;
+  int linear_max;
+  /// The groups visited and the keys compared per lookup with group probing
+  /// (the current layout, see src/table.c).
+  double group_average;
+  int group_max;
+  double compare_average;
+} ProbeLengths;
+
+static int* new_empty_entries(int capacity) {
+  int* entries = malloc(sizeof(int) * capacity);
+  for (int e = 0; e < capacity; e++)
+    entries[e] = -1;
+
+  return entries;
+}
+
+/// Insert the distinct texts of the corpus into a table with linear probing.
+/// Returns the number of distinct texts (written to `distinct`).
+static int measure_linear_probing(Corpus* corpus, uint32_t* hash_codes, int* distinct, ProbeLengths* result) {
+  int capacity = 0;
+  int count = 0;
+  int* entries = NULL;
+
+  for (int i = 0; i < corpus->count; i++) {
+    if (count + 1 > capacity * LINEAR_MAX_LOAD) {
+      int new_capacity = capacity < 10 ? 10 : capacity * 2;
+      int* new_entries = new_empty_entries(new_capacity);
+      for (int e = 0; e < capacity; e++) {
+        if (entries[e] == -1)
+          continue;
+        uint32_t index = hash_codes[entries[e]] % new_capacity;
+        while (new_entries[index] != -1)
+          index = (index + 1) % new_capacity;
+        new_entries[index] = entries[e];
+      }
+      free(entries);
+      entries = new_entries;
+      capacity = new_capacity;
+    }
+
+    uint32_t index = hash_codes[i] % capacity;
+    bool is_duplicate = false;
+    while (entries[index] != -1) {
+      int other = entries[index];
+      if (corpus->lengths[other] == corpus->lengths[i] && memcmp(corpus->texts[other], corpus->texts[i], corpus->lengths[i]) == 0) {
+        is_duplicate = true;
+        break;
+      }
+      index = (index + 1) % capacity;
+    }
+    if (!is_duplicate) {
+      entries[index] = i;
+      distinct[count++] = i;
+    }
+  }
+
+  long total_probes = 0;
+  for (int e = 0; e < capacity; e++) {
+    if (entries[e] == -1)
+      continue;
+    uint32_t home = hash_codes[entries[e]] % capacity;
+    int probes = (int)((e - home + capacity) % capacity) + 1;
+    total_probes += probes;
+    if (probes > result->linear_max)
+      result->linear_max = probes;
+  }
+  result->linear_average = count == 0 ? 0 : (double)total_probes / count;
+  free(entries);
+
+  return count;
+}
+
+/// Insert the distinct texts into a table with group probing (like src/table.c).
+static void measure_group_probing(uint32_t* hash_codes, int* distinct, int distinct_count, ProbeLengths* result) {
+  #define H1(hash_code) ((hash_code) >> 7)
+  #define H2(hash_code) ((int8_t)((hash_code) & 0x7f))
+
+  int capacity = TABLE_GROUP_SIZE;
+  int count = 0;
+  int* entries = new_empty_entries(capacity);
+  int8_t* controls = NULL;
+
+  // (Since nothing is removed, the controls can be derived from the entries.)
+  for (int d = 0; d <= distinct_count; d++) {
+    bool is_rebuild_needed = d == distinct_count || (count + 1) * 8 > capacity * 7;
+    if (is_rebuild_needed) {
+      int new_capacity = d == distinct_count ? capacity : capacity * 2;
+      int* new_entries = new_empty_entries(new_capacity);
+      int8_t* new_controls = malloc(new_capacity);
+      memset(new_controls, -128, new_capacity);
+      uint32_t mask = (uint32_t)new_capacity - 1;
+      for (int e = 0; e < capacity; e++) {
+        if (entries[e] == -1)
+          continue;
+        uint32_t hash_code = hash_codes[entries[e]];
+        uint32_t offset = H1(hash_code) & mask;
+        for (uint32_t distance = TABLE_GROUP_SIZE; true; offset = (offset + distance) & mask, distance += TABLE_GROUP_SIZE) {
+          int bit = 0;
+          while (bit < TABLE_GROUP_SIZE && new_entries[(offset + bit) & mask] != -1)
+            bit++;
+          if (bit < TABLE_GROUP_SIZE) {
+            new_entries[(offset + bit) & mask] = entries[e];
+            new_controls[(offset + bit) & mask] = H2(hash_code);
+            break;
+          }
+        }
+      }
+      free(entries);
+      free(controls);
+      entries = new_entries;
+      controls = new_controls;
+      capacity = new_capacity;
+    }
+    if (d == distinct_count)
+      break;
+
+    // Place the text at the first free entry (the table is rebuilt before measuring).
+    uint32_t mask = (uint32_t)capacity - 1;
+    uint32_t offset = H1(hash_codes[distinct[d]]) & mask;
+    for (uint32_t distance = TABLE_GROUP_SIZE; true; offset = (offset + distance) & mask, distance += TABLE_GROUP_SIZE) {
+      int bit = 0;
+      while (bit < TABLE_GROUP_SIZE && entries[(offset + bit) & mask] != -1)
+        bit++;
+      if (bit < TABLE_GROUP_SIZE) {
+        entries[(offset + bit) & mask] = distinct[d];
+        break;
+      }
+    }
+    count++;
+  }
+
+  long total_groups = 0;
+  long total_compares = 0;
+  uint32_t mask = (uint32_t)capacity - 1;
+  for (int d = 0; d < distinct_count; d++) {
+    uint32_t hash_code = hash_codes[distinct[d]];
+    uint32_t offset = H1(hash_code) & mask;
+    int groups = 0;
+    bool is_found = false;
+    for (uint32_t distance = TABLE_GROUP_SIZE; !is_found; offset = (offset + distance) & mask, distance += TABLE_GROUP_SIZE) {
+      groups++;
+      for (int bit = 0; bit < TABLE_GROUP_SIZE && !is_found; bit++) {
+        uint32_t index = (offset + bit) & mask;
+        if (controls[index] == H2(hash_code)) {
+          total_compares++;
+          is_found = entries[index] == distinct[d];
+        }
+      }
+    }
+    total_groups += groups;
+    if (groups > result->group_max)
+      result->group_max = groups;
+  }
+  result->group_average = distinct_count == 0 ? 0 : (double)total_groups / distinct_count;
+  result->compare_average = distinct_count == 0 ? 0 : (double)total_compares / distinct_count;
+
+  free(entries);
+  free(controls);
+
+  #undef H1
+  #undef H2
+}
+
+/// Measure the lengths of looking up each distinct text of the corpus in
+/// intern tables of the previous and the current layout.
+static ProbeLengths measure_probe_lengths(Corpus* corpus, HashFunction hash) {
+  ProbeLengths result = { 0 };
+  uint32_t* hash_codes = malloc(sizeof(uint32_t) * corpus->count);
+  int* distinct = malloc(sizeof(int) * corpus->count);
+  for (int i = 0; i < corpus->count; i++)
+    hash_codes[i] = hash(corpus->texts[i], corpus->lengths[i]);
+
+  int distinct_count = measure_linear_probing(corpus, hash_codes, distinct, &result);
+  measure_group_probing(hash_codes, distinct, distinct_count, &result);
+
+  free(hash_codes);
+  free(distinct);
+
+  return result;
+}
+
+/// Every variant of the block loop must produce the same hash codes.
+static bool variants_agree(Corpus* corpus) {
+  uint32_t* expected = malloc(sizeof(uint32_t) * corpus->count);
+  text_hash_use_variant(TEXT_HASH_PORTABLE);
+  for (int i = 0; i < corpus->count; i++)
+    expected[i] = hash_text(corpus->texts[i], corpus->lengths[i]);
+
+  bool agree = true;
+  for (TextHashVariant variant = TEXT_HASH_SSE2; variant <= TEXT_HASH_AVX2; variant++) {
+    if (!text_hash_use_variant(variant))
+      continue;
+    for (int i = 0; i < corpus->count && agree; i++)
+      agree = hash_text(corpus->texts[i], corpus->lengths[i]) == expected[i];
+  }
+  free(expected);
+
+  return agree;
+}
+
+static void print_row(Corpus* corpus, const char* hash_name, double throughput, ProbeLengths* probe_lengths) {
+  if (throughput < 0)
+    printf("%-16s %-14s %10s", corpus->name, hash_name, "-");
+  else
+    printf("%-16s %-14s %10.0f", corpus->name, hash_name, throughput);
+  if (probe_lengths != NULL) {
+    printf(" %8.3f %6d", probe_lengths->linear_average, probe_lengths->linear_max);
+    printf(" %8.3f %6d %8.3f", probe_lengths->group_average, probe_lengths->group_max, probe_lengths->compare_average);
+  }
+  printf("\n");
+}
+
+int main(void) {
+  Corpus corpora[] = {
+    make_identifiers(60000),
+    make_numbered_keys(60000),
+    make_sentences("sentences", 30000, 3, 24),
+    make_sentences("long texts", 2000, 200, 800),
+  };
+  int corpus_count = (int)(sizeof(corpora) / sizeof(corpora[0]));
+
+  TextHashVariant best_variant = text_hash_get_variant();
+  printf("Best supported variant: %s\n\n", text_hash_get_variant_name(best_variant));
+  printf("%-16s %-14s %10s %15s %24s\n", "", "", "", "Linear probing", "Group probing");
+  printf("%-16s %-14s %10s %8s %6s %8s %6s %8s\n", "Corpus", "Hash", "MB/s", "Avg", "Max", "Avg", "Max", "Compares");
+
+  bool all_agree = true;
+  for (int c = 0; c < corpus_count; c++) {
+    Corpus* corpus = &corpora[c];
+    all_agree = variants_agree(corpus) && all_agree;
+
+    ProbeLengths fnv1_probe_lengths = measure_probe_lengths(corpus, hash_fnv1);
+    print_row(corpus, "fnv1", measure_throughput(corpus, hash_fnv1), &fnv1_probe_lengths);
+
+    ProbeLengths probe_lengths = measure_probe_lengths(corpus, hash_text);
+    for (TextHashVariant variant = TEXT_HASH_PORTABLE; variant <= TEXT_HASH_AVX2; variant++) {
+      if (!text_hash_use_variant(variant))
+        continue;
+      char name[32];
+      snprintf(name, sizeof(name), "text (%s)", text_hash_get_variant_name(variant));
+      print_row(corpus, name, measure_throughput(corpus, hash_text), variant == TEXT_HASH_PORTABLE ? &probe_lengths : NULL);
+    }
+
+    ProbeLengths uniform_probe_lengths = measure_probe_lengths(corpus, hash_uniform);
+    print_row(corpus, "uniform (ref)", -1, &uniform_probe_lengths);
+    printf("\n");
+  }
+
+  for (int c = 0; c < corpus_count; c++)
+    corpus_free(&corpora[c]);
+
+  if (!all_agree) {
+    fprintf(stderr, "Error: The variants of `hash_text()` produced different hash codes.\n");
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,235 @@
+// Compares the intern pool (src/intern_set.c) with a `Table` (src/table.c)
+// used as a set of texts (which is how the intern pool was stored before),
+// on thousands of distinct texts. Reports the memory allocated by each and the
+// time per operation of adding texts (with and without reserving room up
+// front) and looking up texts that are present and missing.
+//
+// Usage: ./bin/intern_benchmark
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "gc_object.h"
+#include "intern_set.h"
+#include "table.h"
+#include "text_hash.h"
+
+/// The number of operations to run per measurement (the workload is repeated).
+#define OPERATIONS_PER_MEASUREMENT (4 * 1000 * 1000)
+
+// The sets allocate their arrays through `handle_reallocation()` (src/memory.c),
+// which is defined here instead so that the rest of the VM need not be linked.
+void* handle_reallocation(void* memory, size_t old_size, size_t new_size) {
+  (void)old_size;
+  if (new_size == 0) {
+    free(memory);
+    return NULL;
+  }
+
+  void* reallocated_memory = realloc(memory, new_size);
+  if (reallocated_memory == NULL)
+    exit(EXIT_FAILURE);
+
+  return reallocated_memory;
+}
+
+static TextObject* new_text(const char* chars, int length) {
+  TextObject* text = malloc(TEXT_OBJECT_SIZE(length));
+  text->base.type = GC_OBJECT_TYPE_TEXT;
+  text->base.is_marked = false;
+  text->base.next = NULL;
+  text->chars = text->inline_chars;
+  memcpy(text->chars, chars, length);
+  text->chars[length] = '\0';
+  text->length = length;
+  text->hash_code = hash_text(chars, length);
+
+  return text;
+}
+
+/// Distinct texts such as `"user_count_42"` (with `prefix` prepended), as
+/// produced by a program with many text literals.
+static TextObject** make_texts(const char* prefix, int count) {
+  static const char* words[] = {
+    "user", "count", "index", "buffer", "size", "value", "key", "name", "node", "list",
+    "item", "total", "result", "error", "state", "next", "line", "token", "text", "offset",
+  };
+  int word_count = (int)(sizeof(words) / sizeof(words[0]));
+
+  TextObject** texts = malloc(sizeof(TextObject*) * count);
+  char buffer[64];
+  for (int i = 0; i < count; i++) {
+    int length = snprintf(buffer, sizeof(buffer), "%s%s_%s_%d", prefix, words[i % word_count], words[(i / word_count) % word_count], i);
+    texts[i] = new_text(buffer, length);
+  }
+
+  return texts;
+}
+
+static double get_seconds(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static int get_repetitions(int count) {
+  return OPERATIONS_PER_MEASUREMENT / count + 1;
+}
+
+static double get_ns_per_operation(double start, int repetitions, int count) {
+  return (get_seconds() - start) * 1e9 / ((double)repetitions * count);
+}
+
+typedef struct {
+  size_t memory_bytes;
+  double add_ns;
+  double add_reserved_ns;
+  double hit_ns;
+  double miss_ns;
+} Result;
+
+static size_t get_table_memory_size(Table* table) {
+  return table->capacity == 0 ? 0 : (table->capacity + TABLE_GROUP_SIZE - 1) * sizeof(int8_t) + table->capacity * sizeof(TableEntry);
+}
+
+static Result measure_table(TextObject** texts, TextObject** missing_texts, int count, long* sum) {
+  Result result = { 0 };
+  int repetitions = get_repetitions(count);
+
+  double start = get_seconds();
+  for (int r = 0; r < repetitions; r++) {
+    Table table;
+    table_init(&table);
+    for (int i = 0; i < count; i++) {
+      if (table_get_interned_text(&table, texts[i]->chars, texts[i]->length, texts[i]->hash_code) == NULL)
+        table_set(&table, texts[i], FROM_C_NULL);
+    }
+    table_free(&table);
+  }
+  result.add_ns = get_ns_per_operation(start, repetitions, count);
+  // (A table cannot be presized.)
+  result.add_reserved_ns = result.add_ns;
+
+  Table table;
+  table_init(&table);
+  for (int i = 0; i < count; i++)
+    table_set(&table, texts[i], FROM_C_NULL);
+  result.memory_bytes = get_table_memory_size(&table);
+
+  start = get_seconds();
+  for (int r = 0; r < repetitions; r++) {
+    for (int i = 0; i < count; i++)
+      *sum += table_get_interned_text(&table, texts[i]->chars, texts[i]->length, texts[i]->hash_code) != NULL;
+  }
+  result.hit_ns = get_ns_per_operation(start, repetitions, count);
+
+  start = get_seconds();
+  for (int r = 0; r < repetitions; r++) {
+    for (int i = 0; i < count; i++)
+      *sum += table_get_interned_text(&table, missing_texts[i]->chars, missing_texts[i]->length, missing_texts[i]->hash_code) != NULL;
+  }
+  result.miss_ns = get_ns_per_operation(start, repetitions, count);
+
+  table_free(&table);
+
+  return result;
+}
+
+static Result measure_intern_set(TextObject** texts, TextObject** missing_texts, int count, long* sum) {
+  Result result = { 0 };
+  int repetitions = get_repetitions(count);
+
+  for (int reserve = 0; reserve <= 1; reserve++) {
+    double start = get_seconds();
+    for (int r = 0; r < repetitions; r++) {
+      InternSet set;
+      intern_set_init(&set);
+      if (reserve)
+        intern_set_reserve(&set, count);
+      for (int i = 0; i < count; i++) {
+        if (intern_set_find(&set, texts[i]->chars, texts[i]->length, texts[i]->hash_code) == NULL)
+          intern_set_add(&set, texts[i]);
+      }
+      intern_set_free(&set);
+    }
+    double ns = get_ns_per_operation(start, repetitions, count);
+    if (reserve)
+      result.add_reserved_ns = ns;
+    else
+      result.add_ns = ns;
+  }
+
+  InternSet set;
+  intern_set_init(&set);
+  for (int i = 0; i < count; i++)
+    intern_set_add(&set, texts[i]);
+  result.memory_bytes = intern_set_get_memory_size(&set);
+
+  double start = get_seconds();
+  for (int r = 0; r < repetitions; r++) {
+    for (int i = 0; i < count; i++)
+      *sum += intern_set_find(&set, texts[i]->chars, texts[i]->length, texts[i]->hash_code) != NULL;
+  }
+  result.hit_ns = get_ns_per_operation(start, repetitions, count);
+
+  start = get_seconds();
+  for (int r = 0; r < repetitions; r++) {
+    for (int i = 0; i < count; i++)
+      *sum += intern_set_find(&set, missing_texts[i]->chars, missing_texts[i]->length, missing_texts[i]->hash_code) != NULL;
+  }
+  result.miss_ns = get_ns_per_operation(start, repetitions, count);
+
+  intern_set_free(&set);
+
+  return result;
+}
+
+static void print_result(const char* name, int count, Result* result) {
+  printf(
+    "%-12s %8d %12zu %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+    name,
+    count,
+    result->memory_bytes,
+    (double)result->memory_bytes / count,
+    result->add_ns,
+    result->add_reserved_ns,
+    result->hit_ns,
+    result->miss_ns
+  );
+}
+
+int main(void) {
+  printf("%-12s %8s %12s %10s %10s %10s %10s %10s\n", "", "", "Memory", "Bytes", "Add", "Add", "Lookup", "Lookup");
+  printf("%-12s %8s %12s %10s %10s %10s %10s %10s\n", "Set", "Texts", "(bytes)", "per text", "(ns)", "reserved", "hit (ns)", "miss (ns)");
+
+  // (The sum keeps the lookups from being optimized away.)
+  volatile long sink = 0;
+  long sum = 0;
+  int counts[] = { 1000, 5000, 20000, 100000 };
+  for (int c = 0; c < (int)(sizeof(counts) / sizeof(counts[0])); c++) {
+    int count = counts[c];
+    TextObject** texts = make_texts("", count);
+    TextObject** missing_texts = make_texts("missing_", count);
+
+    Result table_result = measure_table(texts, missing_texts, count, &sum);
+    Result intern_set_result = measure_intern_set(texts, missing_texts, count, &sum);
+    print_result("Table", count, &table_result);
+    print_result("InternSet", count, &intern_set_result);
+    printf("\n");
+
+    for (int i = 0; i < count; i++) {
+      free(texts[i]);
+      free(missing_texts[i]);
+    }
+    free(texts);
+    free(missing_texts);
+  }
+
+  sink = sum;
+  (void)sink;
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,125 @@
+#!/usr/bin/env bash
+
+# Generates scripts that go past the limits of the short instruction operands
+# (256 variables, 256 constants, and 64 KB jumps) and compiles and runs each
+# with the interpreter, the JIT, the tracing executor, and the register-based
+# engine, reporting the best wall time out of a number of runs. The output of
+# each run is checked against the expected result.
+#
+#   variables  N variables declared in a block, some of which are used in a loop
+#   constants  N distinct number literals
+#   loop-body  A loop whose body consists of N statements (about 7 bytes of
+#              bytecode each, so that the jumps around it are long at N = 10000)
+#
+# Usage: ./benchmarks/operand_scaling.sh [path to cthusly]
+#   (Defaults to ./bin/cthusly.)
+#
+# Environment variables:
+#   SIZES  The sizes (N) to generate scripts of (default: "100 1000 10000")
+#   RUNS   The number of runs per script and engine (default: 5)
+
+root_dir="$(cd "$(dirname "${BASH_SOURCE[0]}")/.." && pwd)"
+cthusly="${1:-$root_dir/bin/cthusly}"
+sizes="${SIZES:-100 1000 10000}"
+runs="${RUNS:-5}"
+# Format: "<name>|<cthusly options>"
+engines=(
+  "interpreter|"
+  "jit|--jit"
+  "tracing|--tracing"
+  "register|--engine=reg"
+)
+
+if [ ! -x "$cthusly" ]; then
+  echo -e "\nConfiguration error: $cthusly was not found. Please build the project first."
+  exit 1
+fi
+
+script_dir="$(mktemp -d)"
+trap 'rm -rf "$script_dir"' EXIT
+
+# Print a script of kind `$1` and size `$2`, followed by a line with the expected output.
+generate_script() {
+  awk -v kind="$1" -v n="$2" '
+    BEGIN {
+      if (kind == "variables") {
+        print "var total: 0"
+        print "block"
+        for (i = 0; i < n; i++)
+          print "  var v" i ": " i
+        print "  foreach i in 1..100"
+        print "    total: total + v0 + v" int(n / 2) " + v" n - 1
+        print "  end"
+        print "end"
+        print "@out total"
+        expected = 100 * (int(n / 2) + n - 1)
+      }
+      else if (kind == "constants") {
+        print "var total: 0"
+        for (i = 0; i < n; i++) {
+          print "total +: " i + 0.5
+          expected += i + 0.5
+        }
+        print "@out total"
+      }
+      else {
+        print "var total: 0"
+        print "foreach i in 1..10"
+        print "  if i > 0"
+        for (i = 0; i < n; i++)
+          print "    total +: i"
+        print "  else"
+        print "    total: -1"
+        print "  end"
+        print "end"
+        print "@out total"
+        expected = n * 55
+      }
+      printf "%.17g\n", expected
+    }
+  '
+}
+
+# Print the best (lowest) wall time in milliseconds out of `$runs` runs.
+best_time_ms() {
+  local best=""
+  for ((run = 0; run < runs; run++)); do
+    local start=$(date +%s%N)
+    "$@" > /dev/null 2>&1
+    local end=$(date +%s%N)
+    local elapsed=$(((end - start) / 1000000))
+    if [ -z "$best" ] || [ "$elapsed" -lt "$best" ]; then
+      best=$elapsed
+    fi
+  done
+  echo "$best"
+}
+
+printf "%-10s %8s" "Script" "N"
+for engine in "${engines[@]}"; do
+  printf " %14s" "${engine%%|*} (ms)"
+done
+printf "\n"
+
+for kind in variables constants loop-body; do
+  for size in $sizes; do
+    script="$script_dir/$kind-$size.th"
+    generate_script "$kind" "$size" > "$script.generated"
+    head -n -1 "$script.generated" > "$script"
+    expected=$(tail -n 1 "$script.generated")
+
+    printf "%-10s %8d" "$kind" "$size"
+    for engine in "${engines[@]}"; do
+      options="${engine#*|}"
+      output=$("$cthusly" $options "$script" 2> /dev/null)
+      # (Numbers are output with 6 significant digits.)
+      is_expected=$(awk -v output="$output" -v expected="$expected" 'BEGIN { difference = output - expected; print (output != "" && (difference < 0 ? -difference : difference) <= 1e-5 * expected) ? 1 : 0 }')
+      if [ "$is_expected" != 1 ]; then
+        printf "\n\n%s-%s.th (%s): Expected %s but the output was:\n%s\n" "$kind" "$size" "${engine%%|*}" "$expected" "$output"
+        exit 1
+      fi
+      printf " %14d" "$(best_time_ms "$cthusly" $options "$script")"
+    done
+    printf "\n"
+  done
+done
@@ -0,0 +1,75 @@
+#!/usr/bin/env bash
+
+# Compiles and runs each benchmark program at optimization levels -O0, -O1 and
+# -O2, and reports the size of the bytecode (from `--stats`) and the best wall
+# time out of a number of runs at each level, along with the change from -O0 to
+# the highest level. The outputs are checked to be the same.
+#
+# Usage: ./benchmarks/optimization_levels.sh [path to cthusly] [-- paths...]
+#   (Defaults to ./bin/cthusly and the programs in benchmarks/programs.)
+#
+# Environment variables:
+#   RUNS  The number of runs per program and level (default: 5)
+
+root_dir="$(cd "$(dirname "${BASH_SOURCE[0]}")/.." && pwd)"
+cthusly="$root_dir/bin/cthusly"
+if [ $# -gt 0 ] && [ "$1" != "--" ]; then
+  cthusly="$1"
+  shift
+fi
+[ "$1" == "--" ] && shift
+paths=("$@")
+[ ${#paths[@]} -eq 0 ] && paths=("$root_dir"/benchmarks/programs/*.th)
+runs="${RUNS:-5}"
+levels=(-O0 -O1 -O2)
+
+if [ ! -x "$cthusly" ]; then
+  echo -e "\nConfiguration error: $cthusly was not found. Please build the project first."
+  exit 1
+fi
+
+# Print the best (lowest) wall time in milliseconds out of `$runs` runs.
+best_time_ms() {
+  local best=""
+  for ((run = 0; run < runs; run++)); do
+    local start=$(date +%s%N)
+    "$@" > /dev/null 2>&1
+    local end=$(date +%s%N)
+    local elapsed=$(((end - start) / 1000000))
+    if [ -z "$best" ] || [ "$elapsed" -lt "$best" ]; then
+      best=$elapsed
+    fi
+  done
+  echo "$best"
+}
+
+# Print the size of the bytecode that `$1` compiles into at optimization level `$2`.
+bytecode_size() {
+  "$cthusly" "$2" --stats "$1" 2>&1 > /dev/null | awk -F: '/Bytecode \(bytes\)/ { gsub(/ /, "", $2); print $2 }'
+}
+
+printf "%-22s" "Program"
+for level in "${levels[@]}"; do
+  printf " %12s %10s" "$level (bytes)" "$level (ms)"
+done
+printf " %10s %10s\n" "Size" "Time"
+
+for path in "${paths[@]}"; do
+  expected=$("$cthusly" -O0 "$path" 2> /dev/null)
+  printf "%-22s" "$(basename "$path")"
+  sizes=()
+  times=()
+  for level in "${levels[@]}"; do
+    output=$("$cthusly" "$level" "$path" 2> /dev/null)
+    if [ "$output" != "$expected" ]; then
+      printf "\n\n%s (%s): The output differs from that at -O0.\n" "$(basename "$path")" "$level"
+      exit 1
+    fi
+    sizes+=("$(bytecode_size "$path" "$level")")
+    times+=("$(best_time_ms "$cthusly" "$level" "$path")")
+    printf " %12d %10d" "${sizes[-1]}" "${times[-1]}"
+  done
+  printf " %9.1f%% %9.1f%%\n" \
+    "$(awk "BEGIN { print 100 * (${sizes[-1]} - ${sizes[0]}) / ${sizes[0]} }")" \
+    "$(awk "BEGIN { print ${times[0]} == 0 ? 0 : 100 * (${times[-1]} - ${times[0]}) / ${times[0]} }")"
+done
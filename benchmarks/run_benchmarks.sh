@@ -0,0 +1,97 @@
+#!/usr/bin/env bash
+
+# Builds the VM in several configurations and runs every program in
+# `benchmarks/programs` with each of them, reporting the best wall time
+# out of a number of runs.
+#
+# Usage: ./benchmarks/run_benchmarks.sh [configuration names...]
+#   (All configurations are run if no names are provided.)
+#
+# Environment variables:
+#   RUNS      The number of runs per program and configuration (default: 5)
+#   PROGRAMS  A glob for the programs to run (default: benchmarks/programs/*.th)
+
+# Format: "<name>|<CMake options>|<cthusly options>"
+configurations=(
+  "switch|-DCOMPUTED_GOTO=OFF|"
+  "computed-goto|-DCOMPUTED_GOTO=ON|"
+  "nan-boxing|-DNAN_BOXING=ON|"
+  "jit|-DCOMPUTED_GOTO=ON|--jit"
+  "tracing|-DCOMPUTED_GOTO=ON|--tracing"
+  "lazy-interning|-DCOMPUTED_GOTO=ON|--lazy-interning"
+)
+
+# Check dependencies
+if ! which cmake > /dev/null;
+then
+  echo -e "\nConfiguration error: CMake was not found. Please install CMake v3.20 or higher and rerun the script."
+  exit 1
+fi
+
+root_dir="$(cd "$(dirname "${BASH_SOURCE[0]}")/.." && pwd)"
+build_dir="$root_dir/benchmarks/build"
+runs="${RUNS:-5}"
+programs="${PROGRAMS:-$root_dir/benchmarks/programs/*.th}"
+
+is_selected() {
+  if [ $# -eq 1 ]; then
+    return 0
+  fi
+
+  local name="$1"
+  shift
+  for selected in "$@"; do
+    if [ "$selected" == "$name" ]; then
+      return 0
+    fi
+  done
+
+  return 1
+}
+
+# Print the best (lowest) wall time in milliseconds out of `$runs` runs.
+best_time_ms() {
+  local best=""
+  for ((run = 0; run < runs; run++)); do
+    local start=$(date +%s%N)
+    "$@" > /dev/null 2>&1
+    local end=$(date +%s%N)
+    local elapsed=$(((end - start) / 1000000))
+    if [ -z "$best" ] || [ "$elapsed" -lt "$best" ]; then
+      best=$elapsed
+    fi
+  done
+
+  echo "$best"
+}
+
+echo -e "\nBuilding the configurations..."
+for configuration in "${configurations[@]}"; do
+  IFS="|" read -r name cmake_options _ <<< "$configuration"
+  is_selected "$name" "$@" || continue
+
+  config_dir="$build_dir/$name"
+  cmake -S "$root_dir" -B "$config_dir" -DCMAKE_BUILD_TYPE=Release -DEXECUTABLE_OUTPUT_PATH="$config_dir/bin" $cmake_options > /dev/null || exit 1
+  cmake --build "$config_dir" > /dev/null || exit 1
+done
+echo "Done!"
+
+echo -e "\nRunning the benchmarks (best of $runs runs)...\n"
+printf "%-28s" "Program"
+for configuration in "${configurations[@]}"; do
+  IFS="|" read -r name _ _ <<< "$configuration"
+  is_selected "$name" "$@" && printf "%16s" "$name"
+done
+printf "\n"
+
+for program in $programs; do
+  printf "%-28s" "$(basename "$program")"
+  for configuration in "${configurations[@]}"; do
+    IFS="|" read -r name _ cthusly_options <<< "$configuration"
+    is_selected "$name" "$@" || continue
+
+    elapsed=$(best_time_ms "$build_dir/$name/bin/cthusly" $cthusly_options "$program")
+    printf "%14s ms" "$elapsed"
+  done
+  printf "\n"
+done
@@ -0,0 +1,171 @@
+// Measures the time per operation of the hash table (src/table.c) through its
+// public functions, on interned identifiers. The workloads are filling a table,
+// looking up texts in the intern pool (both present and missing texts), looking
+// up values by key, and churn (removing and reinserting keys at a steady size,
+// which leaves tombstones behind).
+//
+// Usage: ./bin/table_benchmark
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "gc_object.h"
+#include "table.h"
+#include "text_hash.h"
+
+/// The number of operations to run per measurement (the workload is repeated).
+#define OPERATIONS_PER_MEASUREMENT (4 * 1000 * 1000)
+
+// The table allocates its arrays through `handle_reallocation()` (src/memory.c),
+// which is defined here instead so that the rest of the VM need not be linked.
+void* handle_reallocation(void* memory, size_t old_size, size_t new_size) {
+  (void)old_size;
+  if (new_size == 0) {
+    free(memory);
+    return NULL;
+  }
+
+  void* reallocated_memory = realloc(memory, new_size);
+  if (reallocated_memory == NULL)
+    exit(EXIT_FAILURE);
+
+  return reallocated_memory;
+}
+
+static TextObject* new_text(const char* chars, int length) {
+  TextObject* text = malloc(TEXT_OBJECT_SIZE(length));
+  text->base.type = GC_OBJECT_TYPE_TEXT;
+  text->base.is_marked = false;
+  text->base.next = NULL;
+  text->chars = text->inline_chars;
+  memcpy(text->chars, chars, length);
+  text->chars[length] = '\0';
+  text->length = length;
+  text->hash_code = hash_text(chars, length);
+
+  return text;
+}
+
+/// Unique identifiers such as `user_count_42` (with `prefix` prepended).
+static TextObject** make_texts(const char* prefix, int count) {
+  static const char* words[] = {
+    "user", "count", "index", "buffer", "size", "value", "key", "name", "node", "list",
+    "item", "total", "result", "error", "state", "next", "line", "token", "text", "offset",
+  };
+  int word_count = (int)(sizeof(words) / sizeof(words[0]));
+
+  TextObject** texts = malloc(sizeof(TextObject*) * count);
+  char buffer[64];
+  for (int i = 0; i < count; i++) {
+    int length = snprintf(buffer, sizeof(buffer), "%s%s_%s_%d", prefix, words[i % word_count], words[(i / word_count) % word_count], i);
+    texts[i] = new_text(buffer, length);
+  }
+
+  return texts;
+}
+
+static double get_seconds(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static int get_repetitions(int count) {
+  return OPERATIONS_PER_MEASUREMENT / count + 1;
+}
+
+static void print_result(const char* workload, int count, double seconds, long operations) {
+  printf("%-24s %10d %12.1f\n", workload, count, seconds * 1e9 / operations);
+}
+
+static void run_workloads(int count) {
+  TextObject** texts = make_texts("", count);
+  TextObject** missing_texts = make_texts("missing_", count);
+  int repetitions = get_repetitions(count);
+  // (The sum keeps the lookups from being optimized away.)
+  volatile long sink = 0;
+  long sum = 0;
+
+  double start = get_seconds();
+  for (int r = 0; r < repetitions; r++) {
+    Table table;
+    table_init(&table);
+    for (int i = 0; i < count; i++)
+      table_set(&table, texts[i], FROM_C_NULL);
+    table_free(&table);
+  }
+  print_result("insert", count, get_seconds() - start, (long)repetitions * count);
+
+  Table table;
+  table_init(&table);
+  for (int i = 0; i < count; i++)
+    table_set(&table, texts[i], FROM_C_DOUBLE(i));
+
+  start = get_seconds();
+  for (int r = 0; r < repetitions; r++) {
+    for (int i = 0; i < count; i++)
+      sum += table_get_interned_text(&table, texts[i]->chars, texts[i]->length, texts[i]->hash_code) != NULL;
+  }
+  print_result("intern lookup (hit)", count, get_seconds() - start, (long)repetitions * count);
+
+  start = get_seconds();
+  for (int r = 0; r < repetitions; r++) {
+    for (int i = 0; i < count; i++)
+      sum += table_get_interned_text(&table, missing_texts[i]->chars, missing_texts[i]->length, missing_texts[i]->hash_code) != NULL;
+  }
+  print_result("intern lookup (miss)", count, get_seconds() - start, (long)repetitions * count);
+
+  start = get_seconds();
+  for (int r = 0; r < repetitions; r++) {
+    for (int i = 0; i < count; i++) {
+      ThuslyValue value;
+      sum += table_get(&table, texts[i], &value);
+    }
+  }
+  print_result("get", count, get_seconds() - start, (long)repetitions * count);
+
+  // Remove and reinsert a sliding window of keys (each iteration is a pop and a set).
+  start = get_seconds();
+  for (int r = 0; r < repetitions; r++) {
+    for (int i = 0; i < count; i++) {
+      table_pop(&table, texts[i]);
+      table_set(&table, missing_texts[i], FROM_C_NULL);
+    }
+    for (int i = 0; i < count; i++) {
+      table_pop(&table, missing_texts[i]);
+      table_set(&table, texts[i], FROM_C_NULL);
+    }
+  }
+  print_result("churn (pop + set)", count, get_seconds() - start, (long)repetitions * count * 2);
+
+  start = get_seconds();
+  for (int r = 0; r < repetitions; r++) {
+    for (int i = 0; i < count; i++)
+      sum += table_get_interned_text(&table, texts[i]->chars, texts[i]->length, texts[i]->hash_code) != NULL;
+  }
+  print_result("intern lookup (churned)", count, get_seconds() - start, (long)repetitions * count);
+
+  sink = sum;
+  (void)sink;
+  table_free(&table);
+  for (int i = 0; i < count; i++) {
+    free(texts[i]);
+    free(missing_texts[i]);
+  }
+  free(texts);
+  free(missing_texts);
+}
+
+int main(void) {
+  printf("%-24s %10s %12s\n", "Workload", "Keys", "ns/op");
+  int counts[] = { 100, 10000, 1000000 };
+  for (int c = 0; c < (int)(sizeof(counts) / sizeof(counts[0])); c++) {
+    run_workloads(counts[c]);
+    printf("\n");
+  }
+
+  return EXIT_SUCCESS;
+}
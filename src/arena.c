@@ -0,0 +1,133 @@
+#include <stdlib.h>
+
+#include "arena.h"
+
+#define ALIGN_UP(size, alignment)  (((size) + (alignment) - 1) & ~((size_t)(alignment) - 1))
+#define CHUNK_HEADER_SIZE          ALIGN_UP(sizeof(ArenaChunk), ARENA_ALIGNMENT)
+#define CHUNK_OF(memory)           ((ArenaChunk*)((uintptr_t)(memory) & ~(uintptr_t)(ARENA_CHUNK_SIZE - 1)))
+
+void arena_init(Arena* arena) {
+  arena->current = NULL;
+  arena->chunks = NULL;
+  arena->free_chunks = NULL;
+  arena->free_chunk_count = 0;
+  arena->stats = (ArenaStats){ 0 };
+}
+
+static void free_chunk_list(ArenaChunk* chunk) {
+  while (chunk != NULL) {
+    ArenaChunk* next = chunk->next;
+    free(chunk);
+    chunk = next;
+  }
+}
+
+/// Release all memory of the arena at once (without visiting each allocation).
+void arena_free(Arena* arena) {
+  free_chunk_list(arena->chunks);
+  free_chunk_list(arena->free_chunks);
+  arena_init(arena);
+}
+
+static void link_chunk(Arena* arena, ArenaChunk* chunk) {
+  chunk->previous = NULL;
+  chunk->next = arena->chunks;
+  if (arena->chunks != NULL)
+    arena->chunks->previous = chunk;
+  arena->chunks = chunk;
+}
+
+static void unlink_chunk(Arena* arena, ArenaChunk* chunk) {
+  if (chunk->previous != NULL)
+    chunk->previous->next = chunk->next;
+  else
+    arena->chunks = chunk->next;
+  if (chunk->next != NULL)
+    chunk->next->previous = chunk->previous;
+}
+
+/// Get an empty chunk of the given size (a multiple of ARENA_CHUNK_SIZE),
+/// reusing a free chunk if possible.
+static ArenaChunk* new_chunk(Arena* arena, size_t size) {
+  ArenaChunk* chunk;
+  bool can_recycle = size == ARENA_CHUNK_SIZE && arena->free_chunks != NULL;
+  if (can_recycle) {
+    chunk = arena->free_chunks;
+    arena->free_chunks = chunk->next;
+    arena->free_chunk_count--;
+    arena->stats.chunks_recycled++;
+  }
+  else {
+    // The alignment lets `CHUNK_OF()` find the header from any allocation.
+    chunk = (ArenaChunk*)aligned_alloc(ARENA_CHUNK_SIZE, size);
+    if (chunk == NULL)
+      // Not enough available memory.
+      exit(EXIT_FAILURE);
+    arena->stats.chunks_allocated++;
+  }
+
+  chunk->size = size;
+  chunk->used = CHUNK_HEADER_SIZE;
+  chunk->live_count = 0;
+  link_chunk(arena, chunk);
+
+  return chunk;
+}
+
+/// Allocate memory from the arena.
+void* arena_allocate(Arena* arena, size_t size) {
+  size = ALIGN_UP(size, ARENA_ALIGNMENT);
+  arena->stats.allocations++;
+
+  // An allocation that does not fit in a regular chunk gets a chunk of its own.
+  // (It still starts within the first ARENA_CHUNK_SIZE bytes of the chunk.)
+  bool is_large = size > ARENA_CHUNK_SIZE - CHUNK_HEADER_SIZE;
+  if (is_large) {
+    ArenaChunk* chunk = new_chunk(arena, ALIGN_UP(CHUNK_HEADER_SIZE + size, ARENA_CHUNK_SIZE));
+    chunk->used += size;
+    chunk->live_count++;
+    return (byte*)chunk + CHUNK_HEADER_SIZE;
+  }
+
+  ArenaChunk* chunk = arena->current;
+  bool fits = chunk != NULL && chunk->used + size <= chunk->size;
+  if (!fits)
+    chunk = arena->current = new_chunk(arena, ARENA_CHUNK_SIZE);
+
+  void* memory = (byte*)chunk + chunk->used;
+  chunk->used += size;
+  chunk->live_count++;
+
+  return memory;
+}
+
+/// Release a single allocation. Its memory is only reused directly if it was the
+/// most recent allocation, otherwise once its chunk has no live allocations left.
+void arena_release(Arena* arena, void* memory, size_t size) {
+  size = ALIGN_UP(size, ARENA_ALIGNMENT);
+  ArenaChunk* chunk = CHUNK_OF(memory);
+  chunk->live_count--;
+
+  bool is_most_recent = chunk == arena->current && (byte*)memory + size == (byte*)chunk + chunk->used;
+  if (is_most_recent)
+    chunk->used -= size;
+
+  bool is_empty = chunk->live_count == 0;
+  if (!is_empty)
+    return;
+
+  if (chunk == arena->current) {
+    chunk->used = CHUNK_HEADER_SIZE;
+    return;
+  }
+
+  unlink_chunk(arena, chunk);
+  bool should_keep = chunk->size == ARENA_CHUNK_SIZE && arena->free_chunk_count < ARENA_MAX_FREE_CHUNKS;
+  if (should_keep) {
+    chunk->next = arena->free_chunks;
+    arena->free_chunks = chunk;
+    arena->free_chunk_count++;
+  }
+  else
+    free(chunk);
+}
@@ -0,0 +1,60 @@
+#ifndef CTHUSLY_ARENA_H
+#define CTHUSLY_ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "common.h"
+
+/// The size (and alignment) of a regular chunk. Allocations that do not fit in
+/// a regular chunk get a chunk of their own (a multiple of this size).
+#define ARENA_CHUNK_SIZE (64 * 1024)
+/// The alignment of every allocation in the arena.
+#define ARENA_ALIGNMENT 8
+/// The maximum number of empty chunks kept for reuse (the rest are freed).
+#define ARENA_MAX_FREE_CHUNKS 32
+
+/// A contiguous block of memory that allocations are bumped out of. The header
+/// is placed at the beginning of the chunk, and since chunks are aligned to
+/// ARENA_CHUNK_SIZE, the chunk of any allocation can be found from its address.
+typedef struct ArenaChunk {
+  struct ArenaChunk* previous;
+  struct ArenaChunk* next;
+  /// The total size of the chunk in bytes (including this header).
+  size_t size;
+  /// The number of bytes used (the offset to bump the next allocation from).
+  size_t used;
+  /// The number of allocations in the chunk that have not been released.
+  int live_count;
+} ArenaChunk;
+
+/// Allocation counters of an arena (shown with the `--gc-stats` flag).
+typedef struct {
+  uint64_t allocations;
+  /// The number of chunks allocated from the system.
+  uint64_t chunks_allocated;
+  /// The number of emptied chunks reused rather than allocated from the system.
+  uint64_t chunks_recycled;
+} ArenaStats;
+
+/// A region (arena) allocator - Memory is handed out by bumping a pointer in the
+/// current chunk, and all chunks are released at once when the arena is freed.
+/// Individual allocations may be released (e.g. by a garbage collector), which
+/// makes a chunk reusable once all of its allocations have been released.
+typedef struct {
+  /// The chunk that allocations are currently bumped out of.
+  ArenaChunk* current;
+  /// All chunks in use (a doubly linked list, including the current chunk).
+  ArenaChunk* chunks;
+  /// Empty chunks kept for reuse (a singly linked list).
+  ArenaChunk* free_chunks;
+  int free_chunk_count;
+  ArenaStats stats;
+} Arena;
+
+void arena_init(Arena* arena);
+void arena_free(Arena* arena);
+void* arena_allocate(Arena* arena, size_t size);
+void arena_release(Arena* arena, void* memory, size_t size);
+
+#endif
@@ -0,0 +1,428 @@
+// The bytecode file format (`.thbc`), which stores a compiled program so that it
+// can be run again without compiling its source:
+//
+//   header        BYTECODE_FILE_HEADER_SIZE bytes (see below)
+//   instructions  <instruction count> bytes
+//   line table    <line table size> bytes (see `LineTable`)
+//   constants     <constant count> constants, each a tag byte (`ConstantTag`)
+//                 followed by its value:
+//                   number: the bits of the IEEE 754 double (8 bytes)
+//                   text:   the length (4 bytes) and the chars, null-terminated
+//                   (booleans and `none` have no value)
+//
+// The header consists of the magic bytes "THBC" followed by seven 4-byte fields:
+// the format version, the checksum (the hash code of all bytes after the header),
+// the instruction count, the line table size, the constant count, the largest
+// stack depth of the program, and a reserved field (zero). All integers are
+// little-endian.
+//
+// A bytecode file is loaded by mapping it into memory, after which the program
+// uses the instructions and the line table in place. Text constants refer to
+// their chars in the mapped file as well (see `make_mapped_text()`), so only
+// the constant pool itself is allocated.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bytecode_file.h"
+#include "gc_object.h"
+#include "memory.h"
+#include "text_hash.h"
+
+/// Whether files are mapped into memory using `mmap()` (otherwise they are read).
+#if defined(__unix__) || defined(__APPLE__)
+#define BYTECODE_FILE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#define BYTECODE_FILE_MAGIC "THBC"
+#define BYTECODE_FILE_MAGIC_SIZE 4
+#define BYTECODE_FILE_HEADER_FIELD_COUNT 7
+#define BYTECODE_FILE_HEADER_SIZE (BYTECODE_FILE_MAGIC_SIZE + 4 * BYTECODE_FILE_HEADER_FIELD_COUNT)
+
+/// The fields of the header following the magic bytes.
+typedef struct {
+  uint32_t version;
+  uint32_t checksum;
+  uint32_t instruction_count;
+  uint32_t line_table_size;
+  uint32_t constant_count;
+  uint32_t max_stack_depth;
+  uint32_t reserved;
+} BytecodeFileHeader;
+
+/// The type of a serialized constant.
+typedef enum {
+  CONSTANT_TAG_NONE,
+  CONSTANT_TAG_FALSE,
+  CONSTANT_TAG_TRUE,
+  CONSTANT_TAG_NUMBER,
+  CONSTANT_TAG_TEXT,
+} ConstantTag;
+
+/// A growable buffer that a file is serialized into before it is written.
+typedef struct {
+  byte* bytes;
+  int count;
+  int capacity;
+} ByteBuffer;
+
+/// The position of a reader of a mapped file (see `read_bytes()`).
+typedef struct {
+  const byte* next;
+  const byte* end;
+} Reader;
+
+static void buffer_write(ByteBuffer* buffer, const void* bytes, int count) {
+  if (buffer->count + count > buffer->capacity) {
+    int old_capacity = buffer->capacity;
+    while (buffer->count + count > buffer->capacity)
+      buffer->capacity = GROW_CAPACITY(buffer->capacity);
+    buffer->bytes = GROW_ARRAY(byte, buffer->bytes, old_capacity, buffer->capacity);
+  }
+
+  memcpy(buffer->bytes + buffer->count, bytes, count);
+  buffer->count += count;
+}
+
+static void buffer_write_byte(ByteBuffer* buffer, byte value) {
+  buffer_write(buffer, &value, 1);
+}
+
+static void encode_u32(byte* destination, uint32_t value) {
+  for (int i = 0; i < 4; i++)
+    destination[i] = (value >> (8 * i)) & 0xff;
+}
+
+static uint32_t decode_u32(const byte* source) {
+  return (uint32_t)source[0] | ((uint32_t)source[1] << 8) | ((uint32_t)source[2] << 16) | ((uint32_t)source[3] << 24);
+}
+
+static void buffer_write_u32(ByteBuffer* buffer, uint32_t value) {
+  byte bytes[4];
+  encode_u32(bytes, value);
+  buffer_write(buffer, bytes, 4);
+}
+
+static void buffer_write_u64(ByteBuffer* buffer, uint64_t value) {
+  buffer_write_u32(buffer, (uint32_t)value);
+  buffer_write_u32(buffer, (uint32_t)(value >> 32));
+}
+
+static void write_text_constant(ByteBuffer* buffer, const char* chars, int length) {
+  buffer_write_byte(buffer, CONSTANT_TAG_TEXT);
+  buffer_write_u32(buffer, (uint32_t)length);
+  buffer_write(buffer, chars, length);
+  buffer_write_byte(buffer, '\0');
+}
+
+/// Serialize a constant. Returns `false` if the value cannot be serialized
+/// (constants are only ever numbers, booleans, `none` and texts).
+static bool write_constant(ByteBuffer* buffer, ThuslyValue value) {
+  if (IS_NONE(value))
+    buffer_write_byte(buffer, CONSTANT_TAG_NONE);
+  else if (IS_BOOLEAN(value))
+    buffer_write_byte(buffer, TO_C_BOOL(value) ? CONSTANT_TAG_TRUE : CONSTANT_TAG_FALSE);
+  else if (IS_NUMBER(value)) {
+    double number = TO_C_DOUBLE(value);
+    uint64_t bits;
+    memcpy(&bits, &number, sizeof(bits));
+    buffer_write_byte(buffer, CONSTANT_TAG_NUMBER);
+    buffer_write_u64(buffer, bits);
+  }
+  // (Texts are written by their chars, since which texts are stored inline
+  // differs between value representations.)
+  else if (IS_SHORT_TEXT(value)) {
+    char chars[SHORT_TEXT_MAX_LENGTH + 1];
+    int length = short_text_unpack(value, chars);
+    write_text_constant(buffer, chars, length);
+  }
+  else if (IS_GC_OBJECT(value) && GET_GC_OBJECT_TYPE(value) == GC_OBJECT_TYPE_TEXT)
+    write_text_constant(buffer, TO_C_STRING(value), TO_TEXT(value)->length);
+  else
+    return false;
+
+  return true;
+}
+
+/// Write the file to a temporary path first and then rename it, so that a
+/// file at the path is always complete (e.g. if several processes compile
+/// the same program at the same time).
+static bool write_file_atomically(const char* path, const byte* bytes, size_t size) {
+  size_t temporary_path_size = strlen(path) + 32;
+  char* temporary_path = ALLOCATE(char, temporary_path_size);
+  #ifdef BYTECODE_FILE_MMAP
+    snprintf(temporary_path, temporary_path_size, "%s.%ld.tmp", path, (long)getpid());
+  #else
+    snprintf(temporary_path, temporary_path_size, "%s.tmp", path);
+  #endif
+
+  bool was_written = false;
+  FILE* file = fopen(temporary_path, "wb");
+  if (file != NULL) {
+    was_written = fwrite(bytes, 1, size, file) == size;
+    was_written = fclose(file) == 0 && was_written;
+    was_written = was_written && rename(temporary_path, path) == 0;
+    if (!was_written)
+      remove(temporary_path);
+  }
+
+  FREE_ARRAY(char, temporary_path, temporary_path_size);
+
+  return was_written;
+}
+
+/// Serialize the compiled program into a bytecode file at the given path.
+bool bytecode_file_write(Program* program, const char* path) {
+  ByteBuffer buffer = { .bytes = NULL, .count = 0, .capacity = 0 };
+  // (The header is written last, once the checksum is known.)
+  byte header_placeholder[BYTECODE_FILE_HEADER_SIZE] = { 0 };
+  buffer_write(&buffer, header_placeholder, BYTECODE_FILE_HEADER_SIZE);
+  buffer_write(&buffer, program->instructions, program->count);
+  buffer_write(&buffer, program->lines.deltas, program->lines.count);
+
+  ConstantPool* pool = &program->constant_pool;
+  for (int i = 0; i < pool->count; i++) {
+    if (!write_constant(&buffer, pool->values[i])) {
+      fprintf(stderr, "The program has a constant that cannot be written to a bytecode file.\n");
+      FREE_ARRAY(byte, buffer.bytes, buffer.capacity);
+      return false;
+    }
+  }
+
+  uint32_t fields[BYTECODE_FILE_HEADER_FIELD_COUNT] = {
+    BYTECODE_FILE_VERSION,
+    hash_text((const char*)buffer.bytes + BYTECODE_FILE_HEADER_SIZE, buffer.count - BYTECODE_FILE_HEADER_SIZE),
+    (uint32_t)program->count,
+    (uint32_t)program->lines.count,
+    (uint32_t)pool->count,
+    (uint32_t)program->max_stack_depth,
+    0,
+  };
+  memcpy(buffer.bytes, BYTECODE_FILE_MAGIC, BYTECODE_FILE_MAGIC_SIZE);
+  for (int i = 0; i < BYTECODE_FILE_HEADER_FIELD_COUNT; i++)
+    encode_u32(buffer.bytes + BYTECODE_FILE_MAGIC_SIZE + 4 * i, fields[i]);
+
+  bool was_written = write_file_atomically(path, buffer.bytes, buffer.count);
+  if (!was_written)
+    fprintf(stderr, "The bytecode file could not be written. (File name: \"%s\")\n", path);
+  FREE_ARRAY(byte, buffer.bytes, buffer.capacity);
+
+  return was_written;
+}
+
+static BytecodeFileHeader read_header(const byte* memory) {
+  const byte* fields = memory + BYTECODE_FILE_MAGIC_SIZE;
+
+  return (BytecodeFileHeader){
+    .version = decode_u32(fields),
+    .checksum = decode_u32(fields + 4),
+    .instruction_count = decode_u32(fields + 8),
+    .line_table_size = decode_u32(fields + 12),
+    .constant_count = decode_u32(fields + 16),
+    .max_stack_depth = decode_u32(fields + 20),
+    .reserved = decode_u32(fields + 24),
+  };
+}
+
+/// Get the reason why the file (read into memory) is not a valid bytecode file,
+/// or `NULL` if it is valid.
+static const char* get_invalid_file_reason(const byte* memory, size_t size) {
+  if (size < BYTECODE_FILE_HEADER_SIZE || memcmp(memory, BYTECODE_FILE_MAGIC, BYTECODE_FILE_MAGIC_SIZE) != 0)
+    return "It is not a bytecode file.";
+
+  BytecodeFileHeader header = read_header(memory);
+  if (header.version != BYTECODE_FILE_VERSION)
+    return "It was compiled by a different version of cthusly. (Compile the source again.)";
+
+  size_t content_size = size - BYTECODE_FILE_HEADER_SIZE;
+  bool is_truncated = content_size > INT32_MAX
+    || (size_t)header.instruction_count + header.line_table_size > content_size;
+  if (is_truncated || hash_text((const char*)memory + BYTECODE_FILE_HEADER_SIZE, (int)content_size) != header.checksum)
+    return "The file is corrupted (the checksum does not match).";
+
+  return NULL;
+}
+
+#ifdef BYTECODE_FILE_MMAP
+/// Map the file into memory. The pages are private (copy-on-write), since the
+/// VM rewrites instructions while running (see `SPECIALIZE()` in vm.c).
+static bool map_file(BytecodeFile* out_file, const char* path) {
+  int file_descriptor = open(path, O_RDONLY);
+  if (file_descriptor < 0)
+    return false;
+
+  struct stat file_stat;
+  bool is_mapped = fstat(file_descriptor, &file_stat) == 0 && file_stat.st_size > 0;
+  if (is_mapped) {
+    void* memory = mmap(NULL, (size_t)file_stat.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, file_descriptor, 0);
+    is_mapped = memory != MAP_FAILED;
+    if (is_mapped)
+      *out_file = (BytecodeFile){ .memory = (byte*)memory, .size = (size_t)file_stat.st_size, .is_mapped = true };
+  }
+  // (The mapping remains valid after the file is closed.)
+  close(file_descriptor);
+
+  return is_mapped;
+}
+#endif
+
+static bool read_whole_file(BytecodeFile* out_file, const char* path) {
+  FILE* file = fopen(path, "rb");
+  if (file == NULL)
+    return false;
+
+  fseek(file, 0L, SEEK_END);
+  long file_size = ftell(file);
+  rewind(file);
+  bool was_read = file_size > 0;
+  if (was_read) {
+    byte* memory = ALLOCATE(byte, file_size);
+    was_read = fread(memory, 1, file_size, file) == (size_t)file_size;
+    if (was_read)
+      *out_file = (BytecodeFile){ .memory = memory, .size = (size_t)file_size, .is_mapped = false };
+    else
+      FREE_ARRAY(byte, memory, file_size);
+  }
+  fclose(file);
+
+  return was_read;
+}
+
+/// Map a bytecode file into memory and check that it is valid (reporting to
+/// stderr if not, unless `should_report_errors` is `false`). The file is to be
+/// unmapped using `bytecode_file_unmap()` once the program loaded from it (see
+/// `bytecode_file_load()`) and the VM running it have been freed.
+bool bytecode_file_map(BytecodeFile* out_file, const char* path, bool should_report_errors) {
+  bool was_opened = false;
+  #ifdef BYTECODE_FILE_MMAP
+    was_opened = map_file(out_file, path);
+  #endif
+  if (!was_opened)
+    was_opened = read_whole_file(out_file, path);
+  if (!was_opened) {
+    if (should_report_errors)
+      fprintf(stderr, "The file could not be opened. (File name: \"%s\")\n", path);
+    return false;
+  }
+
+  const char* invalid_file_reason = get_invalid_file_reason(out_file->memory, out_file->size);
+  if (invalid_file_reason != NULL) {
+    if (should_report_errors)
+      fprintf(stderr, "The bytecode file could not be loaded (\"%s\"). %s\n", path, invalid_file_reason);
+    bytecode_file_unmap(out_file);
+    return false;
+  }
+
+  return true;
+}
+
+void bytecode_file_unmap(BytecodeFile* file) {
+  if (file->memory == NULL)
+    return;
+
+  #ifdef BYTECODE_FILE_MMAP
+    if (file->is_mapped)
+      munmap(file->memory, file->size);
+  #endif
+  if (!file->is_mapped)
+    FREE_ARRAY(byte, file->memory, file->size);
+  *file = (BytecodeFile){ .memory = NULL, .size = 0, .is_mapped = false };
+}
+
+/// Get the next `count` bytes of the file. Returns `NULL` if there are fewer left.
+static const byte* read_bytes(Reader* reader, size_t count) {
+  if ((size_t)(reader->end - reader->next) < count)
+    return NULL;
+
+  const byte* bytes = reader->next;
+  reader->next += count;
+
+  return bytes;
+}
+
+/// Read a constant into `out_value`. Returns `false` if it is malformed.
+static bool read_constant(Reader* reader, Environment* environment, ThuslyValue* out_value) {
+  const byte* tag = read_bytes(reader, 1);
+  if (tag == NULL)
+    return false;
+
+  switch (*tag) {
+    case CONSTANT_TAG_NONE:
+      *out_value = FROM_C_NULL;
+      return true;
+    case CONSTANT_TAG_FALSE:
+    case CONSTANT_TAG_TRUE:
+      *out_value = FROM_C_BOOL(*tag == CONSTANT_TAG_TRUE);
+      return true;
+    case CONSTANT_TAG_NUMBER: {
+      const byte* bits_bytes = read_bytes(reader, 8);
+      if (bits_bytes == NULL)
+        return false;
+      uint64_t bits = decode_u32(bits_bytes) | ((uint64_t)decode_u32(bits_bytes + 4) << 32);
+      double number;
+      memcpy(&number, &bits, sizeof(number));
+      *out_value = FROM_C_DOUBLE(number);
+      return true;
+    }
+    case CONSTANT_TAG_TEXT: {
+      const byte* length_bytes = read_bytes(reader, 4);
+      uint32_t length = length_bytes == NULL ? 0 : decode_u32(length_bytes);
+      const char* chars = length_bytes == NULL || length > INT32_MAX - 1 ? NULL : (const char*)read_bytes(reader, length + 1);
+      if (chars == NULL || chars[length] != '\0')
+        return false;
+      *out_value = length <= SHORT_TEXT_MAX_LENGTH
+        ? make_text(environment, chars, (int)length)
+        : FROM_C_OBJECT_PTR(make_mapped_text(environment, chars, (int)length));
+      return true;
+    }
+    default:
+      return false;
+  }
+}
+
+/// Load the program of a mapped bytecode file (see `bytecode_file_map()`). The
+/// instructions and the line table of the program are those in the file.
+///
+/// IMPORTANT: The program must be set as the VM's program beforehand, so that
+/// the texts in its constant pool are reachable by the garbage collector.
+bool bytecode_file_load(BytecodeFile* file, Environment* environment, Program* out_program) {
+  BytecodeFileHeader header = read_header(file->memory);
+  Reader reader = { .next = file->memory + BYTECODE_FILE_HEADER_SIZE, .end = file->memory + file->size };
+
+  out_program->instructions = (byte*)read_bytes(&reader, header.instruction_count);
+  out_program->count = (int)header.instruction_count;
+  out_program->capacity = (int)header.instruction_count;
+  out_program->lines.deltas = (byte*)read_bytes(&reader, header.line_table_size);
+  out_program->lines.count = (int)header.line_table_size;
+  out_program->lines.capacity = (int)header.line_table_size;
+  out_program->is_mapped = true;
+  out_program->max_stack_depth = (int)header.max_stack_depth;
+
+  // (A program always ends with OP_RETURN.)
+  bool is_valid = header.instruction_count > 0 && out_program->instructions[header.instruction_count - 1] == OP_RETURN;
+  for (uint32_t i = 0; is_valid && i < header.constant_count; i++) {
+    ThuslyValue value;
+    is_valid = read_constant(&reader, environment, &value);
+    if (is_valid)
+      program_add_constant(out_program, value);
+  }
+  is_valid = is_valid && reader.next == reader.end;
+
+  if (!is_valid)
+    fprintf(stderr, "The bytecode file could not be loaded. Its contents are malformed.\n");
+
+  return is_valid;
+}
+
+/// Whether the path is that of a bytecode file (by its extension).
+bool is_bytecode_file_path(const char* path) {
+  size_t length = strlen(path);
+  size_t extension_length = strlen(BYTECODE_FILE_EXTENSION);
+
+  return length > extension_length && strcmp(path + length - extension_length, BYTECODE_FILE_EXTENSION) == 0;
+}
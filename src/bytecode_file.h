@@ -0,0 +1,33 @@
+#ifndef CTHUSLY_BYTECODE_FILE_H
+#define CTHUSLY_BYTECODE_FILE_H
+
+#include <stddef.h>
+
+#include "common.h"
+#include "program.h"
+#include "vm.h"
+
+/// The file extension of compiled programs (see `--compile-only`).
+#define BYTECODE_FILE_EXTENSION ".thbc"
+
+/// The version of the format, which also covers the instruction set. It needs
+/// to be increased whenever either changes, since a file is only loaded by a
+/// build using the same version.
+#define BYTECODE_FILE_VERSION 2
+
+/// The contents of a bytecode file in memory (see `bytecode_file_map()`).
+typedef struct BytecodeFile {
+  byte* memory;
+  size_t size;
+  /// Whether the file is memory-mapped (rather than read into an allocated buffer
+  /// on platforms without `mmap()`).
+  bool is_mapped;
+} BytecodeFile;
+
+bool bytecode_file_write(Program* program, const char* path);
+bool bytecode_file_map(BytecodeFile* out_file, const char* path, bool should_report_errors);
+bool bytecode_file_load(BytecodeFile* file, Environment* environment, Program* out_program);
+void bytecode_file_unmap(BytecodeFile* file);
+bool is_bytecode_file_path(const char* path);
+
+#endif
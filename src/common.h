@@ -10,12 +10,64 @@
 /// (Whether to print output is still controlled via the flags.)
 #define DEBUG_MODE
 
+/// Whether to instrument the interpreter loops of both engines for the opcode
+/// profiler (`--profile`) and for counting the executed instructions (shown with
+/// `--stats`). This adds work to the dispatch of every instruction, so it is not
+/// defined by default. Comment/uncomment to disable/enable (or configure with
+/// `-DPROFILE_DISPATCH=ON`).
+// #define PROFILE_DISPATCH
+
 /// Flag used by the implementer to output temporary information
 /// when debugging.
 // #define DEBUG_MODE_IMPLEMENTER
 
+/// Whether to run a garbage collection before every allocation of a gc
+/// object (rather than when the heap budget is exceeded), in order to
+/// surface objects that are not reachable from the roots while in use.
+/// Comment/uncomment to disable/enable.
+// #define DEBUG_STRESS_GC
+
+/// Whether to represent a ThuslyValue as a single NaN-boxed 64-bit word
+/// rather than as a tagged union (which is padded to 16 bytes).
+/// Comment/uncomment to disable/enable (or configure with `-DNAN_BOXING=ON`).
+// #define NAN_BOXING
+
+/// Whether the VM should dispatch instructions using computed gotos (the
+/// "labels as values" extension supported by GCC and Clang) rather than a
+/// `switch`. The `switch` is used as the portable fallback for compilers
+/// without the extension, as well as for the Wasm build of the playground.
+/// (Define `NO_COMPUTED_GOTO` to force the `switch` based dispatch.)
+#if defined(__GNUC__) && !defined(__EMSCRIPTEN__) && !defined(NO_COMPUTED_GOTO)
+#define COMPUTED_GOTO
+#endif
+
+/// Whether the baseline JIT compiler (`--jit`) is available. It emits x86-64
+/// machine code for the tagged union representation of a ThuslyValue and
+/// needs `mmap()` for allocating executable memory.
+#if defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__)) && !defined(NAN_BOXING)
+#define JIT_SUPPORTED
+#endif
+
+/// Whether the compile cache (`--cache-dir`) is available. It needs the POSIX
+/// functions for creating and listing directories.
+#if defined(__unix__) || defined(__APPLE__)
+#define COMPILE_CACHE_SUPPORTED
+#endif
+
 extern bool flag_debug_compilation;
 extern bool flag_debug_execution;
+extern bool flag_profile_opcodes;
+extern bool flag_show_stats;
+extern bool flag_jit;
+extern bool flag_tracing;
+/// Whether to run programs with the register-based engine (`--engine=reg`)
+/// rather than the stack-based interpreter (`--engine=stack`).
+extern bool flag_register_engine;
+extern bool flag_gc_stats;
+extern bool flag_lazy_interning;
+extern bool flag_compile_only;
+/// The optimization level (`-O0`, `-O1` or `-O2`).
+extern int flag_optimization_level;
 
 typedef uint8_t byte;
 
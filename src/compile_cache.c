@@ -0,0 +1,167 @@
+#include "common.h"
+
+#ifdef COMPILE_CACHE_SUPPORTED
+
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <utime.h>
+
+#include "compile_cache.h"
+#include "memory.h"
+
+#define FNV_OFFSET_BASIS ((uint64_t)0xcbf29ce484222325u)
+#define FNV_PRIME        ((uint64_t)0x100000001b3u)
+/// The length of an entry's file name: the key in hex followed by the extension.
+#define ENTRY_NAME_LENGTH (16 + sizeof(BYTECODE_FILE_EXTENSION) - 1)
+
+/// A cached program found when evicting (see `compile_cache_evict()`).
+typedef struct {
+  char* path;
+  size_t size;
+  time_t modified_time;
+} CacheEntry;
+
+/// Create the cache directory if it does not exist (its parent directory must exist).
+void compile_cache_init(CompileCache* cache, const char* directory, size_t max_size) {
+  cache->directory = directory;
+  cache->max_size = max_size;
+  cache->hits = 0;
+  cache->misses = 0;
+  cache->evictions = 0;
+
+  // (The directory may exist already. One that cannot be created is reported
+  // once storing a program into it fails.)
+  mkdir(directory, 0777);
+}
+
+static uint64_t hash_bytes(uint64_t hash_code, const void* bytes, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    hash_code ^= ((const byte*)bytes)[i];
+    hash_code *= FNV_PRIME;
+  }
+
+  return hash_code;
+}
+
+/// Get the key of the source's compiled program: a 64-bit (FNV-1a) hash of
+/// everything that the compiled program depends on, i.e. the source, the
+/// version of the bytecode file format (which also covers the instruction set)
+/// and the flags that change how programs are compiled.
+static uint64_t get_key(const char* source) {
+  uint32_t version = BYTECODE_FILE_VERSION;
+  // The flags that change how programs are compiled.
+  uint32_t compile_flags = (uint32_t)flag_optimization_level;
+
+  uint64_t key = FNV_OFFSET_BASIS;
+  key = hash_bytes(key, &version, sizeof(version));
+  key = hash_bytes(key, &compile_flags, sizeof(compile_flags));
+
+  return hash_bytes(key, source, strlen(source));
+}
+
+/// Get the path of the cached program compiled from the source (whether or not
+/// it has been cached). Needs to be `free()`d.
+char* compile_cache_get_entry_path(CompileCache* cache, const char* source) {
+  size_t path_size = strlen(cache->directory) + 1 + ENTRY_NAME_LENGTH + 1;
+  char* path = (char*)malloc(path_size);
+  if (path == NULL)
+    exit(EXIT_FAILURE);
+  snprintf(path, path_size, "%s/%016llx%s", cache->directory, (unsigned long long)get_key(source), BYTECODE_FILE_EXTENSION);
+
+  return path;
+}
+
+/// Map the cached program at the path if it has been cached (and is valid,
+/// as the program is compiled again otherwise). Counts as a hit or a miss.
+bool compile_cache_find(CompileCache* cache, const char* entry_path, BytecodeFile* out_file) {
+  if (!bytecode_file_map(out_file, entry_path, false)) {
+    cache->misses++;
+    return false;
+  }
+
+  cache->hits++;
+  // The modification time is when the program was last used, which is what
+  // the least recently used programs are evicted by.
+  utime(entry_path, NULL);
+
+  return true;
+}
+
+static int compare_entries_by_age(const void* a, const void* b) {
+  const CacheEntry* a_entry = (const CacheEntry*)a;
+  const CacheEntry* b_entry = (const CacheEntry*)b;
+  if (a_entry->modified_time != b_entry->modified_time)
+    return a_entry->modified_time < b_entry->modified_time ? -1 : 1;
+
+  // (Entries used within the same second are removed in order of their names.)
+  return strcmp(a_entry->path, b_entry->path);
+}
+
+/// Remove the least recently used programs from the cache (apart from the one
+/// at `kept_entry_path`, which was just stored) until the cached programs fit
+/// within the maximum size of the cache.
+void compile_cache_evict(CompileCache* cache, const char* kept_entry_path) {
+  DIR* directory = opendir(cache->directory);
+  if (directory == NULL)
+    return;
+
+  CacheEntry* entries = NULL;
+  int count = 0;
+  int capacity = 0;
+  size_t total_size = 0;
+  struct dirent* directory_entry;
+  while ((directory_entry = readdir(directory)) != NULL) {
+    const char* name = directory_entry->d_name;
+    if (strlen(name) != ENTRY_NAME_LENGTH || !is_bytecode_file_path(name))
+      continue;
+
+    size_t path_size = strlen(cache->directory) + 1 + ENTRY_NAME_LENGTH + 1;
+    char* path = (char*)malloc(path_size);
+    if (path == NULL)
+      exit(EXIT_FAILURE);
+    snprintf(path, path_size, "%s/%s", cache->directory, name);
+
+    struct stat file_stat;
+    if (stat(path, &file_stat) != 0 || !S_ISREG(file_stat.st_mode)) {
+      free(path);
+      continue;
+    }
+
+    if (count + 1 > capacity) {
+      int old_capacity = capacity;
+      capacity = GROW_CAPACITY(old_capacity);
+      entries = GROW_ARRAY(CacheEntry, entries, old_capacity, capacity);
+    }
+    entries[count++] = (CacheEntry){ .path = path, .size = (size_t)file_stat.st_size, .modified_time = file_stat.st_mtime };
+    total_size += (size_t)file_stat.st_size;
+  }
+  closedir(directory);
+
+  if (total_size > cache->max_size) {
+    qsort(entries, count, sizeof(CacheEntry), compare_entries_by_age);
+    for (int i = 0; i < count && total_size > cache->max_size; i++) {
+      if (strcmp(entries[i].path, kept_entry_path) == 0)
+        continue;
+      // (Another process may have removed the program already.)
+      if (remove(entries[i].path) == 0)
+        cache->evictions++;
+      total_size -= entries[i].size;
+    }
+  }
+
+  for (int i = 0; i < count; i++)
+    free(entries[i].path);
+  FREE_ARRAY(CacheEntry, entries, capacity);
+}
+
+void compile_cache_print_stats(CompileCache* cache, FILE* fout) {
+  fprintf(fout, "Compile cache:\n");
+  fprintf(fout, "    Hits (compiling skipped):           %llu\n", (unsigned long long)cache->hits);
+  fprintf(fout, "    Misses (compiled and stored):       %llu\n", (unsigned long long)cache->misses);
+  fprintf(fout, "    Evictions (least recently used):    %llu\n", (unsigned long long)cache->evictions);
+}
+
+#endif
@@ -0,0 +1,37 @@
+#ifndef CTHUSLY_COMPILE_CACHE_H
+#define CTHUSLY_COMPILE_CACHE_H
+
+#include <stdio.h>
+
+#include "bytecode_file.h"
+#include "common.h"
+
+/// The default size (in megabytes) that the compile cache is kept within (see `--cache-max-size`).
+#define COMPILE_CACHE_DEFAULT_MAX_SIZE_MB 64
+
+#ifdef COMPILE_CACHE_SUPPORTED
+
+/// An on-disk cache of compiled programs, stored as bytecode files in a directory
+/// and named by a hash of their source (see `compile_cache_get_entry_path()`).
+typedef struct {
+  const char* directory;
+  /// The total size (in bytes) of the cached programs that the cache is kept
+  /// within, by removing the least recently used ones (see `compile_cache_evict()`).
+  size_t max_size;
+  /// The number of sources whose compiled program was found in the cache.
+  uint64_t hits;
+  /// The number of sources that were not found in the cache (and were compiled).
+  uint64_t misses;
+  /// The number of cached programs removed to keep the cache within its size.
+  uint64_t evictions;
+} CompileCache;
+
+void compile_cache_init(CompileCache* cache, const char* directory, size_t max_size);
+char* compile_cache_get_entry_path(CompileCache* cache, const char* source);
+bool compile_cache_find(CompileCache* cache, const char* entry_path, BytecodeFile* out_file);
+void compile_cache_evict(CompileCache* cache, const char* kept_entry_path);
+void compile_cache_print_stats(CompileCache* cache, FILE* fout);
+
+#endif
+
+#endif
@@ -1,3 +1,4 @@
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -5,7 +6,11 @@
 #include "common.h"
 #include "compiler.h"
 #include "gc_object.h"
+#include "ir.h"
+#include "memory.h"
+#include "peephole.h"
 #include "program.h"
+#include "text_hash.h"
 #include "thusly_value.h"
 #include "tokenizer.h"
 
@@ -13,11 +18,14 @@
 #include "debug.h"
 #endif
 
-#define VARIABLES_MAX (UINT8_MAX + 1)
-#define CONSTANTS_MAX (UINT8_MAX + 1)
-#define JUMP_MAX UINT16_MAX
+#define VARIABLES_MAX (LONG_OPERAND_MAX + 1)
+#define CONSTANTS_MAX (LONG_OPERAND_MAX + 1)
+#define CONSTANT_INDEX_MIN_CAPACITY 16
+#define VARIABLE_INDEX_MIN_CAPACITY 16
+#define JUMP_MAX LONG_JUMP_MAX
 #define PLACEHOLDER_JUMP_TARGET 0xff  // Note: Keep the 0xff value!
 #define NOT_FOUND (-1)
+#define RECENT_INSTRUCTIONS_MAX 4
 #define UNINITIALIZED (-1)
 
 /// A user-defined variable declared in the source code.
@@ -25,8 +33,64 @@ typedef struct {
   Token name;
   /// The depth/level at which the variable was declared.
   int depth;
+  /// The position of the variable with the same name in an outer scope that this
+  /// variable shadows (NOT_FOUND if there is none).
+  int shadowed_position;
+  /// The variable in the intermediate representation (only built with `-O2`).
+  IrVariable* ir_variable;
 } Variable;
 
+/// An entry of the index from the names of variables to the variables in scope.
+typedef struct {
+  const char* name;
+  int length;
+  uint32_t hash_code;
+  /// The position of the innermost variable in scope with the name (NOT_FOUND
+  /// if none is in scope).
+  int position;
+} VariableIndexEntry;
+
+/// An index from the names of variables to their positions, so that a variable
+/// is found without comparing its name with every variable in scope. Names are
+/// never removed (only their position is cleared when their scope ends).
+/// (An open-addressing hash table, using linear probing.)
+typedef struct {
+  VariableIndexEntry* entries;
+  int count;
+  /// The number of entries (zero or a power of two).
+  int capacity;
+} VariableIndex;
+
+/// An index from the values in the constant pool to their positions, so that
+/// a value used as a literal several times is only added to the pool once.
+/// (An open-addressing hash table of positions, using linear probing.)
+typedef struct {
+  /// The positions in the constant pool (NOT_FOUND for unused entries).
+  int* positions;
+  int count;
+  /// The number of entries (zero or a power of two).
+  int capacity;
+} ConstantIndex;
+
+/// Builds the intermediate representation of the program (see ir.h) alongside the
+/// parsing, which is used for writing the program with `-O2`. Where an instruction is
+/// written while parsing, the node of the same operation is built (on the same line),
+/// taking its operands from the stack of nodes not yet part of an enclosing node.
+typedef struct {
+  Ir* ir;
+  IrNode** nodes;
+  int node_count;
+  int node_capacity;
+  /// The blocks being parsed, the innermost last. (The statements of a block are linked
+  /// in reverse order until the block has been parsed.)
+  IrNode** blocks;
+  int block_count;
+  int block_capacity;
+  /// The number of literals compiled before parsing (since they are counted again
+  /// when the program is written from the intermediate representation).
+  uint64_t constant_literals_before;
+} IrBuilder;
+
 /// The compiler and parser - Parses the tokens received by the tokenizer on demand
 /// (it controls the tokenizer) and writes the bytecode instructions for the VM in
 /// a single pass in the instruction format expected by the VM. (It performs top-down
@@ -35,11 +99,13 @@ typedef struct {
 typedef struct {
   /// The variables declared in the source code.
   /// When a variable is declared, it gets added to this array. The order will
-  /// coincide with how they end up on the VM's stack. Due to only supporting
-  /// instructions using 1 byte for operands, the array count cannot exceed 256.
-  Variable variables[VARIABLES_MAX];
+  /// coincide with how they end up on the VM's stack. (The count cannot exceed
+  /// VARIABLES_MAX, the number of stack slots that the long operands can address.)
+  Variable* variables;
   /// The number of variables currently in scope.
   int variable_count;
+  int variable_capacity;
+  VariableIndex variable_index;
   /// The current level of nesting (number of surrounding blocks).
   int scope_depth;
 } Compiler;
@@ -52,10 +118,30 @@ typedef struct {
   Tokenizer tokenizer;
   Token current;
   Token previous;
+  /// The offsets of the most recently written instructions, the most recent first.
+  /// (Used for fusing a sequence of instructions into a superinstruction, and for
+  /// folding operations on constants. More instructions are tracked than fused at
+  /// once, so that the operands of an outer operation are still known after an
+  /// inner one has been folded, e.g. `1 + 2 * 3`.)
+  int recent_instruction_offsets[RECENT_INSTRUCTIONS_MAX];
+  /// The offset of the most recent instruction that a jump lands on. Instructions
+  /// from this offset onward must not be fused with any instruction before it.
+  int latest_jump_target_offset;
+  ConstantIndex constant_index;
+  /// Builds the intermediate representation while parsing (with `-O2`), otherwise NULL.
+  IrBuilder* ir_builder;
   bool saw_error;
   bool panic_mode;
 } Parser;
 
+/// The state of the written instructions at a point, which the instructions written
+/// after it can be discarded back to (see `discard_instructions_since()`).
+typedef struct {
+  int offset;
+  int recent_instruction_offsets[RECENT_INSTRUCTIONS_MAX];
+  int latest_jump_target_offset;
+} InstructionMark;
+
 /// The levels of precedence from lowest to highest.
 typedef enum {
   PRECEDENCE_IGNORE,
@@ -164,15 +250,31 @@ static ParseRule* get_rule(TokenType type) {
 
 /// Initialize the compiler.
 static void compiler_init(Compiler* compiler) {
+  compiler->variables = NULL;
   compiler->variable_count = 0;
+  compiler->variable_capacity = 0;
+  compiler->variable_index = (VariableIndex){ .entries = NULL, .count = 0, .capacity = 0 };
   compiler->scope_depth = 0;
 }
 
+static void compiler_free(Compiler* compiler) {
+  FREE_ARRAY(Variable, compiler->variables, compiler->variable_capacity);
+  FREE_ARRAY(VariableIndexEntry, compiler->variable_index.entries, compiler->variable_index.capacity);
+  compiler_init(compiler);
+}
+
 /// Initialize the parser.
 static void parser_init(Parser* parser, Compiler* compiler, Environment* environment, Program* writable_program) {
   parser->compiler = compiler;
   parser->environment = environment;
   parser->writable_program = writable_program;
+  for (int i = 0; i < RECENT_INSTRUCTIONS_MAX; i++)
+    parser->recent_instruction_offsets[i] = NOT_FOUND;
+  parser->latest_jump_target_offset = 0;
+  parser->constant_index = (ConstantIndex){ .positions = NULL, .count = 0, .capacity = 0 };
+  parser->ir_builder = NULL;
+  // (The line before any token has been consumed, e.g. of the top-level block.)
+  parser->previous.line = 1;
   parser->saw_error = false;
   parser->panic_mode = false;
 }
@@ -314,25 +416,124 @@ static void synchronize(Parser* parser) {
   }
 }
 
-/// Add a value to the constant pool and get the location.
-static byte make_constant(Parser* parser, ThuslyValue value) {
-  unsigned int constant_index = program_add_constant(get_writable_program(parser), value);
-  // The operand to the OP_CONSTANT instruction (i.e. the index of the constant)
-  // currently only supports 1 byte (256 constants).
+/// Get the bits that identify a constant value. Numbers are identified by the
+/// bits of the double (so that e.g. `0` and `-0` are different constants), and
+/// texts by their short text bits or the address of the interned text.
+static uint64_t get_constant_bits(ThuslyValue value) {
+  #ifdef NAN_BOXING
+    return value;
+  #else
+    switch (value.type) {
+      case TYPE_BOOLEAN:
+        return TO_C_BOOL(value);
+      case TYPE_NUMBER: {
+        uint64_t bits;
+        memcpy(&bits, &TO_C_DOUBLE(value), sizeof(bits));
+        return bits;
+      }
+      case TYPE_GC_OBJECT:
+        return (uint64_t)(uintptr_t)TO_C_OBJECT_PTR(value);
+      case TYPE_SHORT_TEXT:
+        return TO_SHORT_TEXT_BITS(value);
+      default:
+        return 0;
+    }
+  #endif
+}
+
+static bool are_same_constant(ThuslyValue a, ThuslyValue b) {
+  #ifdef NAN_BOXING
+    return a == b;
+  #else
+    return a.type == b.type && get_constant_bits(a) == get_constant_bits(b);
+  #endif
+}
+
+static uint32_t hash_constant(ThuslyValue value) {
+  uint64_t bits = get_constant_bits(value);
+  #ifndef NAN_BOXING
+    bits ^= (uint64_t)value.type << 59;
+  #endif
+  // (Fibonacci hashing, taking the high bits which depend on all bits.)
+  return (uint32_t)((bits * 0x9e3779b97f4a7c15u) >> 32);
+}
+
+/// Whether a value can share a position in the constant pool. Every constant
+/// value can, except for texts that were not interned (equal texts are then
+/// not the same object).
+static bool is_shareable_constant(ThuslyValue value) {
+  return !IS_GC_OBJECT(value) || ((TextObject*)TO_C_OBJECT_PTR(value))->is_interned;
+}
+
+/// Find the entry of the constant index for a value (either the entry holding
+/// the position of an equal constant, or the unused entry to insert it in).
+static int* find_constant_index_entry(ConstantIndex* index, ConstantPool* pool, ThuslyValue value) {
+  uint32_t mask = (uint32_t)index->capacity - 1;
+  for (uint32_t i = hash_constant(value) & mask; true; i = (i + 1) & mask) {
+    int* position = &index->positions[i];
+    if (*position == NOT_FOUND || are_same_constant(pool->values[*position], value))
+      return position;
+  }
+}
+
+static void grow_constant_index(ConstantIndex* index, ConstantPool* pool) {
+  int capacity = index->capacity == 0 ? CONSTANT_INDEX_MIN_CAPACITY : index->capacity * 2;
+  ConstantIndex grown = { .positions = ALLOCATE(int, capacity), .count = index->count, .capacity = capacity };
+  for (int i = 0; i < capacity; i++)
+    grown.positions[i] = NOT_FOUND;
+
+  for (int i = 0; i < index->capacity; i++) {
+    if (index->positions[i] != NOT_FOUND)
+      *find_constant_index_entry(&grown, pool, pool->values[index->positions[i]]) = index->positions[i];
+  }
+
+  FREE_ARRAY(int, index->positions, index->capacity);
+  *index = grown;
+}
+
+static void free_constant_index(ConstantIndex* index) {
+  FREE_ARRAY(int, index->positions, index->capacity);
+  *index = (ConstantIndex){ .positions = NULL, .count = 0, .capacity = 0 };
+}
+
+/// Add a value to the constant pool (unless an equal constant has already been
+/// added) and get the location.
+static int make_constant(Parser* parser, ThuslyValue value) {
+  Program* program = get_writable_program(parser);
+  ConstantIndex* index = &parser->constant_index;
+  VMStats* stats = &parser->environment->vm->stats;
+  stats->constant_literals++;
+
+  int* entry = NULL;
+  if (is_shareable_constant(value)) {
+    // (The index is kept at most half full.)
+    if ((index->count + 1) * 2 > index->capacity)
+      grow_constant_index(index, &program->constant_pool);
+    entry = find_constant_index_entry(index, &program->constant_pool, value);
+    if (*entry != NOT_FOUND)
+      return *entry;
+  }
+
+  unsigned int constant_index = program_add_constant(program, value);
+  stats->constants++;
+  // The index of the constant must fit in the long operand of OP_CONSTANT_LONG.
   if (constant_index > CONSTANTS_MAX - 1) {
     error(parser, "Too many constants have been used.");
     return 0;
   }
 
-  return (byte)constant_index;
+  if (entry != NULL) {
+    *entry = (int)constant_index;
+    index->count++;
+  }
+
+  return (int)constant_index;
 }
 
-static byte make_identifier_constant(Parser* parser, Token* token) {
+static int make_identifier_constant(Parser* parser, Token* token) {
   return make_constant(
     parser,
-    FROM_C_OBJECT_PTR(
-      copy_c_string(parser->environment, token->lexeme, token->length)
-    )
+    make_text(parser->environment, token->lexeme, token->length)
   );
 }
 
@@ -341,47 +542,341 @@ static void overwrite_instruction(Parser* parser, int offset, byte updated_instr
   program_overwrite(get_writable_program(parser), offset, updated_instruction);
 }
 
-/// Write a byte of an instruction.
-static void write_instruction(Parser* parser, byte instruction) {
-  program_write(get_writable_program(parser), instruction, parser->previous.line);
+/// Write a single byte (an opcode or an operand) of an instruction.
+static void write_byte(Parser* parser, byte value) {
+  program_write(get_writable_program(parser), value, parser->previous.line);
+}
+
+/// Get the offset of the current instruction and mark it as the target of a jump.
+static int mark_jump_target(Parser* parser) {
+  parser->latest_jump_target_offset = get_current_instruction_offset(parser);
+
+  return parser->latest_jump_target_offset;
+}
+
+/// Get the opcode of the recent instruction at the given distance (0 being the most
+/// recent one) if it can be fused with the instructions written after it, otherwise
+/// `NOT_FOUND`. An instruction can only be fused if no jump lands after its start.
+static int get_fusable_opcode(Parser* parser, int distance) {
+  int offset = parser->recent_instruction_offsets[distance];
+  bool is_fusable = offset != NOT_FOUND && offset >= parser->latest_jump_target_offset;
+
+  return is_fusable ? get_writable_program(parser)->instructions[offset] : NOT_FOUND;
+}
+
+/// Get an operand of the recent instruction at the given distance (0 being the most recent).
+static byte get_recent_operand(Parser* parser, int distance, int operand_index) {
+  int offset = parser->recent_instruction_offsets[distance];
+
+  return get_writable_program(parser)->instructions[offset + 1 + operand_index];
+}
+
+/// Discard the given number of recently written instructions.
+static void discard_recent_instructions(Parser* parser, int amount) {
+  program_truncate(get_writable_program(parser), parser->recent_instruction_offsets[amount - 1]);
+  for (int i = 0; i < RECENT_INSTRUCTIONS_MAX; i++) {
+    bool is_kept = i + amount < RECENT_INSTRUCTIONS_MAX;
+    parser->recent_instruction_offsets[i] = is_kept ? parser->recent_instruction_offsets[i + amount] : NOT_FOUND;
+  }
+}
+
+/// Write the opcode of an instruction and record where the instruction starts.
+static void write_opcode(Parser* parser, byte opcode) {
+  for (int i = RECENT_INSTRUCTIONS_MAX - 1; i > 0; i--)
+    parser->recent_instruction_offsets[i] = parser->recent_instruction_offsets[i - 1];
+  parser->recent_instruction_offsets[0] = get_current_instruction_offset(parser);
+  write_byte(parser, opcode);
+}
+
+/// Try to fuse the instruction with the given opcode and the recently written ones
+/// into a superinstruction (replacing the recent ones). Returns `true` if fused.
+static bool fuse_superinstruction(Parser* parser, byte opcode) {
+  switch (opcode) {
+    case OP_POP:
+      // OP_SET_VAR <slot>, OP_POP  ->  OP_SET_VAR_POP <slot>
+      if (get_fusable_opcode(parser, 0) == OP_SET_VAR) {
+        byte slot = get_recent_operand(parser, 0, 0);
+        discard_recent_instructions(parser, 1);
+        write_opcode(parser, OP_SET_VAR_POP);
+        write_byte(parser, slot);
+        return true;
+      }
+      return false;
+    case OP_ADD:
+      // OP_GET_VAR <slot>, OP_CONSTANT <index>, OP_ADD  ->  OP_ADD_VAR_CONSTANT <slot> <index>
+      if (get_fusable_opcode(parser, 1) == OP_GET_VAR && get_fusable_opcode(parser, 0) == OP_CONSTANT) {
+        byte slot = get_recent_operand(parser, 1, 0);
+        byte constant_index = get_recent_operand(parser, 0, 0);
+        discard_recent_instructions(parser, 2);
+        write_opcode(parser, OP_ADD_VAR_CONSTANT);
+        write_byte(parser, slot);
+        write_byte(parser, constant_index);
+        return true;
+      }
+      return false;
+    case OP_LESS_THAN_EQUALS:
+      // OP_GET_VAR <slot a>, OP_GET_VAR <slot b>, OP_LESS_THAN_EQUALS  ->  OP_LESS_THAN_EQUALS_VARS <slot a> <slot b>
+      if (get_fusable_opcode(parser, 1) == OP_GET_VAR && get_fusable_opcode(parser, 0) == OP_GET_VAR) {
+        byte slot_a = get_recent_operand(parser, 1, 0);
+        byte slot_b = get_recent_operand(parser, 0, 0);
+        discard_recent_instructions(parser, 2);
+        write_opcode(parser, OP_LESS_THAN_EQUALS_VARS);
+        write_byte(parser, slot_a);
+        write_byte(parser, slot_b);
+        return true;
+      }
+      return false;
+    default:
+      return false;
+  }
+}
+
+/// Write an instruction without operands, or the opcode of an instruction with
+/// operands. Common sequences of instructions are fused into superinstructions.
+static void write_instruction(Parser* parser, byte opcode) {
+  if (fuse_superinstruction(parser, opcode))
+    return;
+
+  write_opcode(parser, opcode);
+}
+
+/// Write an instruction with a one-byte operand.
+static void write_instructions(Parser* parser, byte opcode, byte operand) {
+  write_instruction(parser, opcode);
+  write_byte(parser, operand);
 }
 
-/// Write two bytes of an instruction.
-static void write_instructions(Parser* parser, byte instruction1, byte instruction2) {
-  write_instruction(parser, instruction1);
-  write_instruction(parser, instruction2);
+/// Write an instruction with an operand (a stack slot or constant index), using
+/// the short form of the instruction if the operand fits in one byte, otherwise
+/// the long form (with a 3-byte operand).
+static void write_instruction_with_operand(Parser* parser, byte short_opcode, byte long_opcode, int operand) {
+  if (operand <= SHORT_OPERAND_MAX) {
+    write_instructions(parser, short_opcode, (byte)operand);
+    return;
+  }
+
+  write_instruction(parser, long_opcode);
+  write_byte(parser, (operand >> 16) & 0xff);
+  write_byte(parser, (operand >> 8) & 0xff);
+  write_byte(parser, operand & 0xff);
 }
 
 /// Write an instruction to load a constant.
 static void write_constant_instruction(Parser* parser, ThuslyValue value) {
-  write_instructions(parser, OP_CONSTANT, make_constant(parser, value));
+  write_instruction_with_operand(parser, OP_CONSTANT, OP_CONSTANT_LONG, make_constant(parser, value));
+}
+
+/// Write an instruction to load the variable at the given stack slot.
+static void write_get_variable_instruction(Parser* parser, int stack_slot) {
+  write_instruction_with_operand(parser, OP_GET_VAR, OP_GET_VAR_LONG, stack_slot);
+}
+
+/// Write an instruction to assign the value at the top of the stack to the
+/// variable at the given stack slot.
+static void write_set_variable_instruction(Parser* parser, int stack_slot) {
+  write_instruction_with_operand(parser, OP_SET_VAR, OP_SET_VAR_LONG, stack_slot);
+}
+
+/// Write an instruction to load a value known at compile time.
+static void write_value_instruction(Parser* parser, ThuslyValue value) {
+  if (IS_NONE(value))
+    write_instruction(parser, OP_CONSTANT_NONE);
+  else if (IS_BOOLEAN(value))
+    write_instruction(parser, TO_C_BOOL(value) ? OP_CONSTANT_TRUE : OP_CONSTANT_FALSE);
+  else
+    write_constant_instruction(parser, value);
+}
+
+/// Get the value loaded by the recent instruction at the given distance (0 being the
+/// most recent one) if it loads a constant and can be fused with the instructions
+/// written after it (see `get_fusable_opcode()`). Returns `true` if found.
+static bool get_recent_constant(Parser* parser, int distance, ThuslyValue* out_value) {
+  ThuslyValue* constants = get_writable_program(parser)->constant_pool.values;
+  switch (get_fusable_opcode(parser, distance)) {
+    case OP_CONSTANT:
+      *out_value = constants[get_recent_operand(parser, distance, 0)];
+      return true;
+    case OP_CONSTANT_LONG: {
+      int index = (get_recent_operand(parser, distance, 0) << 16)
+        | (get_recent_operand(parser, distance, 1) << 8)
+        | get_recent_operand(parser, distance, 2);
+      *out_value = constants[index];
+      return true;
+    }
+    case OP_CONSTANT_FALSE:
+      *out_value = FROM_C_BOOL(false);
+      return true;
+    case OP_CONSTANT_NONE:
+      *out_value = FROM_C_NULL;
+      return true;
+    case OP_CONSTANT_TRUE:
+      *out_value = FROM_C_BOOL(true);
+      return true;
+    default:
+      return false;
+  }
+}
+
+static InstructionMark mark_instructions(Parser* parser) {
+  InstructionMark mark;
+  mark.offset = get_writable_program(parser)->count;
+  memcpy(mark.recent_instruction_offsets, parser->recent_instruction_offsets, sizeof(mark.recent_instruction_offsets));
+  mark.latest_jump_target_offset = parser->latest_jump_target_offset;
+
+  return mark;
+}
+
+/// Discard the instructions written since the mark (e.g. of code that is parsed in
+/// order to check it for errors but would never run). They count as folded.
+static void discard_instructions_since(Parser* parser, InstructionMark* mark) {
+  Program* program = get_writable_program(parser);
+  VMStats* stats = &parser->environment->vm->stats;
+  for (int offset = mark->offset; offset < program->count; offset += get_instruction_size(program->instructions[offset]))
+    stats->folded_instructions++;
+  program_truncate(program, mark->offset);
+  memcpy(parser->recent_instruction_offsets, mark->recent_instruction_offsets, sizeof(mark->recent_instruction_offsets));
+  parser->latest_jump_target_offset = mark->latest_jump_target_offset;
+}
+
+/// Whether operations on constants are folded while parsing. They are not while
+/// building the intermediate representation, since the instructions are then written
+/// again from it (and folded then).
+static bool is_folding_enabled(Parser* parser) {
+  return flag_optimization_level >= 1 && parser->ir_builder == NULL;
+}
+
+/// Evaluate the operation of the given instruction on constant operands the way
+/// the VM does. Returns `false` if the operands are of types the operation does
+/// not support, since that is a runtime error (reported if the operation runs).
+static bool evaluate_constant_operation(Parser* parser, byte opcode, ThuslyValue a, ThuslyValue b, ThuslyValue* out_result) {
+  if (opcode == OP_NEGATE) {
+    if (!IS_NUMBER(a))
+      return false;
+    *out_result = FROM_C_DOUBLE(-TO_C_DOUBLE(a));
+    return true;
+  }
+  if (opcode == OP_NOT) {
+    *out_result = FROM_C_BOOL(!is_truthy(a));
+    return true;
+  }
+  if (opcode == OP_EQUALS || opcode == OP_NOT_EQUALS) {
+    *out_result = FROM_C_BOOL(values_are_equal(a, b) == (opcode == OP_EQUALS));
+    return true;
+  }
+  if (opcode == OP_ADD && IS_TEXT(a) && IS_TEXT(b)) {
+    *out_result = concatenate_flat_texts(parser->environment, a, b);
+    return true;
+  }
+  if (!IS_NUMBER(a) || !IS_NUMBER(b))
+    return false;
+
+  double x = TO_C_DOUBLE(a);
+  double y = TO_C_DOUBLE(b);
+  switch (opcode) {
+    case OP_GREATER_THAN:         *out_result = FROM_C_BOOL(x > y); return true;
+    case OP_GREATER_THAN_EQUALS:  *out_result = FROM_C_BOOL(x >= y); return true;
+    case OP_LESS_THAN:            *out_result = FROM_C_BOOL(x < y); return true;
+    case OP_LESS_THAN_EQUALS:     *out_result = FROM_C_BOOL(x <= y); return true;
+    case OP_ADD:                  *out_result = FROM_C_DOUBLE(x + y); return true;
+    case OP_SUBTRACT:             *out_result = FROM_C_DOUBLE(x - y); return true;
+    case OP_MULTIPLY:             *out_result = FROM_C_DOUBLE(x * y); return true;
+    case OP_DIVIDE:               *out_result = FROM_C_DOUBLE(x / y); return true;
+    case OP_MODULO:               *out_result = FROM_C_DOUBLE(fmod(x, y)); return true;
+    default:                      return false;
+  }
+}
+
+/// Try to fold the unary or binary operation of the given instruction and the
+/// recently written instructions loading its operands into a single instruction
+/// loading the result, if the operands are constants. Returns `true` if folded.
+///
+/// Operations that would fail at runtime are not folded, so that the error is
+/// still reported when (and only if) the operation runs, on the right line.
+static bool fold_constant_operation(Parser* parser, byte opcode) {
+  if (!is_folding_enabled(parser))
+    return false;
+
+  bool is_unary = opcode == OP_NEGATE || opcode == OP_NOT;
+  int operand_count = is_unary ? 1 : 2;
+  ThuslyValue operands[2] = { FROM_C_NULL, FROM_C_NULL };
+  for (int i = 0; i < operand_count; i++) {
+    if (!get_recent_constant(parser, operand_count - 1 - i, &operands[i]))
+      return false;
+  }
+
+  // (The operands remain in the constant pool, which keeps a text being
+  // concatenated reachable in case the result triggers a garbage collection.)
+  ThuslyValue result;
+  if (!evaluate_constant_operation(parser, opcode, operands[0], operands[1], &result))
+    return false;
+
+  discard_recent_instructions(parser, operand_count);
+  write_value_instruction(parser, result);
+  // The operand instructions and the operation are replaced by one instruction.
+  parser->environment->vm->stats.folded_instructions += operand_count;
+
+  return true;
+}
+
+/// Write the 4-byte operand of a long jump instruction.
+static void write_jump_operand(Parser* parser, int jump_size) {
+  write_byte(parser, (jump_size >> 24) & 0xff);
+  write_byte(parser, (jump_size >> 16) & 0xff);
+  write_byte(parser, (jump_size >> 8) & 0xff);
+  write_byte(parser, jump_size & 0xff);
 }
 
 /// Write an instruction to jump to an earlier instruction.
+///
+/// Jumps are always written in their long form (with a 4-byte operand) while
+/// compiling, since the size of a forward jump is not known until the code
+/// jumped over has been compiled. The jumps that fit are turned into their short
+/// form (with a 2-byte operand) once the program is compiled (see `shrink_jumps()`).
 static void write_jump_backward_instruction(Parser* parser, int target_offset) {
-  write_instruction(parser, OP_JUMP_BWD);
+  write_instruction(parser, OP_JUMP_BWD_LONG);
 
-  // The jump size (the operand for the jump instruction) should be 2 bytes MORE
+  // The jump size (the operand for the jump instruction) should be 4 bytes MORE
   // than the size from the current instruction to the target when jumping backward.
-  // This is due to that the VM will read the 3-byte jump instruction (1-byte opcode,
-  // 2-byte operand) and thereby move the program counter ahead. So, it needs to jump
+  // This is due to that the VM will read the 5-byte jump instruction (1-byte opcode,
+  // 4-byte operand) and thereby move the program counter ahead. So, it needs to jump
   // over the jump instruction itself as well.
-  int jump_operand_bytes = 2;
-  int jump_size = get_current_instruction_offset(parser) - target_offset + jump_operand_bytes;
+  int jump_operand_bytes = 4;
+  long jump_size = (long)get_current_instruction_offset(parser) - target_offset + jump_operand_bytes;
   if (jump_size > JUMP_MAX)
     error(parser, "The amount of code to jump over is more than what is currently supported.");
 
-  write_instructions(parser, (jump_size >> 8) & PLACEHOLDER_JUMP_TARGET, jump_size & PLACEHOLDER_JUMP_TARGET);
+  write_jump_operand(parser, (int)jump_size);
 }
 
-/// Write an instruction to jump to a later instruction. This uses a 16-bit
+/// Write an instruction to step the loop variable (at the given stack slot) of a
+/// `foreach` loop and jump back to the start of the loop body unless the end of
+/// the range has been passed (see `parse_foreach_statement()`). Like other backward
+/// jumps, it is written in its long form (see `write_jump_backward_instruction()`).
+static void write_foreach_next_instruction(Parser* parser, int loop_variable_slot, int body_start_offset) {
+  write_instruction(parser, OP_FOREACH_NEXT_LONG);
+  write_byte(parser, (loop_variable_slot >> 16) & 0xff);
+  write_byte(parser, (loop_variable_slot >> 8) & 0xff);
+  write_byte(parser, loop_variable_slot & 0xff);
+
+  // (See `write_jump_backward_instruction()` regarding the 4 bytes.)
+  int jump_operand_bytes = 4;
+  long jump_size = (long)get_current_instruction_offset(parser) - body_start_offset + jump_operand_bytes;
+  if (jump_size > JUMP_MAX)
+    error(parser, "The amount of code to jump over is more than what is currently supported.");
+
+  write_jump_operand(parser, (int)jump_size);
+}
+
+/// Write an instruction to jump to a later instruction. This uses a 32-bit
 /// placeholder jump offset and returns where that placeholder starts which
-/// should be used for backpatching it.
+/// should be used for backpatching it. (The instruction given is the long
+/// form of the jump, see `write_jump_backward_instruction()`.)
 static int write_jump_forward_instruction(Parser* parser, byte instruction) {
+  int jump_operand_bytes = 4;
   write_instruction(parser, instruction);
-  write_instructions(parser, PLACEHOLDER_JUMP_TARGET, PLACEHOLDER_JUMP_TARGET);
+  for (int i = 0; i < jump_operand_bytes; i++)
+    write_byte(parser, PLACEHOLDER_JUMP_TARGET);
 
-  int jump_operand_bytes = 2;
   int placeholder_start = get_current_instruction_offset(parser) - jump_operand_bytes;
 
   return placeholder_start;
@@ -391,18 +886,18 @@ static int write_jump_forward_instruction(Parser* parser, byte instruction) {
 /// placeholder offset with the now-correct jump target offset. This assumes the
 /// function is called immediately before the instruction to jump to is written.
 static void patch_jump_forward_instruction(Parser* parser, int placeholder_start) {
-  // The jump size (the operand for the jump instruction) should be 2 bytes LESS
+  // The jump size (the operand for the jump instruction) should be 4 bytes LESS
   // than the size from the current instruction to the target when jumping forward.
-  // This is due to that the VM will read the 3-byte jump instruction (1-byte opcode,
-  // 2-byte operand) and thereby move the program counter ahead. So, the VM does
+  // This is due to that the VM will read the 5-byte jump instruction (1-byte opcode,
+  // 4-byte operand) and thereby move the program counter ahead. So, the VM does
   // not need to jump those bytes again.
-  int jump_operand_bytes = 2;
-  int jump_size = get_current_instruction_offset(parser) - placeholder_start - jump_operand_bytes;
+  int jump_operand_bytes = 4;
+  int jump_size = mark_jump_target(parser) - placeholder_start - jump_operand_bytes;
   if (jump_size > JUMP_MAX)
     error(parser, "The amount of code to jump over is more than what is currently supported.");
 
-  overwrite_instruction(parser, placeholder_start, (jump_size >> 8) & PLACEHOLDER_JUMP_TARGET);
-  overwrite_instruction(parser, placeholder_start + 1, jump_size & PLACEHOLDER_JUMP_TARGET);
+  for (int i = 0; i < jump_operand_bytes; i++)
+    overwrite_instruction(parser, placeholder_start + i, (jump_size >> (8 * (jump_operand_bytes - 1 - i))) & 0xff);
 }
 
 /// Write an instruction to return.
@@ -410,6 +905,237 @@ static void write_return_instruction(Parser* parser) {
   write_instruction(parser, OP_RETURN);
 }
 
+// ---------------------------------------------------
+// INTERMEDIATE REPRESENTATION
+// ---------------------------------------------------
+
+static void ir_builder_init(IrBuilder* builder, Ir* ir, VMStats* stats) {
+  builder->ir = ir;
+  builder->nodes = NULL;
+  builder->node_count = 0;
+  builder->node_capacity = 0;
+  builder->blocks = NULL;
+  builder->block_count = 0;
+  builder->block_capacity = 0;
+  builder->constant_literals_before = stats->constant_literals;
+}
+
+static void ir_builder_free(IrBuilder* builder) {
+  FREE_ARRAY(IrNode*, builder->nodes, builder->node_capacity);
+  FREE_ARRAY(IrNode*, builder->blocks, builder->block_capacity);
+}
+
+/// Whether the intermediate representation is being built. (It is no longer built
+/// once an error has been reported, since the program will not be written.)
+static bool is_building_ir(Parser* parser) {
+  return parser->ir_builder != NULL && !parser->saw_error;
+}
+
+/// Create a node on the line of the most recently consumed token.
+static IrNode* new_ir_node(Parser* parser, IrNodeType type) {
+  return ir_new_node(parser->ir_builder->ir, type, parser->previous.line);
+}
+
+static void push_ir_node(Parser* parser, IrNode* node) {
+  IrBuilder* builder = parser->ir_builder;
+  if (builder->node_count + 1 > builder->node_capacity) {
+    int old_capacity = builder->node_capacity;
+    builder->node_capacity = GROW_CAPACITY(old_capacity);
+    builder->nodes = GROW_ARRAY(IrNode*, builder->nodes, old_capacity, builder->node_capacity);
+  }
+  builder->nodes[builder->node_count++] = node;
+}
+
+static IrNode* pop_ir_node(Parser* parser) {
+  return parser->ir_builder->nodes[--parser->ir_builder->node_count];
+}
+
+static IrVariable* get_ir_variable(Parser* parser, int position) {
+  return parser->compiler->variables[position].ir_variable;
+}
+
+/// Start building a block, which the statements parsed are added to.
+static void begin_ir_block(Parser* parser) {
+  if (!is_building_ir(parser))
+    return;
+
+  IrBuilder* builder = parser->ir_builder;
+  if (builder->block_count + 1 > builder->block_capacity) {
+    int old_capacity = builder->block_capacity;
+    builder->block_capacity = GROW_CAPACITY(old_capacity);
+    builder->blocks = GROW_ARRAY(IrNode*, builder->blocks, old_capacity, builder->block_capacity);
+  }
+  builder->blocks[builder->block_count++] = new_ir_node(parser, IR_BLOCK);
+}
+
+/// Finish building the innermost block (which becomes the most recently built node).
+static void end_ir_block(Parser* parser) {
+  if (!is_building_ir(parser))
+    return;
+
+  IrNode* block = parser->ir_builder->blocks[--parser->ir_builder->block_count];
+  IrNode* statements = NULL;
+  while (block->statements != NULL) {
+    IrNode* statement = block->statements;
+    block->statements = statement->next;
+    statement->next = statements;
+    statements = statement;
+  }
+  block->statements = statements;
+  push_ir_node(parser, block);
+}
+
+static void add_ir_statement(Parser* parser, IrNode* statement) {
+  IrBuilder* builder = parser->ir_builder;
+  IrNode* block = builder->blocks[builder->block_count - 1];
+  statement->next = block->statements;
+  block->statements = statement;
+}
+
+static void build_ir_constant(Parser* parser, ThuslyValue value) {
+  if (!is_building_ir(parser))
+    return;
+
+  IrNode* node = new_ir_node(parser, IR_CONSTANT);
+  node->value = value;
+  push_ir_node(parser, node);
+}
+
+/// Build an operation on the most recently built node(s).
+static void build_ir_operation(Parser* parser, IrNodeType type, byte opcode) {
+  if (!is_building_ir(parser))
+    return;
+
+  IrNode* node = new_ir_node(parser, type);
+  node->opcode = opcode;
+  node->right = type == IR_UNARY ? NULL : pop_ir_node(parser);
+  node->left = pop_ir_node(parser);
+  push_ir_node(parser, node);
+}
+
+/// Build the access (`IR_GET_VARIABLE`) of the variable at the given position, or the
+/// assignment (`IR_SET_VARIABLE`) of the most recently built node to it.
+static void build_ir_variable_access(Parser* parser, IrNodeType type, int position) {
+  if (!is_building_ir(parser))
+    return;
+
+  IrNode* node = new_ir_node(parser, type);
+  node->variable = get_ir_variable(parser, position);
+  node->left = type == IR_SET_VARIABLE ? pop_ir_node(parser) : NULL;
+  push_ir_node(parser, node);
+}
+
+/// Build a statement of the given type from the most recently built node(s): the
+/// expression of an expression statement or `@out` statement, the initializer of
+/// the variable declared most recently, or a block.
+static void build_ir_statement(Parser* parser, IrNodeType type) {
+  if (!is_building_ir(parser))
+    return;
+
+  if (type == IR_BLOCK) {
+    add_ir_statement(parser, pop_ir_node(parser));
+    return;
+  }
+
+  IrNode* statement = new_ir_node(parser, type);
+  statement->left = pop_ir_node(parser);
+  if (type == IR_VAR) {
+    IrBuilder* builder = parser->ir_builder;
+    statement->variable = get_ir_variable(parser, parser->compiler->variable_count - 1);
+    statement->variable->declaring_block = builder->blocks[builder->block_count - 1];
+  }
+  add_ir_statement(parser, statement);
+}
+
+static void build_ir_if_statement(Parser* parser, bool has_else_block) {
+  if (!is_building_ir(parser))
+    return;
+
+  IrNode* statement = new_ir_node(parser, IR_IF);
+  statement->else_body = has_else_block ? pop_ir_node(parser) : NULL;
+  statement->body = pop_ir_node(parser);
+  statement->left = pop_ir_node(parser);
+  add_ir_statement(parser, statement);
+}
+
+static void build_ir_while_statement(Parser* parser, bool has_modification_expr) {
+  if (!is_building_ir(parser))
+    return;
+
+  IrNode* statement = new_ir_node(parser, IR_WHILE);
+  statement->body = pop_ir_node(parser);
+  statement->right = has_modification_expr ? pop_ir_node(parser) : NULL;
+  statement->left = pop_ir_node(parser);
+  add_ir_statement(parser, statement);
+}
+
+/// Build a `foreach` statement, whose stepping is on the given line and whose first
+/// comparison is on the given range line (see `parse_foreach_statement()`).
+static void build_ir_foreach_statement(Parser* parser, int loop_variable_position, int line, int range_line) {
+  if (!is_building_ir(parser))
+    return;
+
+  IrNode* statement = new_ir_node(parser, IR_FOREACH);
+  statement->line = line;
+  statement->range_line = range_line;
+  statement->variable = get_ir_variable(parser, loop_variable_position);
+  statement->variable->is_loop_variable = true;
+  statement->body = pop_ir_node(parser);
+  statement->step = pop_ir_node(parser);
+  statement->right = pop_ir_node(parser);
+  statement->left = pop_ir_node(parser);
+  add_ir_statement(parser, statement);
+}
+
+/// Find the entry of the variable index for a name (either the entry of the
+/// name, or the unused entry to insert it in).
+static VariableIndexEntry* find_variable_index_entry_with_hash(VariableIndex* index, Token* name, uint32_t hash_code) {
+  uint32_t mask = (uint32_t)index->capacity - 1;
+  for (uint32_t i = hash_code & mask; true; i = (i + 1) & mask) {
+    VariableIndexEntry* entry = &index->entries[i];
+    bool is_unused = entry->name == NULL;
+    bool is_same_name = entry->hash_code == hash_code && entry->length == name->length
+      && memcmp(entry->name, name->lexeme, name->length) == 0;
+    if (is_unused || is_same_name)
+      return entry;
+  }
+}
+
+static void grow_variable_index(VariableIndex* index) {
+  int capacity = index->capacity == 0 ? VARIABLE_INDEX_MIN_CAPACITY : index->capacity * 2;
+  VariableIndex grown = { .entries = ALLOCATE(VariableIndexEntry, capacity), .count = index->count, .capacity = capacity };
+  for (int i = 0; i < capacity; i++)
+    grown.entries[i] = (VariableIndexEntry){ .name = NULL, .length = 0, .hash_code = 0, .position = NOT_FOUND };
+
+  for (int i = 0; i < index->capacity; i++) {
+    VariableIndexEntry* entry = &index->entries[i];
+    if (entry->name != NULL) {
+      Token name = { .lexeme = entry->name, .length = entry->length };
+      *find_variable_index_entry_with_hash(&grown, &name, entry->hash_code) = *entry;
+    }
+  }
+
+  FREE_ARRAY(VariableIndexEntry, index->entries, index->capacity);
+  *index = grown;
+}
+
+/// Find the entry of the variable index for a name, adding the name if it has
+/// not been seen before.
+static VariableIndexEntry* find_variable_index_entry(VariableIndex* index, Token* name) {
+  // (The index is kept at most half full.)
+  if ((index->count + 1) * 2 > index->capacity)
+    grow_variable_index(index);
+
+  uint32_t hash_code = hash_text(name->lexeme, name->length);
+  VariableIndexEntry* entry = find_variable_index_entry_with_hash(index, name, hash_code);
+  if (entry->name == NULL) {
+    *entry = (VariableIndexEntry){ .name = name->lexeme, .length = name->length, .hash_code = hash_code, .position = NOT_FOUND };
+    index->count++;
+  }
+
+  return entry;
+}
+
 /// Check whether a variable is declared in the innermost scope.
 static bool is_in_innermost_scope(Parser* parser, Variable* variable) {
   return variable->depth == parser->compiler->scope_depth;
@@ -420,6 +1146,21 @@ static void create_scope(Parser* parser) {
   parser->compiler->scope_depth++;
 }
 
+/// Write instructions to pop the given number of values (e.g. the variables of a scope).
+static void write_pop_instructions(Parser* parser, int count) {
+  while (count > 1) {
+    // `N` in `POPN` is treated as "the number to pop minus 1" in order to allow
+    // popping UINT8_MAX + 1 (i.e. 256) variables with one instruction. Otherwise,
+    // casting 256 to a byte results in 0 due to overflow. (More variables than
+    // that are popped by several instructions.)
+    int popped_count = count < SHORT_OPERAND_MAX + 1 ? count : SHORT_OPERAND_MAX + 1;
+    write_instructions(parser, OP_POPN, (byte)(popped_count - 1));
+    count -= popped_count;
+  }
+  if (count == 1)
+    write_instruction(parser, OP_POP);
+}
+
 /// Discard the innermost scope along with writing instructions to discard the
 /// variables declared there.
 static void discard_scope(Parser* parser) {
@@ -432,16 +1173,11 @@ static void discard_scope(Parser* parser) {
   int variable_count_before = compiler->variable_count;
   while (compiler->variable_count > 0 &&
          is_in_innermost_scope(parser, &compiler->variables[compiler->variable_count - 1])) {
+    Variable* variable = &compiler->variables[compiler->variable_count - 1];
+    find_variable_index_entry(&compiler->variable_index, &variable->name)->position = variable->shadowed_position;
     compiler->variable_count--;
   }
-  int variables_to_discard = variable_count_before - compiler->variable_count;
-  if (variables_to_discard > 1)
-    // `N` in `POPN` is treated as "the number to pop minus 1" in order to allow
-    // popping the maximum number of variables supported on the stack (UINT8_MAX + 1,
-    // i.e. 256). Otherwise, casting 256 to a byte results in 0 due to overflow.
-    write_instructions(parser, OP_POPN, (byte)(variables_to_discard - 1));
-  else if (variables_to_discard == 1)
-    write_instruction(parser, OP_POP);
+  write_pop_instructions(parser, variable_count_before - compiler->variable_count);
 
   // No need to check if it is in the global scope before decrementing.
   // `create_scope()` will only be called when a block is encountered.
@@ -449,29 +1185,33 @@ static void discard_scope(Parser* parser) {
   compiler->scope_depth--;
 }
 
-/// Check whether two variables' names are the same.
-static bool is_same_name(Token* first, Token* second) {
-  if (first->length != second->length)
-    return false;
-
-  return memcmp(first->lexeme, second->lexeme, first->length) == 0;
-}
-
 /// Add a variable to the compiler's list of declared variables.
 /// The variable will initially be marked as "uninitialized". Once its
 /// initializer has been compiled, it will be treated as initialized.
 static void add_variable(Parser* parser, Token name) {
-  bool has_reached_max_variables = parser->compiler->variable_count == VARIABLES_MAX;
+  Compiler* compiler = parser->compiler;
+  bool has_reached_max_variables = compiler->variable_count == VARIABLES_MAX;
   if (has_reached_max_variables) {
     error(parser, "Too many variables are currently in scope.");
     return;
   }
 
-  Variable* variable = &parser->compiler->variables[parser->compiler->variable_count++];
+  bool max_capacity_reached = compiler->variable_count + 1 > compiler->variable_capacity;
+  if (max_capacity_reached) {
+    int old_capacity = compiler->variable_capacity;
+    compiler->variable_capacity = GROW_CAPACITY(old_capacity);
+    compiler->variables = GROW_ARRAY(Variable, compiler->variables, old_capacity, compiler->variable_capacity);
+  }
+
+  VariableIndexEntry* entry = find_variable_index_entry(&compiler->variable_index, &name);
+  Variable* variable = &compiler->variables[compiler->variable_count];
   variable->name = name;
   // When variables are declared, they are only marked as initialized once the
   // entire initializer has been compiled.
   variable->depth = UNINITIALIZED;
+  variable->shadowed_position = entry->position;
+  variable->ir_variable = is_building_ir(parser) ? ir_new_variable(parser->ir_builder->ir) : NULL;
+  entry->position = compiler->variable_count++;
 }
 
 /// Mark the last variable added as initialized; meaning, the initializer has
@@ -481,6 +1221,15 @@ static void mark_initialized(Parser* parser) {
   compiler->variables[compiler->variable_count - 1].depth = compiler->scope_depth;
 }
 
+/// Add a variable that cannot be referred to in the source code (e.g. the end
+/// of the range of a `foreach` loop), initialized by the value just compiled.
+/// (The name is therefore not a valid identifier.)
+static void add_hidden_variable(Parser* parser, const char* name) {
+  Token token = { .type = TOKEN_IDENTIFIER, .lexeme = name, .length = (int)strlen(name), .line = parser->previous.line };
+  add_variable(parser, token);
+  mark_initialized(parser);
+}
+
 /// Check whether a declared variable has been initialized; meaning, the initializer
 /// has been compiled. This is denoted by having a depth != UNINITIALIZED.
 static bool is_initialized(Variable* variable) {
@@ -492,16 +1241,15 @@ static bool is_initialized(Variable* variable) {
 static void declare_variable(Parser* parser) {
   // All user-defined variables are resolved at compile time.
   Token* name = &parser->previous;
-  for (int i = parser->compiler->variable_count - 1; i >= 0; i--) {
-    Variable* existing_variable = &parser->compiler->variables[i];
+  int position = find_variable_index_entry(&parser->compiler->variable_index, name)->position;
+  if (position != NOT_FOUND) {
+    // (Only the innermost variable with the same name needs to be checked.)
+    Variable* existing_variable = &parser->compiler->variables[position];
     bool is_declared_in_different_scope =
       is_initialized(existing_variable) &&
       existing_variable->depth < parser->compiler->scope_depth;
 
-    if (is_declared_in_different_scope)
-      break;
-
-    if (is_same_name(name, &existing_variable->name))
+    if (!is_declared_in_different_scope)
       error(parser, "A variable with the same name has already been declared in this scope.");
   }
 
@@ -518,26 +1266,23 @@ static void define_variable(Parser* parser) {
 /// that was declared lexically closest to where it is being accessed,
 /// going from the innermost scope outward.
 static int resolve(Parser* parser, Token* name) {
-  for (int i = parser->compiler->variable_count - 1; i >= 0; i--) {
-    Variable* existing_variable = &parser->compiler->variables[i];
-    if (is_same_name(name, &existing_variable->name)) {
-      // When variables are declared, they are only marked as initialized once the
-      // entire initializer has been compiled. This prevents ambiguous use of the
-      // same variable name in the initializer as the one being declared. E.g.:
-      //  var x: 1
-      //  block
-      //    var x: x + 1
-      //  end
-      if (!is_initialized(existing_variable))
-        error(parser, "You cannot use the variable's name being declared in its initializer.");
-
-      // The order and position of the `variables` array will be
-      // identical to how they end up on the stack.
-      return i;
-    }
-  }
+  int position = find_variable_index_entry(&parser->compiler->variable_index, name)->position;
+  if (position == NOT_FOUND)
+    return NOT_FOUND;
+
+  // When variables are declared, they are only marked as initialized once the
+  // entire initializer has been compiled. This prevents ambiguous use of the
+  // same variable name in the initializer as the one being declared. E.g.:
+  //  var x: 1
+  //  block
+  //    var x: x + 1
+  //  end
+  if (!is_initialized(&parser->compiler->variables[position]))
+    error(parser, "You cannot use the variable's name being declared in its initializer.");
 
-  return NOT_FOUND;
+  // The order and position of the `variables` array will be
+  // identical to how they end up on the stack.
+  return position;
 }
 
 /// Check wether a given token is an assignment operator.
@@ -556,7 +1301,7 @@ static bool is_assignment_operator(Token* token) {
 
 /// Write an instruction to assign a value to the variable at the given stack slot.
 /// (Callers should have verified that the current token is an assignment operator.)
-static void assign_variable(Parser* parser, byte stack_slot) {
+static void assign_variable(Parser* parser, int stack_slot) {
   advance(parser);
   Token operator = parser->previous;
   TokenType type = operator.type;
@@ -566,21 +1311,26 @@ static void assign_variable(Parser* parser, byte stack_slot) {
   // Augmented assignments.
   else {
     // Add the variable's value to the stack first to ensure correct order of operation.
-    write_instructions(parser, OP_GET_VAR, stack_slot);
+    write_get_variable_instruction(parser, stack_slot);
+    build_ir_variable_access(parser, IR_GET_VARIABLE, stack_slot);
     parse_expression(parser);
 
+    byte opcode = OP_ADD;
     if (type == TOKEN_PLUS_COLON)
-      write_instruction(parser, OP_ADD);
+      opcode = OP_ADD;
     else if (type == TOKEN_MINUS_COLON)
-      write_instruction(parser, OP_SUBTRACT);
+      opcode = OP_SUBTRACT;
     else if (type == TOKEN_STAR_COLON)
-      write_instruction(parser, OP_MULTIPLY);
+      opcode = OP_MULTIPLY;
     else if (type == TOKEN_SLASH_COLON)
-      write_instruction(parser, OP_DIVIDE);
+      opcode = OP_DIVIDE;
     else
       error_at(parser, &operator, "Internal error. Expected an assignment operator.");
+    write_instruction(parser, opcode);
+    build_ir_operation(parser, IR_BINARY, opcode);
   }
-  write_instructions(parser, OP_SET_VAR, stack_slot);
+  write_set_variable_instruction(parser, stack_slot);
+  build_ir_variable_access(parser, IR_SET_VARIABLE, stack_slot);
 }
 
 /// Write an instruction to assign a value to the variable name provided if it
@@ -591,9 +1341,11 @@ static void access_or_assign_variable(Parser* parser, Token name, bool is_assign
     error_at(parser, &name, "The variable has not been declared. Use 'var <name> : <value>' to declare it first.");
 
   if (is_assignable)
-    assign_variable(parser, (byte)stack_slot);
-  else
-    write_instructions(parser, OP_GET_VAR, (byte)stack_slot);
+    assign_variable(parser, stack_slot);
+  else {
+    write_get_variable_instruction(parser, stack_slot);
+    build_ir_variable_access(parser, IR_GET_VARIABLE, stack_slot);
+  }
 }
 
 // ---------------------------------------------------
@@ -636,7 +1388,9 @@ static void parse_standard_block_without_scope(Parser* parser) {
 /// standalone `block` statements or `while` loops.
 static void parse_standard_block_with_scope(Parser* parser) {
   create_scope(parser);
+  begin_ir_block(parser);
   parse_standard_block_without_scope(parser);
+  end_ir_block(parser);
   discard_scope(parser);
 }
 
@@ -644,26 +1398,36 @@ static void parse_standard_block_with_scope(Parser* parser) {
 /// the grammar. Instead, 'end' and NEWLINE are assumed to be consumed correctly by the caller.
 static void parse_selection_block(Parser* parser) {
   create_scope(parser);
+  begin_ir_block(parser);
   consume_newline(parser);
   // TODO: Also check against TOKEN_ELSEIF when it's added.
   while (!compare(parser, TOKEN_ELSE) && !is_at_end_of_block(parser) && !is_at_end_of_file(parser))
     parse_statement(parser);
 
+  end_ir_block(parser);
   discard_scope(parser);
 }
 
 static void parse_block_statement(Parser* parser) {
   parse_standard_block_with_scope(parser);
+  build_ir_statement(parser, IR_BLOCK);
 }
 
 static void parse_expression_statement(Parser* parser) {
   parse_expression(parser);
   consume_newline(parser);
   write_instruction(parser, OP_POP);
+  build_ir_statement(parser, IR_EXPRESSION_STATEMENT);
 }
 
 /// Grammar: `"foreach" IDENTIFIER "in" expression ".." expression ( "step" expression )? standardBlock`
+///
+/// The end of the range and the step are evaluated once (before the first iteration)
+/// into hidden variables in the two stack slots after the loop variable. After the
+/// first iteration, the loop variable is stepped and compared against the end by
+/// OP_FOREACH_NEXT at the end of the body.
 static void parse_foreach_statement(Parser* parser) {
+  int foreach_line = parser->previous.line;
   // Create a scope in order to scope the loop variable.
   create_scope(parser);
 
@@ -678,76 +1442,117 @@ static void parse_foreach_statement(Parser* parser) {
   // The variable must be defined After the initializer has been parsed in order to prevent
   // use of it in the implicit initializer (left-hand side of `..`).
   define_variable(parser);
-  byte loop_variable_slot = (byte)resolve(parser, &loop_variable_name);
+  int loop_variable_slot = resolve(parser, &loop_variable_name);
   consume(parser, TOKEN_DOT_DOT, "You must use '..' with two surrounding expressions for the loop range. (E.g. '0..3')");
 
-  // --- Condition: ---
-  int condition_start_offset = get_current_instruction_offset(parser);
-  // Parse the right-hand side (rhs) of `..` and compare it against the loop variable (i.e. `variable <= rhs`).
-  write_instructions(parser, OP_GET_VAR, loop_variable_slot);
+  // --- Range: ---
+  // Parse the right-hand side (rhs) of `..`, followed by the `step`.
   parse_expression(parser);
-  write_instruction(parser, OP_LESS_THAN_EQUALS);
-  // Always jump over the `step` part.
-  int placeholder_jump_to_body = write_jump_forward_instruction(parser, OP_JUMP_FWD_IF_TRUE);
-  int placeholder_jump_to_end = write_jump_forward_instruction(parser, OP_JUMP_FWD_IF_FALSE);
-
-  // --- Step: ---
-  int step_start_offset = get_current_instruction_offset(parser);
-  // Get the loop variable before the `step` to enforce the addition order `variable + step`.
-  write_instructions(parser, OP_GET_VAR, loop_variable_slot);
+  add_hidden_variable(parser, "(foreach end)");
   if (match(parser, TOKEN_STEP))
     parse_expression(parser);
-  else
+  else {
     // If `step` is omitted, there is an implicit `step` of 1.
     write_constant_instruction(parser, FROM_C_DOUBLE(1));
+    build_ir_constant(parser, FROM_C_DOUBLE(1));
+  }
+  add_hidden_variable(parser, "(foreach step)");
 
-  // Add the two previous values and assign it to the loop variable (i.e. `variable: variable + step`).
-  write_instruction(parser, OP_ADD);
-  write_instructions(parser, OP_SET_VAR, loop_variable_slot);
-  // Pop the assignment value.
+  // --- Condition: ---
+  // Compare the loop variable against the end before the first iteration (i.e. `variable <= rhs`).
+  int range_line = parser->previous.line;
+  write_get_variable_instruction(parser, loop_variable_slot);
+  write_get_variable_instruction(parser, loop_variable_slot + 1);
+  write_instruction(parser, OP_LESS_THAN_EQUALS);
+  int placeholder_jump_to_end = write_jump_forward_instruction(parser, OP_JUMP_FWD_IF_FALSE_LONG);
+  // Pop the condition value.
   write_instruction(parser, OP_POP);
-  write_jump_backward_instruction(parser, condition_start_offset);
 
   // --- Body: ---
-  patch_jump_forward_instruction(parser, placeholder_jump_to_body);
-  // Pop the condition value.
-  write_instruction(parser, OP_POP);
-  parse_standard_block_without_scope(parser);
-  write_jump_backward_instruction(parser, step_start_offset);
+  int body_start_offset = mark_jump_target(parser);
+  parse_standard_block_with_scope(parser);
+
+  // --- Step: ---
+  // The instruction is written on the line of the `foreach` (where the range is) rather
+  // than of the `end`, since that is where its runtime errors are to be reported.
+  Token end_of_body = parser->previous;
+  parser->previous.line = foreach_line;
+  write_foreach_next_instruction(parser, loop_variable_slot, body_start_offset);
+  parser->previous = end_of_body;
+  int placeholder_jump_over_pop = write_jump_forward_instruction(parser, OP_JUMP_FWD_LONG);
 
   // --- End: ---
   patch_jump_forward_instruction(parser, placeholder_jump_to_end);
-  // Pop the condition value.
+  // Pop the condition value (of the first comparison).
   write_instruction(parser, OP_POP);
+  patch_jump_forward_instruction(parser, placeholder_jump_over_pop);
   discard_scope(parser);
+  build_ir_foreach_statement(parser, loop_variable_slot, foreach_line, range_line);
+}
+
+/// Parse the blocks of an `if` statement whose condition is a constant. Only the
+/// block that runs (if any) is kept, without the jumps around it. The other block
+/// is still parsed in order to check it for errors (e.g. the scope of its variables).
+static void parse_constant_if_statement(Parser* parser, bool is_condition_true) {
+  // (The condition, the two jumps and the two pops of the condition are not
+  // written at all, so they count as removed too.)
+  discard_recent_instructions(parser, 1);
+  VMStats* stats = &parser->environment->vm->stats;
+  stats->folded_instructions += 5;
+
+  InstructionMark if_mark = mark_instructions(parser);
+  parse_selection_block(parser);
+  if (!is_condition_true) {
+    discard_instructions_since(parser, &if_mark);
+    stats->dead_branches++;
+  }
+
+  bool has_else_block = match(parser, TOKEN_ELSE);
+  if (has_else_block) {
+    InstructionMark else_mark = mark_instructions(parser);
+    parse_selection_block(parser);
+    if (is_condition_true) {
+      discard_instructions_since(parser, &else_mark);
+      stats->dead_branches++;
+    }
+  }
+  consume_end_of_block(parser);
 }
 
 static void parse_if_statement(Parser* parser) {
   // --- If-Condition: ---
   parse_expression(parser);
-  int placeholder_jump_over_if = write_jump_forward_instruction(parser, OP_JUMP_FWD_IF_FALSE);
+  ThuslyValue condition;
+  if (is_folding_enabled(parser) && get_recent_constant(parser, 0, &condition)) {
+    parse_constant_if_statement(parser, is_truthy(condition));
+    return;
+  }
+  int placeholder_jump_over_if = write_jump_forward_instruction(parser, OP_JUMP_FWD_IF_FALSE_LONG);
 
   // --- If-Then Body: ---
   write_instruction(parser, OP_POP);
   parse_selection_block(parser);
-  int placeholder_jump_over_else = write_jump_forward_instruction(parser, OP_JUMP_FWD);
+  int placeholder_jump_over_else = write_jump_forward_instruction(parser, OP_JUMP_FWD_LONG);
 
   // --- Else-Then Body: ---
   patch_jump_forward_instruction(parser, placeholder_jump_over_if);
   // Pop the if-condition value.
   write_instruction(parser, OP_POP);
-  if (match(parser, TOKEN_ELSE))
+  bool has_else_block = match(parser, TOKEN_ELSE);
+  if (has_else_block)
     parse_selection_block(parser);
   consume_end_of_block(parser);
 
   // --- End: ---
   patch_jump_forward_instruction(parser, placeholder_jump_over_else);
+  build_ir_if_statement(parser, has_else_block);
 }
 
 static void parse_out_statement(Parser* parser) {
   parse_expression(parser);
   consume_newline(parser);
   write_instruction(parser, OP_OUT);
+  build_ir_statement(parser, IR_OUT);
 }
 
 static void parse_var_statement(Parser* parser) {
@@ -758,19 +1563,25 @@ static void parse_var_statement(Parser* parser) {
   parse_expression(parser);
   consume_newline(parser);
   define_variable(parser);
+  build_ir_statement(parser, IR_VAR);
 }
 
 /// Grammar: `"while" expression ( "{" expression "}" )? standardBlock`
 static void parse_while_statement(Parser* parser) {
   // --- Condition: ---
-  int condition_start_offset = get_current_instruction_offset(parser);
+  InstructionMark while_mark = mark_instructions(parser);
+  int condition_start_offset = mark_jump_target(parser);
   parse_expression(parser);
+  // A loop whose condition is a falsy constant never runs. It is still parsed in
+  // order to check it for errors, but none of its instructions are kept.
+  ThuslyValue condition;
+  bool is_dead_loop = is_folding_enabled(parser) && get_recent_constant(parser, 0, &condition) && !is_truthy(condition);
   // Always jump over the modification part.
-  int placeholder_jump_to_body = write_jump_forward_instruction(parser, OP_JUMP_FWD_IF_TRUE);
-  int placeholder_jump_to_end = write_jump_forward_instruction(parser, OP_JUMP_FWD_IF_FALSE);
+  int placeholder_jump_to_body = write_jump_forward_instruction(parser, OP_JUMP_FWD_IF_TRUE_LONG);
+  int placeholder_jump_to_end = write_jump_forward_instruction(parser, OP_JUMP_FWD_IF_FALSE_LONG);
 
   // --- Optional Modification: ---
-  int modification_start_offset = get_current_instruction_offset(parser);
+  int modification_start_offset = mark_jump_target(parser);
   bool has_modification_expr = match(parser, TOKEN_OPEN_BRACE);
   if (has_modification_expr) {
     parse_expression(parser);
@@ -791,6 +1602,12 @@ static void parse_while_statement(Parser* parser) {
   patch_jump_forward_instruction(parser, placeholder_jump_to_end);
   // Pop the condition value.
   write_instruction(parser, OP_POP);
+  build_ir_while_statement(parser, has_modification_expr);
+
+  if (is_dead_loop) {
+    discard_instructions_since(parser, &while_mark);
+    parser->environment->vm->stats.dead_branches++;
+  }
 }
 
 // ---------------------------------------------------
@@ -842,9 +1659,38 @@ static void parse_expression(Parser* parser) {
   parse_precedence(parser, PRECEDENCE_ASSIGNMENT);
 }
 
+/// Fold a logical operator (`and`/`or`) whose left operand is a constant into
+/// the operand that is its result (`is_left_result` telling which). The right
+/// operand is parsed either way in order to check it for errors, but its
+/// instructions are discarded if it would never be evaluated.
+static void fold_logical_operator(Parser* parser, bool is_left_result, Precedence precedence) {
+  // (The jump over the right operand and the pop of the left one are not
+  // written at all, so they count as removed too.)
+  VMStats* stats = &parser->environment->vm->stats;
+  stats->folded_instructions += 2;
+
+  if (!is_left_result) {
+    discard_recent_instructions(parser, 1);
+    stats->folded_instructions++;
+    parse_precedence(parser, precedence);
+    return;
+  }
+
+  InstructionMark right_operand_mark = mark_instructions(parser);
+  parse_precedence(parser, precedence);
+  discard_instructions_since(parser, &right_operand_mark);
+}
+
 static void parse_and(Parser* parser, bool _) {
+  // The result is the left operand if it is a falsy constant, otherwise the right one.
+  ThuslyValue left;
+  if (is_folding_enabled(parser) && get_recent_constant(parser, 0, &left)) {
+    fold_logical_operator(parser, !is_truthy(left), PRECEDENCE_CONJUNCTION);
+    return;
+  }
+
   // Jump to the end if the left condition is false.
-  int placeholder_jump_over_and = write_jump_forward_instruction(parser, OP_JUMP_FWD_IF_FALSE);
+  int placeholder_jump_over_and = write_jump_forward_instruction(parser, OP_JUMP_FWD_IF_FALSE_LONG);
 
   // Pop the left condition and continue parsing the right-hand side.
   write_instruction(parser, OP_POP);
@@ -852,6 +1698,7 @@ static void parse_and(Parser* parser, bool _) {
 
   // Jump lands here if the left condition is false.
   patch_jump_forward_instruction(parser, placeholder_jump_over_and);
+  build_ir_operation(parser, IR_AND, 0);
 
   // The last value left on the stack is the result of the expression and
   // should therefore not be popped.
@@ -866,53 +1713,38 @@ static void parse_binary(Parser* parser, bool _) {
   // 5 + 6 * 7 / 8 should be parsed 5 + ((6 * 7) / 8)
   parse_precedence(parser, (Precedence)(rule->precedence + 1));
 
+  byte opcode;
   switch (operator) {
-    case TOKEN_EQUALS:
-      write_instruction(parser, OP_EQUALS);
-      break;
-    case TOKEN_EXCLAMATION_EQUALS:
-      write_instruction(parser, OP_NOT_EQUALS);
-      break;
-    case TOKEN_GREATER_THAN:
-      write_instruction(parser, OP_GREATER_THAN);
-      break;
-    case TOKEN_GREATER_THAN_EQUALS:
-      write_instruction(parser, OP_GREATER_THAN_EQUALS);
-      break;
-    case TOKEN_LESS_THAN:
-      write_instruction(parser, OP_LESS_THAN);
-      break;
-    case TOKEN_LESS_THAN_EQUALS:
-      write_instruction(parser, OP_LESS_THAN_EQUALS);
-      break;
-    case TOKEN_PLUS:
-      write_instruction(parser, OP_ADD);
-      break;
-    case TOKEN_MINUS:
-      write_instruction(parser, OP_SUBTRACT);
-      break;
-    case TOKEN_STAR:
-      write_instruction(parser, OP_MULTIPLY);
-      break;
-    case TOKEN_SLASH:
-      write_instruction(parser, OP_DIVIDE);
-      break;
-    case TOKEN_MOD:
-      write_instruction(parser, OP_MODULO);
-      break;
+    case TOKEN_EQUALS:                opcode = OP_EQUALS; break;
+    case TOKEN_EXCLAMATION_EQUALS:    opcode = OP_NOT_EQUALS; break;
+    case TOKEN_GREATER_THAN:          opcode = OP_GREATER_THAN; break;
+    case TOKEN_GREATER_THAN_EQUALS:   opcode = OP_GREATER_THAN_EQUALS; break;
+    case TOKEN_LESS_THAN:             opcode = OP_LESS_THAN; break;
+    case TOKEN_LESS_THAN_EQUALS:      opcode = OP_LESS_THAN_EQUALS; break;
+    case TOKEN_PLUS:                  opcode = OP_ADD; break;
+    case TOKEN_MINUS:                 opcode = OP_SUBTRACT; break;
+    case TOKEN_STAR:                  opcode = OP_MULTIPLY; break;
+    case TOKEN_SLASH:                 opcode = OP_DIVIDE; break;
+    case TOKEN_MOD:                   opcode = OP_MODULO; break;
     default:
       // This should not be reachable.
       return;
   }
+
+  if (!fold_constant_operation(parser, opcode))
+    write_instruction(parser, opcode);
+  build_ir_operation(parser, IR_BINARY, opcode);
 }
 
 static void parse_boolean(Parser* parser, bool _) {
   switch (parser->previous.type) {
     case TOKEN_FALSE:
       write_instruction(parser, OP_CONSTANT_FALSE);
+      build_ir_constant(parser, FROM_C_BOOL(false));
       break;
     case TOKEN_TRUE:
       write_instruction(parser, OP_CONSTANT_TRUE);
+      build_ir_constant(parser, FROM_C_BOOL(true));
       break;
     default:
       // This should not be reachable.
@@ -927,16 +1759,25 @@ static void parse_grouping(Parser* parser, bool _) {
 
 static void parse_none(Parser* parser, bool _) {
   write_instruction(parser, OP_CONSTANT_NONE);
+  build_ir_constant(parser, FROM_C_NULL);
 }
 
 static void parse_number(Parser* parser, bool _) {
   double value = strtod(parser->previous.lexeme, NULL);
   write_constant_instruction(parser, FROM_C_DOUBLE(value));
+  build_ir_constant(parser, FROM_C_DOUBLE(value));
 }
 
 static void parse_or(Parser* parser, bool _) {
+  // The result is the left operand if it is a truthy constant, otherwise the right one.
+  ThuslyValue left;
+  if (is_folding_enabled(parser) && get_recent_constant(parser, 0, &left)) {
+    fold_logical_operator(parser, is_truthy(left), PRECEDENCE_DISJUNCTION);
+    return;
+  }
+
   // Jump to the end if the left condition is true.
-  int placeholder_jump_over_or = write_jump_forward_instruction(parser, OP_JUMP_FWD_IF_TRUE);
+  int placeholder_jump_over_or = write_jump_forward_instruction(parser, OP_JUMP_FWD_IF_TRUE_LONG);
 
   // Pop the left condition and continue parsing the right-hand side.
   write_instruction(parser, OP_POP);
@@ -944,44 +1785,357 @@ static void parse_or(Parser* parser, bool _) {
 
   // Jump lands here if the left condition is true.
   patch_jump_forward_instruction(parser, placeholder_jump_over_or);
+  build_ir_operation(parser, IR_OR, 0);
 
   // The last value left on the stack is the result of the expression and
   // should therefore not be popped.
 }
 
 static void parse_text(Parser* parser, bool _) {
-  write_constant_instruction(
-    parser,
-    FROM_C_OBJECT_PTR(
-      // Copy the lexeme without the surrounding double quotes.
-      copy_c_string(parser->environment, parser->previous.lexeme + 1, parser->previous.length - 2)
-    )
-  );
+  // Copy the lexeme without the surrounding double quotes.
+  ThuslyValue text = make_text(parser->environment, parser->previous.lexeme + 1, parser->previous.length - 2);
+  write_constant_instruction(parser, text);
+  // (The text is kept reachable by the constant pool.)
+  build_ir_constant(parser, text);
 }
 
 static void parse_unary(Parser* parser, bool _) {
   TokenType operator = parser->previous.type;
   parse_precedence(parser, PRECEDENCE_UNARY);
 
+  byte opcode;
   switch (operator) {
-    case TOKEN_MINUS:
-      write_instruction(parser, OP_NEGATE);
-      break;
-    case TOKEN_NOT:
-      write_instruction(parser, OP_NOT);
-      break;
+    case TOKEN_MINUS:   opcode = OP_NEGATE; break;
+    case TOKEN_NOT:     opcode = OP_NOT; break;
     default:
       // This should not be reachable.
       return;
   }
+
+  if (!fold_constant_operation(parser, opcode))
+    write_instruction(parser, opcode);
+  build_ir_operation(parser, IR_UNARY, opcode);
 }
 
 static void parse_variable(Parser* parser, bool is_assignable) {
   access_or_assign_variable(parser, parser->previous, is_assignable);
 }
 
+// ---------------------------------------------------
+// WRITING THE INTERMEDIATE REPRESENTATION
+// ---------------------------------------------------
+
+/// The state of writing the instructions of the (optimized) intermediate representation.
+/// The instructions are written the same way as by the parse functions, on the lines
+/// of the nodes (see `IrNode.line`).
+typedef struct {
+  Parser* parser;
+  /// The number of stack slots used by the variables in scope.
+  int variable_count;
+} IrEmitter;
+
+static void emit_ir_expression(IrEmitter* emitter, IrNode* node);
+static void emit_ir_block(IrEmitter* emitter, IrNode* block, bool should_pop_variables);
+
+/// Write the instructions of `and`/`or` (see `parse_and()` and `parse_or()`).
+static void emit_ir_logical_operator(IrEmitter* emitter, IrNode* node) {
+  Parser* parser = emitter->parser;
+  emit_ir_expression(emitter, node->left);
+  parser->previous.line = node->line;
+
+  ThuslyValue left;
+  if (flag_optimization_level >= 1 && get_recent_constant(parser, 0, &left)) {
+    // (See `fold_logical_operator()`. The right operand is not written at all if
+    // it would never be evaluated.)
+    VMStats* stats = &parser->environment->vm->stats;
+    stats->folded_instructions += 2;
+    bool is_left_result = node->type == IR_AND ? !is_truthy(left) : is_truthy(left);
+    if (!is_left_result) {
+      discard_recent_instructions(parser, 1);
+      stats->folded_instructions++;
+      emit_ir_expression(emitter, node->right);
+    }
+    return;
+  }
+
+  int placeholder_jump_over_right = write_jump_forward_instruction(
+    parser,
+    node->type == IR_AND ? OP_JUMP_FWD_IF_FALSE_LONG : OP_JUMP_FWD_IF_TRUE_LONG
+  );
+  write_instruction(parser, OP_POP);
+  emit_ir_expression(emitter, node->right);
+  patch_jump_forward_instruction(parser, placeholder_jump_over_right);
+}
+
+static void emit_ir_expression(IrEmitter* emitter, IrNode* node) {
+  Parser* parser = emitter->parser;
+  switch (node->type) {
+    case IR_CONSTANT:
+      parser->previous.line = node->line;
+      write_value_instruction(parser, node->value);
+      return;
+    case IR_GET_VARIABLE:
+      parser->previous.line = node->line;
+      write_get_variable_instruction(parser, node->variable->slot);
+      return;
+    case IR_SET_VARIABLE:
+      emit_ir_expression(emitter, node->left);
+      parser->previous.line = node->line;
+      write_set_variable_instruction(parser, node->variable->slot);
+      return;
+    case IR_UNARY:
+    case IR_BINARY:
+      emit_ir_expression(emitter, node->left);
+      if (node->right != NULL)
+        emit_ir_expression(emitter, node->right);
+      parser->previous.line = node->line;
+      if (!fold_constant_operation(parser, node->opcode))
+        write_instruction(parser, node->opcode);
+      return;
+    case IR_AND:
+    case IR_OR:
+      emit_ir_logical_operator(emitter, node);
+      return;
+    default:
+      // This should not be reachable.
+      return;
+  }
+}
+
+/// Write the instructions of an `if` statement whose condition is a constant (see
+/// `parse_constant_if_statement()`).
+static void emit_ir_constant_if_statement(IrEmitter* emitter, IrNode* statement, bool is_condition_true) {
+  Parser* parser = emitter->parser;
+  discard_recent_instructions(parser, 1);
+  VMStats* stats = &parser->environment->vm->stats;
+  stats->folded_instructions += 5;
+
+  IrNode* blocks[2] = { statement->body, statement->else_body };
+  for (int i = 0; i < 2; i++) {
+    if (blocks[i] == NULL)
+      continue;
+
+    InstructionMark mark = mark_instructions(parser);
+    emit_ir_block(emitter, blocks[i], true);
+    if (is_condition_true != (i == 0)) {
+      discard_instructions_since(parser, &mark);
+      stats->dead_branches++;
+    }
+  }
+}
+
+/// Write the instructions of an `if` statement (see `parse_if_statement()`).
+static void emit_ir_if_statement(IrEmitter* emitter, IrNode* statement) {
+  Parser* parser = emitter->parser;
+  emit_ir_expression(emitter, statement->left);
+  parser->previous.line = statement->line;
+  ThuslyValue condition;
+  if (flag_optimization_level >= 1 && get_recent_constant(parser, 0, &condition)) {
+    emit_ir_constant_if_statement(emitter, statement, is_truthy(condition));
+    return;
+  }
+  int placeholder_jump_over_if = write_jump_forward_instruction(parser, OP_JUMP_FWD_IF_FALSE_LONG);
+  write_instruction(parser, OP_POP);
+  emit_ir_block(emitter, statement->body, true);
+  int placeholder_jump_over_else = write_jump_forward_instruction(parser, OP_JUMP_FWD_LONG);
+
+  patch_jump_forward_instruction(parser, placeholder_jump_over_if);
+  write_instruction(parser, OP_POP);
+  if (statement->else_body != NULL)
+    emit_ir_block(emitter, statement->else_body, true);
+  patch_jump_forward_instruction(parser, placeholder_jump_over_else);
+}
+
+/// Write the instructions of a `while` statement (see `parse_while_statement()`).
+static void emit_ir_while_statement(IrEmitter* emitter, IrNode* statement) {
+  Parser* parser = emitter->parser;
+  InstructionMark while_mark = mark_instructions(parser);
+  int condition_start_offset = mark_jump_target(parser);
+  emit_ir_expression(emitter, statement->left);
+  ThuslyValue condition;
+  bool is_dead_loop = flag_optimization_level >= 1 && get_recent_constant(parser, 0, &condition) && !is_truthy(condition);
+  parser->previous.line = statement->line;
+  int placeholder_jump_to_body = write_jump_forward_instruction(parser, OP_JUMP_FWD_IF_TRUE_LONG);
+  int placeholder_jump_to_end = write_jump_forward_instruction(parser, OP_JUMP_FWD_IF_FALSE_LONG);
+
+  int modification_start_offset = mark_jump_target(parser);
+  if (statement->right != NULL) {
+    emit_ir_expression(emitter, statement->right);
+    write_instruction(parser, OP_POP);
+    write_jump_backward_instruction(parser, condition_start_offset);
+  }
+
+  patch_jump_forward_instruction(parser, placeholder_jump_to_body);
+  write_instruction(parser, OP_POP);
+  emit_ir_block(emitter, statement->body, true);
+  write_jump_backward_instruction(parser, statement->right != NULL ? modification_start_offset : condition_start_offset);
+
+  patch_jump_forward_instruction(parser, placeholder_jump_to_end);
+  write_instruction(parser, OP_POP);
+
+  if (is_dead_loop) {
+    discard_instructions_since(parser, &while_mark);
+    parser->environment->vm->stats.dead_branches++;
+  }
+}
+
+/// Write the instructions of a `foreach` statement (see `parse_foreach_statement()`).
+static void emit_ir_foreach_statement(IrEmitter* emitter, IrNode* statement) {
+  Parser* parser = emitter->parser;
+  // The loop variable and the hidden end and step variables.
+  int slot = emitter->variable_count;
+  emit_ir_expression(emitter, statement->left);
+  statement->variable->slot = slot;
+  emitter->variable_count++;
+  emit_ir_expression(emitter, statement->right);
+  emit_ir_expression(emitter, statement->step);
+  emitter->variable_count += 2;
+
+  parser->previous.line = statement->range_line;
+  write_get_variable_instruction(parser, slot);
+  write_get_variable_instruction(parser, slot + 1);
+  write_instruction(parser, OP_LESS_THAN_EQUALS);
+  int placeholder_jump_to_end = write_jump_forward_instruction(parser, OP_JUMP_FWD_IF_FALSE_LONG);
+  write_instruction(parser, OP_POP);
+
+  int body_start_offset = mark_jump_target(parser);
+  emit_ir_block(emitter, statement->body, true);
+
+  parser->previous.line = statement->line;
+  write_foreach_next_instruction(parser, slot, body_start_offset);
+  int placeholder_jump_over_pop = write_jump_forward_instruction(parser, OP_JUMP_FWD_LONG);
+
+  patch_jump_forward_instruction(parser, placeholder_jump_to_end);
+  write_instruction(parser, OP_POP);
+  patch_jump_forward_instruction(parser, placeholder_jump_over_pop);
+  write_pop_instructions(parser, 3);
+  emitter->variable_count -= 3;
+}
+
+static void emit_ir_statement(IrEmitter* emitter, IrNode* statement) {
+  Parser* parser = emitter->parser;
+  switch (statement->type) {
+    case IR_BLOCK:
+      emit_ir_block(emitter, statement, true);
+      return;
+    case IR_EXPRESSION_STATEMENT:
+      emit_ir_expression(emitter, statement->left);
+      parser->previous.line = statement->line;
+      write_instruction(parser, OP_POP);
+      return;
+    case IR_OUT:
+      emit_ir_expression(emitter, statement->left);
+      parser->previous.line = statement->line;
+      write_instruction(parser, OP_OUT);
+      return;
+    case IR_VAR:
+      // The value of the initializer becomes the variable (at the top of the stack).
+      emit_ir_expression(emitter, statement->left);
+      statement->variable->slot = emitter->variable_count++;
+      return;
+    case IR_IF:
+      emit_ir_if_statement(emitter, statement);
+      return;
+    case IR_WHILE:
+      emit_ir_while_statement(emitter, statement);
+      return;
+    case IR_FOREACH:
+      emit_ir_foreach_statement(emitter, statement);
+      return;
+    default:
+      // This should not be reachable.
+      return;
+  }
+}
+
+/// Write the instructions of the statements of a block, followed by instructions
+/// to discard the variables declared in it if `should_pop_variables` is set (the
+/// variables of the top-level block are never discarded).
+static void emit_ir_block(IrEmitter* emitter, IrNode* block, bool should_pop_variables) {
+  int variable_count_before = emitter->variable_count;
+  for (IrNode* statement = block->statements; statement != NULL; statement = statement->next)
+    emit_ir_statement(emitter, statement);
+
+  if (should_pop_variables)
+    write_pop_instructions(emitter->parser, emitter->variable_count - variable_count_before);
+  emitter->variable_count = variable_count_before;
+}
+
+/// Optimize the intermediate representation built while parsing (see `ir_optimize()`)
+/// and write the instructions of the program again from it.
+static void write_optimized_program(Parser* parser) {
+  IrBuilder* builder = parser->ir_builder;
+  Ir* ir = builder->ir;
+  VMStats* stats = &parser->environment->vm->stats;
+  end_ir_block(parser);
+  ir->program = pop_ir_node(parser);
+  ir_optimize(ir, stats);
+
+  // The instructions written while parsing are discarded (the constant pool is kept).
+  parser->ir_builder = NULL;
+  program_truncate(get_writable_program(parser), 0);
+  for (int i = 0; i < RECENT_INSTRUCTIONS_MAX; i++)
+    parser->recent_instruction_offsets[i] = NOT_FOUND;
+  parser->latest_jump_target_offset = 0;
+  stats->constant_literals = builder->constant_literals_before;
+
+  Token end_of_file = parser->previous;
+  IrEmitter emitter = { .parser = parser, .variable_count = 0 };
+  emit_ir_block(&emitter, ir->program, false);
+  parser->previous = end_of_file;
+}
+
+/// Whether the long jump instruction at the given offset fits in the short form.
+/// (Since turning jumps into their short form only removes code, a jump that fits
+/// before any jump is shrunk still fits afterward.)
+static bool is_shrinkable_jump(Program* program, int offset) {
+  byte opcode = program->instructions[offset];
+  if (get_short_jump_opcode(opcode) == opcode)
+    return false;
+  // The short form of OP_FOREACH_NEXT also has a short (1-byte) stack slot.
+  if (opcode == OP_FOREACH_NEXT_LONG && get_loop_variable_slot(program, offset) > SHORT_OPERAND_MAX)
+    return false;
+
+  int next_offset = offset + get_instruction_size(opcode);
+  int target_offset = get_jump_target(program, offset);
+  int jump_size = target_offset > next_offset ? target_offset - next_offset : next_offset - target_offset;
+
+  return jump_size <= SHORT_JUMP_MAX;
+}
+
+/// Turn the long jump instructions (which all jumps are written as while compiling)
+/// into their short form wherever the jump fits, and move the rest of the code
+/// accordingly. The common case of a program without long jumps thereby ends up
+/// with the same code as if the jumps had been written in their short form.
+static void shrink_jumps(Parser* parser) {
+  Program* program = get_writable_program(parser);
+  int count = program->count;
+
+  // The new offset of each instruction (indexed by its current offset).
+  int* new_offsets = ALLOCATE(int, count + 1);
+  int new_offset = 0;
+  for (int offset = 0; offset < count; offset += get_instruction_size(program->instructions[offset])) {
+    new_offsets[offset] = new_offset;
+    byte opcode = program->instructions[offset];
+    new_offset += get_instruction_size(is_shrinkable_jump(program, offset) ? get_short_jump_opcode(opcode) : opcode);
+  }
+  new_offsets[count] = new_offset;
+  program_relocate(program, new_offsets);
+
+  FREE_ARRAY(int, new_offsets, count + 1);
+}
+
 static void end_compilation(Parser* parser) {
   write_return_instruction(parser);
+  Program* program = get_writable_program(parser);
+  if (flag_optimization_level >= 1 && !parser->saw_error)
+    peephole_optimize(program, &parser->environment->vm->stats);
+  shrink_jumps(parser);
+  program->max_stack_depth = get_max_stack_depth(program);
+
+  VMStats* stats = &parser->environment->vm->stats;
+  stats->bytecode_size += program->count;
+  stats->line_table_size += program_get_line_table_size(program);
 
   #ifdef DEBUG_MODE
     if (flag_debug_compilation && !parser->saw_error)
@@ -989,7 +2143,31 @@ static void end_compilation(Parser* parser) {
   #endif
 }
 
+/// Count the text literals in the source that are too long to be short texts
+/// (and are therefore interned when compiled). This is an upper bound on the
+/// number of texts interned during compilation, since literals may repeat.
+/// (Double quotes within comments are counted as well, as the source is only
+/// scanned for the quotes rather than tokenized.)
+static int count_long_text_literals(const char* source) {
+  int count = 0;
+  const char* opening_quote = strchr(source, '"');
+  while (opening_quote != NULL) {
+    const char* closing_quote = strchr(opening_quote + 1, '"');
+    if (closing_quote == NULL)
+      break;
+
+    if (closing_quote - opening_quote - 1 > SHORT_TEXT_MAX_LENGTH)
+      count++;
+    opening_quote = strchr(closing_quote + 1, '"');
+  }
+
+  return count;
+}
+
 bool compile(Environment* environment, const char* source, Program* out_program) {
+  // The intern pool is grown once up front rather than repeatedly while compiling.
+  intern_set_reserve(&environment->texts, count_long_text_literals(source));
+
   Parser parser;
   Compiler compiler;
   compiler_init(&compiler);
@@ -997,13 +2175,35 @@ bool compile(Environment* environment, const char* source, Program* out_program)
   // TODO: Refactor this into a call in `parser_init`.
   tokenizer_init(&parser.tokenizer, source);
 
+  // With `-O2`, the intermediate representation of the program is built while
+  // parsing, and the instructions are written again from it once optimized.
+  Ir ir;
+  IrBuilder ir_builder;
+  bool should_build_ir = flag_optimization_level >= 2;
+  if (should_build_ir) {
+    ir_init(&ir);
+    ir_builder_init(&ir_builder, &ir, &environment->vm->stats);
+    parser.ir_builder = &ir_builder;
+    begin_ir_block(&parser);
+  }
+
   advance(&parser);
 
   while (!match(&parser, TOKEN_EOF)) {
     parse_statement(&parser);
   }
 
+  if (is_building_ir(&parser))
+    write_optimized_program(&parser);
+  parser.ir_builder = NULL;
+
   end_compilation(&parser);
+  if (should_build_ir) {
+    ir_builder_free(&ir_builder);
+    ir_free(&ir);
+  }
+  free_constant_index(&parser.constant_index);
+  compiler_free(&compiler);
 
   return !parser.saw_error;
 }
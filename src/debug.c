@@ -3,6 +3,7 @@
 #include "common.h"
 #include "debug.h"
 #include "program.h"
+#include "register_vm.h"
 #include "thusly_value.h"
 
 #define COLUMN_LENGTH 12
@@ -23,11 +24,12 @@ void disassembler_indent_to_last_column() {
 }
 
 static void print_source_line_number(Program* program, int offset) {
-  bool is_same_line_as_previous = offset > 0 && program->source_lines[offset] == program->source_lines[offset - 1];
+  int source_line = program_get_source_line(program, offset);
+  bool is_same_line_as_previous = offset > 0 && source_line == program_get_source_line(program, offset - 1);
   if (is_same_line_as_previous)
     indent(COLUMN_LENGTH);
   else {
-    printf("%-4d", program->source_lines[offset]);
+    printf("%-4d", source_line);
     indent(COLUMN_LENGTH - 4);
   }
 }
@@ -71,78 +73,157 @@ static int print_variable(const char* op_name, Program* program, int offset) {
   return offset + 2;
 }
 
-static int print_jump(const char* op_name, Program* program, int sign, int offset) {
-  uint16_t jump_offset = (uint16_t)((program->instructions[offset + 1] << 8) | program->instructions[offset + 2]);
-  int target_offset = offset + 3 + sign * jump_offset;
+static int print_long_constant(const char* op_name, Program* program, int offset) {
+  int constant_index = read_long_operand(&program->instructions[offset + 1]);
+  printf("%s %d    (points to: ", op_name, constant_index);
+  print_value(program->constant_pool.values[constant_index]);
+  printf(")\n");
+
+  return offset + 4;
+}
+
+static int print_long_variable(const char* op_name, Program* program, int offset) {
+  int variable_slot = read_long_operand(&program->instructions[offset + 1]);
+  printf("%s %d\n", op_name, variable_slot);
+
+  return offset + 4;
+}
+
+static int print_jump(const char* op_name, Program* program, int offset) {
+  int next_offset = offset + get_instruction_size(program->instructions[offset]);
+  int target_offset = get_jump_target(program, offset);
+  int jump_offset = target_offset > next_offset ? target_offset - next_offset : next_offset - target_offset;
   printf("%s %d    (jumps from %d to %d)\n", op_name, jump_offset, offset, target_offset);
 
+  return next_offset;
+}
+
+static int print_variable_and_constant(const char* op_name, Program* program, int offset) {
+  byte variable_slot = program->instructions[offset + 1];
+  byte constant_index = program->instructions[offset + 2];
+  printf("%s %d %d    (points to: ", op_name, variable_slot, constant_index);
+  print_value(program->constant_pool.values[constant_index]);
+  printf(")\n");
+
+  return offset + 3;
+}
+
+static int print_two_variables(const char* op_name, Program* program, int offset) {
+  byte variable_slot_a = program->instructions[offset + 1];
+  byte variable_slot_b = program->instructions[offset + 2];
+  printf("%s %d %d\n", op_name, variable_slot_a, variable_slot_b);
+
   return offset + 3;
 }
 
+static int print_foreach_next(const char* op_name, Program* program, int offset) {
+  int variable_slot = get_loop_variable_slot(program, offset);
+  int target_offset = get_jump_target(program, offset);
+  printf("%s %d    (jumps from %d to %d)\n", op_name, variable_slot, offset, target_offset);
+
+  return offset + get_instruction_size(program->instructions[offset]);
+}
+
+/// Get the name of an opcode, or `NULL` if it is not supported.
+const char* get_opcode_name(byte opcode) {
+  switch (opcode) {
+    case OP_ADD:                       return "OP_ADD";
+    case OP_CONSTANT:                  return "OP_CONSTANT";
+    case OP_CONSTANT_FALSE:            return "OP_CONSTANT_FALSE";
+    case OP_CONSTANT_NONE:             return "OP_CONSTANT_NONE";
+    case OP_CONSTANT_TRUE:             return "OP_CONSTANT_TRUE";
+    case OP_DIVIDE:                    return "OP_DIVIDE";
+    case OP_EQUALS:                    return "OP_EQUALS";
+    case OP_GET_VAR:                   return "OP_GET_VAR";
+    case OP_GREATER_THAN:              return "OP_GREATER_THAN";
+    case OP_GREATER_THAN_EQUALS:       return "OP_GREATER_THAN_EQUALS";
+    case OP_JUMP_BWD:                  return "OP_JUMP_BWD";
+    case OP_JUMP_FWD:                  return "OP_JUMP_FWD";
+    case OP_JUMP_FWD_IF_FALSE:         return "OP_JUMP_FWD_IF_FALSE";
+    case OP_JUMP_FWD_IF_TRUE:          return "OP_JUMP_FWD_IF_TRUE";
+    case OP_LESS_THAN:                 return "OP_LESS_THAN";
+    case OP_LESS_THAN_EQUALS:          return "OP_LESS_THAN_EQUALS";
+    case OP_MODULO:                    return "OP_MODULO";
+    case OP_MULTIPLY:                  return "OP_MULTIPLY";
+    case OP_NEGATE:                    return "OP_NEGATE";
+    case OP_NOT:                       return "OP_NOT";
+    case OP_NOT_EQUALS:                return "OP_NOT_EQUALS";
+    case OP_OUT:                       return "OP_OUT";
+    case OP_POP:                       return "OP_POP";
+    case OP_POPN:                      return "OP_POPN";
+    case OP_RETURN:                    return "OP_RETURN";
+    case OP_SET_VAR:                   return "OP_SET_VAR";
+    case OP_SUBTRACT:                  return "OP_SUBTRACT";
+    case OP_ADD_VAR_CONSTANT:          return "OP_ADD_VAR_CONSTANT";
+    case OP_FOREACH_NEXT:              return "OP_FOREACH_NEXT";
+    case OP_LESS_THAN_EQUALS_VARS:     return "OP_LESS_THAN_EQUALS_VARS";
+    case OP_SET_VAR_POP:               return "OP_SET_VAR_POP";
+    case OP_CONSTANT_LONG:             return "OP_CONSTANT_LONG";
+    case OP_FOREACH_NEXT_LONG:         return "OP_FOREACH_NEXT_LONG";
+    case OP_GET_VAR_LONG:              return "OP_GET_VAR_LONG";
+    case OP_JUMP_BWD_LONG:             return "OP_JUMP_BWD_LONG";
+    case OP_JUMP_FWD_LONG:             return "OP_JUMP_FWD_LONG";
+    case OP_JUMP_FWD_IF_FALSE_LONG:    return "OP_JUMP_FWD_IF_FALSE_LONG";
+    case OP_JUMP_FWD_IF_TRUE_LONG:     return "OP_JUMP_FWD_IF_TRUE_LONG";
+    case OP_SET_VAR_LONG:              return "OP_SET_VAR_LONG";
+    case OP_ADD_NUM:                   return "OP_ADD_NUM";
+    case OP_CONCAT_TEXT:               return "OP_CONCAT_TEXT";
+    case OP_DIVIDE_NUM:                return "OP_DIVIDE_NUM";
+    case OP_EQUALS_NUM:                return "OP_EQUALS_NUM";
+    case OP_GREATER_THAN_NUM:          return "OP_GREATER_THAN_NUM";
+    case OP_GREATER_THAN_EQUALS_NUM:   return "OP_GREATER_THAN_EQUALS_NUM";
+    case OP_LESS_THAN_NUM:             return "OP_LESS_THAN_NUM";
+    case OP_LESS_THAN_EQUALS_NUM:      return "OP_LESS_THAN_EQUALS_NUM";
+    case OP_MULTIPLY_NUM:              return "OP_MULTIPLY_NUM";
+    case OP_NOT_EQUALS_NUM:            return "OP_NOT_EQUALS_NUM";
+    case OP_SUBTRACT_NUM:              return "OP_SUBTRACT_NUM";
+    default:                           return NULL;
+  }
+}
+
 /// Disassemble the instruction and return the offset to the next instruction.
 int disassemble_instruction(Program* program, int offset) {
   print_source_line_number(program, offset);
   print_bytecode_offset(offset);
 
   byte instruction = program->instructions[offset];
+  const char* op_name = get_opcode_name(instruction);
   switch (instruction) {
-    case OP_POP:
-      return print_opcode("OP_POP", offset);
     case OP_POPN:
-      return print_pop_n("OP_POPN", program, offset);
+      return print_pop_n(op_name, program, offset);
     case OP_GET_VAR:
-      return print_variable("OP_GET_VAR", program, offset);
     case OP_SET_VAR:
-      return print_variable("OP_SET_VAR", program, offset);
+    case OP_SET_VAR_POP:
+      return print_variable(op_name, program, offset);
     case OP_CONSTANT:
-      return print_constant("OP_CONSTANT", program, offset);
-    case OP_CONSTANT_FALSE:
-      return print_opcode("OP_CONSTANT_FALSE", offset);
-    case OP_CONSTANT_NONE:
-      return print_opcode("OP_CONSTANT_NONE", offset);
-    case OP_CONSTANT_TRUE:
-      return print_opcode("OP_CONSTANT_TRUE", offset);
-    case OP_EQUALS:
-      return print_opcode("OP_EQUALS", offset);
-    case OP_NOT_EQUALS:
-      return print_opcode("OP_NOT_EQUALS", offset);
-    case OP_GREATER_THAN:
-      return print_opcode("OP_GREATER_THAN", offset);
-    case OP_GREATER_THAN_EQUALS:
-      return print_opcode("OP_GREATER_THAN_EQUALS", offset);
-    case OP_LESS_THAN:
-      return print_opcode("OP_LESS_THAN", offset);
-    case OP_LESS_THAN_EQUALS:
-      return print_opcode("OP_LESS_THAN_EQUALS", offset);
-    case OP_ADD:
-      return print_opcode("OP_ADD", offset);
-    case OP_SUBTRACT:
-      return print_opcode("OP_SUBTRACT", offset);
-    case OP_MULTIPLY:
-      return print_opcode("OP_MULTIPLY", offset);
-    case OP_DIVIDE:
-      return print_opcode("OP_DIVIDE", offset);
-    case OP_MODULO:
-      return print_opcode("OP_MODULO", offset);
-    case OP_NEGATE:
-      return print_opcode("OP_NEGATE", offset);
-    case OP_NOT:
-      return print_opcode("OP_NOT", offset);
-    case OP_OUT:
-      return print_opcode("OP_OUT", offset);
+      return print_constant(op_name, program, offset);
+    case OP_ADD_VAR_CONSTANT:
+      return print_variable_and_constant(op_name, program, offset);
+    case OP_LESS_THAN_EQUALS_VARS:
+      return print_two_variables(op_name, program, offset);
+    case OP_FOREACH_NEXT:
+    case OP_FOREACH_NEXT_LONG:
+      return print_foreach_next(op_name, program, offset);
+    case OP_CONSTANT_LONG:
+      return print_long_constant(op_name, program, offset);
+    case OP_GET_VAR_LONG:
+    case OP_SET_VAR_LONG:
+      return print_long_variable(op_name, program, offset);
+    case OP_JUMP_BWD:
     case OP_JUMP_FWD:
-      return print_jump("OP_JUMP_FWD", program, 1, offset);
     case OP_JUMP_FWD_IF_FALSE:
-      return print_jump("OP_JUMP_FWD_IF_FALSE", program, 1, offset);
     case OP_JUMP_FWD_IF_TRUE:
-      return print_jump("OP_JUMP_FWD_IF_TRUE", program, 1, offset);
-    case OP_JUMP_BWD:
-      return print_jump("OP_JUMP_BWD", program, -1, offset);
-    case OP_RETURN:
-      return print_opcode("OP_RETURN", offset);
+    case OP_JUMP_BWD_LONG:
+    case OP_JUMP_FWD_LONG:
+    case OP_JUMP_FWD_IF_FALSE_LONG:
+    case OP_JUMP_FWD_IF_TRUE_LONG:
+      return print_jump(op_name, program, offset);
     default:
-      printf("Unsupported opcode %d\n", instruction);
-      return offset + 1;
+      if (op_name == NULL) {
+        printf("Unsupported opcode %d\n", instruction);
+        return offset + 1;
+      }
+      return print_opcode(op_name, offset);
   }
 }
 
@@ -167,3 +248,140 @@ void disassemble_stack(VM* vm) {
   }
   printf("]\n\n");
 }
+
+void disassembler_print_register_headings(const char* title) {
+  printf("================ %s ================\n\n", title);
+  printf("Source      Register    Register\n");
+  printf("Line        Index       Instruction");
+  printf("\n\n");
+}
+
+static const char* get_register_opcode_name(RegisterOpcode opcode) {
+  switch (opcode) {
+    case REG_MOVE:                            return "REG_MOVE";
+    case REG_ADD:                             return "REG_ADD";
+    case REG_SUBTRACT:                        return "REG_SUBTRACT";
+    case REG_MULTIPLY:                        return "REG_MULTIPLY";
+    case REG_DIVIDE:                          return "REG_DIVIDE";
+    case REG_MODULO:                          return "REG_MODULO";
+    case REG_EQUALS:                          return "REG_EQUALS";
+    case REG_NOT_EQUALS:                      return "REG_NOT_EQUALS";
+    case REG_GREATER_THAN:                    return "REG_GREATER_THAN";
+    case REG_GREATER_THAN_EQUALS:             return "REG_GREATER_THAN_EQUALS";
+    case REG_LESS_THAN:                       return "REG_LESS_THAN";
+    case REG_LESS_THAN_EQUALS:                return "REG_LESS_THAN_EQUALS";
+    case REG_NEGATE:                          return "REG_NEGATE";
+    case REG_NOT:                             return "REG_NOT";
+    case REG_OUT:                             return "REG_OUT";
+    case REG_JUMP:                            return "REG_JUMP";
+    case REG_JUMP_IF_FALSE:                   return "REG_JUMP_IF_FALSE";
+    case REG_JUMP_IF_TRUE:                    return "REG_JUMP_IF_TRUE";
+    case REG_JUMP_IF_GREATER_THAN:            return "REG_JUMP_IF_GREATER_THAN";
+    case REG_JUMP_IF_GREATER_THAN_EQUALS:     return "REG_JUMP_IF_GREATER_THAN_EQUALS";
+    case REG_JUMP_IF_LESS_THAN:               return "REG_JUMP_IF_LESS_THAN";
+    case REG_JUMP_IF_LESS_THAN_EQUALS:        return "REG_JUMP_IF_LESS_THAN_EQUALS";
+    case REG_JUMP_UNLESS_EQUALS:              return "REG_JUMP_UNLESS_EQUALS";
+    case REG_JUMP_UNLESS_NOT_EQUALS:          return "REG_JUMP_UNLESS_NOT_EQUALS";
+    case REG_JUMP_UNLESS_GREATER_THAN:        return "REG_JUMP_UNLESS_GREATER_THAN";
+    case REG_JUMP_UNLESS_GREATER_THAN_EQUALS: return "REG_JUMP_UNLESS_GREATER_THAN_EQUALS";
+    case REG_JUMP_UNLESS_LESS_THAN:           return "REG_JUMP_UNLESS_LESS_THAN";
+    case REG_JUMP_UNLESS_LESS_THAN_EQUALS:    return "REG_JUMP_UNLESS_LESS_THAN_EQUALS";
+    case REG_FOREACH_NEXT:                    return "REG_FOREACH_NEXT";
+    case REG_RETURN:                          return "REG_RETURN";
+    default:                                  return "Unsupported register opcode";
+  }
+}
+
+/// Print a register operand: `r<index>` for the stack slots, and the value for
+/// the registers holding constants.
+static void print_register(RegisterProgram* register_program, Program* program, int reg) {
+  int constant_index = reg - register_program->constant_base;
+  if (constant_index < 0)
+    printf("r%d", reg);
+  else if (constant_index < program->constant_pool.count) {
+    printf("k%d (", constant_index);
+    print_value(program->constant_pool.values[constant_index]);
+    printf(")");
+  }
+  else {
+    static const char* special_names[] = { "false", "none", "true" };
+    printf("%s", special_names[constant_index - program->constant_pool.count]);
+  }
+}
+
+void disassemble_register_instruction(RegisterProgram* register_program, Program* program, int index) {
+  int source_offset = register_program->source_offsets[index];
+  int source_line = program_get_source_line(program, source_offset);
+  bool is_same_line_as_previous = index > 0
+    && source_line == program_get_source_line(program, register_program->source_offsets[index - 1]);
+  if (is_same_line_as_previous)
+    indent(COLUMN_LENGTH);
+  else {
+    printf("%-4d", source_line);
+    indent(COLUMN_LENGTH - 4);
+  }
+  print_bytecode_offset(index);
+
+  RegisterInstruction* instruction = &register_program->instructions[index];
+  printf("%s", get_register_opcode_name(instruction->opcode));
+  switch (instruction->opcode) {
+    case REG_RETURN:
+      break;
+    case REG_JUMP:
+      printf("    (jumps to %d)", instruction->a);
+      break;
+    case REG_JUMP_IF_FALSE:
+    case REG_JUMP_IF_TRUE:
+    case REG_FOREACH_NEXT:
+      printf(" ");
+      print_register(register_program, program, instruction->b);
+      printf("    (jumps to %d)", instruction->a);
+      break;
+    case REG_JUMP_IF_GREATER_THAN:
+    case REG_JUMP_IF_GREATER_THAN_EQUALS:
+    case REG_JUMP_IF_LESS_THAN:
+    case REG_JUMP_IF_LESS_THAN_EQUALS:
+    case REG_JUMP_UNLESS_EQUALS:
+    case REG_JUMP_UNLESS_NOT_EQUALS:
+    case REG_JUMP_UNLESS_GREATER_THAN:
+    case REG_JUMP_UNLESS_GREATER_THAN_EQUALS:
+    case REG_JUMP_UNLESS_LESS_THAN:
+    case REG_JUMP_UNLESS_LESS_THAN_EQUALS:
+      printf(" ");
+      print_register(register_program, program, instruction->b);
+      printf(", ");
+      print_register(register_program, program, instruction->c);
+      printf("    (jumps to %d)", instruction->a);
+      break;
+    case REG_OUT:
+      printf(" ");
+      print_register(register_program, program, instruction->a);
+      break;
+    case REG_MOVE:
+    case REG_NEGATE:
+    case REG_NOT:
+      printf(" ");
+      print_register(register_program, program, instruction->a);
+      printf(", ");
+      print_register(register_program, program, instruction->b);
+      break;
+    default:
+      printf(" ");
+      print_register(register_program, program, instruction->a);
+      printf(", ");
+      print_register(register_program, program, instruction->b);
+      printf(", ");
+      print_register(register_program, program, instruction->c);
+      break;
+  }
+  printf("\n");
+}
+
+void disassemble_register_program(RegisterProgram* register_program, Program* program) {
+  disassembler_print_register_headings("Register program");
+
+  for (int index = 0; index < register_program->count; index++)
+    disassemble_register_instruction(register_program, program, index);
+
+  printf("\n");
+}
@@ -2,12 +2,17 @@
 #define CTHUSLY_DEBUG_H
 
 #include "program.h"
+#include "register_vm.h"
 #include "vm.h"
 
+const char* get_opcode_name(byte opcode);
 void disassemble_stack(VM* vm);
 void disassemble_program(Program* program);
 int disassemble_instruction(Program* program, int offset);
 void disassembler_print_headings(const char* title);
 void disassembler_indent_to_last_column();
+void disassemble_register_program(RegisterProgram* register_program, Program* program);
+void disassemble_register_instruction(RegisterProgram* register_program, Program* program, int index);
+void disassembler_print_register_headings(const char* title);
 
 #endif
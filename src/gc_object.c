@@ -5,81 +5,329 @@
 
 #include "gc_object.h"
 #include "memory.h"
+#include "text_hash.h"
 
-#define ALLOCATE_OBJECT(environment, type, gc_object_type) \
-  (type*)allocate_object(environment, sizeof(type), gc_object_type)
+/// Count memory owned by gc objects towards the heap budget of the collector.
+static void track_allocation(Environment* environment, size_t size) {
+  environment->bytes_allocated += size;
+  if (environment->bytes_allocated > environment->gc_stats.peak_bytes_allocated)
+    environment->gc_stats.peak_bytes_allocated = environment->bytes_allocated;
+}
 
-/// Allocate memory for a `GCObject`.
+/// Allocate memory for a `GCObject` from the environment's arena. The object is
+/// not tracked by the garbage collector until it is added using `add_object()`.
 ///
 /// The size of the object needs to be passed as an argument (rather than
 /// using `sizeof(GCObject)`) since there are different-sized object types.
 static GCObject* allocate_object(Environment* environment, size_t size, GCObjectType gc_object_type) {
-  GCObject* object = (GCObject*)handle_reallocation(NULL, 0, size);
+  // Collections only run when allocating a new object (rather than on any
+  // allocation) since all reachable objects are rooted at that point.
+  #ifdef DEBUG_STRESS_GC
+    collect_garbage(environment);
+  #else
+    if (environment->bytes_allocated > environment->next_gc)
+      collect_garbage(environment);
+  #endif
+
+  GCObject* object = (GCObject*)arena_allocate(&environment->arena, size);
   object->type = gc_object_type;
+  object->is_marked = false;
+
+  return object;
+}
+
+/// Add an allocated object to the objects tracked by the garbage collector.
+static void add_object(Environment* environment, GCObject* object, size_t size) {
+  track_allocation(environment, size);
 
   // Add the object to the linked list (inserting at the beginning).
   object->next = environment->gc_objects;
   environment->gc_objects = object;
+}
 
-  return object;
+/// Allocate memory for a text object with room for `length` chars (plus the
+/// terminating null byte) stored inline, right after the object itself. The
+/// chars are to be written by the caller before calling `intern_text()`.
+static TextObject* allocate_text_object(Environment* environment, int length) {
+  TextObject* text = (TextObject*)allocate_object(environment, TEXT_OBJECT_SIZE(length), GC_OBJECT_TYPE_TEXT);
+  text->chars = text->inline_chars;
+  text->length = length;
+  text->chars[length] = '\0';
+  text->has_hash_code = false;
+  text->is_interned = false;
+
+  return text;
+}
+
+/// Return the interned text equal to the newly allocated text if one exists
+/// (releasing the new text), otherwise add the new text to the intern pool.
+static TextObject* intern_text(Environment* environment, TextObject* text) {
+  text->hash_code = hash_text(text->chars, text->length);
+  text->has_hash_code = true;
+  TextObject* interned_text = intern_set_find(&environment->texts, text->chars, text->length, text->hash_code);
+  if (interned_text != NULL) {
+    // Since the text was the most recent allocation, this undoes the allocation.
+    arena_release(&environment->arena, text, TEXT_OBJECT_SIZE(text->length));
+    return interned_text;
+  }
+
+  add_object(environment, &text->base, TEXT_OBJECT_SIZE(text->length));
+  text->is_interned = true;
+  intern_set_add(&environment->texts, text);
+
+  return text;
 }
 
-/// Allocate memory for a text object and add the object to the text intern pool.
-static TextObject* allocate_text_object(Environment* environment, char* chars, int length, uint32_t hash_code) {
-  TextObject* text = ALLOCATE_OBJECT(environment, TextObject, GC_OBJECT_TYPE_TEXT);
-  text->chars = chars;
+/// Finish a newly allocated text created at runtime (e.g. by concatenation).
+/// It is interned unless using `--lazy-interning`, in which case it is neither
+/// hashed nor looked up in the intern pool (e.g. a text that is only output
+/// never needs to be).
+static TextObject* claim_runtime_text(Environment* environment, TextObject* text) {
+  if (!flag_lazy_interning)
+    return intern_text(environment, text);
+
+  add_object(environment, &text->base, TEXT_OBJECT_SIZE(text->length));
+
+  return text;
+}
+
+/// Create a Thusly text object by copying a C string.
+///
+/// Note: Texts of at most SHORT_TEXT_MAX_LENGTH chars are to be created as short
+/// texts instead (see `make_text()`).
+TextObject* copy_c_string(Environment* environment, const char* chars, int length) {
+  TextObject* text = allocate_text_object(environment, length);
+  memcpy(text->chars, chars, length);
+
+  return intern_text(environment, text);
+}
+
+/// Create a Thusly text from a C string, stored inline if short enough.
+ThuslyValue make_text(Environment* environment, const char* chars, int length) {
+  if (length <= SHORT_TEXT_MAX_LENGTH)
+    return short_text_pack(chars, length);
+
+  return FROM_C_OBJECT_PTR(copy_c_string(environment, chars, length));
+}
+
+/// Create a text object whose chars (null-terminated) are kept elsewhere for as
+/// long as the text is used, i.e. a text constant of a bytecode file mapped into
+/// memory (see bytecode_file.c). The chars are thereby neither copied nor hashed
+/// up front. The text is not interned but compared by its chars (like the texts
+/// created at runtime when using `--lazy-interning`), so that loading a program
+/// does not have to look up each of its texts in the intern pool.
+TextObject* make_mapped_text(Environment* environment, const char* chars, int length) {
+  TextObject* text = (TextObject*)allocate_object(environment, sizeof(TextObject), GC_OBJECT_TYPE_TEXT);
+  text->chars = (char*)chars;
   text->length = length;
-  text->hash_code = hash_code;
-  table_set(&environment->texts, text, FROM_C_NULL);
+  text->has_hash_code = false;
+  text->is_interned = false;
+  add_object(environment, &text->base, sizeof(TextObject));
 
   return text;
 }
 
-/// Produce a deterministic fixed-size hash code from a given key.
-/// (Uses the FNV1 hash algorithm: http://www.isthe.com/chongo/tech/comp/fnv/)
-static uint32_t hash(const char* key, int length) {
-  #define FNV1_32_INIT ((uint32_t)2166136261u)
-  #define FNV_32_PRIME ((uint32_t)16777619)
+static int get_text_length(ThuslyValue value) {
+  if (IS_SHORT_TEXT(value)) {
+    char buffer[SHORT_TEXT_MAX_LENGTH + 1];
+    return short_text_unpack(value, buffer);
+  }
+  if (IS_ROPE(value))
+    return TO_ROPE(value)->length;
 
-  uint32_t hash_code = FNV1_32_INIT;
-  for (int i = 0; i < length; i++) {
-    // Incorporate each char into the hash (xor the bottom with the current octet).
-    hash_code ^= (uint8_t)key[i];
-    // Shuffle the bits around (multiply by the 32 bit FNV magic prime).
-    hash_code *= FNV_32_PRIME;
+  return TO_TEXT(value)->length;
+}
+
+/// Get the chars of a flat text value (or a flattened rope). Short texts are
+/// unpacked into `buffer` (which needs room for SHORT_TEXT_MAX_LENGTH + 1 chars).
+/// Returns the length.
+static int get_text_chars(ThuslyValue value, char* buffer, const char** out_chars) {
+  if (IS_SHORT_TEXT(value)) {
+    *out_chars = buffer;
+    return short_text_unpack(value, buffer);
   }
 
-  return hash_code;
+  TextObject* text = IS_ROPE(value) ? TO_ROPE(value)->flattened : TO_TEXT(value);
+  *out_chars = text->chars;
 
-  #undef FNV1_32_INIT
-  #undef FNV_32_PRIME
+  return text->length;
 }
 
-/// Have a Thusly text object claim ownership of a C string.
-TextObject* claim_c_string(Environment* environment, char* chars, int length) {
-  uint32_t hash_code = hash(chars, length);
-  TextObject* interned_text = table_get_interned_text(&environment->texts, chars, length, hash_code);
-  if (interned_text != NULL) {
-    FREE_ARRAY(char, chars, length + 1);
-    return interned_text;
+/// Write the chars of a text of any form to `destination` (without a null byte).
+///
+/// Ropes may be nested very deeply (e.g. when built by appending in a loop), so
+/// they are walked using an explicit stack rather than recursion. The chars are
+/// written backwards (the right child before the left), which keeps the stack
+/// short for ropes built by appending (they lean to the left).
+static void write_text_chars(ThuslyValue value, char* destination) {
+  char* end = destination + get_text_length(value);
+  int capacity = GROW_CAPACITY(0);
+  ThuslyValue* pending = ALLOCATE(ThuslyValue, capacity);
+  int count = 0;
+  pending[count++] = value;
+
+  while (count > 0) {
+    ThuslyValue current = pending[--count];
+    bool is_unflattened_rope = IS_ROPE(current) && TO_ROPE(current)->flattened == NULL;
+    if (is_unflattened_rope) {
+      if (count + 2 > capacity) {
+        int old_capacity = capacity;
+        capacity = GROW_CAPACITY(old_capacity);
+        pending = GROW_ARRAY(ThuslyValue, pending, old_capacity, capacity);
+      }
+      pending[count++] = TO_ROPE(current)->left;
+      pending[count++] = TO_ROPE(current)->right;
+      continue;
+    }
+
+    char buffer[SHORT_TEXT_MAX_LENGTH + 1];
+    const char* chars;
+    int length = get_text_chars(current, buffer, &chars);
+    end -= length;
+    memcpy(end, chars, length);
   }
 
-  return allocate_text_object(environment, chars, length, hash_code);
+  FREE_ARRAY(ThuslyValue, pending, capacity);
 }
 
-/// Have a Thusly text object copy a C string.
-TextObject* copy_c_string(Environment* environment, const char* chars, int length) {
-  uint32_t hash_code = hash(chars, length);
-  TextObject* interned_text = table_get_interned_text(&environment->texts, chars, length, hash_code);
-  if (interned_text != NULL)
-    return interned_text;
+/// Get the operand to store in a new rope (a flattened rope is replaced by its text).
+static ThuslyValue to_rope_child(ThuslyValue value) {
+  if (IS_ROPE(value) && TO_ROPE(value)->flattened != NULL)
+    return FROM_C_OBJECT_PTR(TO_ROPE(value)->flattened);
+
+  return value;
+}
+
+/// Create a Thusly text from the concatenation of two texts. The result is a
+/// rope unless it is shorter than ROPE_MIN_LENGTH (see `RopeObject`). Returns
+/// `false` (without creating a text) if the result would be longer than
+/// TEXT_MAX_LENGTH, which is a runtime error.
+///
+/// IMPORTANT: The texts passed must be reachable by the garbage collector
+/// (e.g. remain on the VM stack) since allocating may trigger a collection.
+bool concatenate_texts(Environment* environment, ThuslyValue a, ThuslyValue b, ThuslyValue* out_result) {
+  int a_text_length = get_text_length(a);
+  int b_text_length = get_text_length(b);
+  if (a_text_length > TEXT_MAX_LENGTH - b_text_length)
+    return false;
 
-  // Allocate +1 for the terminating null byte.
-  char* chars_copy = ALLOCATE(char, length + 1);
-  memcpy(chars_copy, chars, length);
-  chars_copy[length] = '\0';
+  int length = a_text_length + b_text_length;
+  if (length >= ROPE_MIN_LENGTH) {
+    RopeObject* rope = (RopeObject*)allocate_object(environment, sizeof(RopeObject), GC_OBJECT_TYPE_ROPE);
+    rope->length = length;
+    rope->left = to_rope_child(a);
+    rope->right = to_rope_child(b);
+    rope->flattened = NULL;
+    add_object(environment, &rope->base, sizeof(RopeObject));
+    *out_result = FROM_C_OBJECT_PTR(rope);
+
+    return true;
+  }
 
-  return allocate_text_object(environment, chars_copy, length, hash_code);
+  // (Ropes are never shorter than ROPE_MIN_LENGTH, so both texts are flat.)
+  char a_buffer[SHORT_TEXT_MAX_LENGTH + 1];
+  char b_buffer[SHORT_TEXT_MAX_LENGTH + 1];
+  const char* a_chars;
+  const char* b_chars;
+  int a_length = get_text_chars(a, a_buffer, &a_chars);
+  int b_length = get_text_chars(b, b_buffer, &b_chars);
+
+  if (length <= SHORT_TEXT_MAX_LENGTH) {
+    char chars[SHORT_TEXT_MAX_LENGTH];
+    memcpy(chars, a_chars, a_length);
+    memcpy(chars + a_length, b_chars, b_length);
+    *out_result = short_text_pack(chars, length);
+    return true;
+  }
+
+  TextObject* text = allocate_text_object(environment, length);
+  memcpy(text->chars, a_chars, a_length);
+  memcpy(text->chars + a_length, b_chars, b_length);
+  *out_result = FROM_C_OBJECT_PTR(claim_runtime_text(environment, text));
+
+  return true;
+}
+
+/// Create a flat text from the concatenation of two flat texts, e.g. when two
+/// text constants are concatenated at compile time (constants are never ropes).
+/// Unlike at runtime, the result is always interned.
+///
+/// IMPORTANT: The texts passed must be reachable by the garbage collector
+/// (e.g. be in the constant pool) since allocating may trigger a collection.
+ThuslyValue concatenate_flat_texts(Environment* environment, ThuslyValue a, ThuslyValue b) {
+  char a_buffer[SHORT_TEXT_MAX_LENGTH + 1];
+  char b_buffer[SHORT_TEXT_MAX_LENGTH + 1];
+  const char* a_chars;
+  const char* b_chars;
+  int a_length = get_text_chars(a, a_buffer, &a_chars);
+  int b_length = get_text_chars(b, b_buffer, &b_chars);
+  int length = a_length + b_length;
+
+  if (length <= SHORT_TEXT_MAX_LENGTH) {
+    char chars[SHORT_TEXT_MAX_LENGTH];
+    memcpy(chars, a_chars, a_length);
+    memcpy(chars + a_length, b_chars, b_length);
+    return short_text_pack(chars, length);
+  }
+
+  TextObject* text = allocate_text_object(environment, length);
+  memcpy(text->chars, a_chars, a_length);
+  memcpy(text->chars + a_length, b_chars, b_length);
+
+  return FROM_C_OBJECT_PTR(intern_text(environment, text));
+}
+
+/// Get the flat form of a text, flattening it first if it is a rope. A rope
+/// is only flattened once, which copies its chars into a new text and interns
+/// it (so flattened texts can be compared by identity like all other texts,
+/// unless interning lazily). Other values are returned as is.
+///
+/// IMPORTANT: The value passed must be reachable by the garbage collector
+/// (e.g. remain on the VM stack) since allocating may trigger a collection.
+ThuslyValue flatten_text(Environment* environment, ThuslyValue value) {
+  if (!IS_ROPE(value))
+    return value;
+
+  RopeObject* rope = TO_ROPE(value);
+  if (rope->flattened == NULL) {
+    TextObject* text = allocate_text_object(environment, rope->length);
+    write_text_chars(value, text->chars);
+    rope->flattened = claim_runtime_text(environment, text);
+    rope->left = FROM_C_NULL;
+    rope->right = FROM_C_NULL;
+  }
+
+  return FROM_C_OBJECT_PTR(rope->flattened);
+}
+
+/// Get the hash code of a text, hashing its chars the first time if it is not interned.
+uint32_t get_text_hash_code(TextObject* text) {
+  if (!text->has_hash_code) {
+    text->hash_code = hash_text(text->chars, text->length);
+    text->has_hash_code = true;
+  }
+
+  return text->hash_code;
+}
+
+/// Check whether two different gc objects (as opposed to the same object)
+/// are equal. Only texts can be equal, and only if at least one of them was
+/// not interned (see `--lazy-interning`), in which case they are compared by
+/// their length, hash code and chars (in that order).
+///
+/// Note: Ropes must have been flattened (see `flatten_text()`).
+bool gc_objects_are_equal(GCObject* a, GCObject* b) {
+  if (a->type != GC_OBJECT_TYPE_TEXT || b->type != GC_OBJECT_TYPE_TEXT)
+    return false;
+
+  TextObject* a_text = (TextObject*)a;
+  TextObject* b_text = (TextObject*)b;
+  if (a_text->is_interned && b_text->is_interned)
+    return false;
+
+  return a_text->length == b_text->length
+    && get_text_hash_code(a_text) == get_text_hash_code(b_text)
+    && memcmp(a_text->chars, b_text->chars, a_text->length) == 0;
 }
 
 void print_object(ThuslyValue value) {
@@ -87,5 +335,20 @@ void print_object(ThuslyValue value) {
     case GC_OBJECT_TYPE_TEXT:
       printf("%s", TO_C_STRING(value));
       break;
+    case GC_OBJECT_TYPE_ROPE: {
+      RopeObject* rope = TO_ROPE(value);
+      if (rope->flattened != NULL) {
+        printf("%s", rope->flattened->chars);
+        break;
+      }
+      // (`@out` flattens its operand, so this is only reached when printing
+      // the stack while debugging, which should not change the heap.)
+      char* chars = ALLOCATE(char, rope->length + 1);
+      write_text_chars(value, chars);
+      chars[rope->length] = '\0';
+      printf("%s", chars);
+      FREE_ARRAY(char, chars, rope->length + 1);
+      break;
+    }
   }
 }
@@ -1,6 +1,7 @@
 #ifndef CTHUSLY_GC_OBJECT_H
 #define CTHUSLY_GC_OBJECT_H
 
+#include <limits.h>
 #include <stdint.h>
 
 #include "common.h"
@@ -8,14 +9,22 @@
 #include "vm.h"
 
 #define GET_GC_OBJECT_TYPE(thusly_value) (TO_C_OBJECT_PTR(thusly_value)->type)
-#define IS_TEXT(thusly_value)            matches_gc_object_type(thusly_value, GC_OBJECT_TYPE_TEXT)
+#define IS_TEXT(thusly_value)            is_text(thusly_value)
+#define IS_ROPE(thusly_value)            matches_gc_object_type(thusly_value, GC_OBJECT_TYPE_ROPE)
 
 #define TO_TEXT(thusly_value)            ((TextObject*)TO_C_OBJECT_PTR(thusly_value))
 #define TO_C_STRING(thusly_value)        (((TextObject*)TO_C_OBJECT_PTR(thusly_value))->chars)
+#define TO_ROPE(thusly_value)            ((RopeObject*)TO_C_OBJECT_PTR(thusly_value))
+
+/// The minimum length of a concatenation to be kept as a rope. Shorter results
+/// are copied into a new text right away, since that is cheaper than allocating
+/// a rope (and later flattening it).
+#define ROPE_MIN_LENGTH 32
 
 /// The type of a heap-allocated value.
 typedef enum {
   GC_OBJECT_TYPE_TEXT,
+  GC_OBJECT_TYPE_ROPE,
 } GCObjectType;
 
 /// The common state of all dynamically (heap) allocated values (referred to as gc objects here).
@@ -25,6 +34,8 @@ typedef enum {
 /// first field of the `GCObject` struct. (There is never padding in the beginning of a struct.)
 struct GCObject {
   GCObjectType type;
+  /// Whether the object was found to be reachable during the current garbage collection.
+  bool is_marked;
   /// Pointer to the next heap-allocated object in the (intrusive) linked list.
   /// (The head is pointed to by the VM's `Environment` struct.)
   struct GCObject* next;
@@ -34,13 +45,57 @@ struct GCObject {
 struct TextObject {
   // IMPORTANT: This field must be first (see notes in `GCObject`).
   GCObject base;
+  /// The null-terminated chars (points to `inline_chars`, unless the chars
+  /// are mapped from a bytecode file, see `make_mapped_text()`).
   char* chars;
   int length;
+  /// The hash code of the chars (computed when first needed for texts that
+  /// are not interned, see `get_text_hash_code()`).
   uint32_t hash_code;
+  bool has_hash_code;
+  /// Whether the text is in the intern pool. Texts created at runtime are
+  /// not interned when using `--lazy-interning`, so there may be several
+  /// text objects with the same chars (see `gc_objects_are_equal()`).
+  bool is_interned;
+  /// The chars are allocated together with the object (in the same allocation).
+  char inline_chars[];
 };
 
-TextObject* claim_c_string(Environment* environment, char* chars, int length);
+/// The maximum length of a text (its length is stored as an `int`).
+#define TEXT_MAX_LENGTH INT_MAX
+
+/// The size of a text object holding `length` chars (and the terminating null byte).
+#define TEXT_OBJECT_SIZE(length) (sizeof(TextObject) + (length) + 1)
+
+/// The size of a text object, which does not hold its chars if they are mapped
+/// from a bytecode file (see `make_mapped_text()`).
+static inline size_t get_text_object_size(TextObject* text) {
+  return text->chars == text->inline_chars ? TEXT_OBJECT_SIZE(text->length) : sizeof(TextObject);
+}
+
+/// A lazily concatenated text (a rope) - The concatenation of two texts (each
+/// either a flat text or another rope) whose chars are not copied until they
+/// are needed (see `flatten_text()`). The result is then hashed and interned
+/// (unless interning lazily) once, rather than on every concatenation.
+typedef struct {
+  // IMPORTANT: This field must be first (see notes in `GCObject`).
+  GCObject base;
+  int length;
+  ThuslyValue left;
+  ThuslyValue right;
+  /// The flat text once the rope has been flattened (otherwise `NULL`).
+  /// The children are then dropped (set to `none`) so they can be collected.
+  TextObject* flattened;
+} RopeObject;
+
 TextObject* copy_c_string(Environment* environment, const char* chars, int length);
+ThuslyValue make_text(Environment* environment, const char* chars, int length);
+TextObject* make_mapped_text(Environment* environment, const char* chars, int length);
+bool concatenate_texts(Environment* environment, ThuslyValue a, ThuslyValue b, ThuslyValue* out_result);
+ThuslyValue concatenate_flat_texts(Environment* environment, ThuslyValue a, ThuslyValue b);
+ThuslyValue flatten_text(Environment* environment, ThuslyValue value);
+uint32_t get_text_hash_code(TextObject* text);
+bool gc_objects_are_equal(GCObject* a, GCObject* b);
 void print_object(ThuslyValue value);
 
 // Note: The body of this function is not used directly in a macro since the
@@ -50,4 +105,13 @@ static inline bool matches_gc_object_type(ThuslyValue value, GCObjectType type)
   return IS_GC_OBJECT(value) && TO_C_OBJECT_PTR(value)->type == type;
 }
 
+/// Whether the value is a text, either short (inline), a TextObject or a rope.
+static inline bool is_text(ThuslyValue value) {
+  if (IS_SHORT_TEXT(value))
+    return true;
+
+  return IS_GC_OBJECT(value)
+    && (GET_GC_OBJECT_TYPE(value) == GC_OBJECT_TYPE_TEXT || GET_GC_OBJECT_TYPE(value) == GC_OBJECT_TYPE_ROPE);
+}
+
 #endif
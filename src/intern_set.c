@@ -0,0 +1,134 @@
+#include <string.h>
+
+#include "gc_object.h"
+#include "intern_set.h"
+#include "memory.h"
+#include "table_probe.h"
+
+void intern_set_init(InternSet* set) {
+  set->controls = NULL;
+  set->entries = NULL;
+  set->count = 0;
+  set->capacity = 0;
+}
+
+void intern_set_free(InternSet* set) {
+  FREE_ARRAY(int8_t, set->controls, get_control_count(set->capacity));
+  FREE_ARRAY(InternEntry, set->entries, set->capacity);
+  intern_set_init(set);
+}
+
+/// The smallest capacity that holds `count` texts within the maximum load factor.
+static int get_capacity_for(int count) {
+  int capacity = TABLE_MIN_CAPACITY;
+  while (!IS_WITHIN_MAX_LOAD(count, capacity))
+    capacity *= 2;
+
+  return capacity;
+}
+
+/// Move the texts into newly allocated arrays of the given capacity (leaving
+/// out the entries not marked as full).
+static void resize(InternSet* set, int new_capacity) {
+  int new_control_count = get_control_count(new_capacity);
+  int8_t* new_controls = ALLOCATE(int8_t, new_control_count);
+  memset(new_controls, CONTROL_EMPTY, new_control_count);
+  InternEntry* new_entries = ALLOCATE(InternEntry, new_capacity);
+
+  int count = 0;
+  for (int i = 0; i < set->capacity; i++) {
+    if (!IS_FULL(set->controls[i]))
+      continue;
+
+    InternEntry* old_entry = &set->entries[i];
+    uint32_t index = find_free_index(new_controls, new_capacity, old_entry->hash_code);
+    set_control(new_controls, new_capacity, index, H2(old_entry->hash_code));
+    new_entries[index] = *old_entry;
+    count++;
+  }
+
+  FREE_ARRAY(int8_t, set->controls, get_control_count(set->capacity));
+  FREE_ARRAY(InternEntry, set->entries, set->capacity);
+  set->controls = new_controls;
+  set->entries = new_entries;
+  set->count = count;
+  set->capacity = new_capacity;
+}
+
+/// Make room for `additional_count` more texts up front (e.g. for the text
+/// literals of a program about to be compiled), so that the set does not
+/// need to be grown repeatedly while they are added.
+void intern_set_reserve(InternSet* set, int additional_count) {
+  int capacity = get_capacity_for(set->count + additional_count);
+  if (capacity > set->capacity)
+    resize(set, capacity);
+}
+
+/// Find the interned text with the given chars. Returns NULL if the text has
+/// not been interned.
+TextObject* intern_set_find(InternSet* set, const char* chars, int length, uint32_t hash_code) {
+  if (set->count == 0)
+    return NULL;
+
+  ProbeSequence probe = probe_start(hash_code, set->capacity);
+  prefetch_entries(&set->entries[probe.offset]);
+  int8_t h2 = H2(hash_code);
+  while (true) {
+    const int8_t* group = set->controls + probe.offset;
+    for (uint32_t matches = group_match(group, h2); matches != 0; matches &= matches - 1) {
+      InternEntry* entry = &set->entries[probe_index(&probe, lowest_bit_index(matches))];
+      // (The text itself is only read once the hash code and length match.)
+      if (entry->hash_code == hash_code && entry->length == length && memcmp(entry->text->chars, chars, length) == 0)
+        return entry->text;
+    }
+
+    // A text is never placed beyond a group with an empty entry.
+    if (group_match(group, CONTROL_EMPTY) != 0)
+      return NULL;
+
+    probe_next(&probe);
+  }
+}
+
+/// Add a text known not to be in the set (see `intern_set_find()`).
+void intern_set_add(InternSet* set, TextObject* text) {
+  if (!IS_WITHIN_MAX_LOAD(set->count + 1, set->capacity))
+    resize(set, set->capacity == 0 ? TABLE_MIN_CAPACITY : set->capacity * 2);
+
+  uint32_t index = find_free_index(set->controls, set->capacity, text->hash_code);
+  set_control(set->controls, set->capacity, index, H2(text->hash_code));
+  set->entries[index] = (InternEntry){ .hash_code = text->hash_code, .length = text->length, .text = text };
+  set->count++;
+}
+
+/// Remove the texts that were not marked as reachable by the garbage collector
+/// (the set only references its texts weakly).
+///
+/// Rather than leaving deleted entries behind, the remaining texts are moved
+/// into new arrays, which are also shrunk if most of the texts were removed.
+void intern_set_remove_unmarked(InternSet* set) {
+  int remaining_count = 0;
+  for (int i = 0; i < set->capacity; i++) {
+    if (!IS_FULL(set->controls[i]))
+      continue;
+
+    if (set->entries[i].text->base.is_marked)
+      remaining_count++;
+    else
+      set->controls[i] = CONTROL_DELETED;
+  }
+
+  bool was_any_removed = remaining_count < set->count;
+  if (!was_any_removed)
+    return;
+
+  // (Room is left for as many texts again as remain, so that a set that
+  // shrinks does not have to grow again right away.)
+  int new_capacity = get_capacity_for(remaining_count * 2);
+  resize(set, new_capacity < set->capacity ? new_capacity : set->capacity);
+}
+
+/// Get the number of bytes allocated by the set (for the GC stats).
+size_t intern_set_get_memory_size(InternSet* set) {
+  return get_control_count(set->capacity) * sizeof(int8_t) + set->capacity * sizeof(InternEntry);
+}
@@ -0,0 +1,42 @@
+#ifndef CTHUSLY_INTERN_SET_H
+#define CTHUSLY_INTERN_SET_H
+
+#include <stddef.h>
+
+#include "thusly_value.h"
+
+/// An entry of the intern set. The hash code and length of the text are
+/// stored next to the pointer so that texts which differ can be rejected
+/// without following the pointer.
+typedef struct {
+  uint32_t hash_code;
+  int length;
+  TextObject* text;
+} InternEntry;
+
+/// The set of interned texts (the intern pool) - Looks up texts by their chars.
+///
+/// Uses the same open-addressing layout as `Table` (a control byte per entry
+/// holding 7 bits of the hash code, probed a group at a time), but stores no
+/// values. Texts are only ever removed in bulk by the garbage collector, after
+/// which the set is rebuilt, so the set never contains deleted entries.
+typedef struct {
+  /// The control bytes (see `table_probe.h`), followed by a copy of the first
+  /// TABLE_GROUP_SIZE - 1 bytes so that a group can be loaded at any index.
+  int8_t* controls;
+  InternEntry* entries;
+  /// The number of texts.
+  int count;
+  /// The number of entries (zero or a power of two of at least TABLE_GROUP_SIZE).
+  int capacity;
+} InternSet;
+
+void intern_set_init(InternSet* set);
+void intern_set_free(InternSet* set);
+void intern_set_reserve(InternSet* set, int additional_count);
+TextObject* intern_set_find(InternSet* set, const char* chars, int length, uint32_t hash_code);
+void intern_set_add(InternSet* set, TextObject* text);
+void intern_set_remove_unmarked(InternSet* set);
+size_t intern_set_get_memory_size(InternSet* set);
+
+#endif
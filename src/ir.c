@@ -0,0 +1,891 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "ir.h"
+#include "memory.h"
+#include "program.h"
+
+/// The maximum number of child nodes of a node (not counting the statements of a block).
+#define CHILDREN_MAX 5
+/// The smallest expression (in nodes) worth hoisting out of a loop into a variable.
+#define HOISTED_EXPRESSION_MIN_SIZE 3
+/// The maximum number of rounds of removing unused variables. (Removing a variable
+/// may leave the variables only read by its initializer unused.)
+#define UNUSED_VARIABLE_ROUNDS_MAX 16
+
+/// The optimizer - Rewrites the intermediate representation of a program (the syntax
+/// tree built by the compiler) before the compiler writes the bytecode from it. Since
+/// loops have a single entry and a single exit (there is no `break` or `continue`) and
+/// variables are only accessed in their scope, the passes work on the tree directly.
+///
+/// An expression is only moved, merged with another, or removed if evaluating it has
+/// no effect other than its value, i.e. it does not assign a variable and cannot cause
+/// a runtime error (see `annotate()`). Whether an operation can fail depends on the
+/// types of its operands, so the variables that only ever hold numbers are found first.
+
+typedef struct {
+  Ir* ir;
+  VMStats* stats;
+  /// Identifies the current marking of variables (a variable is marked if its `mark`
+  /// equals the stamp). A new stamp clears the marks of all variables at once.
+  int stamp;
+  bool has_changed;
+} Optimizer;
+
+/// How a variable is used after a statement in the same block (see `remove_dead_stores()`).
+typedef enum {
+  LATER_NOT_USED,
+  LATER_READ,
+  LATER_OVERWRITTEN,
+} LaterUse;
+
+/// The loop whose invariant expressions are being hoisted (see `hoist_loop_invariants()`).
+typedef struct {
+  IrNode* loop;
+  /// The block with the loop statement (which declares the hoisted variables).
+  IrNode* block;
+  /// The link to the loop statement (or to the first declaration hoisted before it).
+  IrNode** loop_link;
+  /// Where the next declaration is inserted (after those hoisted before it).
+  IrNode** insertion_link;
+} HoistedLoop;
+
+/// An expression that may have the same value as other expressions in the block
+/// (see `eliminate_common_subexpressions()`).
+typedef struct {
+  IrNode* node;
+  /// The field referring to the node (in its parent).
+  IrNode** link;
+  /// The index in the block of the statement with the expression.
+  int statement_index;
+  /// The sum of the versions of the variables read. Since versions only increase,
+  /// two occurrences have the same sum only if none of the variables was assigned
+  /// in between.
+  long version_sum;
+  /// The order in which the expressions were found.
+  int sequence;
+  /// The next occurrence of the same expression (-1 if none).
+  int next_in_group;
+  bool is_grouped;
+} Occurrence;
+
+/// The occurrences of an expression with the same value.
+typedef struct {
+  int first_occurrence;
+  int size;
+} OccurrenceGroup;
+
+/// The analysis of a subexpression while collecting occurrences.
+typedef struct {
+  bool is_eligible;
+  bool reads_variable;
+  long version_sum;
+} SubexpressionInfo;
+
+typedef struct {
+  Occurrence* occurrences;
+  int count;
+  int capacity;
+} OccurrenceArray;
+
+typedef void (*VisitFunction)(Optimizer* optimizer, IrNode* node);
+typedef void (*BlockFunction)(Optimizer* optimizer, IrNode* block);
+
+void ir_init(Ir* ir) {
+  arena_init(&ir->arena);
+  ir->program = NULL;
+}
+
+void ir_free(Ir* ir) {
+  arena_free(&ir->arena);
+  ir->program = NULL;
+}
+
+IrNode* ir_new_node(Ir* ir, IrNodeType type, int line) {
+  IrNode* node = (IrNode*)arena_allocate(&ir->arena, sizeof(IrNode));
+  memset(node, 0, sizeof(IrNode));
+  node->type = type;
+  node->line = line;
+  node->range_line = line;
+  node->value = FROM_C_NULL;
+
+  return node;
+}
+
+IrVariable* ir_new_variable(Ir* ir) {
+  IrVariable* variable = (IrVariable*)arena_allocate(&ir->arena, sizeof(IrVariable));
+  memset(variable, 0, sizeof(IrVariable));
+
+  return variable;
+}
+
+static bool is_operation(IrNode* node) {
+  return node->type == IR_UNARY || node->type == IR_BINARY || node->type == IR_AND || node->type == IR_OR;
+}
+
+/// Get the links to (i.e. the fields referring to) the child nodes of a node, in
+/// the order they are evaluated (not counting the statements of a block).
+static int get_child_links(IrNode* node, IrNode** out_links[CHILDREN_MAX]) {
+  IrNode** fields[CHILDREN_MAX] = { &node->left, &node->right, &node->step, &node->body, &node->else_body };
+  int count = 0;
+  for (int i = 0; i < CHILDREN_MAX; i++) {
+    if (*fields[i] != NULL)
+      out_links[count++] = fields[i];
+  }
+
+  return count;
+}
+
+/// Call the function for every node in the tree of the given node (parents first).
+static void visit_nodes(Optimizer* optimizer, IrNode* node, VisitFunction visit) {
+  visit(optimizer, node);
+
+  IrNode** child_links[CHILDREN_MAX];
+  int child_count = get_child_links(node, child_links);
+  for (int i = 0; i < child_count; i++)
+    visit_nodes(optimizer, *child_links[i], visit);
+  for (IrNode* statement = node->statements; statement != NULL; statement = statement->next)
+    visit_nodes(optimizer, statement, visit);
+}
+
+/// Call the function for each block directly nested in a statement (e.g. the body of
+/// a loop, or the statement itself if it is a block).
+static void for_each_nested_block(Optimizer* optimizer, IrNode* statement, BlockFunction function) {
+  if (statement->type == IR_BLOCK) {
+    function(optimizer, statement);
+    return;
+  }
+  if (statement->body != NULL)
+    function(optimizer, statement->body);
+  if (statement->else_body != NULL)
+    function(optimizer, statement->else_body);
+}
+
+/// Whether the statement assigns the value of its expression to a variable (e.g. `x +: 1`).
+static bool is_assignment_statement(IrNode* statement) {
+  return statement->type == IR_EXPRESSION_STATEMENT && statement->left->type == IR_SET_VARIABLE;
+}
+
+// ---------------------------------------------------
+// ANALYSIS
+// ---------------------------------------------------
+
+/// Whether the expression results in a number whenever it is evaluated without a
+/// runtime error (e.g. a subtraction either results in a number or fails), given
+/// whether its operands do and which variables only ever hold numbers.
+static bool is_number_result(IrNode* node, bool are_operands_numbers) {
+  switch (node->type) {
+    case IR_CONSTANT:
+      return IS_NUMBER(node->value);
+    case IR_GET_VARIABLE:
+      return node->variable->is_number;
+    case IR_UNARY:
+      return node->opcode == OP_NEGATE;
+    case IR_BINARY:
+      switch (node->opcode) {
+        case OP_ADD:
+          return are_operands_numbers;
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_MODULO:
+          return true;
+        default:
+          return false;
+      }
+    case IR_SET_VARIABLE:
+    case IR_AND:
+    case IR_OR:
+      // (The result is the value assigned, or one of the operands.)
+      return are_operands_numbers;
+    default:
+      return false;
+  }
+}
+
+static bool is_number_expression(IrNode* node) {
+  bool are_operands_numbers = (node->left == NULL || is_number_expression(node->left))
+    && (node->right == NULL || is_number_expression(node->right));
+
+  return is_number_result(node, are_operands_numbers);
+}
+
+static void assume_number_variable(Optimizer* _, IrNode* node) {
+  if (node->type == IR_VAR || node->type == IR_FOREACH)
+    node->variable->is_number = true;
+}
+
+static void check_number_assignment(Optimizer* optimizer, IrNode* node) {
+  // (The value assigned to a loop variable by the `foreach` loop itself is the start
+  // of the range, or a number since the loop stops with an error otherwise.)
+  bool is_assignment = node->type == IR_SET_VARIABLE || node->type == IR_VAR || node->type == IR_FOREACH;
+  if (is_assignment && node->variable->is_number && !is_number_expression(node->left)) {
+    node->variable->is_number = false;
+    optimizer->has_changed = true;
+  }
+}
+
+/// Find the variables that only ever hold numbers, i.e. every value assigned to them
+/// is a number. All variables are first assumed to hold numbers, and the assumption
+/// is dropped for the variables assigned other values until no assumption changes.
+static void infer_number_variables(Optimizer* optimizer) {
+  visit_nodes(optimizer, optimizer->ir->program, assume_number_variable);
+  do {
+    optimizer->has_changed = false;
+    visit_nodes(optimizer, optimizer->ir->program, check_number_assignment);
+  } while (optimizer->has_changed);
+}
+
+static uint32_t combine_hash_codes(uint32_t a, uint32_t b) {
+  return (a ^ b) * 0x9e3779b1u + (a << 6) + (a >> 2);
+}
+
+static uint32_t hash_constant(ThuslyValue value) {
+  if (!IS_NUMBER(value))
+    // (Other constants collide, which only costs comparisons.)
+    return IS_BOOLEAN(value) ? 1 + TO_C_BOOL(value) : 3;
+
+  double number = TO_C_DOUBLE(value);
+  uint64_t bits;
+  memcpy(&bits, &number, sizeof(bits));
+
+  return (uint32_t)(bits ^ (bits >> 32));
+}
+
+/// Whether two constants are the same. Numbers are compared by their bits, since
+/// e.g. `0` and `-0` are equal but not interchangeable (`1 / -0` is `-inf`).
+static bool are_same_constant(ThuslyValue a, ThuslyValue b) {
+  if (IS_NUMBER(a) && IS_NUMBER(b)) {
+    double x = TO_C_DOUBLE(a);
+    double y = TO_C_DOUBLE(b);
+    return memcmp(&x, &y, sizeof(x)) == 0;
+  }
+
+  return values_are_equal(a, b);
+}
+
+/// Whether two pure expressions always have the same value (i.e. have the same tree).
+static bool are_same_expression(IrNode* a, IrNode* b) {
+  if (a->type != b->type)
+    return false;
+
+  switch (a->type) {
+    case IR_CONSTANT:
+      return are_same_constant(a->value, b->value);
+    case IR_GET_VARIABLE:
+      return a->variable == b->variable;
+    case IR_UNARY:
+      return a->opcode == b->opcode && are_same_expression(a->left, b->left);
+    case IR_BINARY:
+      return a->opcode == b->opcode && are_same_expression(a->left, b->left) && are_same_expression(a->right, b->right);
+    case IR_AND:
+    case IR_OR:
+      return are_same_expression(a->left, b->left) && are_same_expression(a->right, b->right);
+    default:
+      return false;
+  }
+}
+
+/// Analyze the expressions in the tree of the node (their purity, size and hash code).
+///
+/// An operation is pure if its operands are, and it cannot fail given the types of its
+/// operands: `not`, `=`, `!=`, `and` and `or` never fail, and the other operations
+/// do not fail on numbers.
+static void annotate(IrNode* node) {
+  IrNode** child_links[CHILDREN_MAX];
+  int child_count = get_child_links(node, child_links);
+  for (int i = 0; i < child_count; i++)
+    annotate(*child_links[i]);
+  for (IrNode* statement = node->statements; statement != NULL; statement = statement->next)
+    annotate(statement);
+
+  IrNode* left = node->left;
+  IrNode* right = node->right;
+  bool are_operands_numbers = (left == NULL || left->is_number) && (right == NULL || right->is_number);
+  node->is_number = is_number_result(node, are_operands_numbers);
+  switch (node->type) {
+    case IR_CONSTANT:
+      node->is_pure = true;
+      node->size = 1;
+      node->hash_code = hash_constant(node->value);
+      break;
+    case IR_GET_VARIABLE:
+      node->is_pure = true;
+      node->size = 1;
+      node->hash_code = (uint32_t)((uintptr_t)node->variable >> 4);
+      break;
+    case IR_SET_VARIABLE:
+      node->is_pure = false;
+      node->size = 1 + left->size;
+      node->hash_code = 0;
+      break;
+    case IR_UNARY:
+      node->is_pure = left->is_pure && (node->opcode == OP_NOT || left->is_number);
+      node->size = 1 + left->size;
+      node->hash_code = combine_hash_codes(node->opcode, left->hash_code);
+      break;
+    case IR_BINARY: {
+      bool is_equality = node->opcode == OP_EQUALS || node->opcode == OP_NOT_EQUALS;
+      bool are_numbers = left->is_number && right->is_number;
+      node->is_pure = left->is_pure && right->is_pure && (is_equality || are_numbers);
+      node->size = 1 + left->size + right->size;
+      node->hash_code = combine_hash_codes(combine_hash_codes(node->opcode, left->hash_code), right->hash_code);
+      break;
+    }
+    case IR_AND:
+    case IR_OR:
+      node->is_pure = left->is_pure && right->is_pure;
+      node->size = 1 + left->size + right->size;
+      node->hash_code = combine_hash_codes(combine_hash_codes(node->type, left->hash_code), right->hash_code);
+      break;
+    default:
+      break;
+  }
+}
+
+static bool reads_variable(IrNode* node) {
+  if (node->type == IR_GET_VARIABLE)
+    return true;
+
+  return (node->left != NULL && reads_variable(node->left)) || (node->right != NULL && reads_variable(node->right));
+}
+
+static void mark_replaced(Optimizer* _, IrNode* node) {
+  node->is_replaced = true;
+}
+
+static void mark_assigned_variable(Optimizer* optimizer, IrNode* node) {
+  if (node->type == IR_SET_VARIABLE)
+    node->variable->mark = optimizer->stamp;
+}
+
+static void mark_assigned_or_declared_variable(Optimizer* optimizer, IrNode* node) {
+  if (node->type == IR_SET_VARIABLE || node->type == IR_VAR || node->type == IR_FOREACH)
+    node->variable->mark = optimizer->stamp;
+}
+
+/// Create a node reading the variable.
+static IrNode* new_variable_reference(Optimizer* optimizer, IrVariable* variable, int line) {
+  IrNode* node = ir_new_node(optimizer->ir, IR_GET_VARIABLE, line);
+  node->variable = variable;
+  node->is_pure = true;
+  node->is_number = variable->is_number;
+  node->size = 1;
+  node->hash_code = (uint32_t)((uintptr_t)variable >> 4);
+
+  return node;
+}
+
+/// Declare a new variable initialized by the expression, inserting the declaration
+/// into the block at the given link (before the statement it refers to).
+static IrNode* declare_variable(Optimizer* optimizer, IrNode* block, IrNode** link, IrNode* expression) {
+  IrVariable* variable = ir_new_variable(optimizer->ir);
+  variable->is_number = expression->is_number;
+  variable->declaring_block = block;
+
+  IrNode* declaration = ir_new_node(optimizer->ir, IR_VAR, expression->line);
+  declaration->variable = variable;
+  declaration->left = expression;
+  declaration->next = *link;
+  *link = declaration;
+
+  return declaration;
+}
+
+// ---------------------------------------------------
+// DEAD STORE ELIMINATION
+// ---------------------------------------------------
+
+static LaterUse get_later_use(Optimizer* optimizer, IrVariable* variable) {
+  return variable->mark == optimizer->stamp ? (LaterUse)variable->later_use : LATER_NOT_USED;
+}
+
+static void set_later_use(Optimizer* optimizer, IrVariable* variable, LaterUse later_use) {
+  variable->mark = optimizer->stamp;
+  variable->later_use = later_use;
+}
+
+static void mark_read_later(Optimizer* optimizer, IrNode* node) {
+  if (node->type == IR_GET_VARIABLE)
+    set_later_use(optimizer, node->variable, LATER_READ);
+}
+
+/// Remove the assignments (`x: <value>` statements) whose value is never read: the
+/// variable is assigned again by a later statement in the same block before it is
+/// read, or its scope ends (it is declared in the block) before it is read. Going from
+/// the last statement to the first, how each variable is used later is tracked.
+///
+/// Only unconditional statements of the block count as assigning again, and any read
+/// within a later statement (e.g. in a nested loop) counts as a read. A value that is
+/// not pure is still evaluated.
+static void remove_dead_stores(Optimizer* optimizer, IrNode* block) {
+  int count = 0;
+  for (IrNode* statement = block->statements; statement != NULL; statement = statement->next) {
+    for_each_nested_block(optimizer, statement, remove_dead_stores);
+    count++;
+  }
+  if (count == 0)
+    return;
+
+  IrNode** statements = ALLOCATE(IrNode*, count);
+  int index = 0;
+  for (IrNode* statement = block->statements; statement != NULL; statement = statement->next)
+    statements[index++] = statement;
+
+  optimizer->stamp++;
+  for (int i = count - 1; i >= 0; i--) {
+    IrNode* statement = statements[i];
+    if (!is_assignment_statement(statement)) {
+      visit_nodes(optimizer, statement, mark_read_later);
+      continue;
+    }
+
+    IrNode* assignment = statement->left;
+    IrVariable* variable = assignment->variable;
+    LaterUse later_use = get_later_use(optimizer, variable);
+    bool is_dead = later_use == LATER_OVERWRITTEN || (later_use == LATER_NOT_USED && variable->declaring_block == block);
+    if (is_dead) {
+      optimizer->stats->removed_stores++;
+      if (assignment->left->is_pure) {
+        statements[i] = NULL;
+        continue;
+      }
+      statement->left = assignment->left;
+    }
+    else
+      set_later_use(optimizer, variable, LATER_OVERWRITTEN);
+    // (The value is evaluated before it is assigned.)
+    visit_nodes(optimizer, statement->left, mark_read_later);
+  }
+
+  IrNode** link = &block->statements;
+  for (int i = 0; i < count; i++) {
+    if (statements[i] != NULL) {
+      *link = statements[i];
+      link = &statements[i]->next;
+    }
+  }
+  *link = NULL;
+  FREE_ARRAY(IrNode*, statements, count);
+}
+
+// ---------------------------------------------------
+// UNUSED VARIABLE REMOVAL
+// ---------------------------------------------------
+
+static void reset_read_counts(Optimizer* _, IrNode* node) {
+  if (node->type == IR_VAR || node->type == IR_FOREACH) {
+    node->variable->read_count = 0;
+    node->variable->self_read_count = 0;
+  }
+}
+
+/// Count the reads of each variable in the tree of the node. The reads in a pure value
+/// assigned to the same variable by a statement (e.g. `x +: 1`) are also counted as
+/// "self reads", as they are only needed if the variable is read elsewhere.
+static void count_reads(IrNode* node, IrVariable* assigned_variable) {
+  if (node->type == IR_GET_VARIABLE) {
+    node->variable->read_count++;
+    if (node->variable == assigned_variable)
+      node->variable->self_read_count++;
+    return;
+  }
+  if (is_assignment_statement(node) && node->left->left->is_pure) {
+    count_reads(node->left->left, node->left->variable);
+    return;
+  }
+
+  IrNode** child_links[CHILDREN_MAX];
+  int child_count = get_child_links(node, child_links);
+  for (int i = 0; i < child_count; i++)
+    count_reads(*child_links[i], assigned_variable);
+  for (IrNode* statement = node->statements; statement != NULL; statement = statement->next)
+    count_reads(statement, NULL);
+}
+
+/// Whether a variable is never read (other than to assign it again). Loop variables
+/// are always kept, since they control the loop.
+static bool is_unused_variable(IrVariable* variable) {
+  return !variable->is_loop_variable && variable->read_count == variable->self_read_count;
+}
+
+/// Replace the assignments to unused variables in the expression at the link by the
+/// values assigned.
+static void remove_unused_assignments(IrNode** link) {
+  while ((*link)->type == IR_SET_VARIABLE && is_unused_variable((*link)->variable))
+    *link = (*link)->left;
+
+  IrNode* node = *link;
+  if (node->left != NULL)
+    remove_unused_assignments(&node->left);
+  if (node->right != NULL)
+    remove_unused_assignments(&node->right);
+}
+
+/// Remove the declarations of and the assignments to the unused variables in the block.
+/// The initializers and the values assigned that are not pure are still evaluated.
+static void remove_unused_variables_in_block(Optimizer* optimizer, IrNode* block) {
+  IrNode** link = &block->statements;
+  while (*link != NULL) {
+    IrNode* statement = *link;
+    bool is_declaration = statement->type == IR_VAR;
+    if ((is_declaration && is_unused_variable(statement->variable))
+        || (is_assignment_statement(statement) && is_unused_variable(statement->left->variable))) {
+      IrNode* value = is_declaration ? statement->left : statement->left->left;
+      if (is_declaration)
+        optimizer->stats->removed_variables++;
+      else
+        optimizer->stats->removed_stores++;
+
+      if (value->is_pure) {
+        *link = statement->next;
+        continue;
+      }
+      statement->type = IR_EXPRESSION_STATEMENT;
+      statement->variable = NULL;
+      statement->left = value;
+    }
+
+    IrNode** expression_links[3] = { &statement->left, &statement->right, &statement->step };
+    for (int i = 0; i < 3; i++) {
+      if (*expression_links[i] != NULL)
+        remove_unused_assignments(expression_links[i]);
+    }
+    for_each_nested_block(optimizer, statement, remove_unused_variables_in_block);
+    link = &statement->next;
+  }
+}
+
+/// Remove the variables that are never read, along with the assignments to them.
+static void remove_unused_variables(Optimizer* optimizer) {
+  IrNode* program = optimizer->ir->program;
+  for (int round = 0; round < UNUSED_VARIABLE_ROUNDS_MAX; round++) {
+    annotate(program);
+    visit_nodes(optimizer, program, reset_read_counts);
+    count_reads(program, NULL);
+
+    uint64_t removed_count = optimizer->stats->removed_variables;
+    remove_unused_variables_in_block(optimizer, program);
+    if (optimizer->stats->removed_variables == removed_count)
+      break;
+  }
+}
+
+// ---------------------------------------------------
+// LOOP-INVARIANT CODE MOTION
+// ---------------------------------------------------
+
+/// Hoist the loop-invariant expression at the link (if worth it): it is evaluated once
+/// into a variable declared before the loop, and replaced by reading the variable.
+/// Equal expressions share the variable.
+static void hoist_expression(Optimizer* optimizer, HoistedLoop* hoisted_loop, IrNode** link) {
+  IrNode* expression = *link;
+  // (Operations on constants only are folded when the program is written.)
+  if (!is_operation(expression) || expression->size < HOISTED_EXPRESSION_MIN_SIZE || !reads_variable(expression))
+    return;
+
+  IrVariable* variable = NULL;
+  for (IrNode* declaration = *hoisted_loop->loop_link; declaration != hoisted_loop->loop; declaration = declaration->next) {
+    if (are_same_expression(declaration->left, expression)) {
+      variable = declaration->variable;
+      break;
+    }
+  }
+  if (variable == NULL) {
+    IrNode* declaration = declare_variable(optimizer, hoisted_loop->block, hoisted_loop->insertion_link, expression);
+    hoisted_loop->insertion_link = &declaration->next;
+    variable = declaration->variable;
+  }
+
+  *link = new_variable_reference(optimizer, variable, expression->line);
+  optimizer->stats->hoisted_expressions++;
+}
+
+/// Find the loop-invariant expressions in the tree of the node at the link: the pure
+/// expressions that only read variables neither assigned nor declared in the loop
+/// (which are marked). The largest ones are hoisted, except for the node itself, since
+/// the expression it is part of may be invariant as well. Returns whether it is invariant.
+static bool find_loop_invariants(Optimizer* optimizer, HoistedLoop* hoisted_loop, IrNode** link) {
+  IrNode* node = *link;
+  if (node->type == IR_CONSTANT)
+    return true;
+  if (node->type == IR_GET_VARIABLE)
+    return node->variable->mark != optimizer->stamp;
+
+  IrNode** child_links[CHILDREN_MAX];
+  bool is_child_invariant[CHILDREN_MAX];
+  int child_count = get_child_links(node, child_links);
+  bool are_children_invariant = true;
+  for (int i = 0; i < child_count; i++) {
+    is_child_invariant[i] = find_loop_invariants(optimizer, hoisted_loop, child_links[i]);
+    are_children_invariant = are_children_invariant && is_child_invariant[i];
+  }
+  for (IrNode** statement_link = &node->statements; *statement_link != NULL; statement_link = &(*statement_link)->next)
+    find_loop_invariants(optimizer, hoisted_loop, statement_link);
+
+  if (is_operation(node) && node->is_pure && are_children_invariant)
+    return true;
+
+  for (int i = 0; i < child_count; i++) {
+    if (is_child_invariant[i])
+      hoist_expression(optimizer, hoisted_loop, child_links[i]);
+  }
+
+  return false;
+}
+
+/// Hoist the invariant expressions of the loop at the link (in the block) out of it.
+/// The range of a `foreach` loop is only evaluated once anyway, so only its body is
+/// searched. (Evaluating a pure expression before the loop is safe even if the loop
+/// would not have evaluated it.)
+static void hoist_from_loop(Optimizer* optimizer, IrNode* block, IrNode** loop_link) {
+  IrNode* loop = *loop_link;
+  optimizer->stamp++;
+  visit_nodes(optimizer, loop, mark_assigned_or_declared_variable);
+
+  HoistedLoop hoisted_loop = { .loop = loop, .block = block, .loop_link = loop_link, .insertion_link = loop_link };
+  IrNode** searched_links[3] = { &loop->body, NULL, NULL };
+  if (loop->type == IR_WHILE) {
+    searched_links[1] = &loop->left;
+    searched_links[2] = loop->right != NULL ? &loop->right : NULL;
+  }
+  for (int i = 0; i < 3; i++) {
+    if (searched_links[i] != NULL && find_loop_invariants(optimizer, &hoisted_loop, searched_links[i]))
+      hoist_expression(optimizer, &hoisted_loop, searched_links[i]);
+  }
+}
+
+/// Hoist the invariant expressions of the loops in the block out of them (outer loops
+/// first, so that an expression invariant in nested loops is hoisted out of all of them).
+static void hoist_loop_invariants(Optimizer* optimizer, IrNode* block) {
+  IrNode** link = &block->statements;
+  while (*link != NULL) {
+    IrNode* statement = *link;
+    if (statement->type == IR_WHILE || statement->type == IR_FOREACH)
+      hoist_from_loop(optimizer, block, link);
+    for_each_nested_block(optimizer, statement, hoist_loop_invariants);
+    link = &statement->next;
+  }
+}
+
+// ---------------------------------------------------
+// COMMON SUBEXPRESSION ELIMINATION
+// ---------------------------------------------------
+
+static void bump_assigned_version(Optimizer* _, IrNode* node) {
+  if (node->type == IR_SET_VARIABLE)
+    node->variable->version++;
+}
+
+/// Collect the pure operations in the tree of the expression at the link that do not
+/// read a variable assigned within the statement (which are marked).
+static SubexpressionInfo collect_occurrences(Optimizer* optimizer, OccurrenceArray* array, IrNode** link, int statement_index) {
+  IrNode* node = *link;
+  if (node->type == IR_CONSTANT)
+    return (SubexpressionInfo){ .is_eligible = true, .reads_variable = false, .version_sum = 0 };
+  if (node->type == IR_GET_VARIABLE) {
+    bool is_eligible = node->variable->mark != optimizer->stamp;
+    return (SubexpressionInfo){ .is_eligible = is_eligible, .reads_variable = true, .version_sum = node->variable->version };
+  }
+
+  SubexpressionInfo info = { .is_eligible = is_operation(node) && node->is_pure, .reads_variable = false, .version_sum = 0 };
+  IrNode** operand_links[2] = { &node->left, &node->right };
+  for (int i = 0; i < 2; i++) {
+    if (*operand_links[i] == NULL)
+      continue;
+    SubexpressionInfo operand = collect_occurrences(optimizer, array, operand_links[i], statement_index);
+    info.is_eligible = info.is_eligible && operand.is_eligible;
+    info.reads_variable = info.reads_variable || operand.reads_variable;
+    info.version_sum += operand.version_sum;
+  }
+
+  // (Operations on constants only are folded when the program is written.)
+  if (info.is_eligible && info.reads_variable) {
+    if (array->count + 1 > array->capacity) {
+      int old_capacity = array->capacity;
+      array->capacity = GROW_CAPACITY(old_capacity);
+      array->occurrences = GROW_ARRAY(Occurrence, array->occurrences, old_capacity, array->capacity);
+    }
+    array->occurrences[array->count] = (Occurrence){
+      .node = node, .link = link, .statement_index = statement_index, .version_sum = info.version_sum,
+      .sequence = array->count, .next_in_group = -1, .is_grouped = false,
+    };
+    array->count++;
+  }
+
+  return info;
+}
+
+static int compare_occurrences(const void* a, const void* b) {
+  const Occurrence* x = (const Occurrence*)a;
+  const Occurrence* y = (const Occurrence*)b;
+  if (x->node->hash_code != y->node->hash_code)
+    return x->node->hash_code < y->node->hash_code ? -1 : 1;
+  if (x->version_sum != y->version_sum)
+    return x->version_sum < y->version_sum ? -1 : 1;
+
+  return x->sequence - y->sequence;
+}
+
+static int compare_groups(const void* a, const void* b) {
+  const OccurrenceGroup* x = (const OccurrenceGroup*)a;
+  const OccurrenceGroup* y = (const OccurrenceGroup*)b;
+  // Larger expressions first (so that an expression is replaced as a whole rather
+  // than by its parts), then in the order found.
+  if (x->size != y->size)
+    return y->size - x->size;
+
+  return x->first_occurrence - y->first_occurrence;
+}
+
+/// Get the expressions of a statement that are evaluated once, before its nested blocks.
+static int get_evaluated_expression_links(IrNode* statement, IrNode** out_links[3]) {
+  switch (statement->type) {
+    case IR_EXPRESSION_STATEMENT:
+    case IR_OUT:
+    case IR_VAR:
+    case IR_IF:
+      out_links[0] = &statement->left;
+      return 1;
+    case IR_FOREACH:
+      out_links[0] = &statement->left;
+      out_links[1] = &statement->right;
+      out_links[2] = &statement->step;
+      return 3;
+    default:
+      // (The condition of a `while` loop is evaluated repeatedly, see `hoist_loop_invariants()`.)
+      return 0;
+  }
+}
+
+/// Replace the occurrences of the group still in the tree (if worth it) by a variable
+/// declared before the statement with the first occurrence, initialized by that occurrence.
+/// If the first occurrence is the initializer of a variable that is never assigned
+/// afterwards, that variable is read instead.
+static void replace_occurrence_group(Optimizer* optimizer, IrNode* block, IrNode*** statement_links, Occurrence* occurrences, OccurrenceGroup* group) {
+  int count = 0;
+  int first = -1;
+  for (int i = group->first_occurrence; i != -1; i = occurrences[i].next_in_group) {
+    if (!occurrences[i].node->is_replaced) {
+      count++;
+      first = first == -1 ? i : first;
+    }
+  }
+  // Each occurrence but the first is replaced by reading the variable (a single
+  // instruction rather than the operation and its operands).
+  if (count < 2 || group->size * (count - 1) <= count)
+    return;
+
+  IrNode* expression = occurrences[first].node;
+  IrNode* declaration = *statement_links[occurrences[first].statement_index];
+  bool is_initializer = declaration->type == IR_VAR && declaration->left == expression
+    && declaration->variable->version == declaration->variable->declared_version;
+  if (!is_initializer)
+    declaration = declare_variable(optimizer, block, statement_links[occurrences[first].statement_index], expression);
+  for (int i = first; i != -1; i = occurrences[i].next_in_group) {
+    Occurrence* occurrence = &occurrences[i];
+    if (occurrence->node->is_replaced || (i == first && is_initializer))
+      continue;
+
+    if (i != first)
+      visit_nodes(optimizer, occurrence->node, mark_replaced);
+    *occurrence->link = new_variable_reference(optimizer, declaration->variable, occurrence->node->line);
+  }
+  optimizer->stats->eliminated_subexpressions += count - 1;
+}
+
+/// Replace the repeated pure expressions in the statements of the block (and nested
+/// blocks) by a variable holding the value computed once. Expressions in different
+/// statements have the same value if the variables read are not assigned in between,
+/// which the versions of the variables tell (see `Occurrence`).
+static void eliminate_common_subexpressions(Optimizer* optimizer, IrNode* block) {
+  int statement_count = 0;
+  for (IrNode* statement = block->statements; statement != NULL; statement = statement->next)
+    statement_count++;
+  if (statement_count == 0)
+    return;
+
+  // The links to the statements stay valid when declarations are inserted before them,
+  // as they are the `next` field of the preceding statement (declarations inserted
+  // before the same statement end up in the reverse order, so an expression that is part
+  // of a larger one is declared before it).
+  IrNode*** statement_links = ALLOCATE(IrNode**, statement_count);
+  OccurrenceArray array = { .occurrences = NULL, .count = 0, .capacity = 0 };
+  int index = 0;
+  for (IrNode** link = &block->statements; *link != NULL; link = &(*link)->next, index++) {
+    IrNode* statement = *link;
+    statement_links[index] = link;
+
+    // Mark the variables assigned while evaluating the expressions (except the variable
+    // assigned by the statement itself, which is assigned last).
+    IrNode** expression_links[3];
+    int expression_count = get_evaluated_expression_links(statement, expression_links);
+    optimizer->stamp++;
+    for (int i = 0; i < expression_count; i++) {
+      IrNode* expression = *expression_links[i];
+      bool is_root_assignment = i == 0 && is_assignment_statement(statement);
+      visit_nodes(optimizer, is_root_assignment ? expression->left : expression, mark_assigned_variable);
+    }
+    if (statement->type == IR_FOREACH)
+      statement->variable->mark = optimizer->stamp;
+
+    for (int i = 0; i < expression_count; i++)
+      collect_occurrences(optimizer, &array, expression_links[i], index);
+    visit_nodes(optimizer, statement, bump_assigned_version);
+    if (statement->type == IR_VAR)
+      statement->variable->declared_version = statement->variable->version;
+  }
+
+  // Group the occurrences of the same expression with the same versions.
+  if (array.count > 1)
+    qsort(array.occurrences, array.count, sizeof(Occurrence), compare_occurrences);
+  OccurrenceGroup* groups = ALLOCATE(OccurrenceGroup, array.count + 1);
+  int group_count = 0;
+  for (int i = 0; i < array.count; i++) {
+    Occurrence* occurrence = &array.occurrences[i];
+    if (occurrence->is_grouped)
+      continue;
+
+    int last = i;
+    for (int j = i + 1; j < array.count; j++) {
+      Occurrence* other = &array.occurrences[j];
+      if (other->node->hash_code != occurrence->node->hash_code || other->version_sum != occurrence->version_sum)
+        break;
+      if (!other->is_grouped && are_same_expression(other->node, occurrence->node)) {
+        other->is_grouped = true;
+        array.occurrences[last].next_in_group = j;
+        last = j;
+      }
+    }
+    if (last != i)
+      groups[group_count++] = (OccurrenceGroup){ .first_occurrence = i, .size = occurrence->node->size };
+  }
+
+  if (group_count > 1)
+    qsort(groups, group_count, sizeof(OccurrenceGroup), compare_groups);
+  for (int i = 0; i < group_count; i++)
+    replace_occurrence_group(optimizer, block, statement_links, array.occurrences, &groups[i]);
+
+  FREE_ARRAY(OccurrenceGroup, groups, array.count + 1);
+  FREE_ARRAY(Occurrence, array.occurrences, array.capacity);
+  FREE_ARRAY(IrNode**, statement_links, statement_count);
+
+  for (IrNode* statement = block->statements; statement != NULL; statement = statement->next)
+    for_each_nested_block(optimizer, statement, eliminate_common_subexpressions);
+}
+
+/// Optimize the intermediate representation of a program.
+void ir_optimize(Ir* ir, VMStats* stats) {
+  Optimizer optimizer = { .ir = ir, .stats = stats, .stamp = 0, .has_changed = false };
+  infer_number_variables(&optimizer);
+
+  annotate(ir->program);
+  remove_dead_stores(&optimizer, ir->program);
+  remove_unused_variables(&optimizer);
+
+  annotate(ir->program);
+  hoist_loop_invariants(&optimizer, ir->program);
+
+  annotate(ir->program);
+  eliminate_common_subexpressions(&optimizer, ir->program);
+}
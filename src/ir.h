@@ -0,0 +1,111 @@
+#ifndef CTHUSLY_IR_H
+#define CTHUSLY_IR_H
+
+#include "arena.h"
+#include "common.h"
+#include "thusly_value.h"
+#include "vm.h"
+
+/// The kinds of nodes in the intermediate representation.
+typedef enum {
+  // Expressions
+  IR_CONSTANT,
+  IR_GET_VARIABLE,
+  IR_SET_VARIABLE,
+  IR_UNARY,
+  IR_BINARY,
+  IR_AND,
+  IR_OR,
+  // Statements
+  IR_BLOCK,
+  IR_EXPRESSION_STATEMENT,
+  IR_FOREACH,
+  IR_IF,
+  IR_OUT,
+  IR_VAR,
+  IR_WHILE,
+} IrNodeType;
+
+/// A variable of the program. Variables are identified by their declaration
+/// rather than by their name or stack slot, so that declarations can be added
+/// and removed (the stack slots are assigned when the program is written).
+typedef struct {
+  /// Whether the variable is the loop variable of a `foreach` loop.
+  bool is_loop_variable;
+  /// Whether the variable only ever holds numbers (see `ir_optimize()`).
+  bool is_number;
+  /// The stack slot (assigned when the program is written).
+  int slot;
+  /// The block whose statements declare the variable (NULL for loop variables).
+  struct IrNode* declaring_block;
+  // The state of the optimization passes (see ir.c):
+  int read_count;
+  int self_read_count;
+  /// Increased whenever the variable is assigned (see `eliminate_common_subexpressions()`).
+  int version;
+  /// The version of the variable after its declaration (see `eliminate_common_subexpressions()`).
+  int declared_version;
+  /// The variable is marked by a pass if `mark` is the current stamp of the pass.
+  int mark;
+  int later_use;
+} IrVariable;
+
+/// A node of the intermediate representation: the syntax tree of the program.
+/// The fields used depend on the type of the node:
+/// - IR_CONSTANT: `value`.
+/// - IR_GET_VARIABLE: `variable`.
+/// - IR_SET_VARIABLE, IR_VAR: `variable` and the value in `left`.
+/// - IR_UNARY, IR_BINARY: `opcode` (of the instruction) and the operands in `left` and `right`.
+/// - IR_AND, IR_OR: the operands in `left` and `right`.
+/// - IR_EXPRESSION_STATEMENT, IR_OUT: the expression in `left`.
+/// - IR_BLOCK: the first statement in `statements` (the rest linked by `next`).
+/// - IR_IF: the condition in `left`, the blocks in `body` and `else_body` (or NULL).
+/// - IR_WHILE: the condition in `left`, the modification expression in `right`
+///   (or NULL), and the body in `body`.
+/// - IR_FOREACH: `variable`, the start, end and step of the range in `left`, `right`
+///   and `step`, and the body in `body`.
+typedef struct IrNode {
+  IrNodeType type;
+  /// The line in the source code of the instruction performing the operation
+  /// (which runtime errors are reported on). The comparison before the first
+  /// iteration of a `foreach` loop is on `range_line`.
+  int line;
+  int range_line;
+  byte opcode;
+  ThuslyValue value;
+  IrVariable* variable;
+  struct IrNode* left;
+  struct IrNode* right;
+  struct IrNode* step;
+  struct IrNode* body;
+  struct IrNode* else_body;
+  struct IrNode* statements;
+  struct IrNode* next;
+  // The analysis of an expression by the optimization passes (see `annotate()` in ir.c):
+  /// Whether evaluating the expression has no effect other than its value (it
+  /// neither assigns a variable nor can cause a runtime error).
+  bool is_pure;
+  /// Whether the expression results in a number (unless it fails).
+  bool is_number;
+  /// The number of nodes of the expression.
+  int size;
+  uint32_t hash_code;
+  /// Whether the expression has been replaced (and is no longer in the tree).
+  bool is_replaced;
+} IrNode;
+
+/// The intermediate representation of a program. All nodes and variables are
+/// allocated in the arena and freed at once.
+typedef struct {
+  Arena arena;
+  /// The block of the top-level statements.
+  IrNode* program;
+} Ir;
+
+void ir_init(Ir* ir);
+void ir_free(Ir* ir);
+IrNode* ir_new_node(Ir* ir, IrNodeType type, int line);
+IrVariable* ir_new_variable(Ir* ir);
+void ir_optimize(Ir* ir, VMStats* stats);
+
+#endif
@@ -0,0 +1,872 @@
+#include "common.h"
+
+#ifdef JIT_SUPPORTED
+
+#include <math.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "jit.h"
+#include "memory.h"
+#include "thusly_value.h"
+
+/// The baseline JIT compiler - Translates the bytecode of a program into x86-64
+/// machine code using one template per instruction (a "template JIT"). The code
+/// uses the same stack slot model as the interpreter (`vm->stack`), so execution
+/// can be handed over to the interpreter at any instruction boundary. Numeric
+/// operations are inlined behind type guards, and when a guard fails, the JIT-
+/// compiled code exits and the interpreter resumes at that instruction (which
+/// then either performs the generic operation or reports the runtime error).
+///
+/// Registers used by the generated code (all callee-saved in the System V ABI):
+///   rbx  The `VM*` passed as the first argument.
+///   r12  The next slot for the top of the stack (`vm->next_stack_top`).
+///   r13  The bottom of the stack (`vm->stack`).
+///   r14  The constant pool values (`program->constant_pool.values`).
+///
+/// `vm->next_stack_top` is only written back before calling into C helpers and
+/// when exiting the JIT-compiled code.
+
+// The templates rely on the tagged (non-NaN-boxed) layout of a ThuslyValue.
+_Static_assert(sizeof(DataType) == 4, "The JIT expects a 4-byte ThuslyValue type tag.");
+
+#define VALUE_SIZE          ((int)sizeof(ThuslyValue))
+#define TYPE_OFFSET         ((int)offsetof(ThuslyValue, type))
+#define PAYLOAD_OFFSET      ((int)offsetof(ThuslyValue, to))
+#define VM_STACK_OFFSET     ((int)offsetof(VM, stack))
+#define VM_STACK_TOP_OFFSET ((int)offsetof(VM, next_stack_top))
+#define VM_NEXT_INSTRUCTION_OFFSET ((int)offsetof(VM, next_instruction))
+
+// Offsets (relative to r12) of the values at the top of the stack.
+#define TOP(distance)         (-VALUE_SIZE * ((distance) + 1))
+#define TOP_TYPE(distance)    (TOP(distance) + TYPE_OFFSET)
+#define TOP_PAYLOAD(distance) (TOP(distance) + PAYLOAD_OFFSET)
+
+/// x86-64 general-purpose register numbers (as encoded in instructions).
+typedef enum {
+  RAX = 0,
+  RCX = 1,
+  RDX = 2,
+  RBX = 3,
+  RSP = 4,
+  RBP = 5,
+  RSI = 6,
+  RDI = 7,
+  R12 = 12,
+  R13 = 13,
+  R14 = 14,
+  R15 = 15,
+} Register;
+
+/// x86-64 SSE register numbers.
+typedef enum {
+  XMM0 = 0,
+  XMM1 = 1,
+} XmmRegister;
+
+/// Condition codes used in `jcc` and `setcc` (added to the base opcodes).
+typedef enum {
+  CONDITION_PARITY = 0xa,
+  CONDITION_NOT_PARITY = 0xb,
+  CONDITION_EQUAL = 0x4,
+  CONDITION_NOT_EQUAL = 0x5,
+  CONDITION_ABOVE_EQUAL = 0x3,
+  CONDITION_ABOVE = 0x7,
+} Condition;
+
+/// A rel32 operand to fill in once the native offset of its target is known.
+typedef struct {
+  /// The position of the rel32 operand in the code buffer.
+  int position;
+  /// The bytecode offset of the target instruction.
+  int target_offset;
+  /// Whether the target is the fallback stub of the instruction (rather than the
+  /// native code of the instruction itself).
+  bool targets_fallback;
+} Fixup;
+
+typedef struct {
+  Program* program;
+  byte* code;
+  int count;
+  int capacity;
+  /// The native code offset of each bytecode instruction (indexed by bytecode offset).
+  int* native_offsets;
+  /// The native code offset of the fallback stub of each bytecode instruction
+  /// that has a type guard (or -1 if it has none).
+  int* fallback_offsets;
+  Fixup* fixups;
+  int fixup_count;
+  int fixup_capacity;
+  /// The native code offset of the shared epilogue.
+  int epilogue_offset;
+  /// The positions of the rel32 operands jumping to the epilogue.
+  Fixup* epilogue_fixups;
+  int epilogue_fixup_count;
+  int epilogue_fixup_capacity;
+} Assembler;
+
+// ---------------------------------------------------
+// RUNTIME HELPERS (called from the generated code)
+// ---------------------------------------------------
+
+static void helper_out(VM* vm) {
+  flatten_stack_top(vm, 1);
+  vm->next_stack_top--;
+  print_value(*vm->next_stack_top);
+  printf("\n");
+}
+
+static void helper_equals(VM* vm) {
+  flatten_stack_top(vm, 2);
+  ThuslyValue b = *--vm->next_stack_top;
+  ThuslyValue a = *--vm->next_stack_top;
+  *vm->next_stack_top++ = FROM_C_BOOL(values_are_equal(a, b));
+}
+
+static void helper_not_equals(VM* vm) {
+  flatten_stack_top(vm, 2);
+  ThuslyValue b = *--vm->next_stack_top;
+  ThuslyValue a = *--vm->next_stack_top;
+  *vm->next_stack_top++ = FROM_C_BOOL(!values_are_equal(a, b));
+}
+
+/// Returns `false` (leaving the stack untouched) if the operands are not numbers.
+static bool helper_modulo(VM* vm) {
+  ThuslyValue b = vm->next_stack_top[-1];
+  ThuslyValue a = vm->next_stack_top[-2];
+  if (!IS_NUMBER(a) || !IS_NUMBER(b))
+    return false;
+
+  vm->next_stack_top--;
+  vm->next_stack_top[-1] = FROM_C_DOUBLE(fmod(TO_C_DOUBLE(a), TO_C_DOUBLE(b)));
+
+  return true;
+}
+
+// ---------------------------------------------------
+// ENCODING
+// ---------------------------------------------------
+
+static void emit_byte(Assembler* assembler, byte value) {
+  bool max_capacity_reached = assembler->count + 1 > assembler->capacity;
+  if (max_capacity_reached) {
+    int old_capacity = assembler->capacity;
+    assembler->capacity = GROW_CAPACITY(old_capacity);
+    assembler->code = GROW_ARRAY(byte, assembler->code, old_capacity, assembler->capacity);
+  }
+
+  assembler->code[assembler->count++] = value;
+}
+
+static void emit_bytes(Assembler* assembler, int count, const byte* bytes) {
+  for (int i = 0; i < count; i++)
+    emit_byte(assembler, bytes[i]);
+}
+
+static void emit_int32(Assembler* assembler, int32_t value) {
+  uint32_t bits = (uint32_t)value;
+  for (int i = 0; i < 4; i++)
+    emit_byte(assembler, (bits >> (8 * i)) & 0xff);
+}
+
+static void emit_int64(Assembler* assembler, uint64_t value) {
+  for (int i = 0; i < 8; i++)
+    emit_byte(assembler, (value >> (8 * i)) & 0xff);
+}
+
+static void patch_int32(Assembler* assembler, int position, int32_t value) {
+  uint32_t bits = (uint32_t)value;
+  for (int i = 0; i < 4; i++)
+    assembler->code[position + i] = (bits >> (8 * i)) & 0xff;
+}
+
+/// Emit a REX prefix if needed (or always if `is_64_bit`).
+static void emit_rex(Assembler* assembler, bool is_64_bit, int reg, int base) {
+  byte rex = 0x40 | (is_64_bit ? 0x08 : 0) | ((reg & 8) ? 0x04 : 0) | ((base & 8) ? 0x01 : 0);
+  if (rex != 0x40)
+    emit_byte(assembler, rex);
+}
+
+/// Emit the ModRM (and SIB) bytes addressing memory at `[base + displacement]`.
+static void emit_memory_operand(Assembler* assembler, int reg, int base, int32_t displacement) {
+  // Always use a 32-bit displacement (mod = 10) for simplicity.
+  emit_byte(assembler, 0x80 | ((reg & 7) << 3) | (base & 7));
+  // rsp and r12 as the base require a SIB byte.
+  if ((base & 7) == RSP)
+    emit_byte(assembler, 0x24);
+  emit_int32(assembler, displacement);
+}
+
+/// Emit an instruction with a memory operand: [prefix] [REX] opcode... ModRM [SIB] disp32.
+static void emit_memory_instruction(Assembler* assembler, int prefix, bool is_64_bit, int opcode_length,
+                                    const byte* opcode, int reg, int base, int32_t displacement) {
+  if (prefix != 0)
+    emit_byte(assembler, prefix);
+  emit_rex(assembler, is_64_bit, reg, base);
+  emit_bytes(assembler, opcode_length, opcode);
+  emit_memory_operand(assembler, reg, base, displacement);
+}
+
+// movdqu xmm, [base + displacement]
+static void emit_load_xmm128(Assembler* assembler, XmmRegister xmm, Register base, int32_t displacement) {
+  emit_memory_instruction(assembler, 0xf3, false, 2, (byte[]){ 0x0f, 0x6f }, xmm, base, displacement);
+}
+
+// movdqu [base + displacement], xmm
+static void emit_store_xmm128(Assembler* assembler, Register base, int32_t displacement, XmmRegister xmm) {
+  emit_memory_instruction(assembler, 0xf3, false, 2, (byte[]){ 0x0f, 0x7f }, xmm, base, displacement);
+}
+
+// movsd xmm, [base + displacement]
+static void emit_load_double(Assembler* assembler, XmmRegister xmm, Register base, int32_t displacement) {
+  emit_memory_instruction(assembler, 0xf2, false, 2, (byte[]){ 0x0f, 0x10 }, xmm, base, displacement);
+}
+
+// movsd [base + displacement], xmm
+static void emit_store_double(Assembler* assembler, Register base, int32_t displacement, XmmRegister xmm) {
+  emit_memory_instruction(assembler, 0xf2, false, 2, (byte[]){ 0x0f, 0x11 }, xmm, base, displacement);
+}
+
+// <addsd|subsd|mulsd|divsd> xmm_destination, xmm_source
+static void emit_double_arithmetic(Assembler* assembler, byte sse_opcode, XmmRegister destination, XmmRegister source) {
+  emit_bytes(assembler, 4, (byte[]){ 0xf2, 0x0f, sse_opcode, 0xc0 | (destination << 3) | source });
+}
+
+// ucomisd xmm_a, xmm_b
+static void emit_compare_doubles(Assembler* assembler, XmmRegister a, XmmRegister b) {
+  emit_bytes(assembler, 4, (byte[]){ 0x66, 0x0f, 0x2e, 0xc0 | (a << 3) | b });
+}
+
+// <add|sub> register, imm32
+static void emit_add_immediate(Assembler* assembler, Register reg, int32_t value) {
+  bool is_subtraction = value < 0;
+  emit_rex(assembler, true, 0, reg);
+  emit_byte(assembler, 0x81);
+  emit_byte(assembler, 0xc0 | ((is_subtraction ? 5 : 0) << 3) | (reg & 7));
+  emit_int32(assembler, is_subtraction ? -value : value);
+}
+
+// cmp dword [base + displacement], imm32
+static void emit_compare_int32_memory(Assembler* assembler, Register base, int32_t displacement, int32_t value) {
+  emit_memory_instruction(assembler, 0, false, 1, (byte[]){ 0x81 }, 7, base, displacement);
+  emit_int32(assembler, value);
+}
+
+// cmp byte [base + displacement], imm8
+static void emit_compare_byte_memory(Assembler* assembler, Register base, int32_t displacement, byte value) {
+  emit_memory_instruction(assembler, 0, false, 1, (byte[]){ 0x80 }, 7, base, displacement);
+  emit_byte(assembler, value);
+}
+
+// mov dword [base + displacement], imm32
+static void emit_store_int32(Assembler* assembler, Register base, int32_t displacement, int32_t value) {
+  emit_memory_instruction(assembler, 0, false, 1, (byte[]){ 0xc7 }, 0, base, displacement);
+  emit_int32(assembler, value);
+}
+
+// mov qword [base + displacement], imm32 (sign-extended)
+static void emit_store_int64(Assembler* assembler, Register base, int32_t displacement, int32_t value) {
+  emit_memory_instruction(assembler, 0, true, 1, (byte[]){ 0xc7 }, 0, base, displacement);
+  emit_int32(assembler, value);
+}
+
+// mov register, qword [base + displacement]
+static void emit_load_register(Assembler* assembler, Register destination, Register base, int32_t displacement) {
+  emit_memory_instruction(assembler, 0, true, 1, (byte[]){ 0x8b }, destination, base, displacement);
+}
+
+// mov qword [base + displacement], register
+static void emit_store_register(Assembler* assembler, Register base, int32_t displacement, Register source) {
+  emit_memory_instruction(assembler, 0, true, 1, (byte[]){ 0x89 }, source, base, displacement);
+}
+
+// mov eax, dword [base + displacement]
+static void emit_load_eax_int32(Assembler* assembler, Register base, int32_t displacement) {
+  emit_memory_instruction(assembler, 0, false, 1, (byte[]){ 0x8b }, RAX, base, displacement);
+}
+
+// mov register, imm64
+static void emit_move_immediate64(Assembler* assembler, Register reg, uint64_t value) {
+  emit_rex(assembler, true, 0, reg);
+  emit_byte(assembler, 0xb8 + (reg & 7));
+  emit_int64(assembler, value);
+}
+
+// mov destination, source (64-bit)
+static void emit_move_register(Assembler* assembler, Register destination, Register source) {
+  emit_rex(assembler, true, source, destination);
+  emit_byte(assembler, 0x89);
+  emit_byte(assembler, 0xc0 | ((source & 7) << 3) | (destination & 7));
+}
+
+// cmp eax, imm32
+static void emit_compare_eax(Assembler* assembler, int32_t value) {
+  emit_byte(assembler, 0x3d);
+  emit_int32(assembler, value);
+}
+
+// set<condition> <al|cl>
+static void emit_set_condition(Assembler* assembler, Condition condition, Register reg) {
+  emit_bytes(assembler, 3, (byte[]){ 0x0f, 0x90 + condition, 0xc0 | reg });
+}
+
+static void emit_push(Assembler* assembler, Register reg) {
+  emit_rex(assembler, false, 0, reg);
+  emit_byte(assembler, 0x50 + (reg & 7));
+}
+
+static void emit_pop(Assembler* assembler, Register reg) {
+  emit_rex(assembler, false, 0, reg);
+  emit_byte(assembler, 0x58 + (reg & 7));
+}
+
+/// Emit a call to a C function (the stack top is synced with the VM around it).
+static void emit_call_helper(Assembler* assembler, void* function) {
+  emit_store_register(assembler, RBX, VM_STACK_TOP_OFFSET, R12);
+  emit_move_register(assembler, RDI, RBX);
+  emit_move_immediate64(assembler, RAX, (uint64_t)(uintptr_t)function);
+  // call rax
+  emit_bytes(assembler, 2, (byte[]){ 0xff, 0xd0 });
+  emit_load_register(assembler, R12, RBX, VM_STACK_TOP_OFFSET);
+}
+
+// ---------------------------------------------------
+// JUMPS AND LABELS
+// ---------------------------------------------------
+
+static void add_fixup(Assembler* assembler, int target_offset, bool targets_fallback) {
+  bool max_capacity_reached = assembler->fixup_count + 1 > assembler->fixup_capacity;
+  if (max_capacity_reached) {
+    int old_capacity = assembler->fixup_capacity;
+    assembler->fixup_capacity = GROW_CAPACITY(old_capacity);
+    assembler->fixups = GROW_ARRAY(Fixup, assembler->fixups, old_capacity, assembler->fixup_capacity);
+  }
+
+  assembler->fixups[assembler->fixup_count++] = (Fixup){ assembler->count, target_offset, targets_fallback };
+  emit_int32(assembler, 0);
+}
+
+static void add_epilogue_fixup(Assembler* assembler) {
+  bool max_capacity_reached = assembler->epilogue_fixup_count + 1 > assembler->epilogue_fixup_capacity;
+  if (max_capacity_reached) {
+    int old_capacity = assembler->epilogue_fixup_capacity;
+    assembler->epilogue_fixup_capacity = GROW_CAPACITY(old_capacity);
+    assembler->epilogue_fixups = GROW_ARRAY(Fixup, assembler->epilogue_fixups, old_capacity, assembler->epilogue_fixup_capacity);
+  }
+
+  assembler->epilogue_fixups[assembler->epilogue_fixup_count++] = (Fixup){ assembler->count, 0, false };
+  emit_int32(assembler, 0);
+}
+
+/// Emit a jump to the native code of the instruction at the given bytecode offset.
+static void emit_jump_to_instruction(Assembler* assembler, int target_offset) {
+  emit_byte(assembler, 0xe9);
+  add_fixup(assembler, target_offset, false);
+}
+
+/// Emit a conditional jump to the native code of the instruction at the given bytecode offset.
+static void emit_conditional_jump_to_instruction(Assembler* assembler, Condition condition, int target_offset) {
+  emit_bytes(assembler, 2, (byte[]){ 0x0f, 0x80 + condition });
+  add_fixup(assembler, target_offset, false);
+}
+
+/// Emit a conditional jump to the fallback stub of the instruction at the given bytecode offset.
+static void emit_conditional_fallback(Assembler* assembler, Condition condition, int offset) {
+  emit_bytes(assembler, 2, (byte[]){ 0x0f, 0x80 + condition });
+  add_fixup(assembler, offset, true);
+  assembler->fallback_offsets[offset] = 0;
+}
+
+/// Emit a conditional jump to a position later in the same template (returns the
+/// position of its 8-bit operand to patch with `patch_local_jump()`).
+static int emit_local_conditional_jump(Assembler* assembler, Condition condition) {
+  emit_bytes(assembler, 2, (byte[]){ 0x70 + condition, 0 });
+
+  return assembler->count - 1;
+}
+
+static int emit_local_jump(Assembler* assembler) {
+  emit_bytes(assembler, 2, (byte[]){ 0xeb, 0 });
+
+  return assembler->count - 1;
+}
+
+static void patch_local_jump(Assembler* assembler, int position) {
+  assembler->code[position] = (byte)(assembler->count - position - 1);
+}
+
+// ---------------------------------------------------
+// TEMPLATES
+// ---------------------------------------------------
+
+/// Guard that the value at the given distance from the top of the stack is a number.
+static void emit_number_guard(Assembler* assembler, int distance, int offset) {
+  emit_compare_int32_memory(assembler, R12, TOP_TYPE(distance), TYPE_NUMBER);
+  emit_conditional_fallback(assembler, CONDITION_NOT_EQUAL, offset);
+}
+
+static void emit_push_value(Assembler* assembler, Register base, int32_t displacement) {
+  emit_load_xmm128(assembler, XMM0, base, displacement);
+  emit_store_xmm128(assembler, R12, 0, XMM0);
+  emit_add_immediate(assembler, R12, VALUE_SIZE);
+}
+
+static void emit_push_literal(Assembler* assembler, DataType type, int32_t payload) {
+  emit_store_int32(assembler, R12, TYPE_OFFSET, type);
+  emit_store_int64(assembler, R12, PAYLOAD_OFFSET, payload);
+  emit_add_immediate(assembler, R12, VALUE_SIZE);
+}
+
+/// Replace the two numbers at the top of the stack with the result of `sse_opcode`.
+static void emit_numeric_arithmetic(Assembler* assembler, byte sse_opcode, int offset) {
+  emit_number_guard(assembler, 0, offset);
+  emit_number_guard(assembler, 1, offset);
+  emit_load_double(assembler, XMM0, R12, TOP_PAYLOAD(1));
+  emit_load_double(assembler, XMM1, R12, TOP_PAYLOAD(0));
+  emit_double_arithmetic(assembler, sse_opcode, XMM0, XMM1);
+  emit_store_double(assembler, R12, TOP_PAYLOAD(1), XMM0);
+  emit_add_immediate(assembler, R12, -VALUE_SIZE);
+}
+
+/// Replace the value at the top of the stack (at the given distance after popping)
+/// with a boolean holding the value of `al`.
+static void emit_store_al_as_boolean(Assembler* assembler, int distance) {
+  // movzx eax, al
+  emit_bytes(assembler, 3, (byte[]){ 0x0f, 0xb6, 0xc0 });
+  emit_store_int32(assembler, R12, TOP_TYPE(distance), TYPE_BOOLEAN);
+  emit_store_register(assembler, R12, TOP_PAYLOAD(distance), RAX);
+}
+
+/// Compare the numbers in xmm0 (a) and xmm1 (b) and set `al` to the result.
+static void emit_set_comparison(Assembler* assembler, Opcode comparison) {
+  // Only "above" conditions are used (with swapped operands for "less than")
+  // since they are false for unordered operands (NaN), matching C semantics.
+  switch (comparison) {
+    case OP_GREATER_THAN:
+      emit_compare_doubles(assembler, XMM0, XMM1);
+      emit_set_condition(assembler, CONDITION_ABOVE, RAX);
+      break;
+    case OP_GREATER_THAN_EQUALS:
+      emit_compare_doubles(assembler, XMM0, XMM1);
+      emit_set_condition(assembler, CONDITION_ABOVE_EQUAL, RAX);
+      break;
+    case OP_LESS_THAN:
+      emit_compare_doubles(assembler, XMM1, XMM0);
+      emit_set_condition(assembler, CONDITION_ABOVE, RAX);
+      break;
+    case OP_LESS_THAN_EQUALS:
+      emit_compare_doubles(assembler, XMM1, XMM0);
+      emit_set_condition(assembler, CONDITION_ABOVE_EQUAL, RAX);
+      break;
+    case OP_EQUALS:
+      // Equal and ordered.
+      emit_compare_doubles(assembler, XMM0, XMM1);
+      emit_set_condition(assembler, CONDITION_EQUAL, RAX);
+      emit_set_condition(assembler, CONDITION_NOT_PARITY, RCX);
+      // and al, cl
+      emit_bytes(assembler, 2, (byte[]){ 0x20, 0xc8 });
+      break;
+    case OP_NOT_EQUALS:
+      // Not equal or unordered.
+      emit_compare_doubles(assembler, XMM0, XMM1);
+      emit_set_condition(assembler, CONDITION_NOT_EQUAL, RAX);
+      emit_set_condition(assembler, CONDITION_PARITY, RCX);
+      // or al, cl
+      emit_bytes(assembler, 2, (byte[]){ 0x08, 0xc8 });
+      break;
+    default:
+      break;
+  }
+}
+
+static void emit_numeric_comparison(Assembler* assembler, Opcode comparison, int offset) {
+  emit_number_guard(assembler, 0, offset);
+  emit_number_guard(assembler, 1, offset);
+  emit_load_double(assembler, XMM0, R12, TOP_PAYLOAD(1));
+  emit_load_double(assembler, XMM1, R12, TOP_PAYLOAD(0));
+  emit_set_comparison(assembler, comparison);
+  emit_add_immediate(assembler, R12, -VALUE_SIZE);
+  emit_store_al_as_boolean(assembler, 0);
+}
+
+/// Numbers are compared inline, while other types are compared by a C helper.
+static void emit_equality(Assembler* assembler, Opcode comparison) {
+  emit_compare_int32_memory(assembler, R12, TOP_TYPE(0), TYPE_NUMBER);
+  int jump_to_generic_1 = emit_local_conditional_jump(assembler, CONDITION_NOT_EQUAL);
+  emit_compare_int32_memory(assembler, R12, TOP_TYPE(1), TYPE_NUMBER);
+  int jump_to_generic_2 = emit_local_conditional_jump(assembler, CONDITION_NOT_EQUAL);
+  emit_load_double(assembler, XMM0, R12, TOP_PAYLOAD(1));
+  emit_load_double(assembler, XMM1, R12, TOP_PAYLOAD(0));
+  emit_set_comparison(assembler, comparison);
+  emit_add_immediate(assembler, R12, -VALUE_SIZE);
+  emit_store_al_as_boolean(assembler, 0);
+  int jump_to_end = emit_local_jump(assembler);
+
+  patch_local_jump(assembler, jump_to_generic_1);
+  patch_local_jump(assembler, jump_to_generic_2);
+  emit_call_helper(assembler, comparison == OP_EQUALS ? (void*)helper_equals : (void*)helper_not_equals);
+  patch_local_jump(assembler, jump_to_end);
+}
+
+/// Jump to the target if the value at the top of the stack is truthy (or falsy
+/// if `jump_if_truthy` is `false`). (All values are truthy except `none` and `false`.)
+static void emit_jump_on_truthiness(Assembler* assembler, bool jump_if_truthy, int target_offset) {
+  emit_load_eax_int32(assembler, R12, TOP_TYPE(0));
+  emit_compare_eax(assembler, TYPE_NONE);
+  int jump_if_none = emit_local_conditional_jump(assembler, CONDITION_EQUAL);
+  emit_compare_eax(assembler, TYPE_BOOLEAN);
+  if (jump_if_truthy) {
+    emit_conditional_jump_to_instruction(assembler, CONDITION_NOT_EQUAL, target_offset);
+    emit_compare_byte_memory(assembler, R12, TOP_PAYLOAD(0), 0);
+    emit_conditional_jump_to_instruction(assembler, CONDITION_NOT_EQUAL, target_offset);
+    patch_local_jump(assembler, jump_if_none);
+  }
+  else {
+    int jump_if_not_boolean = emit_local_conditional_jump(assembler, CONDITION_NOT_EQUAL);
+    emit_compare_byte_memory(assembler, R12, TOP_PAYLOAD(0), 0);
+    int jump_if_true = emit_local_conditional_jump(assembler, CONDITION_NOT_EQUAL);
+    patch_local_jump(assembler, jump_if_none);
+    emit_jump_to_instruction(assembler, target_offset);
+    patch_local_jump(assembler, jump_if_not_boolean);
+    patch_local_jump(assembler, jump_if_true);
+  }
+}
+
+/// Replace the value at the top of the stack with its logical negation.
+static void emit_not(Assembler* assembler) {
+  // al = 1 (falsy) if the value is `none` or `false`.
+  emit_load_eax_int32(assembler, R12, TOP_TYPE(0));
+  emit_compare_eax(assembler, TYPE_NONE);
+  int jump_if_none = emit_local_conditional_jump(assembler, CONDITION_EQUAL);
+  emit_compare_eax(assembler, TYPE_BOOLEAN);
+  int jump_if_not_boolean = emit_local_conditional_jump(assembler, CONDITION_NOT_EQUAL);
+  emit_compare_byte_memory(assembler, R12, TOP_PAYLOAD(0), 0);
+  emit_set_condition(assembler, CONDITION_EQUAL, RAX);
+  int jump_to_store = emit_local_jump(assembler);
+  patch_local_jump(assembler, jump_if_none);
+  // mov al, 1
+  emit_bytes(assembler, 2, (byte[]){ 0xb0, 0x01 });
+  int jump_to_store_2 = emit_local_jump(assembler);
+  patch_local_jump(assembler, jump_if_not_boolean);
+  // xor eax, eax
+  emit_bytes(assembler, 2, (byte[]){ 0x31, 0xc0 });
+  patch_local_jump(assembler, jump_to_store);
+  patch_local_jump(assembler, jump_to_store_2);
+  emit_store_al_as_boolean(assembler, 0);
+}
+
+/// Step the loop variable of a `foreach` loop (followed by the end and step of the
+/// range in the next stack slots) and jump back to the start of the loop body unless
+/// the end has been passed. Other types than numbers are left to the interpreter.
+static void emit_foreach_next(Assembler* assembler, int offset) {
+  Program* program = assembler->program;
+  int32_t variable = VALUE_SIZE * get_loop_variable_slot(program, offset);
+  int32_t end = variable + VALUE_SIZE;
+  int32_t step = variable + 2 * VALUE_SIZE;
+  emit_compare_int32_memory(assembler, R13, variable + TYPE_OFFSET, TYPE_NUMBER);
+  emit_conditional_fallback(assembler, CONDITION_NOT_EQUAL, offset);
+  emit_compare_int32_memory(assembler, R13, end + TYPE_OFFSET, TYPE_NUMBER);
+  emit_conditional_fallback(assembler, CONDITION_NOT_EQUAL, offset);
+  emit_compare_int32_memory(assembler, R13, step + TYPE_OFFSET, TYPE_NUMBER);
+  emit_conditional_fallback(assembler, CONDITION_NOT_EQUAL, offset);
+
+  emit_load_double(assembler, XMM0, R13, variable + PAYLOAD_OFFSET);
+  emit_load_double(assembler, XMM1, R13, step + PAYLOAD_OFFSET);
+  emit_double_arithmetic(assembler, 0x58, XMM0, XMM1);
+  emit_store_double(assembler, R13, variable + PAYLOAD_OFFSET, XMM0);
+  // Jump back if `end >= variable` (see `emit_set_comparison()` regarding NaN).
+  emit_load_double(assembler, XMM1, R13, end + PAYLOAD_OFFSET);
+  emit_compare_doubles(assembler, XMM1, XMM0);
+  emit_conditional_jump_to_instruction(assembler, CONDITION_ABOVE_EQUAL, get_jump_target(program, offset));
+}
+
+/// Emit the native code for the instruction at the given offset. Returns `false`
+/// if the instruction is not supported by the JIT.
+static bool emit_instruction(Assembler* assembler, int offset) {
+  Program* program = assembler->program;
+  byte* operands = &program->instructions[offset + 1];
+
+  switch (program->instructions[offset]) {
+    case OP_POP:
+      emit_add_immediate(assembler, R12, -VALUE_SIZE);
+      return true;
+    case OP_POPN:
+      // See `compiler.discard_scope()` for comments regarding `N + 1`.
+      emit_add_immediate(assembler, R12, -VALUE_SIZE * (operands[0] + 1));
+      return true;
+    case OP_GET_VAR:
+      emit_push_value(assembler, R13, VALUE_SIZE * operands[0]);
+      return true;
+    case OP_GET_VAR_LONG:
+      emit_push_value(assembler, R13, VALUE_SIZE * read_long_operand(operands));
+      return true;
+    case OP_SET_VAR:
+      emit_load_xmm128(assembler, XMM0, R12, TOP(0));
+      emit_store_xmm128(assembler, R13, VALUE_SIZE * operands[0], XMM0);
+      return true;
+    case OP_SET_VAR_LONG:
+      emit_load_xmm128(assembler, XMM0, R12, TOP(0));
+      emit_store_xmm128(assembler, R13, VALUE_SIZE * read_long_operand(operands), XMM0);
+      return true;
+    case OP_SET_VAR_POP:
+      emit_load_xmm128(assembler, XMM0, R12, TOP(0));
+      emit_store_xmm128(assembler, R13, VALUE_SIZE * operands[0], XMM0);
+      emit_add_immediate(assembler, R12, -VALUE_SIZE);
+      return true;
+    case OP_CONSTANT:
+      emit_push_value(assembler, R14, VALUE_SIZE * operands[0]);
+      return true;
+    case OP_CONSTANT_LONG:
+      emit_push_value(assembler, R14, VALUE_SIZE * read_long_operand(operands));
+      return true;
+    case OP_CONSTANT_FALSE:
+      emit_push_literal(assembler, TYPE_BOOLEAN, false);
+      return true;
+    case OP_CONSTANT_NONE:
+      emit_push_literal(assembler, TYPE_NONE, 0);
+      return true;
+    case OP_CONSTANT_TRUE:
+      emit_push_literal(assembler, TYPE_BOOLEAN, true);
+      return true;
+    case OP_EQUALS:
+    case OP_EQUALS_NUM:
+      emit_equality(assembler, OP_EQUALS);
+      return true;
+    case OP_NOT_EQUALS:
+    case OP_NOT_EQUALS_NUM:
+      emit_equality(assembler, OP_NOT_EQUALS);
+      return true;
+    case OP_GREATER_THAN:
+    case OP_GREATER_THAN_NUM:
+      emit_numeric_comparison(assembler, OP_GREATER_THAN, offset);
+      return true;
+    case OP_GREATER_THAN_EQUALS:
+    case OP_GREATER_THAN_EQUALS_NUM:
+      emit_numeric_comparison(assembler, OP_GREATER_THAN_EQUALS, offset);
+      return true;
+    case OP_LESS_THAN:
+    case OP_LESS_THAN_NUM:
+      emit_numeric_comparison(assembler, OP_LESS_THAN, offset);
+      return true;
+    case OP_LESS_THAN_EQUALS:
+    case OP_LESS_THAN_EQUALS_NUM:
+      emit_numeric_comparison(assembler, OP_LESS_THAN_EQUALS, offset);
+      return true;
+    // Concatenation is left to the interpreter (reached via the type guard).
+    case OP_ADD:
+    case OP_ADD_NUM:
+    case OP_CONCAT_TEXT:
+      emit_numeric_arithmetic(assembler, 0x58, offset);
+      return true;
+    case OP_SUBTRACT:
+    case OP_SUBTRACT_NUM:
+      emit_numeric_arithmetic(assembler, 0x5c, offset);
+      return true;
+    case OP_MULTIPLY:
+    case OP_MULTIPLY_NUM:
+      emit_numeric_arithmetic(assembler, 0x59, offset);
+      return true;
+    case OP_DIVIDE:
+    case OP_DIVIDE_NUM:
+      emit_numeric_arithmetic(assembler, 0x5e, offset);
+      return true;
+    case OP_MODULO:
+      emit_call_helper(assembler, (void*)helper_modulo);
+      // test al, al
+      emit_bytes(assembler, 2, (byte[]){ 0x84, 0xc0 });
+      emit_conditional_fallback(assembler, CONDITION_EQUAL, offset);
+      return true;
+    case OP_NEGATE:
+      emit_number_guard(assembler, 0, offset);
+      // btc qword [r12 + TOP_PAYLOAD(0)], 63  (flip the sign bit)
+      emit_memory_instruction(assembler, 0, true, 2, (byte[]){ 0x0f, 0xba }, 7, R12, TOP_PAYLOAD(0));
+      emit_byte(assembler, 63);
+      return true;
+    case OP_NOT:
+      emit_not(assembler);
+      return true;
+    case OP_OUT:
+      emit_call_helper(assembler, (void*)helper_out);
+      return true;
+    case OP_JUMP_FWD:
+    case OP_JUMP_FWD_LONG:
+    case OP_JUMP_BWD:
+    case OP_JUMP_BWD_LONG:
+      emit_jump_to_instruction(assembler, get_jump_target(program, offset));
+      return true;
+    case OP_JUMP_FWD_IF_FALSE:
+    case OP_JUMP_FWD_IF_FALSE_LONG:
+      emit_jump_on_truthiness(assembler, false, get_jump_target(program, offset));
+      return true;
+    case OP_JUMP_FWD_IF_TRUE:
+    case OP_JUMP_FWD_IF_TRUE_LONG:
+      emit_jump_on_truthiness(assembler, true, get_jump_target(program, offset));
+      return true;
+    case OP_ADD_VAR_CONSTANT:
+      // Fused: OP_GET_VAR <slot>, OP_CONSTANT <index>, OP_ADD
+      emit_push_value(assembler, R13, VALUE_SIZE * operands[0]);
+      emit_push_value(assembler, R14, VALUE_SIZE * operands[1]);
+      // (If the guard fails, the pushed operands are popped again by the stub.)
+      emit_number_guard(assembler, 0, offset);
+      emit_number_guard(assembler, 1, offset);
+      emit_load_double(assembler, XMM0, R12, TOP_PAYLOAD(1));
+      emit_load_double(assembler, XMM1, R12, TOP_PAYLOAD(0));
+      emit_double_arithmetic(assembler, 0x58, XMM0, XMM1);
+      emit_store_double(assembler, R12, TOP_PAYLOAD(1), XMM0);
+      emit_add_immediate(assembler, R12, -VALUE_SIZE);
+      return true;
+    case OP_LESS_THAN_EQUALS_VARS:
+      // Fused: OP_GET_VAR <slot a>, OP_GET_VAR <slot b>, OP_LESS_THAN_EQUALS
+      emit_push_value(assembler, R13, VALUE_SIZE * operands[0]);
+      emit_push_value(assembler, R13, VALUE_SIZE * operands[1]);
+      emit_numeric_comparison(assembler, OP_LESS_THAN_EQUALS, offset);
+      return true;
+    case OP_FOREACH_NEXT:
+    case OP_FOREACH_NEXT_LONG:
+      emit_foreach_next(assembler, offset);
+      return true;
+    case OP_RETURN:
+      // mov eax, JIT_EXIT_RETURN
+      emit_byte(assembler, 0xb8);
+      emit_int32(assembler, JIT_EXIT_RETURN);
+      emit_byte(assembler, 0xe9);
+      add_epilogue_fixup(assembler);
+      return true;
+    default:
+      return false;
+  }
+}
+
+/// Emit the stub that exits to the interpreter at the given instruction.
+static void emit_fallback_stub(Assembler* assembler, int offset) {
+  // The fused instructions push their operands before the guards, so those
+  // need to be popped again before the interpreter re-executes the instruction.
+  byte opcode = assembler->program->instructions[offset];
+  if (opcode == OP_ADD_VAR_CONSTANT || opcode == OP_LESS_THAN_EQUALS_VARS)
+    emit_add_immediate(assembler, R12, -2 * VALUE_SIZE);
+
+  emit_move_immediate64(assembler, RAX, (uint64_t)(uintptr_t)&assembler->program->instructions[offset]);
+  emit_store_register(assembler, RBX, VM_NEXT_INSTRUCTION_OFFSET, RAX);
+  // mov eax, JIT_EXIT_FALLBACK
+  emit_byte(assembler, 0xb8);
+  emit_int32(assembler, JIT_EXIT_FALLBACK);
+  emit_byte(assembler, 0xe9);
+  add_epilogue_fixup(assembler);
+}
+
+static void emit_prologue(Assembler* assembler) {
+  emit_push(assembler, RBX);
+  emit_push(assembler, R12);
+  emit_push(assembler, R13);
+  emit_push(assembler, R14);
+  // (r15 is pushed to keep the stack 16-byte aligned for calls to C helpers.)
+  emit_push(assembler, R15);
+  emit_move_register(assembler, RBX, RDI);
+  emit_load_register(assembler, R12, RBX, VM_STACK_TOP_OFFSET);
+  emit_load_register(assembler, R13, RBX, VM_STACK_OFFSET);
+  emit_move_immediate64(assembler, R14, (uint64_t)(uintptr_t)assembler->program->constant_pool.values);
+}
+
+static void emit_epilogue(Assembler* assembler) {
+  assembler->epilogue_offset = assembler->count;
+  emit_store_register(assembler, RBX, VM_STACK_TOP_OFFSET, R12);
+  emit_pop(assembler, R15);
+  emit_pop(assembler, R14);
+  emit_pop(assembler, R13);
+  emit_pop(assembler, R12);
+  emit_pop(assembler, RBX);
+  // ret
+  emit_byte(assembler, 0xc3);
+}
+
+static void resolve_fixups(Assembler* assembler) {
+  for (int i = 0; i < assembler->fixup_count; i++) {
+    Fixup* fixup = &assembler->fixups[i];
+    int target = fixup->targets_fallback
+      ? assembler->fallback_offsets[fixup->target_offset]
+      : assembler->native_offsets[fixup->target_offset];
+    patch_int32(assembler, fixup->position, target - (fixup->position + 4));
+  }
+  for (int i = 0; i < assembler->epilogue_fixup_count; i++) {
+    Fixup* fixup = &assembler->epilogue_fixups[i];
+    patch_int32(assembler, fixup->position, assembler->epilogue_offset - (fixup->position + 4));
+  }
+}
+
+static void assembler_free(Assembler* assembler) {
+  FREE_ARRAY(byte, assembler->code, assembler->capacity);
+  FREE_ARRAY(int, assembler->native_offsets, assembler->program->count + 1);
+  FREE_ARRAY(int, assembler->fallback_offsets, assembler->program->count + 1);
+  FREE_ARRAY(Fixup, assembler->fixups, assembler->fixup_capacity);
+  FREE_ARRAY(Fixup, assembler->epilogue_fixups, assembler->epilogue_fixup_capacity);
+}
+
+/// Compile the program into native code. Returns `false` if the program uses
+/// instructions not supported by the JIT (it should then be interpreted).
+bool jit_compile(Program* program, JitCode* out_code) {
+  Assembler assembler = { .program = program };
+  assembler.native_offsets = ALLOCATE(int, program->count + 1);
+  assembler.fallback_offsets = ALLOCATE(int, program->count + 1);
+  for (int i = 0; i <= program->count; i++)
+    assembler.fallback_offsets[i] = -1;
+
+  emit_prologue(&assembler);
+  int offset = 0;
+  while (offset < program->count) {
+    assembler.native_offsets[offset] = assembler.count;
+    if (!emit_instruction(&assembler, offset)) {
+      assembler_free(&assembler);
+      return false;
+    }
+    offset += get_instruction_size(program->instructions[offset]);
+  }
+
+  // The fallback stubs are placed out of line after the main code.
+  for (int i = 0; i < program->count; i++) {
+    bool has_guard = assembler.fallback_offsets[i] != -1;
+    if (has_guard) {
+      assembler.fallback_offsets[i] = assembler.count;
+      emit_fallback_stub(&assembler, i);
+    }
+  }
+  emit_epilogue(&assembler);
+  resolve_fixups(&assembler);
+
+  // The memory is mapped as writable to copy the code over, and then remapped
+  // as executable (never both at once).
+  void* memory = mmap(NULL, assembler.count, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (memory == MAP_FAILED) {
+    assembler_free(&assembler);
+    return false;
+  }
+  memcpy(memory, assembler.code, assembler.count);
+  if (mprotect(memory, assembler.count, PROT_READ | PROT_EXEC) != 0) {
+    munmap(memory, assembler.count);
+    assembler_free(&assembler);
+    return false;
+  }
+
+  out_code->memory = memory;
+  out_code->size = assembler.count;
+  assembler_free(&assembler);
+
+  return true;
+}
+
+/// Execute the JIT-compiled code from the beginning of the program.
+JitExit jit_execute(JitCode* code, VM* vm) {
+  JitExit (*function)(VM*) = (JitExit (*)(VM*))code->memory;
+
+  return function(vm);
+}
+
+void jit_free(JitCode* code) {
+  munmap(code->memory, code->size);
+  code->memory = NULL;
+  code->size = 0;
+}
+
+#endif
@@ -0,0 +1,32 @@
+#ifndef CTHUSLY_JIT_H
+#define CTHUSLY_JIT_H
+
+#include "common.h"
+#include "program.h"
+#include "vm.h"
+
+#ifdef JIT_SUPPORTED
+
+/// How the execution of JIT-compiled code ended.
+typedef enum {
+  /// The program ran to completion (it reached OP_RETURN).
+  JIT_EXIT_RETURN,
+  /// A type guard failed. The VM's `next_instruction` points to the instruction
+  /// to resume at (the one whose guard failed) using the interpreter.
+  JIT_EXIT_FALLBACK,
+} JitExit;
+
+/// Native x86-64 machine code compiled from a program.
+typedef struct {
+  /// The executable memory containing the code (mapped using `mmap()`).
+  void* memory;
+  size_t size;
+} JitCode;
+
+bool jit_compile(Program* program, JitCode* out_code);
+JitExit jit_execute(JitCode* code, VM* vm);
+void jit_free(JitCode* code);
+
+#endif
+
+#endif
@@ -2,12 +2,36 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "bytecode_file.h"
 #include "common.h"
+#include "compile_cache.h"
 #include "exit_code.h"
+#include "memory.h"
+#include "profiler.h"
 #include "vm.h"
 
 bool flag_debug_compilation = false;
 bool flag_debug_execution = false;
+bool flag_profile_opcodes = false;
+bool flag_show_stats = false;
+bool flag_jit = false;
+bool flag_tracing = false;
+bool flag_register_engine = false;
+bool flag_gc_stats = false;
+bool flag_lazy_interning = false;
+bool flag_compile_only = false;
+int flag_optimization_level = 1;
+
+/// The path of the bytecode file to write when using `--compile-only` (set with `-o`).
+static const char* output_path = NULL;
+/// The directory of the compile cache (set with `--cache-dir`), which is only used if set.
+static const char* cache_directory = NULL;
+/// The size (in megabytes) of the compile cache (set with `--cache-max-size`).
+static const char* cache_max_size_mb = NULL;
+
+#ifdef COMPILE_CACHE_SUPPORTED
+static CompileCache compile_cache;
+#endif
 
 static void print_help(FILE* fout) {
   fprintf(fout,
@@ -20,6 +44,35 @@ static void print_help(FILE* fout) {
     "    -d,     --debug          Show compiler output (bytecode) and VM execution trace\n"
     "    -dcomp, --debug-comp     Show compiler output (bytecode)\n"
     "    -dexec, --debug-exec     Show VM execution trace\n"
+    "    -prof,  --profile        Run all [path]s and show the most executed opcode\n"
+    "                             sequences (superinstruction candidates)\n"
+    "    -s,     --stats          Show VM stats (e.g. instruction specialization hits)\n"
+    "    -gcs,   --gc-stats       Show garbage collection stats (e.g. pause times)\n"
+    "    -jit,   --jit            Compile the program into x86-64 machine code before\n"
+    "                             running it (falls back to the interpreter if unsupported)\n"
+    "    -tr,    --tracing        Record traces of hot loops and run them with a dedicated\n"
+    "                             executor (type-guarded and without branches)\n"
+    "            --engine=<name>  The engine running the program: stack (default), or reg to\n"
+    "                             run it as register instructions (e.g. ADD r3, r1, r2)\n"
+    "                             translated from the bytecode (not with --jit or --tracing)\n"
+    "    -li,    --lazy-interning Only intern the texts in the source code, not the texts\n"
+    "                             created at runtime (compared by their chars instead)\n"
+    "    -c,     --compile-only   Compile [path] into a bytecode file instead of running it\n"
+    "                             (run it by passing the bytecode file as the [path])\n"
+    "    -o,     --output <file>  The path of the bytecode file when using --compile-only\n"
+    "                             (default: [path] with the extension " BYTECODE_FILE_EXTENSION ")\n"
+    "    -cd,    --cache-dir <dir>\n"
+    "                             Cache compiled programs in <dir> (as bytecode files named\n"
+    "                             by a hash of the source) and skip compiling sources that\n"
+    "                             were compiled before\n"
+    "    -cms,   --cache-max-size <MB>\n"
+    "                             The size the cache is kept within by removing the least\n"
+    "                             recently used programs (default: 64)\n"
+    "    -O0,    -O1,    -O2      The optimization level: 0 compiles the program as written\n"
+    "                             (apart from fusing superinstructions), 1 folds constants and\n"
+    "                             runs the peephole optimizer (default), 2 also moves invariant\n"
+    "                             expressions out of loops, reuses repeated expressions and\n"
+    "                             removes unused variables (the REPL uses at most 1)\n"
     "\n"
   );
 }
@@ -41,6 +94,10 @@ static void run_repl() {
     interpret(&vm, line);
   }
 
+  if (flag_show_stats)
+    vm_print_stats(&vm, stderr);
+  if (flag_gc_stats)
+    gc_print_stats(&vm.environment, stderr);
   vm_free(&vm);
 }
 
@@ -78,25 +135,149 @@ static char* read_file(const char* path) {
   return source_buffer;
 }
 
-static void run_file(const char* path) {
+/// Run the program of a bytecode file (see `--compile-only`).
+static ErrorReport run_bytecode_file(const char* path) {
+  BytecodeFile file;
+  if (!bytecode_file_map(&file, path, true))
+    exit(EXIT_CODE_INPUT_FILE_ERROR);
+
+  VM vm;
+  vm_init(&vm);
+  ErrorReport report = interpret_bytecode_file(&vm, &file);
+  if (flag_show_stats)
+    vm_print_stats(&vm, stderr);
+  if (flag_gc_stats)
+    gc_print_stats(&vm.environment, stderr);
+
+  // The texts of the program refer to the file, so it is unmapped last.
+  vm_free(&vm);
+  bytecode_file_unmap(&file);
+
+  return report;
+}
+
+/// Get the default path of the bytecode file compiled from the source file at
+/// the given path (its `.th` extension replaced). Needs to be `free()`d.
+static char* get_default_output_path(const char* path) {
+  size_t length = strlen(path);
+  const char* source_extension = ".th";
+  size_t source_extension_length = strlen(source_extension);
+  if (length > source_extension_length && strcmp(path + length - source_extension_length, source_extension) == 0)
+    length -= source_extension_length;
+
+  size_t output_path_size = length + strlen(BYTECODE_FILE_EXTENSION) + 1;
+  char* default_output_path = (char*)malloc(output_path_size);
+  if (default_output_path == NULL)
+    exit(EXIT_CODE_IO_OP_ERROR);
+  snprintf(default_output_path, output_path_size, "%.*s%s", (int)length, path, BYTECODE_FILE_EXTENSION);
+
+  return default_output_path;
+}
+
+/// Compile the source file into a bytecode file (see `--compile-only`).
+static ErrorReport compile_file(const char* path) {
+  VM vm;
+  vm_init(&vm);
+  char* source = read_file(path);
+  char* default_output_path = output_path == NULL ? get_default_output_path(path) : NULL;
+
+  ErrorReport report = compile_to_bytecode_file(&vm, source, output_path == NULL ? default_output_path : output_path);
+  if (flag_show_stats)
+    vm_print_stats(&vm, stderr);
+
+  free(default_output_path);
+  free(source);
+  vm_free(&vm);
+
+  return report;
+}
+
+#ifdef COMPILE_CACHE_SUPPORTED
+/// Run the source using the compile cache: The compiled program is run from the
+/// cache if the source was compiled before, otherwise the source is compiled
+/// into the cache first. The cached program is mapped into `out_file`, which is
+/// to be unmapped once the VM has been freed.
+static ErrorReport interpret_cached(VM* vm, const char* source, BytecodeFile* out_file) {
+  char* entry_path = compile_cache_get_entry_path(&compile_cache, source);
+  bool is_cached = compile_cache_find(&compile_cache, entry_path, out_file);
+  if (!is_cached) {
+    ErrorReport report = compile_to_bytecode_file(vm, source, entry_path);
+    if (report == REPORT_COMPILE_ERROR) {
+      free(entry_path);
+      return report;
+    }
+    is_cached = report == REPORT_NO_ERROR && bytecode_file_map(out_file, entry_path, false);
+    if (is_cached)
+      compile_cache_evict(&compile_cache, entry_path);
+  }
+  free(entry_path);
+
+  // (If the program could not be stored, e.g. since the directory is not
+  // writable, the source is compiled again and run as usual.)
+  return is_cached ? interpret_bytecode_file(vm, out_file) : interpret(vm, source);
+}
+#endif
+
+static ErrorReport run_file(const char* path) {
+  if (is_bytecode_file_path(path))
+    return run_bytecode_file(path);
+
   VM vm;
   vm_init(&vm);
   char* source = read_file(path);
+  BytecodeFile cached_file = { .memory = NULL, .size = 0, .is_mapped = false };
 
-  ErrorReport report = interpret(&vm, source);
+  #ifdef COMPILE_CACHE_SUPPORTED
+    ErrorReport report = cache_directory != NULL
+      ? interpret_cached(&vm, source, &cached_file)
+      : interpret(&vm, source);
+  #else
+    ErrorReport report = interpret(&vm, source);
+  #endif
+  if (flag_show_stats) {
+    vm_print_stats(&vm, stderr);
+    #ifdef COMPILE_CACHE_SUPPORTED
+      if (cache_directory != NULL)
+        compile_cache_print_stats(&compile_cache, stderr);
+    #endif
+  }
+  if (flag_gc_stats)
+    gc_print_stats(&vm.environment, stderr);
 
   // `read_file()` uses `malloc()` for the source, thus it needs to be freed here.
   free(source);
+  // (The texts of a cached program refer to its file, so it is unmapped last.)
   vm_free(&vm);
+  bytecode_file_unmap(&cached_file);
+
+  return report;
+}
 
-  if (report == REPORT_COMPILE_ERROR)
-    exit(EXIT_CODE_INPUT_DATA_ERROR);
-  if (report == REPORT_RUNTIME_ERROR)
-    exit(EXIT_CODE_INTERNAL_SOFTWARE_ERROR);
+/// Run all programs in the corpus and report their opcode profile.
+static void run_profile(const char* paths[], int path_count) {
+  for (int i = 0; i < path_count; i++) {
+    // Errors are reported by the VM, and the rest of the corpus is still profiled.
+    run_file(paths[i]);
+  }
+
+  profiler_print_report(stdout);
+}
+
+/// Get the variable to set to the value of the option if the flag is an option
+/// taking a value (e.g. `-o <file>`), otherwise `NULL`.
+static const char** get_option_value(const char* flag) {
+  if (strcmp(flag, "-o") == 0 || strcmp(flag, "--output") == 0)
+    return &output_path;
+  if (strcmp(flag, "-cd") == 0 || strcmp(flag, "--cache-dir") == 0)
+    return &cache_directory;
+  if (strcmp(flag, "-cms") == 0 || strcmp(flag, "--cache-max-size") == 0)
+    return &cache_max_size_mb;
+
+  return NULL;
 }
 
-/// Set the corresponding debug flag if it is valid. Returns `true` if valid.
-static bool validate_and_set_debug_flag(const char* flag) {
+/// Set the corresponding flag if it is valid. Returns `true` if valid.
+static bool validate_and_set_flag(const char* flag) {
   if (strcmp(flag, "-d") == 0 || strcmp(flag, "--debug") == 0) {
     flag_debug_compilation = true;
     return flag_debug_execution = true;
@@ -105,34 +286,126 @@ static bool validate_and_set_debug_flag(const char* flag) {
     return flag_debug_compilation = true;
   if (strcmp(flag, "-dexec") == 0 || strcmp(flag, "--debug-exec") == 0)
     return flag_debug_execution = true;
+  if (strcmp(flag, "-prof") == 0 || strcmp(flag, "--profile") == 0)
+    return flag_profile_opcodes = true;
+  if (strcmp(flag, "-s") == 0 || strcmp(flag, "--stats") == 0)
+    return flag_show_stats = true;
+  if (strcmp(flag, "-gcs") == 0 || strcmp(flag, "--gc-stats") == 0)
+    return flag_gc_stats = true;
+  if (strcmp(flag, "-jit") == 0 || strcmp(flag, "--jit") == 0)
+    return flag_jit = true;
+  if (strcmp(flag, "-tr") == 0 || strcmp(flag, "--tracing") == 0)
+    return flag_tracing = true;
+  if (strcmp(flag, "--engine=stack") == 0 || strcmp(flag, "--engine=reg") == 0) {
+    flag_register_engine = strcmp(flag, "--engine=reg") == 0;
+    return true;
+  }
+  if (strcmp(flag, "-li") == 0 || strcmp(flag, "--lazy-interning") == 0)
+    return flag_lazy_interning = true;
+  if (strcmp(flag, "-c") == 0 || strcmp(flag, "--compile-only") == 0)
+    return flag_compile_only = true;
+  if (strcmp(flag, "-O0") == 0 || strcmp(flag, "-O1") == 0 || strcmp(flag, "-O2") == 0) {
+    flag_optimization_level = flag[2] - '0';
+    return true;
+  }
 
   return false;
 }
 
 int main(int argc, const char* argv[]) {
-  // Example input: ./cthusly
-  if (argc == 1)
-    run_repl();
-  // Example input: ./cthusly path/to/file (or: ./cthusly --debug)
-  else if (argc == 2) {
-    const char* argv1 = argv[1];
-    if (strcmp(argv1, "-h") == 0 || strcmp(argv1, "--help") == 0)
+  // Example input: ./cthusly --debug-comp --debug-exec path/to/file
+  int arg_index = 1;
+  while (arg_index < argc && argv[arg_index][0] == '-') {
+    const char* flag = argv[arg_index++];
+    if (strcmp(flag, "-h") == 0 || strcmp(flag, "--help") == 0) {
       print_help(stdout);
-    else if (validate_and_set_debug_flag(argv1))
-      run_repl();
-    else
-      run_file(argv1);
-  }
-  // Example input: ./cthusly --debug path/to/file
-  else if (argc == 3) {
-    const char* flag = argv[1];
-    if (!validate_and_set_debug_flag(flag)) {
+      return EXIT_SUCCESS;
+    }
+    const char** option_value = get_option_value(flag);
+    if (option_value != NULL) {
+      if (arg_index == argc) {
+        print_help(stderr);
+        return EXIT_CODE_USAGE_ERROR;
+      }
+      *option_value = argv[arg_index++];
+      continue;
+    }
+    if (!validate_and_set_flag(flag)) {
+      print_help(stderr);
+      return EXIT_CODE_USAGE_ERROR;
+    }
+  }
+
+  #ifndef JIT_SUPPORTED
+    if (flag_jit)
+      fprintf(stderr, "The JIT is not supported by this build (x86-64 without NaN boxing only), the program will be interpreted.\n");
+  #endif
+
+  const char** paths = &argv[arg_index];
+  int path_count = argc - arg_index;
+  // The JIT and the loop traces run the stack-based bytecode.
+  bool is_register_engine_combined = flag_register_engine && (flag_jit || flag_tracing);
+  if ((output_path != NULL && !flag_compile_only) || is_register_engine_combined) {
+    print_help(stderr);
+    return EXIT_CODE_USAGE_ERROR;
+  }
+
+  // Example input: ./cthusly --cache-dir path/to/cache --cache-max-size 16 path/to/file
+  long max_size_mb = COMPILE_CACHE_DEFAULT_MAX_SIZE_MB;
+  if (cache_max_size_mb != NULL) {
+    char* end;
+    max_size_mb = strtol(cache_max_size_mb, &end, 10);
+    if (cache_directory == NULL || *end != '\0' || max_size_mb <= 0) {
       print_help(stderr);
       return EXIT_CODE_USAGE_ERROR;
     }
+  }
+  #ifdef COMPILE_CACHE_SUPPORTED
+    if (cache_directory != NULL)
+      compile_cache_init(&compile_cache, cache_directory, (size_t)max_size_mb * 1024 * 1024);
+  #else
+    if (cache_directory != NULL)
+      fprintf(stderr, "The compile cache is not supported by this build (POSIX only), programs will be compiled every time.\n");
+  #endif
 
-    const char* path = argv[2];
-    run_file(path);
+  // Example input: ./cthusly --profile path/to/file1 path/to/file2
+  if (flag_profile_opcodes) {
+    #ifndef PROFILE_DISPATCH
+      fprintf(stderr, "Profiling requires the `PROFILE_DISPATCH` macro to be defined (see src/common.h).\n");
+      return EXIT_CODE_USAGE_ERROR;
+    #endif
+    if (path_count == 0) {
+      print_help(stderr);
+      return EXIT_CODE_USAGE_ERROR;
+    }
+    run_profile(paths, path_count);
+  }
+  // Example input: ./cthusly --compile-only -o path/to/file.thbc path/to/file.th
+  else if (flag_compile_only) {
+    if (path_count != 1) {
+      print_help(stderr);
+      return EXIT_CODE_USAGE_ERROR;
+    }
+    ErrorReport report = compile_file(paths[0]);
+    if (report == REPORT_COMPILE_ERROR)
+      return EXIT_CODE_INPUT_DATA_ERROR;
+    if (report == REPORT_IO_ERROR)
+      return EXIT_CODE_IO_OP_ERROR;
+  }
+  // Example input: ./cthusly
+  else if (path_count == 0) {
+    // The REPL compiles each line on its own, leaving nothing for `-O2` to optimize.
+    if (flag_optimization_level > 1)
+      flag_optimization_level = 1;
+    run_repl();
+  }
+  // Example input: ./cthusly path/to/file
+  else if (path_count == 1) {
+    ErrorReport report = run_file(paths[0]);
+    if (report == REPORT_COMPILE_ERROR)
+      return EXIT_CODE_INPUT_DATA_ERROR;
+    if (report == REPORT_RUNTIME_ERROR)
+      return EXIT_CODE_INTERNAL_SOFTWARE_ERROR;
   }
   else {
     print_help(stderr);
@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 
 #include "gc_object.h"
 #include "memory.h"
@@ -24,15 +25,123 @@ void* handle_reallocation(void* memory, size_t old_size, size_t new_size) {
   return reallocated_memory;
 }
 
-static void free_object(GCObject* object) {
+/// Release the memory of a gc object back to the arena. Returns the number of bytes released.
+static size_t free_object(Environment* environment, GCObject* object) {
   switch (object->type) {
     case GC_OBJECT_TYPE_TEXT: {
-      TextObject* text = (TextObject*)object;
-      FREE_ARRAY(char, text->chars, text->length + 1);
-      FREE(TextObject, object);
-      break;
+      size_t size = get_text_object_size((TextObject*)object);
+      arena_release(&environment->arena, object, size);
+      return size;
     }
+    case GC_OBJECT_TYPE_ROPE:
+      arena_release(&environment->arena, object, sizeof(RopeObject));
+      return sizeof(RopeObject);
   }
+
+  return 0;
+}
+
+static void mark_object(Environment* environment, GCObject* object) {
+  if (object == NULL || object->is_marked)
+    return;
+
+  object->is_marked = true;
+
+  // Texts do not reference other objects, but ropes do. Their references are
+  // traced later from the "gray" stack rather than recursively here, since
+  // ropes may be nested too deeply for the C stack.
+  if (object->type == GC_OBJECT_TYPE_TEXT)
+    return;
+
+  bool max_capacity_reached = environment->gray_count + 1 > environment->gray_capacity;
+  if (max_capacity_reached) {
+    int old_capacity = environment->gray_capacity;
+    environment->gray_capacity = GROW_CAPACITY(old_capacity);
+    environment->gray_stack = GROW_ARRAY(GCObject*, environment->gray_stack, old_capacity, environment->gray_capacity);
+  }
+  environment->gray_stack[environment->gray_count++] = object;
+}
+
+static void mark_value(Environment* environment, ThuslyValue value) {
+  if (IS_GC_OBJECT(value))
+    mark_object(environment, TO_C_OBJECT_PTR(value));
+}
+
+/// Mark the objects directly reachable by the VM: the values on the stack
+/// (which include all variables) and the constant pool of the program.
+static void mark_roots(Environment* environment) {
+  VM* vm = environment->vm;
+  for (ThuslyValue* slot = vm->stack; slot < vm->next_stack_top; slot++)
+    mark_value(environment, *slot);
+
+  if (vm->program != NULL) {
+    ConstantPool* constant_pool = &vm->program->constant_pool;
+    for (int i = 0; i < constant_pool->count; i++)
+      mark_value(environment, constant_pool->values[i]);
+  }
+}
+
+/// Mark the objects referenced by the marked objects until no "gray" objects
+/// (marked but not yet traced) remain.
+static void trace_references(Environment* environment) {
+  while (environment->gray_count > 0) {
+    GCObject* object = environment->gray_stack[--environment->gray_count];
+    if (object->type == GC_OBJECT_TYPE_ROPE) {
+      RopeObject* rope = (RopeObject*)object;
+      mark_value(environment, rope->left);
+      mark_value(environment, rope->right);
+      mark_object(environment, (GCObject*)rope->flattened);
+    }
+  }
+}
+
+/// Free all unmarked objects and unmark the rest for the next collection.
+static void sweep(Environment* environment) {
+  GCObject* previous = NULL;
+  GCObject* current = environment->gc_objects;
+  while (current != NULL) {
+    if (current->is_marked) {
+      current->is_marked = false;
+      previous = current;
+      current = current->next;
+      continue;
+    }
+
+    GCObject* unreachable = current;
+    current = current->next;
+    if (previous == NULL)
+      environment->gc_objects = current;
+    else
+      previous->next = current;
+
+    size_t size = free_object(environment, unreachable);
+    environment->bytes_allocated -= size;
+    environment->gc_stats.bytes_reclaimed += size;
+    environment->gc_stats.objects_reclaimed++;
+  }
+}
+
+/// Mark-and-sweep garbage collection - Frees all gc objects that are not
+/// reachable from the roots (see `mark_roots()`).
+void collect_garbage(Environment* environment) {
+  clock_t start = clock();
+
+  mark_roots(environment);
+  trace_references(environment);
+  // The intern pool references its texts weakly, so the unreachable texts
+  // are removed from it before being freed (to not leave dangling keys).
+  intern_set_remove_unmarked(&environment->texts);
+  sweep(environment);
+
+  size_t next_gc = environment->bytes_allocated * GC_HEAP_GROWTH_FACTOR;
+  environment->next_gc = next_gc < GC_INITIAL_HEAP_BUDGET ? GC_INITIAL_HEAP_BUDGET : next_gc;
+
+  GCStats* stats = &environment->gc_stats;
+  double pause_ms = 1000.0 * (clock() - start) / CLOCKS_PER_SEC;
+  stats->collections++;
+  stats->total_pause_ms += pause_ms;
+  if (pause_ms > stats->max_pause_ms)
+    stats->max_pause_ms = pause_ms;
 }
 
 void free_objects(Environment* environment) {
@@ -43,10 +152,43 @@ void free_objects(Environment* environment) {
   #endif
   // ---------------
 
-  GCObject* current = environment->gc_objects;
-  while (current != NULL) {
-    GCObject* next = current->next;
-    free_object(current);
-    current = next;
-  }
+  // All objects are released at once along with the arena (they do not own
+  // any memory outside of it).
+  arena_free(&environment->arena);
+  environment->gc_objects = NULL;
+  environment->bytes_allocated = 0;
+
+  FREE_ARRAY(GCObject*, environment->gray_stack, environment->gray_capacity);
+  environment->gray_stack = NULL;
+  environment->gray_count = 0;
+  environment->gray_capacity = 0;
+}
+
+void gc_print_stats(Environment* environment, FILE* fout) {
+  GCStats* stats = &environment->gc_stats;
+  double average_pause_ms = stats->collections == 0 ? 0 : stats->total_pause_ms / stats->collections;
+
+  fprintf(fout, "\n================ GC Stats ================\n\n");
+  fprintf(fout, "Collections:                            %llu\n", (unsigned long long)stats->collections);
+  fprintf(fout, "Pause time:\n");
+  fprintf(fout, "    Total:                              %.3f ms\n", stats->total_pause_ms);
+  fprintf(fout, "    Average:                            %.3f ms\n", average_pause_ms);
+  fprintf(fout, "    Max:                                %.3f ms\n", stats->max_pause_ms);
+  fprintf(fout, "Reclaimed:\n");
+  fprintf(fout, "    Objects:                            %llu\n", (unsigned long long)stats->objects_reclaimed);
+  fprintf(fout, "    Bytes:                              %llu\n", (unsigned long long)stats->bytes_reclaimed);
+  fprintf(fout, "Heap:\n");
+  fprintf(fout, "    Current size:                       %zu bytes\n", environment->bytes_allocated);
+  fprintf(fout, "    Peak size:                          %zu bytes\n", stats->peak_bytes_allocated);
+  fprintf(fout, "    Next collection at:                 %zu bytes\n", environment->next_gc);
+  ArenaStats* arena_stats = &environment->arena.stats;
+  fprintf(fout, "Arena:\n");
+  fprintf(fout, "    Allocations:                        %llu\n", (unsigned long long)arena_stats->allocations);
+  fprintf(fout, "    Chunks allocated:                   %llu\n", (unsigned long long)arena_stats->chunks_allocated);
+  fprintf(fout, "    Chunks recycled:                    %llu\n", (unsigned long long)arena_stats->chunks_recycled);
+  InternSet* texts = &environment->texts;
+  fprintf(fout, "Intern pool:\n");
+  fprintf(fout, "    Texts:                              %d\n", texts->count);
+  fprintf(fout, "    Capacity:                           %d\n", texts->capacity);
+  fprintf(fout, "    Memory:                             %zu bytes\n", intern_set_get_memory_size(texts));
 }
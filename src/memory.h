@@ -1,6 +1,8 @@
 #ifndef CTHUSLY_MEMORY_H
 #define CTHUSLY_MEMORY_H
 
+#include <stdio.h>
+
 #include "common.h"
 #include "vm.h"
 
@@ -19,7 +21,15 @@
 
 #define FREE(type, memory) handle_reallocation(memory, sizeof(type), 0)
 
+/// The heap size (in bytes) at which the first garbage collection runs.
+#define GC_INITIAL_HEAP_BUDGET (1024 * 1024)
+/// The factor by which the heap may grow (relative to the bytes still reachable
+/// after a collection) before the next collection runs.
+#define GC_HEAP_GROWTH_FACTOR 2
+
 void* handle_reallocation(void* memory, size_t old_capacity, size_t new_capacity);
+void collect_garbage(Environment* environment);
 void free_objects(Environment* environment);
+void gc_print_stats(Environment* environment, FILE* fout);
 
 #endif
@@ -0,0 +1,336 @@
+#include <string.h>
+
+#include "common.h"
+#include "memory.h"
+#include "peephole.h"
+#include "program.h"
+#include "thusly_value.h"
+
+/// The peephole optimizer - Rewrites short sequences of instructions of a compiled
+/// program into fewer or cheaper ones. E.g. a jump landing on another jump is
+/// threaded to the final target, a conditional jump whose condition is already
+/// known is either made unconditional or removed, and a value pushed only to be
+/// popped is not pushed at all.
+///
+/// It runs once the whole program has been compiled, before the jumps are shrunk
+/// (see `shrink_jumps()` in compiler.c), so all jumps are in their long form. In a
+/// pass over the program, instructions are rewritten in place or marked as removed,
+/// after which the program is compacted (retargeting the jumps and relocating the
+/// line table). Passes are repeated while anything changes, since a rewrite may
+/// enable another one.
+///
+/// Only instructions that cannot cause a runtime error are removed, so runtime
+/// errors are still reported on the same lines. A removed instruction that a jump
+/// lands on is only removed along with what it does, e.g. a constant and the pop
+/// of it, such that jumping to the instruction after it has the same effect.
+
+#define NOT_FOUND (-1)
+/// The largest number of passes over the program.
+#define PASSES_MAX 8
+/// The largest number of jumps followed when threading a jump (which also stops
+/// at cycles of jumps, such as an empty infinite loop).
+#define JUMP_CHAIN_MAX 16
+#define LONG_JUMP_SIZE 5
+
+typedef struct {
+  Program* program;
+  /// Whether a jump lands on the instruction at each offset.
+  bool* is_jump_target;
+  /// Whether the instruction at each offset is to be removed.
+  bool* is_removed;
+  bool is_changed;
+  VMStats* stats;
+} Peephole;
+
+static bool is_constant_push(byte opcode) {
+  switch (opcode) {
+    case OP_CONSTANT:
+    case OP_CONSTANT_FALSE:
+    case OP_CONSTANT_NONE:
+    case OP_CONSTANT_TRUE:
+    case OP_CONSTANT_LONG:
+      return true;
+    default:
+      return false;
+  }
+}
+
+/// Whether the instruction only pushes a value (which may thereby be removed along
+/// with the pop of the value).
+static bool is_pure_push(byte opcode) {
+  return is_constant_push(opcode) || opcode == OP_GET_VAR || opcode == OP_GET_VAR_LONG;
+}
+
+static bool is_conditional_jump(byte opcode) {
+  return opcode == OP_JUMP_FWD_IF_FALSE_LONG || opcode == OP_JUMP_FWD_IF_TRUE_LONG;
+}
+
+static bool is_unconditional_jump(byte opcode) {
+  return opcode == OP_JUMP_FWD_LONG || opcode == OP_JUMP_BWD_LONG;
+}
+
+/// Get the number of values popped by the instruction if it only pops values, otherwise 0.
+static int get_pop_count(Program* program, int offset) {
+  switch (program->instructions[offset]) {
+    case OP_POP:
+      return 1;
+    case OP_POPN:
+      // (See `compiler.discard_scope()` regarding `N + 1`.)
+      return program->instructions[offset + 1] + 1;
+    default:
+      return 0;
+  }
+}
+
+/// Get the value pushed by the constant instruction at the given offset.
+static ThuslyValue get_pushed_constant(Program* program, int offset) {
+  const byte* instruction = &program->instructions[offset];
+  switch (instruction[0]) {
+    case OP_CONSTANT:       return program->constant_pool.values[instruction[1]];
+    case OP_CONSTANT_LONG:  return program->constant_pool.values[read_long_operand(&instruction[1])];
+    case OP_CONSTANT_FALSE: return FROM_C_BOOL(false);
+    case OP_CONSTANT_TRUE:  return FROM_C_BOOL(true);
+    default:                return FROM_C_NULL;
+  }
+}
+
+/// Write the 4-byte operand of a long jump.
+static void write_jump_operand(byte* operand, uint32_t jump_size) {
+  for (int i = 0; i < 4; i++)
+    operand[i] = (jump_size >> (8 * (3 - i))) & 0xff;
+}
+
+/// Overwrite the long jump at the given offset with a jump to the given target. An
+/// unconditional jump is written as a forward or backward jump depending on the target.
+static void write_jump(Program* program, int offset, byte opcode, int target_offset) {
+  int next_offset = offset + LONG_JUMP_SIZE;
+  if (is_unconditional_jump(opcode))
+    opcode = target_offset >= next_offset ? OP_JUMP_FWD_LONG : OP_JUMP_BWD_LONG;
+  uint32_t jump_size = (uint32_t)(opcode == OP_JUMP_BWD_LONG ? next_offset - target_offset : target_offset - next_offset);
+
+  program->instructions[offset] = opcode;
+  write_jump_operand(&program->instructions[offset + 1], jump_size);
+}
+
+static void remove_instruction(Peephole* peephole, int offset) {
+  peephole->is_removed[offset] = true;
+  peephole->is_changed = true;
+  peephole->stats->peephole_removals++;
+}
+
+/// Get the final target of the jump at the given offset by following the jumps
+/// that it lands on. Unconditional jumps are always followed, and conditional ones
+/// only by a conditional jump (since the value tested is the same): a jump with the
+/// same condition is followed, and one with the opposite condition is jumped over.
+static int get_threaded_target(Program* program, int offset) {
+  byte opcode = program->instructions[offset];
+  int target_offset = get_jump_target(program, offset);
+  for (int i = 0; i < JUMP_CHAIN_MAX && target_offset != offset; i++) {
+    byte target_opcode = program->instructions[target_offset];
+    int next_target_offset;
+    if (is_unconditional_jump(target_opcode) || (is_conditional_jump(opcode) && target_opcode == opcode))
+      next_target_offset = get_jump_target(program, target_offset);
+    else if (is_conditional_jump(opcode) && is_conditional_jump(target_opcode))
+      next_target_offset = target_offset + LONG_JUMP_SIZE;
+    else
+      break;
+
+    // (Conditional jumps only jump forward.)
+    if (is_conditional_jump(opcode) && next_target_offset <= offset)
+      break;
+    target_offset = next_target_offset;
+  }
+
+  return target_offset;
+}
+
+/// Rewrite the jump at the given offset (see `rewrite_instructions()` for the
+/// `previous` instruction and the return value).
+static int rewrite_jump(Peephole* peephole, int previous, int offset) {
+  Program* program = peephole->program;
+  byte opcode = program->instructions[offset];
+  bool is_only_reached_from_previous = previous != NOT_FOUND && !peephole->is_jump_target[offset];
+  byte previous_opcode = previous != NOT_FOUND ? program->instructions[previous] : OP_RETURN;
+
+  // A conditional jump right after a constant, or after a conditional jump that was
+  // not taken, tests a value known at this point, so it is always or never taken.
+  // E.g. `OP_CONSTANT_TRUE, OP_JUMP_FWD_IF_FALSE` (`if true`) never jumps, and the
+  // `foreach` and `while` loops start with `OP_JUMP_FWD_IF_TRUE, OP_JUMP_FWD_IF_FALSE`.
+  bool is_condition_known = is_constant_push(previous_opcode) || is_conditional_jump(previous_opcode);
+  if (is_conditional_jump(opcode) && is_only_reached_from_previous && is_condition_known) {
+    bool is_condition_truthy = is_constant_push(previous_opcode)
+      ? is_truthy(get_pushed_constant(program, previous))
+      : previous_opcode == OP_JUMP_FWD_IF_FALSE_LONG;
+    bool is_taken = (opcode == OP_JUMP_FWD_IF_TRUE_LONG) == is_condition_truthy;
+    if (!is_taken) {
+      remove_instruction(peephole, offset);
+      return previous;
+    }
+    opcode = OP_JUMP_FWD_LONG;
+    write_jump(program, offset, opcode, get_jump_target(program, offset));
+    peephole->is_changed = true;
+  }
+
+  // A jump landing on another jump is threaded to where that jump goes.
+  int target_offset = get_jump_target(program, offset);
+  int threaded_target_offset = get_threaded_target(program, offset);
+  if (threaded_target_offset != target_offset) {
+    write_jump(program, offset, opcode, threaded_target_offset);
+    opcode = program->instructions[offset];
+    target_offset = threaded_target_offset;
+    peephole->is_jump_target[target_offset] = true;
+    peephole->is_changed = true;
+    peephole->stats->threaded_jumps++;
+  }
+
+  // A conditional jump over an unconditional jump is the unconditional jump with
+  // the opposite condition. I.e. `OP_JUMP_FWD_IF_TRUE <a>, OP_JUMP_FWD <b>, (a:)`
+  // becomes `OP_JUMP_FWD_IF_FALSE <b>`.
+  bool is_jumped_over = is_conditional_jump(previous_opcode)
+    && get_jump_target(program, previous) == offset + LONG_JUMP_SIZE;
+  if (opcode == OP_JUMP_FWD_LONG && is_only_reached_from_previous && is_jumped_over) {
+    opcode = previous_opcode == OP_JUMP_FWD_IF_TRUE_LONG ? OP_JUMP_FWD_IF_FALSE_LONG : OP_JUMP_FWD_IF_TRUE_LONG;
+    write_jump(program, offset, opcode, target_offset);
+    remove_instruction(peephole, previous);
+    previous = NOT_FOUND;
+  }
+
+  // A value pushed right before jumping to a pop of it is not pushed, and the jump
+  // lands after the pop instead. (E.g. `if false` once its jump is unconditional.)
+  bool is_pushed_for_pop = previous != NOT_FOUND && is_pure_push(previous_opcode)
+    && target_offset > offset && program->instructions[target_offset] == OP_POP;
+  if (opcode == OP_JUMP_FWD_LONG && is_only_reached_from_previous && is_pushed_for_pop) {
+    target_offset++;
+    write_jump(program, offset, opcode, target_offset);
+    peephole->is_jump_target[target_offset] = true;
+    remove_instruction(peephole, previous);
+    previous = NOT_FOUND;
+  }
+
+  // A jump to the next instruction does nothing (a conditional one leaves the
+  // value tested on the stack either way).
+  if (target_offset == offset + LONG_JUMP_SIZE) {
+    remove_instruction(peephole, offset);
+    return peephole->is_jump_target[offset] ? NOT_FOUND : previous;
+  }
+
+  return offset;
+}
+
+/// Rewrite the pop (OP_POP or OP_POPN) at the given offset (see `rewrite_instructions()`
+/// for the `previous` instruction and the return value).
+static int rewrite_pop(Peephole* peephole, int previous, int offset) {
+  Program* program = peephole->program;
+  if (previous == NOT_FOUND || peephole->is_jump_target[offset])
+    return offset;
+
+  // A value pushed only to be popped is not pushed. (E.g. `OP_CONSTANT_TRUE, OP_POP`
+  // is left from `if true` once its jump is removed.)
+  byte* instructions = program->instructions;
+  if (is_pure_push(instructions[previous]) && instructions[offset] == OP_POP) {
+    remove_instruction(peephole, previous);
+    remove_instruction(peephole, offset);
+    return NOT_FOUND;
+  }
+
+  // Consecutive pops are merged into one. (E.g. at the end of a `foreach` loop,
+  // where the condition is popped and then the loop variable.)
+  int previous_pop_count = get_pop_count(program, previous);
+  int pop_count = previous_pop_count + get_pop_count(program, offset);
+  if (previous_pop_count == 0 || pop_count > SHORT_OPERAND_MAX + 1)
+    return offset;
+
+  if (instructions[offset] == OP_POPN) {
+    instructions[offset + 1] = (byte)(pop_count - 1);
+    remove_instruction(peephole, previous);
+    return offset;
+  }
+  if (instructions[previous] == OP_POPN) {
+    instructions[previous + 1] = (byte)(pop_count - 1);
+    remove_instruction(peephole, offset);
+    return previous;
+  }
+  // `OP_POP, OP_POP` is turned into `OP_POPN 1` in place (as the sizes are the same).
+  instructions[previous] = OP_POPN;
+  instructions[previous + 1] = 1;
+  peephole->is_changed = true;
+  peephole->stats->peephole_removals++;
+
+  return previous;
+}
+
+/// Rewrite the instructions in one pass over the program. Each instruction is
+/// rewritten given the `previous` instruction, i.e. the one right before it that
+/// is kept (or `NOT_FOUND` if that was removed), and the rewrite returns which
+/// instruction is the previous one of the next instruction.
+static void rewrite_instructions(Peephole* peephole) {
+  Program* program = peephole->program;
+  int previous = NOT_FOUND;
+  int offset = 0;
+  while (offset < program->count) {
+    byte opcode = program->instructions[offset];
+    if (is_conditional_jump(opcode) || is_unconditional_jump(opcode))
+      previous = rewrite_jump(peephole, previous, offset);
+    else if (opcode == OP_POP || opcode == OP_POPN)
+      previous = rewrite_pop(peephole, previous, offset);
+    else
+      previous = offset;
+    offset += get_instruction_size(opcode);
+  }
+}
+
+/// Remove the instructions marked as removed and move the rest of the code
+/// accordingly. A jump to a removed instruction lands on the next instruction kept.
+static void remove_marked_instructions(Peephole* peephole) {
+  Program* program = peephole->program;
+  int count = program->count;
+
+  // The new offset of each byte (indexed by its current offset). The operands
+  // of an instruction are given the new offset of the instruction, since a line
+  // table entry may be at such an offset (see `program_relocate()`).
+  int* new_offsets = ALLOCATE(int, count + 1);
+  int new_offset = 0;
+  for (int offset = 0; offset < count;) {
+    int size = get_instruction_size(program->instructions[offset]);
+    for (int i = 0; i < size; i++)
+      new_offsets[offset + i] = new_offset;
+    if (!peephole->is_removed[offset])
+      new_offset += size;
+    offset += size;
+  }
+  new_offsets[count] = new_offset;
+  program_relocate(program, new_offsets);
+
+  FREE_ARRAY(int, new_offsets, count + 1);
+}
+
+/// Optimize the compiled program (whose jumps must still be in their long form).
+void peephole_optimize(Program* program, VMStats* stats) {
+  for (int pass = 0; pass < PASSES_MAX; pass++) {
+    int count = program->count;
+    Peephole peephole = {
+      .program = program,
+      .is_jump_target = ALLOCATE(bool, count + 1),
+      .is_removed = ALLOCATE(bool, count + 1),
+      .is_changed = false,
+      .stats = stats,
+    };
+    for (int offset = 0; offset <= count; offset++) {
+      peephole.is_jump_target[offset] = false;
+      peephole.is_removed[offset] = false;
+    }
+    for (int offset = 0; offset < count; offset += get_instruction_size(program->instructions[offset])) {
+      if (is_jump_instruction(program->instructions[offset]))
+        peephole.is_jump_target[get_jump_target(program, offset)] = true;
+    }
+
+    rewrite_instructions(&peephole);
+    if (peephole.is_changed)
+      remove_marked_instructions(&peephole);
+
+    FREE_ARRAY(bool, peephole.is_jump_target, count + 1);
+    FREE_ARRAY(bool, peephole.is_removed, count + 1);
+    if (!peephole.is_changed)
+      break;
+  }
+}
@@ -0,0 +1,9 @@
+#ifndef CTHUSLY_PEEPHOLE_H
+#define CTHUSLY_PEEPHOLE_H
+
+#include "program.h"
+#include "vm.h"
+
+void peephole_optimize(Program* program, VMStats* stats);
+
+#endif
@@ -0,0 +1,127 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "common.h"
+#include "debug.h"
+#include "profiler.h"
+#include "program.h"
+
+/// The number of the most common sequences to show in the report.
+#define REPORT_MAX_ROWS 15
+
+/// The opcode profiler - Counts the executed instructions as well as the executed
+/// sequences of two (bigrams) and three (trigrams) instructions that are adjacent
+/// in the bytecode. These sequences are the candidates for being fused into
+/// superinstructions. (Sequences spanning a taken jump are not counted since
+/// those instructions are not adjacent and could not be fused.)
+
+typedef struct {
+  /// The number of recent adjacent instructions (at most 2).
+  int count;
+  /// The opcodes of the recent adjacent instructions (the most recent first).
+  byte opcodes[2];
+  /// The offset expected for the next instruction if it is adjacent.
+  int next_offset;
+} RecentInstructions;
+
+/// A sequence of opcodes and the number of times it was executed.
+typedef struct {
+  byte opcodes[3];
+  int length;
+  uint64_t count;
+} SequenceCount;
+
+static uint64_t unigram_counts[OPCODE_COUNT];
+static uint64_t bigram_counts[OPCODE_COUNT][OPCODE_COUNT];
+static uint64_t trigram_counts[OPCODE_COUNT][OPCODE_COUNT][OPCODE_COUNT];
+static uint64_t total_count = 0;
+static RecentInstructions recent = { .count = 0, .next_offset = -1 };
+
+/// Reset the sequence tracking before a new program starts executing.
+void profiler_start_program() {
+  recent.count = 0;
+  recent.next_offset = -1;
+}
+
+/// Record the execution of the instruction at the given offset.
+void profiler_record_instruction(Program* program, int offset) {
+  byte opcode = program->instructions[offset];
+  bool is_adjacent = offset == recent.next_offset;
+  if (!is_adjacent)
+    recent.count = 0;
+
+  total_count++;
+  unigram_counts[opcode]++;
+  if (recent.count >= 1)
+    bigram_counts[recent.opcodes[0]][opcode]++;
+  if (recent.count >= 2)
+    trigram_counts[recent.opcodes[1]][recent.opcodes[0]][opcode]++;
+
+  recent.opcodes[1] = recent.opcodes[0];
+  recent.opcodes[0] = opcode;
+  recent.count = recent.count < 2 ? recent.count + 1 : 2;
+  recent.next_offset = offset + get_instruction_size(opcode);
+}
+
+static int compare_sequence_counts(const void* a, const void* b) {
+  uint64_t count_a = ((const SequenceCount*)a)->count;
+  uint64_t count_b = ((const SequenceCount*)b)->count;
+
+  return count_a < count_b ? 1 : (count_a > count_b ? -1 : 0);
+}
+
+static void print_sequences(FILE* fout, const char* title, SequenceCount* sequences, int count) {
+  qsort(sequences, count, sizeof(SequenceCount), compare_sequence_counts);
+
+  fprintf(fout, "\n%s\n\n", title);
+  fprintf(fout, "%16s  %7s    Sequence\n", "Executed", "Share");
+  for (int i = 0; i < count && i < REPORT_MAX_ROWS; i++) {
+    SequenceCount* sequence = &sequences[i];
+    fprintf(fout, "%16llu  %6.2f%%    ", (unsigned long long)sequence->count, 100.0 * sequence->count / total_count);
+    for (int j = 0; j < sequence->length; j++)
+      fprintf(fout, j == 0 ? "%s" : "; %s", get_opcode_name(sequence->opcodes[j]));
+    fprintf(fout, "\n");
+  }
+}
+
+/// Print the most frequently executed instructions and sequences of instructions.
+void profiler_print_report(FILE* fout) {
+  fprintf(fout, "\n================ Opcode Profile ================\n");
+  fprintf(fout, "\nInstructions executed: %llu\n", (unsigned long long)total_count);
+  if (total_count == 0)
+    return;
+
+  SequenceCount* sequences = malloc(sizeof(SequenceCount) * OPCODE_COUNT * OPCODE_COUNT * OPCODE_COUNT);
+  if (sequences == NULL)
+    return;
+
+  int count = 0;
+  for (int a = 0; a < OPCODE_COUNT; a++) {
+    if (unigram_counts[a] > 0)
+      sequences[count++] = (SequenceCount){ { a }, 1, unigram_counts[a] };
+  }
+  print_sequences(fout, "Instructions:", sequences, count);
+
+  count = 0;
+  for (int a = 0; a < OPCODE_COUNT; a++) {
+    for (int b = 0; b < OPCODE_COUNT; b++) {
+      if (bigram_counts[a][b] > 0)
+        sequences[count++] = (SequenceCount){ { a, b }, 2, bigram_counts[a][b] };
+    }
+  }
+  print_sequences(fout, "Bigrams (superinstruction candidates):", sequences, count);
+
+  count = 0;
+  for (int a = 0; a < OPCODE_COUNT; a++) {
+    for (int b = 0; b < OPCODE_COUNT; b++) {
+      for (int c = 0; c < OPCODE_COUNT; c++) {
+        if (trigram_counts[a][b][c] > 0)
+          sequences[count++] = (SequenceCount){ { a, b, c }, 3, trigram_counts[a][b][c] };
+      }
+    }
+  }
+  print_sequences(fout, "Trigrams (superinstruction candidates):", sequences, count);
+  fprintf(fout, "\n");
+
+  free(sequences);
+}
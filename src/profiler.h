@@ -0,0 +1,12 @@
+#ifndef CTHUSLY_PROFILER_H
+#define CTHUSLY_PROFILER_H
+
+#include <stdio.h>
+
+#include "program.h"
+
+void profiler_start_program();
+void profiler_record_instruction(Program* program, int offset);
+void profiler_print_report(FILE* fout);
+
+#endif
@@ -1,5 +1,6 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "memory.h"
 #include "program.h"
@@ -34,11 +35,65 @@ static void constant_pool_add(ConstantPool* pool, ThuslyValue value) {
   pool->count++;
 }
 
+/// The largest offset delta of a line table entry.
+#define LINE_OFFSET_DELTA_MAX UINT8_MAX
+/// The range of source line deltas of a line table entry.
+#define LINE_DELTA_MIN INT8_MIN
+#define LINE_DELTA_MAX INT8_MAX
+
+static void line_table_init(LineTable* lines) {
+  lines->deltas = NULL;
+  lines->count = 0;
+  lines->capacity = 0;
+  lines->last_offset = 0;
+  lines->last_source_line = 0;
+}
+
+static void line_table_free(LineTable* lines) {
+  FREE_ARRAY(byte, lines->deltas, lines->capacity);
+  line_table_init(lines);
+}
+
+static void line_table_write(LineTable* lines, int offset_delta, int line_delta) {
+  bool max_capacity_reached = lines->count + 2 > lines->capacity;
+  if (max_capacity_reached) {
+    int old_capacity = lines->capacity;
+    lines->capacity = GROW_CAPACITY(old_capacity);
+    lines->deltas = GROW_ARRAY(byte, lines->deltas, old_capacity, lines->capacity);
+  }
+
+  lines->deltas[lines->count] = (byte)offset_delta;
+  lines->deltas[lines->count + 1] = (byte)(int8_t)line_delta;
+  lines->count += 2;
+}
+
+/// Record the source line of the instruction (byte) written at the given offset,
+/// which only adds an entry if the line differs from that of the previous instruction.
+static void line_table_add(LineTable* lines, int offset, int source_line) {
+  if (source_line == lines->last_source_line)
+    return;
+
+  int offset_delta = offset - lines->last_offset;
+  int line_delta = source_line - lines->last_source_line;
+  for (; offset_delta > LINE_OFFSET_DELTA_MAX; offset_delta -= LINE_OFFSET_DELTA_MAX)
+    line_table_write(lines, LINE_OFFSET_DELTA_MAX, 0);
+  for (; line_delta > LINE_DELTA_MAX; line_delta -= LINE_DELTA_MAX, offset_delta = 0)
+    line_table_write(lines, offset_delta, LINE_DELTA_MAX);
+  for (; line_delta < LINE_DELTA_MIN; line_delta -= LINE_DELTA_MIN, offset_delta = 0)
+    line_table_write(lines, offset_delta, LINE_DELTA_MIN);
+  line_table_write(lines, offset_delta, line_delta);
+
+  lines->last_offset = offset;
+  lines->last_source_line = source_line;
+}
+
 void program_init(Program* program) {
-  program->source_lines = NULL;
+  line_table_init(&program->lines);
   program->instructions = NULL;
   program->count = 0;
   program->capacity = 0;
+  program->is_mapped = false;
+  program->max_stack_depth = 0;
   constant_pool_init(&program->constant_pool);
 }
 
@@ -50,8 +105,10 @@ void program_free(Program* program) {
   #endif
   // ---------------
 
-  FREE_ARRAY(int, program->source_lines, program->capacity);
-  FREE_ARRAY(byte, program->instructions, program->capacity);
+  if (!program->is_mapped) {
+    line_table_free(&program->lines);
+    FREE_ARRAY(byte, program->instructions, program->capacity);
+  }
   constant_pool_free(&program->constant_pool);
   program_init(program);
 }
@@ -62,11 +119,10 @@ void program_write(Program* program, byte instruction, int source_line) {
     int old_capacity = program->capacity;
     program->capacity = GROW_CAPACITY(old_capacity);
     program->instructions = GROW_ARRAY(byte, program->instructions, old_capacity, program->capacity);
-    program->source_lines = GROW_ARRAY(int, program->source_lines, old_capacity, program->capacity);
   }
 
   program->instructions[program->count] = instruction;
-  program->source_lines[program->count] = source_line;
+  line_table_add(&program->lines, program->count, source_line);
   program->count++;
 }
 
@@ -74,8 +130,300 @@ void program_overwrite(Program* program, int offset, byte updated_instruction) {
   program->instructions[offset] = updated_instruction;
 }
 
+/// Discard the instructions from the given offset (count) onward.
+void program_truncate(Program* program, int count) {
+  program->count = count;
+
+  // (The entries are removed from the end by undoing their deltas.)
+  LineTable* lines = &program->lines;
+  while (lines->count > 0 && lines->last_offset >= count) {
+    lines->count -= 2;
+    lines->last_offset -= lines->deltas[lines->count];
+    lines->last_source_line -= (int8_t)lines->deltas[lines->count + 1];
+  }
+}
+
+/// Get the source line of the instruction at the given offset (or of the
+/// instruction that the byte at the offset is an operand of).
+///
+/// (The line table is decoded from the start, which is only done when reporting
+/// runtime errors and disassembling.)
+int program_get_source_line(Program* program, int offset) {
+  LineTable* lines = &program->lines;
+  int entry_offset = 0;
+  int source_line = 0;
+  for (int i = 0; i < lines->count; i += 2) {
+    int next_entry_offset = entry_offset + lines->deltas[i];
+    if (next_entry_offset > offset)
+      break;
+
+    entry_offset = next_entry_offset;
+    source_line += (int8_t)lines->deltas[i + 1];
+  }
+
+  return source_line;
+}
+
+/// Rebuild the line table after the instructions have been moved to new offsets
+/// (indexed by their previous offsets, see `program_relocate()`).
+static void program_relocate_lines(Program* program, const int* new_offsets) {
+  LineTable old_lines = program->lines;
+  line_table_init(&program->lines);
+
+  int offset = 0;
+  int source_line = 0;
+  for (int i = 0; i < old_lines.count; i += 2) {
+    offset += old_lines.deltas[i];
+    source_line += (int8_t)old_lines.deltas[i + 1];
+
+    // Only the last of the entries at an offset holds the line of the instruction
+    // there. (The offsets of entries that do not change the line need not be those
+    // of instructions, and are skipped.)
+    bool is_last_at_offset = i + 2 == old_lines.count || old_lines.deltas[i + 2] != 0;
+    if (is_last_at_offset && source_line != program->lines.last_source_line)
+      line_table_add(&program->lines, new_offsets[offset], source_line);
+  }
+
+  line_table_free(&old_lines);
+}
+
+/// Move the instructions to the given new offsets (indexed by their current
+/// offsets, with `new_offsets[program->count]` being the new size of the code),
+/// e.g. after the peephole optimizer removed instructions or when the compiler
+/// turns long jumps into their short form. The new size of an instruction is the
+/// distance to the new offset of the next one: An instruction whose new size is
+/// 0 is removed, and a long jump given the size of its short form is turned into
+/// the short form. Jumps are re-encoded for the new offsets of their targets.
+void program_relocate(Program* program, const int* new_offsets) {
+  int count = program->count;
+
+  // The instructions are moved in place (toward the start, so an instruction is
+  // read before it can be overwritten).
+  int offset = 0;
+  while (offset < count) {
+    byte opcode = program->instructions[offset];
+    int size = get_instruction_size(opcode);
+    int destination = new_offsets[offset];
+    int new_size = new_offsets[offset + size] - destination;
+    if (new_size == 0) {
+      // (Removed.)
+    }
+    else if (is_jump_instruction(opcode)) {
+      bool is_shortened = new_size < size;
+      byte new_opcode = is_shortened ? get_short_jump_opcode(opcode) : opcode;
+      int new_target = new_offsets[get_jump_target(program, offset)];
+      int new_next_offset = destination + new_size;
+      int jump_size = new_target > new_next_offset ? new_target - new_next_offset : new_next_offset - new_target;
+      // The stack slot of OP_FOREACH_NEXT precedes the jump operand.
+      bool has_slot = opcode == OP_FOREACH_NEXT || opcode == OP_FOREACH_NEXT_LONG;
+      int slot = has_slot ? get_loop_variable_slot(program, offset) : 0;
+      int slot_operand_bytes = has_slot ? (new_opcode == OP_FOREACH_NEXT ? 1 : 3) : 0;
+      int jump_operand_bytes = new_size - 1 - slot_operand_bytes;
+
+      program->instructions[destination] = new_opcode;
+      for (int i = 0; i < slot_operand_bytes; i++)
+        program->instructions[destination + 1 + i] = (slot >> (8 * (slot_operand_bytes - 1 - i))) & 0xff;
+      for (int i = 0; i < jump_operand_bytes; i++)
+        program->instructions[destination + 1 + slot_operand_bytes + i] = (jump_size >> (8 * (jump_operand_bytes - 1 - i))) & 0xff;
+    }
+    else
+      memmove(&program->instructions[destination], &program->instructions[offset], size);
+    offset += size;
+  }
+  program_relocate_lines(program, new_offsets);
+  program_truncate(program, new_offsets[count]);
+}
+
+/// Get the number of bytes used by the line table (for the VM stats).
+size_t program_get_line_table_size(Program* program) {
+  return program->lines.count * sizeof(byte);
+}
+
 int program_add_constant(Program* program, ThuslyValue value) {
   constant_pool_add(&program->constant_pool, value);
 
   return program->constant_pool.count - 1;
 }
+
+/// Get the size (in bytes) of an instruction, including its operands.
+int get_instruction_size(byte opcode) {
+  switch (opcode) {
+    case OP_CONSTANT:
+    case OP_GET_VAR:
+    case OP_POPN:
+    case OP_SET_VAR:
+    case OP_SET_VAR_POP:
+      return 2;
+    case OP_ADD_VAR_CONSTANT:
+    case OP_JUMP_BWD:
+    case OP_JUMP_FWD:
+    case OP_JUMP_FWD_IF_FALSE:
+    case OP_JUMP_FWD_IF_TRUE:
+    case OP_LESS_THAN_EQUALS_VARS:
+      return 3;
+    case OP_CONSTANT_LONG:
+    case OP_FOREACH_NEXT:
+    case OP_GET_VAR_LONG:
+    case OP_SET_VAR_LONG:
+      return 4;
+    case OP_JUMP_BWD_LONG:
+    case OP_JUMP_FWD_LONG:
+    case OP_JUMP_FWD_IF_FALSE_LONG:
+    case OP_JUMP_FWD_IF_TRUE_LONG:
+      return 5;
+    case OP_FOREACH_NEXT_LONG:
+      return 8;
+    default:
+      return 1;
+  }
+}
+
+/// Read the operand of a long-operand instruction (3 bytes, big-endian).
+int read_long_operand(const byte* operand) {
+  return (operand[0] << 16) | (operand[1] << 8) | operand[2];
+}
+
+bool is_jump_instruction(byte opcode) {
+  switch (opcode) {
+    case OP_FOREACH_NEXT:
+    case OP_FOREACH_NEXT_LONG:
+    case OP_JUMP_BWD:
+    case OP_JUMP_FWD:
+    case OP_JUMP_FWD_IF_FALSE:
+    case OP_JUMP_FWD_IF_TRUE:
+    case OP_JUMP_BWD_LONG:
+    case OP_JUMP_FWD_LONG:
+    case OP_JUMP_FWD_IF_FALSE_LONG:
+    case OP_JUMP_FWD_IF_TRUE_LONG:
+      return true;
+    default:
+      return false;
+  }
+}
+
+/// Get the short form of a long jump instruction (other instructions are returned as is).
+byte get_short_jump_opcode(byte long_opcode) {
+  switch (long_opcode) {
+    case OP_FOREACH_NEXT_LONG:      return OP_FOREACH_NEXT;
+    case OP_JUMP_BWD_LONG:          return OP_JUMP_BWD;
+    case OP_JUMP_FWD_LONG:          return OP_JUMP_FWD;
+    case OP_JUMP_FWD_IF_FALSE_LONG: return OP_JUMP_FWD_IF_FALSE;
+    case OP_JUMP_FWD_IF_TRUE_LONG:  return OP_JUMP_FWD_IF_TRUE;
+    default:                        return long_opcode;
+  }
+}
+
+/// Get the offset of the instruction that the jump instruction at the given
+/// offset jumps to. (The jump is relative to the end of the jump instruction.)
+int get_jump_target(Program* program, int offset) {
+  byte opcode = program->instructions[offset];
+  const byte* operand = &program->instructions[offset + 1];
+  int next_offset = offset + get_instruction_size(opcode);
+  // The jump operand of OP_FOREACH_NEXT follows the stack slot of the loop variable.
+  if (opcode == OP_FOREACH_NEXT)
+    operand += 1;
+  else if (opcode == OP_FOREACH_NEXT_LONG)
+    operand += 3;
+  switch (opcode) {
+    case OP_FOREACH_NEXT:
+    case OP_JUMP_BWD:
+      return next_offset - ((operand[0] << 8) | operand[1]);
+    case OP_FOREACH_NEXT_LONG:
+    case OP_JUMP_BWD_LONG:
+      return next_offset - (int)(((uint32_t)operand[0] << 24) | (operand[1] << 16) | (operand[2] << 8) | operand[3]);
+    case OP_JUMP_FWD_LONG:
+    case OP_JUMP_FWD_IF_FALSE_LONG:
+    case OP_JUMP_FWD_IF_TRUE_LONG:
+      return next_offset + (int)(((uint32_t)operand[0] << 24) | (operand[1] << 16) | (operand[2] << 8) | operand[3]);
+    default:
+      return next_offset + ((operand[0] << 8) | operand[1]);
+  }
+}
+
+/// Get the stack slot of the loop variable of the OP_FOREACH_NEXT (or
+/// OP_FOREACH_NEXT_LONG) instruction at the given offset.
+int get_loop_variable_slot(Program* program, int offset) {
+  const byte* operand = &program->instructions[offset + 1];
+
+  return program->instructions[offset] == OP_FOREACH_NEXT ? operand[0] : read_long_operand(operand);
+}
+
+/// Get the change in the number of values on the VM's stack from executing the
+/// instruction at the given offset, and set `out_peak` to the largest number of
+/// values it has pushed at any point (e.g. the fused instructions may push both
+/// of their operands before combining them).
+int get_stack_effect(Program* program, int offset, int* out_peak) {
+  byte opcode = program->instructions[offset];
+  int effect;
+  switch (opcode) {
+    case OP_CONSTANT:
+    case OP_CONSTANT_FALSE:
+    case OP_CONSTANT_NONE:
+    case OP_CONSTANT_TRUE:
+    case OP_CONSTANT_LONG:
+    case OP_GET_VAR:
+    case OP_GET_VAR_LONG:
+      effect = 1;
+      break;
+    case OP_ADD_VAR_CONSTANT:
+    case OP_LESS_THAN_EQUALS_VARS:
+      *out_peak = 2;
+      return 1;
+    case OP_NEGATE:
+    case OP_NOT:
+    case OP_RETURN:
+    case OP_SET_VAR:
+    case OP_SET_VAR_LONG:
+      effect = 0;
+      break;
+    case OP_POPN:
+      // See `compiler.discard_scope()` for comments regarding `N + 1`.
+      effect = -(program->instructions[offset + 1] + 1);
+      break;
+    default:
+      // The jumps leave the stack as is, and the remaining instructions pop
+      // one value (e.g. OP_POP) or replace two values with one (e.g. OP_ADD).
+      effect = is_jump_instruction(opcode) ? 0 : -1;
+      break;
+  }
+  *out_peak = effect > 0 ? effect : 0;
+
+  return effect;
+}
+
+/// Get the largest number of values on the VM's stack while running the program.
+///
+/// The instructions are visited in order, and the depth before an instruction is
+/// the largest depth of the instruction before it and of the forward jumps to it.
+/// Backward jumps are not followed, since the compiler only writes them at the end
+/// of loops whose bodies leave the stack as they found it. (Treating every
+/// instruction as reachable from the one before it can only overestimate the depth.)
+int get_max_stack_depth(Program* program) {
+  int* depths = ALLOCATE(int, program->count + 1);
+  for (int i = 0; i <= program->count; i++)
+    depths[i] = 0;
+
+  int max_depth = 0;
+  int offset = 0;
+  while (offset < program->count) {
+    int peak;
+    int depth_after = depths[offset] + get_stack_effect(program, offset, &peak);
+    if (depths[offset] + peak > max_depth)
+      max_depth = depths[offset] + peak;
+
+    byte opcode = program->instructions[offset];
+    int next_offset = offset + get_instruction_size(opcode);
+    if (is_jump_instruction(opcode)) {
+      int target_offset = get_jump_target(program, offset);
+      if (target_offset > offset && depth_after > depths[target_offset])
+        depths[target_offset] = depth_after;
+    }
+    if (depth_after > depths[next_offset])
+      depths[next_offset] = depth_after;
+    offset = next_offset;
+  }
+
+  FREE_ARRAY(int, depths, program->count + 1);
+
+  return max_depth;
+}
@@ -4,6 +4,16 @@
 #include "common.h"
 #include "thusly_value.h"
 
+/// The largest operand of an instruction in its short form (1 byte), such as the
+/// stack slot of OP_GET_VAR or the constant index of OP_CONSTANT.
+#define SHORT_OPERAND_MAX UINT8_MAX
+/// The largest operand of an instruction in its long form (3 bytes, e.g. OP_GET_VAR_LONG).
+#define LONG_OPERAND_MAX ((1 << 24) - 1)
+/// The largest jump (in bytes) of a jump instruction in its short form (2 bytes).
+#define SHORT_JUMP_MAX UINT16_MAX
+/// The largest jump (in bytes) of a jump instruction in its long form (4 bytes).
+#define LONG_JUMP_MAX INT32_MAX
+
 /// The opcode of the instruction for determining
 /// which operation the VM should perform.
 typedef enum {
@@ -36,6 +46,40 @@ typedef enum {
   OP_RETURN,
   OP_SET_VAR,
   OP_SUBTRACT,
+  // Superinstructions (fused sequences of common instructions).
+  OP_ADD_VAR_CONSTANT,
+  OP_FOREACH_NEXT,
+  OP_LESS_THAN_EQUALS_VARS,
+  OP_SET_VAR_POP,
+  // ----
+  // Long-operand forms of instructions, used when an operand does not fit in the
+  // short form. The compiler writes the short form whenever the operand fits.
+  OP_CONSTANT_LONG,
+  OP_FOREACH_NEXT_LONG,
+  OP_GET_VAR_LONG,
+  OP_JUMP_BWD_LONG,
+  OP_JUMP_FWD_LONG,
+  OP_JUMP_FWD_IF_FALSE_LONG,
+  OP_JUMP_FWD_IF_TRUE_LONG,
+  OP_SET_VAR_LONG,
+  // ----
+  // Type-specialized (quickened) forms of generic instructions. These are never
+  // written by the compiler, but the VM rewrites a generic instruction in place
+  // based on the operand types observed, and reverts it if the types change.
+  OP_ADD_NUM,
+  OP_CONCAT_TEXT,
+  OP_DIVIDE_NUM,
+  OP_EQUALS_NUM,
+  OP_GREATER_THAN_NUM,
+  OP_GREATER_THAN_EQUALS_NUM,
+  OP_LESS_THAN_NUM,
+  OP_LESS_THAN_EQUALS_NUM,
+  OP_MULTIPLY_NUM,
+  OP_NOT_EQUALS_NUM,
+  OP_SUBTRACT_NUM,
+  // ----
+  // (Not an opcode, but the number of opcodes.)
+  OPCODE_COUNT,
 } Opcode;
 
 /// The constant pool containing all literal values used in
@@ -47,24 +91,54 @@ typedef struct {
   int capacity;
 } ConstantPool;
 
+/// The source line of each instruction, delta-encoded: an entry is a pair of
+/// bytes holding the number of bytes since the offset of the previous entry and
+/// the (signed) change in source line from there. Entries are only added where
+/// the source line changes, so the table grows with the number of lines rather
+/// than the number of bytes. (Larger changes are split over several entries.)
+typedef struct {
+  byte* deltas;
+  int count;
+  int capacity;
+  /// The offset and source line that the last entry leads to.
+  int last_offset;
+  int last_source_line;
+} LineTable;
+
 /// The compiled program containing the bytecode
 /// instructions in sequential order.
 typedef struct {
   ConstantPool constant_pool;
-  // The `source_lines` array follows the `instructions` in
-  // that the bytecode instruction at e.g. index 2 corresponds
-  // to the source file line at index 2.
-  // TODO: Use run-length encoding to only store unique source lines.
-  int* source_lines;
+  /// The source lines of the `instructions` (see `program_get_source_line()`).
+  LineTable lines;
   byte* instructions;
   int count;
   int capacity;
+  /// Whether the instructions and line table are mapped from a bytecode file
+  /// (see bytecode_file.c) rather than allocated, in which case they are not
+  /// freed along with the program.
+  bool is_mapped;
+  /// The largest number of values on the VM's stack while running the program
+  /// (see `get_max_stack_depth()`), which the VM reserves room for up front.
+  int max_stack_depth;
 } Program;
 
 void program_init(Program* program);
 void program_free(Program* program);
 void program_write(Program* program, byte instruction, int source_line);
 void program_overwrite(Program* program, int offset, byte updated_instruction);
+void program_truncate(Program* program, int count);
+int program_get_source_line(Program* program, int offset);
+void program_relocate(Program* program, const int* new_offsets);
+size_t program_get_line_table_size(Program* program);
 int program_add_constant(Program* program, ThuslyValue value);
+int get_instruction_size(byte opcode);
+int read_long_operand(const byte* operand);
+bool is_jump_instruction(byte opcode);
+byte get_short_jump_opcode(byte long_opcode);
+int get_jump_target(Program* program, int offset);
+int get_loop_variable_slot(Program* program, int offset);
+int get_stack_effect(Program* program, int offset, int* out_peak);
+int get_max_stack_depth(Program* program);
 
 #endif
@@ -0,0 +1,787 @@
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "common.h"
+#include "debug.h"
+#include "gc_object.h"
+#include "memory.h"
+#include "register_vm.h"
+
+/// The register-based engine (`--engine=reg`) - Rather than pushing the operands
+/// of each operation onto the stack and popping them again, a register instruction
+/// names the registers it reads and writes (e.g. `REG_ADD r3, r1, r2`), so that
+/// e.g. `total: total + i` is a single instruction rather than four.
+///
+/// The register program is translated from the compiled bytecode by running the
+/// stack symbolically: Each stack slot records the register that holds its value,
+/// which is the slot's own register unless the value was pushed by OP_GET_VAR or
+/// OP_CONSTANT (which emit nothing, but make the slot refer to the register of
+/// the variable or constant). Operations then read the referred registers
+/// directly, and write their result into the register of the slot that the
+/// bytecode leaves it in, or straight into a variable if it is assigned next.
+///
+/// Slots referring to another register are materialized (the value is moved
+/// into the slot's own register) before that register is written, and at every
+/// jump and jump target, where the slots are to hold their own values. The
+/// exception is the condition of a conditional jump that is popped wherever the
+/// jump goes, which is never materialized (and a comparison followed by such a
+/// jump is fused into a compare-and-branch instruction).
+
+/// (Of a stack depth or an instruction index) The instruction is not reached by
+/// the translation (yet).
+#define NOT_REACHED -1
+
+typedef struct {
+  Program* program;
+  RegisterProgram* out;
+  /// The register holding the value of each stack slot (see the comment above).
+  int* sources;
+  /// The number of stack slots referring to each register.
+  int* reference_counts;
+  /// The stack slots that may refer to another register (some entries may be
+  /// stale, i.e. refer to their own register again).
+  int* referring_slots;
+  int referring_count;
+  int referring_capacity;
+  /// The depth of the stack at the current instruction (NOT_REACHED after an
+  /// unconditional jump until the next jump target).
+  int depth;
+  /// The depth of the stack before each instruction (NOT_REACHED if unreachable).
+  int* depths;
+  bool* is_jump_target;
+  /// The index of the register instruction that each bytecode instruction was
+  /// translated into (that is, the first one, if any).
+  int* indices;
+  /// The index of the register instruction after the latest jump target (since
+  /// instructions before it cannot be rewritten based on the instructions after).
+  int label_index;
+} Translator;
+
+static bool writes_register(RegisterOpcode opcode) {
+  return opcode <= REG_NOT;
+}
+
+static bool is_comparison(RegisterOpcode opcode) {
+  return opcode >= REG_EQUALS && opcode <= REG_LESS_THAN_EQUALS;
+}
+
+static bool is_register_jump(RegisterOpcode opcode) {
+  return opcode >= REG_JUMP && opcode <= REG_FOREACH_NEXT;
+}
+
+static int emit(Translator* translator, RegisterOpcode opcode, int a, int b, int c, int source_offset) {
+  RegisterProgram* out = translator->out;
+  if (out->count == out->capacity) {
+    int old_capacity = out->capacity;
+    out->capacity = GROW_CAPACITY(old_capacity);
+    out->instructions = GROW_ARRAY(RegisterInstruction, out->instructions, old_capacity, out->capacity);
+    out->source_offsets = GROW_ARRAY(int, out->source_offsets, old_capacity, out->capacity);
+  }
+  out->instructions[out->count] = (RegisterInstruction){ .opcode = opcode, .a = a, .b = b, .c = c };
+  out->source_offsets[out->count] = source_offset;
+
+  return out->count++;
+}
+
+/// Make the stack slot hold its own value again (without moving the value into it).
+static void release_slot(Translator* translator, int slot) {
+  int source = translator->sources[slot];
+  if (source != slot) {
+    translator->reference_counts[source]--;
+    translator->sources[slot] = slot;
+  }
+}
+
+static void set_source(Translator* translator, int slot, int source) {
+  release_slot(translator, slot);
+  if (source == slot)
+    return;
+
+  translator->sources[slot] = source;
+  translator->reference_counts[source]++;
+  if (translator->referring_count == translator->referring_capacity) {
+    int old_capacity = translator->referring_capacity;
+    translator->referring_capacity = GROW_CAPACITY(old_capacity);
+    translator->referring_slots = GROW_ARRAY(int, translator->referring_slots, old_capacity, translator->referring_capacity);
+  }
+  translator->referring_slots[translator->referring_count++] = slot;
+}
+
+static void push_source(Translator* translator, int source) {
+  set_source(translator, translator->depth++, source);
+}
+
+static void pop_slots(Translator* translator, int count) {
+  for (int i = 0; i < count; i++)
+    release_slot(translator, --translator->depth);
+}
+
+static void materialize_slot(Translator* translator, int slot, int source_offset) {
+  emit(translator, REG_MOVE, slot, translator->sources[slot], 0, source_offset);
+  release_slot(translator, slot);
+}
+
+/// Materialize the stack slots referring to the register before it is written.
+static void prepare_write(Translator* translator, int reg, int source_offset) {
+  if (translator->reference_counts[reg] == 0)
+    return;
+
+  for (int i = 0; i < translator->referring_count; i++) {
+    int slot = translator->referring_slots[i];
+    if (translator->sources[slot] == reg)
+      materialize_slot(translator, slot, source_offset);
+  }
+}
+
+/// Materialize all stack slots, except for the top of the stack if `keep_top` is set.
+static void materialize_all(Translator* translator, bool keep_top, int source_offset) {
+  int top = translator->depth - 1;
+  int kept_count = 0;
+  for (int i = 0; i < translator->referring_count; i++) {
+    int slot = translator->referring_slots[i];
+    if (translator->sources[slot] == slot)
+      continue;
+    if (keep_top && slot == top)
+      translator->referring_slots[kept_count++] = slot;
+    else
+      materialize_slot(translator, slot, source_offset);
+  }
+  translator->referring_count = kept_count;
+}
+
+/// End the current path of the control flow (after an unconditional jump). The
+/// stack slots are made to hold their own values, as at every jump target.
+static void end_path(Translator* translator) {
+  for (int i = 0; i < translator->referring_count; i++)
+    release_slot(translator, translator->referring_slots[i]);
+  translator->referring_count = 0;
+  translator->depth = NOT_REACHED;
+}
+
+static bool is_unconditional_jump(byte opcode) {
+  return opcode == OP_JUMP_FWD || opcode == OP_JUMP_FWD_LONG || opcode == OP_JUMP_BWD || opcode == OP_JUMP_BWD_LONG;
+}
+
+/// Set the depth of the stack before each instruction, following the jumps in
+/// both directions (unlike `get_max_stack_depth()`, the code after a jump is only
+/// reached by jumping to it, e.g. the modification expression of a `while` loop
+/// is reached by the backward jump at the end of the loop body).
+static void find_stack_depths(Program* program, int* depths) {
+  for (int offset = 0; offset < program->count; offset++)
+    depths[offset] = NOT_REACHED;
+  depths[0] = 0;
+
+  bool is_changed = true;
+  while (is_changed) {
+    is_changed = false;
+    for (int offset = 0; offset < program->count; offset += get_instruction_size(program->instructions[offset])) {
+      if (depths[offset] == NOT_REACHED)
+        continue;
+
+      int peak;
+      int depth_after = depths[offset] + get_stack_effect(program, offset, &peak);
+      byte opcode = program->instructions[offset];
+      int next_offset = offset + get_instruction_size(opcode);
+      if (is_jump_instruction(opcode)) {
+        int target = get_jump_target(program, offset);
+        if (depths[target] == NOT_REACHED) {
+          depths[target] = depth_after;
+          is_changed = is_changed || target < offset;
+        }
+      }
+      bool is_fallthrough = opcode != OP_RETURN && !is_unconditional_jump(opcode);
+      if (is_fallthrough && next_offset < program->count && depths[next_offset] == NOT_REACHED)
+        depths[next_offset] = depth_after;
+    }
+  }
+}
+
+/// Whether the value at the top of the stack is popped (rather than used) by
+/// the instruction at the given offset, whichever way its jumps go. (A
+/// conditional jump uses the value, e.g. the second of the two jumps starting a
+/// loop at `-O0`, which tests the same condition as the first.)
+static bool is_top_discarded_at(Program* program, int offset) {
+  byte opcode = program->instructions[offset];
+  switch (opcode) {
+    case OP_POP:
+      return true;
+    case OP_JUMP_FWD:
+    case OP_JUMP_FWD_LONG:
+      return program->instructions[get_jump_target(program, offset)] == OP_POP;
+    default:
+      return false;
+  }
+}
+
+static void translate_operation(Translator* translator, RegisterOpcode opcode, int operand_count, int source_offset) {
+  int depth = translator->depth;
+  int b = translator->sources[depth - operand_count];
+  int c = operand_count == 2 ? translator->sources[depth - 1] : 0;
+  pop_slots(translator, operand_count);
+  int result = translator->depth;
+  prepare_write(translator, result, source_offset);
+  emit(translator, opcode, result, b, c, source_offset);
+  push_source(translator, result);
+}
+
+/// Translate an operation reading the given registers (rather than stack slots).
+static void translate_fused_operation(Translator* translator, RegisterOpcode opcode, int b, int c, int source_offset) {
+  int result = translator->depth;
+  prepare_write(translator, result, source_offset);
+  emit(translator, opcode, result, b, c, source_offset);
+  push_source(translator, result);
+}
+
+static void translate_assignment(Translator* translator, int slot, int source_offset) {
+  RegisterProgram* out = translator->out;
+  int top = translator->depth - 1;
+  int value = translator->sources[top];
+
+  // When the value was just computed into the top of the stack, the instruction
+  // computing it writes it into the variable instead.
+  RegisterInstruction* latest = out->count > translator->label_index ? &out->instructions[out->count - 1] : NULL;
+  bool is_retargetable = value == top && latest != NULL && writes_register(latest->opcode)
+    && latest->a == top && translator->reference_counts[slot] == 0;
+  if (is_retargetable) {
+    latest->a = slot;
+    release_slot(translator, slot);
+    set_source(translator, top, slot);
+    return;
+  }
+
+  prepare_write(translator, slot, source_offset);
+  if (value != slot)
+    emit(translator, REG_MOVE, slot, value, 0, source_offset);
+  release_slot(translator, slot);
+}
+
+/// Get the opcode of the comparison fused with a conditional jump on its result.
+static RegisterOpcode get_fused_jump_opcode(RegisterOpcode comparison, bool is_jump_if_false) {
+  switch (comparison) {
+    // (The jump if equal is the jump unless not equal, and vice versa.)
+    case REG_EQUALS:              return is_jump_if_false ? REG_JUMP_UNLESS_EQUALS : REG_JUMP_UNLESS_NOT_EQUALS;
+    case REG_NOT_EQUALS:          return is_jump_if_false ? REG_JUMP_UNLESS_NOT_EQUALS : REG_JUMP_UNLESS_EQUALS;
+    case REG_GREATER_THAN:        return is_jump_if_false ? REG_JUMP_UNLESS_GREATER_THAN : REG_JUMP_IF_GREATER_THAN;
+    case REG_GREATER_THAN_EQUALS: return is_jump_if_false ? REG_JUMP_UNLESS_GREATER_THAN_EQUALS : REG_JUMP_IF_GREATER_THAN_EQUALS;
+    case REG_LESS_THAN:           return is_jump_if_false ? REG_JUMP_UNLESS_LESS_THAN : REG_JUMP_IF_LESS_THAN;
+    default:                      return is_jump_if_false ? REG_JUMP_UNLESS_LESS_THAN_EQUALS : REG_JUMP_IF_LESS_THAN_EQUALS;
+  }
+}
+
+static void translate_conditional_jump(Translator* translator, bool is_jump_if_false, int source_offset) {
+  Program* program = translator->program;
+  RegisterProgram* out = translator->out;
+  int target = get_jump_target(program, source_offset);
+  int top = translator->depth - 1;
+  int next_offset = source_offset + get_instruction_size(program->instructions[source_offset]);
+  bool is_condition_discarded = program->instructions[target] == OP_POP && is_top_discarded_at(program, next_offset);
+
+  // A comparison computing the condition right before the jump.
+  int comparison_index = out->count - 1;
+  bool is_fusable = is_condition_discarded && comparison_index >= translator->label_index
+    && is_comparison(out->instructions[comparison_index].opcode) && out->instructions[comparison_index].a == top
+    && translator->sources[top] == top;
+
+  materialize_all(translator, is_condition_discarded, source_offset);
+  if (is_fusable) {
+    // The moves materializing the stack slots do not read the result of the
+    // comparison, so the comparison is moved after them (fused with the jump).
+    RegisterInstruction comparison = out->instructions[comparison_index];
+    int comparison_offset = out->source_offsets[comparison_index];
+    int moved_count = out->count - comparison_index - 1;
+    memmove(&out->instructions[comparison_index], &out->instructions[comparison_index + 1], sizeof(RegisterInstruction) * moved_count);
+    memmove(&out->source_offsets[comparison_index], &out->source_offsets[comparison_index + 1], sizeof(int) * moved_count);
+    out->count--;
+    emit(translator, get_fused_jump_opcode(comparison.opcode, is_jump_if_false), target, comparison.b, comparison.c, comparison_offset);
+  }
+  else {
+    RegisterOpcode opcode = is_jump_if_false ? REG_JUMP_IF_FALSE : REG_JUMP_IF_TRUE;
+    emit(translator, opcode, target, translator->sources[top], 0, source_offset);
+  }
+}
+
+static void translate_jump(Translator* translator, int source_offset) {
+  Program* program = translator->program;
+  int target = get_jump_target(program, source_offset);
+  bool is_top_discarded = translator->depth > 0 && program->instructions[target] == OP_POP;
+  materialize_all(translator, is_top_discarded, source_offset);
+  emit(translator, REG_JUMP, target, 0, 0, source_offset);
+  end_path(translator);
+}
+
+static void translate_instruction(Translator* translator, int offset) {
+  Program* program = translator->program;
+  const byte* operands = &program->instructions[offset + 1];
+  int constant_base = translator->out->constant_base;
+  int special_base = constant_base + program->constant_pool.count;
+
+  switch (program->instructions[offset]) {
+    case OP_CONSTANT:
+      push_source(translator, constant_base + operands[0]);
+      break;
+    case OP_CONSTANT_LONG:
+      push_source(translator, constant_base + read_long_operand(operands));
+      break;
+    case OP_CONSTANT_FALSE:
+      push_source(translator, special_base);
+      break;
+    case OP_CONSTANT_NONE:
+      push_source(translator, special_base + 1);
+      break;
+    case OP_CONSTANT_TRUE:
+      push_source(translator, special_base + 2);
+      break;
+    case OP_GET_VAR:
+      push_source(translator, translator->sources[operands[0]]);
+      break;
+    case OP_GET_VAR_LONG:
+      push_source(translator, translator->sources[read_long_operand(operands)]);
+      break;
+    case OP_SET_VAR:
+      translate_assignment(translator, operands[0], offset);
+      break;
+    case OP_SET_VAR_LONG:
+      translate_assignment(translator, read_long_operand(operands), offset);
+      break;
+    case OP_SET_VAR_POP:
+      translate_assignment(translator, operands[0], offset);
+      pop_slots(translator, 1);
+      break;
+    case OP_POP:
+      pop_slots(translator, 1);
+      break;
+    case OP_POPN:
+      // (See `compiler.discard_scope()` regarding `N + 1`.)
+      pop_slots(translator, operands[0] + 1);
+      break;
+    case OP_ADD:                 translate_operation(translator, REG_ADD, 2, offset); break;
+    case OP_SUBTRACT:            translate_operation(translator, REG_SUBTRACT, 2, offset); break;
+    case OP_MULTIPLY:            translate_operation(translator, REG_MULTIPLY, 2, offset); break;
+    case OP_DIVIDE:              translate_operation(translator, REG_DIVIDE, 2, offset); break;
+    case OP_MODULO:              translate_operation(translator, REG_MODULO, 2, offset); break;
+    case OP_EQUALS:              translate_operation(translator, REG_EQUALS, 2, offset); break;
+    case OP_NOT_EQUALS:          translate_operation(translator, REG_NOT_EQUALS, 2, offset); break;
+    case OP_GREATER_THAN:        translate_operation(translator, REG_GREATER_THAN, 2, offset); break;
+    case OP_GREATER_THAN_EQUALS: translate_operation(translator, REG_GREATER_THAN_EQUALS, 2, offset); break;
+    case OP_LESS_THAN:           translate_operation(translator, REG_LESS_THAN, 2, offset); break;
+    case OP_LESS_THAN_EQUALS:    translate_operation(translator, REG_LESS_THAN_EQUALS, 2, offset); break;
+    case OP_NEGATE:              translate_operation(translator, REG_NEGATE, 1, offset); break;
+    case OP_NOT:                 translate_operation(translator, REG_NOT, 1, offset); break;
+    case OP_ADD_VAR_CONSTANT: {
+      int variable = translator->sources[operands[0]];
+      translate_fused_operation(translator, REG_ADD, variable, constant_base + operands[1], offset);
+      break;
+    }
+    case OP_LESS_THAN_EQUALS_VARS: {
+      int a = translator->sources[operands[0]];
+      int b = translator->sources[operands[1]];
+      translate_fused_operation(translator, REG_LESS_THAN_EQUALS, a, b, offset);
+      break;
+    }
+    case OP_OUT:
+      emit(translator, REG_OUT, translator->sources[translator->depth - 1], 0, 0, offset);
+      pop_slots(translator, 1);
+      break;
+    case OP_JUMP_FWD:
+    case OP_JUMP_FWD_LONG:
+    case OP_JUMP_BWD:
+    case OP_JUMP_BWD_LONG:
+      translate_jump(translator, offset);
+      break;
+    case OP_JUMP_FWD_IF_FALSE:
+    case OP_JUMP_FWD_IF_FALSE_LONG:
+      translate_conditional_jump(translator, true, offset);
+      break;
+    case OP_JUMP_FWD_IF_TRUE:
+    case OP_JUMP_FWD_IF_TRUE_LONG:
+      translate_conditional_jump(translator, false, offset);
+      break;
+    case OP_FOREACH_NEXT:
+    case OP_FOREACH_NEXT_LONG:
+      materialize_all(translator, false, offset);
+      emit(translator, REG_FOREACH_NEXT, get_jump_target(program, offset), get_loop_variable_slot(program, offset), 0, offset);
+      break;
+    case OP_RETURN:
+      emit(translator, REG_RETURN, 0, 0, 0, offset);
+      end_path(translator);
+      break;
+  }
+}
+
+/// Translate the (compiled, not yet run) program into register instructions.
+void register_program_translate(Program* program, RegisterProgram* out_program, VMStats* stats) {
+  out_program->instructions = NULL;
+  out_program->source_offsets = NULL;
+  out_program->count = 0;
+  out_program->capacity = 0;
+  out_program->constant_base = program->max_stack_depth;
+  // (The constants are followed by false, none and true.)
+  out_program->register_count = program->max_stack_depth + program->constant_pool.count + 3;
+
+  Translator translator = {
+    .program = program,
+    .out = out_program,
+    .sources = ALLOCATE(int, program->max_stack_depth + 1),
+    .reference_counts = ALLOCATE(int, out_program->register_count),
+    .referring_slots = NULL,
+    .referring_count = 0,
+    .referring_capacity = 0,
+    .depth = 0,
+    .depths = ALLOCATE(int, program->count),
+    .is_jump_target = ALLOCATE(bool, program->count),
+    .indices = ALLOCATE(int, program->count),
+    .label_index = 0,
+  };
+  for (int slot = 0; slot <= program->max_stack_depth; slot++)
+    translator.sources[slot] = slot;
+  for (int reg = 0; reg < out_program->register_count; reg++)
+    translator.reference_counts[reg] = 0;
+  for (int offset = 0; offset < program->count; offset++) {
+    translator.is_jump_target[offset] = false;
+    translator.indices[offset] = NOT_REACHED;
+  }
+
+  find_stack_depths(program, translator.depths);
+  int instruction_count = 0;
+  for (int offset = 0; offset < program->count; offset += get_instruction_size(program->instructions[offset])) {
+    if (is_jump_instruction(program->instructions[offset]))
+      translator.is_jump_target[get_jump_target(program, offset)] = true;
+    instruction_count++;
+  }
+
+  for (int offset = 0; offset < program->count; offset += get_instruction_size(program->instructions[offset])) {
+    if (translator.is_jump_target[offset]) {
+      if (translator.depth != NOT_REACHED)
+        materialize_all(&translator, false, offset);
+      translator.label_index = out_program->count;
+    }
+    translator.depth = translator.depths[offset];
+    // (E.g. the instructions after an unconditional jump that no jump goes to.)
+    if (translator.depth == NOT_REACHED)
+      continue;
+
+    translator.indices[offset] = out_program->count;
+    translate_instruction(&translator, offset);
+  }
+
+  // The jumps were translated with the bytecode offset of their target.
+  for (int i = 0; i < out_program->count; i++) {
+    RegisterInstruction* instruction = &out_program->instructions[i];
+    if (is_register_jump(instruction->opcode))
+      instruction->a = translator.indices[instruction->a];
+  }
+
+  stats->translated_instructions += instruction_count;
+  stats->register_instructions += out_program->count;
+
+  FREE_ARRAY(int, translator.sources, program->max_stack_depth + 1);
+  FREE_ARRAY(int, translator.reference_counts, out_program->register_count);
+  FREE_ARRAY(int, translator.referring_slots, translator.referring_capacity);
+  FREE_ARRAY(int, translator.depths, program->count);
+  FREE_ARRAY(bool, translator.is_jump_target, program->count);
+  FREE_ARRAY(int, translator.indices, program->count);
+}
+
+void register_program_free(RegisterProgram* program) {
+  FREE_ARRAY(RegisterInstruction, program->instructions, program->capacity);
+  FREE_ARRAY(int, program->source_offsets, program->capacity);
+  program->instructions = NULL;
+  program->source_offsets = NULL;
+  program->count = 0;
+  program->capacity = 0;
+}
+
+static bool are_registers_equal(Environment* environment, ThuslyValue* registers, int a, int b) {
+  if (IS_NUMBER(registers[a]) && IS_NUMBER(registers[b]))
+    return TO_C_DOUBLE(registers[a]) == TO_C_DOUBLE(registers[b]);
+
+  // Ropes are flattened in their registers (as on the stack, see `flatten_stack_top()`),
+  // which keeps the first operand rooted while the second is flattened.
+  registers[a] = flatten_text(environment, registers[a]);
+  registers[b] = flatten_text(environment, registers[b]);
+
+  return values_are_equal(registers[a], registers[b]);
+}
+
+/// Run the register program of the VM's program. The VM's stack is to have
+/// room for the registers (`register_program->register_count`).
+ErrorReport register_vm_execute(RegisterProgram* register_program, VM* vm) {
+  Environment* environment = &vm->environment;
+  ConstantPool* constants = &vm->program->constant_pool;
+  ThuslyValue* registers = vm->stack;
+  int constant_base = register_program->constant_base;
+  for (int reg = 0; reg < constant_base; reg++)
+    registers[reg] = FROM_C_NULL;
+  for (int i = 0; i < constants->count; i++)
+    registers[constant_base + i] = constants->values[i];
+  registers[constant_base + constants->count] = FROM_C_BOOL(false);
+  registers[constant_base + constants->count + 1] = FROM_C_NULL;
+  registers[constant_base + constants->count + 2] = FROM_C_BOOL(true);
+  // All registers are roots for the garbage collector.
+  vm->next_stack_top = registers + register_program->register_count;
+
+  RegisterInstruction* instructions = register_program->instructions;
+  RegisterInstruction* instruction = NULL;
+  RegisterInstruction* next_instruction = instructions;
+
+  #define R(index)        (registers[(index)])
+  #define JUMP(index)     (next_instruction = &instructions[(index)])
+  // Report the runtime error (on the source line of the bytecode instruction that
+  // the current instruction was translated from) and stop.
+  #define FAIL(...)                                                                         \
+    do {                                                                                    \
+      int source_offset = register_program->source_offsets[instruction - instructions];     \
+      vm_runtime_error(vm, source_offset, __VA_ARGS__);                                     \
+      return REPORT_RUNTIME_ERROR;                                                          \
+    } while (false)
+
+  #define DO_BINARY_OP(from_c_value, operator, operator_string)                             \
+    do {                                                                                    \
+      ThuslyValue b = R(instruction->b);                                                    \
+      ThuslyValue c = R(instruction->c);                                                    \
+      if (!IS_NUMBER(b) || !IS_NUMBER(c))                                                   \
+        FAIL("The operation (%s) can only be performed on numbers.", operator_string);     \
+      R(instruction->a) = from_c_value(TO_C_DOUBLE(b) operator TO_C_DOUBLE(c));             \
+    } while (false)
+
+  // Fused: the comparison and the jump if its result is `is_jump_if_true`.
+  #define DO_COMPARE_AND_JUMP(operator, operator_string, is_jump_if_true)                   \
+    do {                                                                                    \
+      ThuslyValue b = R(instruction->b);                                                    \
+      ThuslyValue c = R(instruction->c);                                                    \
+      if (!IS_NUMBER(b) || !IS_NUMBER(c))                                                   \
+        FAIL("The operation (%s) can only be performed on numbers.", operator_string);     \
+      if ((TO_C_DOUBLE(b) operator TO_C_DOUBLE(c)) == (is_jump_if_true))                    \
+        JUMP(instruction->a);                                                               \
+    } while (false)
+
+  #ifdef DEBUG_MODE
+    #define TRACE_EXECUTION()                                                               \
+      do {                                                                                  \
+        if (flag_debug_execution)                                                           \
+          disassemble_register_instruction(register_program, vm->program,                   \
+                                           (int)(next_instruction - instructions));         \
+      } while (false)
+  #else
+    #define TRACE_EXECUTION() do {} while (false)
+  #endif
+
+  // (See PROFILE_DISPATCH. The profiler only hooks into the stack-based loop.)
+  #ifdef PROFILE_DISPATCH
+    #define PROFILE_EXECUTION()                                                             \
+      do {                                                                                  \
+        if (flag_show_stats)                                                                \
+          vm->stats.executed_instructions++;                                                \
+      } while (false)
+  #else
+    #define PROFILE_EXECUTION() do {} while (false)
+  #endif
+
+  // (See `decode_and_execute()` in vm.c regarding the dispatch.)
+  #ifdef COMPUTED_GOTO
+    static void* dispatch_table[] = {
+      [REG_MOVE]                             = &&LABEL_REG_MOVE,
+      [REG_ADD]                              = &&LABEL_REG_ADD,
+      [REG_SUBTRACT]                         = &&LABEL_REG_SUBTRACT,
+      [REG_MULTIPLY]                         = &&LABEL_REG_MULTIPLY,
+      [REG_DIVIDE]                           = &&LABEL_REG_DIVIDE,
+      [REG_MODULO]                           = &&LABEL_REG_MODULO,
+      [REG_EQUALS]                           = &&LABEL_REG_EQUALS,
+      [REG_NOT_EQUALS]                       = &&LABEL_REG_NOT_EQUALS,
+      [REG_GREATER_THAN]                     = &&LABEL_REG_GREATER_THAN,
+      [REG_GREATER_THAN_EQUALS]              = &&LABEL_REG_GREATER_THAN_EQUALS,
+      [REG_LESS_THAN]                        = &&LABEL_REG_LESS_THAN,
+      [REG_LESS_THAN_EQUALS]                 = &&LABEL_REG_LESS_THAN_EQUALS,
+      [REG_NEGATE]                           = &&LABEL_REG_NEGATE,
+      [REG_NOT]                              = &&LABEL_REG_NOT,
+      [REG_OUT]                              = &&LABEL_REG_OUT,
+      [REG_JUMP]                             = &&LABEL_REG_JUMP,
+      [REG_JUMP_IF_FALSE]                    = &&LABEL_REG_JUMP_IF_FALSE,
+      [REG_JUMP_IF_TRUE]                     = &&LABEL_REG_JUMP_IF_TRUE,
+      [REG_JUMP_IF_GREATER_THAN]             = &&LABEL_REG_JUMP_IF_GREATER_THAN,
+      [REG_JUMP_IF_GREATER_THAN_EQUALS]      = &&LABEL_REG_JUMP_IF_GREATER_THAN_EQUALS,
+      [REG_JUMP_IF_LESS_THAN]                = &&LABEL_REG_JUMP_IF_LESS_THAN,
+      [REG_JUMP_IF_LESS_THAN_EQUALS]         = &&LABEL_REG_JUMP_IF_LESS_THAN_EQUALS,
+      [REG_JUMP_UNLESS_EQUALS]               = &&LABEL_REG_JUMP_UNLESS_EQUALS,
+      [REG_JUMP_UNLESS_NOT_EQUALS]           = &&LABEL_REG_JUMP_UNLESS_NOT_EQUALS,
+      [REG_JUMP_UNLESS_GREATER_THAN]         = &&LABEL_REG_JUMP_UNLESS_GREATER_THAN,
+      [REG_JUMP_UNLESS_GREATER_THAN_EQUALS]  = &&LABEL_REG_JUMP_UNLESS_GREATER_THAN_EQUALS,
+      [REG_JUMP_UNLESS_LESS_THAN]            = &&LABEL_REG_JUMP_UNLESS_LESS_THAN,
+      [REG_JUMP_UNLESS_LESS_THAN_EQUALS]     = &&LABEL_REG_JUMP_UNLESS_LESS_THAN_EQUALS,
+      [REG_FOREACH_NEXT]                     = &&LABEL_REG_FOREACH_NEXT,
+      [REG_RETURN]                           = &&LABEL_REG_RETURN,
+    };
+
+    #define DECODE_LOOP          DISPATCH();
+    #define INSTRUCTION(opcode)  LABEL_##opcode
+    #define DISPATCH()                                                      \
+      do {                                                                  \
+        TRACE_EXECUTION();                                                  \
+        PROFILE_EXECUTION();                                                \
+        instruction = next_instruction++;                                   \
+        goto *dispatch_table[instruction->opcode];                          \
+      } while (false)
+  #else
+    #define DECODE_LOOP          decode: TRACE_EXECUTION(); PROFILE_EXECUTION(); instruction = next_instruction++; switch (instruction->opcode)
+    #define INSTRUCTION(opcode)  case opcode
+    #define DISPATCH()           goto decode
+  #endif
+
+  #ifdef DEBUG_MODE
+    if (flag_debug_execution)
+      disassembler_print_register_headings("Execution");
+  #endif
+
+  DECODE_LOOP
+  {
+    INSTRUCTION(REG_MOVE):
+      R(instruction->a) = R(instruction->b);
+      DISPATCH();
+    INSTRUCTION(REG_ADD): {
+      ThuslyValue b = R(instruction->b);
+      ThuslyValue c = R(instruction->c);
+      if (IS_NUMBER(b) && IS_NUMBER(c))
+        R(instruction->a) = FROM_C_DOUBLE(TO_C_DOUBLE(b) + TO_C_DOUBLE(c));
+      else if (IS_TEXT(b) && IS_TEXT(c)) {
+        // (The operands stay rooted in their registers if a collection runs.)
+        if (!concatenate_texts(environment, b, c, &R(instruction->a)))
+          FAIL("The concatenated text would be longer than the maximum length (%d).", TEXT_MAX_LENGTH);
+      }
+      else
+        FAIL("Addition/concatenation (+) can only be performed on either numbers or texts.");
+      DISPATCH();
+    }
+    INSTRUCTION(REG_SUBTRACT):
+      DO_BINARY_OP(FROM_C_DOUBLE, -, "-");
+      DISPATCH();
+    INSTRUCTION(REG_MULTIPLY):
+      DO_BINARY_OP(FROM_C_DOUBLE, *, "*");
+      DISPATCH();
+    INSTRUCTION(REG_DIVIDE):
+      DO_BINARY_OP(FROM_C_DOUBLE, /, "/");
+      DISPATCH();
+    INSTRUCTION(REG_MODULO): {
+      ThuslyValue b = R(instruction->b);
+      ThuslyValue c = R(instruction->c);
+      if (!IS_NUMBER(b) || !IS_NUMBER(c))
+        FAIL("Modulo (mod) can only be performed on numbers.");
+      R(instruction->a) = FROM_C_DOUBLE(fmod(TO_C_DOUBLE(b), TO_C_DOUBLE(c)));
+      DISPATCH();
+    }
+    INSTRUCTION(REG_EQUALS):
+    INSTRUCTION(REG_NOT_EQUALS): {
+      bool is_equal = are_registers_equal(environment, registers, instruction->b, instruction->c);
+      R(instruction->a) = FROM_C_BOOL(instruction->opcode == REG_EQUALS ? is_equal : !is_equal);
+      DISPATCH();
+    }
+    INSTRUCTION(REG_GREATER_THAN):
+      DO_BINARY_OP(FROM_C_BOOL, >, ">");
+      DISPATCH();
+    INSTRUCTION(REG_GREATER_THAN_EQUALS):
+      DO_BINARY_OP(FROM_C_BOOL, >=, ">=");
+      DISPATCH();
+    INSTRUCTION(REG_LESS_THAN):
+      DO_BINARY_OP(FROM_C_BOOL, <, "<");
+      DISPATCH();
+    INSTRUCTION(REG_LESS_THAN_EQUALS):
+      DO_BINARY_OP(FROM_C_BOOL, <=, "<=");
+      DISPATCH();
+    INSTRUCTION(REG_NEGATE): {
+      ThuslyValue b = R(instruction->b);
+      if (!IS_NUMBER(b))
+        FAIL("Negation (-) can only be performed on numbers.");
+      R(instruction->a) = FROM_C_DOUBLE(-TO_C_DOUBLE(b));
+      DISPATCH();
+    }
+    INSTRUCTION(REG_NOT):
+      R(instruction->a) = FROM_C_BOOL(!is_truthy(R(instruction->b)));
+      DISPATCH();
+    INSTRUCTION(REG_OUT):
+      #ifdef DEBUG_MODE
+        if (flag_debug_execution) {
+          disassembler_indent_to_last_column();
+          printf("output: ");
+        }
+      #endif
+      R(instruction->a) = flatten_text(environment, R(instruction->a));
+      print_value(R(instruction->a));
+      printf("\n");
+      DISPATCH();
+    INSTRUCTION(REG_JUMP):
+      JUMP(instruction->a);
+      DISPATCH();
+    INSTRUCTION(REG_JUMP_IF_FALSE):
+      if (!is_truthy(R(instruction->b)))
+        JUMP(instruction->a);
+      DISPATCH();
+    INSTRUCTION(REG_JUMP_IF_TRUE):
+      if (is_truthy(R(instruction->b)))
+        JUMP(instruction->a);
+      DISPATCH();
+    INSTRUCTION(REG_JUMP_IF_GREATER_THAN):
+      DO_COMPARE_AND_JUMP(>, ">", true);
+      DISPATCH();
+    INSTRUCTION(REG_JUMP_IF_GREATER_THAN_EQUALS):
+      DO_COMPARE_AND_JUMP(>=, ">=", true);
+      DISPATCH();
+    INSTRUCTION(REG_JUMP_IF_LESS_THAN):
+      DO_COMPARE_AND_JUMP(<, "<", true);
+      DISPATCH();
+    INSTRUCTION(REG_JUMP_IF_LESS_THAN_EQUALS):
+      DO_COMPARE_AND_JUMP(<=, "<=", true);
+      DISPATCH();
+    INSTRUCTION(REG_JUMP_UNLESS_EQUALS):
+    INSTRUCTION(REG_JUMP_UNLESS_NOT_EQUALS): {
+      bool is_equal = are_registers_equal(environment, registers, instruction->b, instruction->c);
+      if (instruction->opcode == REG_JUMP_UNLESS_EQUALS ? !is_equal : is_equal)
+        JUMP(instruction->a);
+      DISPATCH();
+    }
+    INSTRUCTION(REG_JUMP_UNLESS_GREATER_THAN):
+      DO_COMPARE_AND_JUMP(>, ">", false);
+      DISPATCH();
+    INSTRUCTION(REG_JUMP_UNLESS_GREATER_THAN_EQUALS):
+      DO_COMPARE_AND_JUMP(>=, ">=", false);
+      DISPATCH();
+    INSTRUCTION(REG_JUMP_UNLESS_LESS_THAN):
+      DO_COMPARE_AND_JUMP(<, "<", false);
+      DISPATCH();
+    INSTRUCTION(REG_JUMP_UNLESS_LESS_THAN_EQUALS):
+      DO_COMPARE_AND_JUMP(<=, "<=", false);
+      DISPATCH();
+    INSTRUCTION(REG_FOREACH_NEXT): {
+      // (See OP_FOREACH_NEXT, including the errors of the generic path.)
+      ThuslyValue* variable = &R(instruction->b);
+      if (IS_NUMBER(variable[0]) && IS_NUMBER(variable[2]))
+        variable[0] = FROM_C_DOUBLE(TO_C_DOUBLE(variable[0]) + TO_C_DOUBLE(variable[2]));
+      else if (IS_TEXT(variable[0]) && IS_TEXT(variable[2])) {
+        if (!concatenate_texts(environment, variable[0], variable[2], &variable[0]))
+          FAIL("The concatenated text would be longer than the maximum length (%d).", TEXT_MAX_LENGTH);
+      }
+      else
+        FAIL("Addition/concatenation (+) can only be performed on either numbers or texts.");
+      if (!IS_NUMBER(variable[0]) || !IS_NUMBER(variable[1]))
+        FAIL("The operation (<=) can only be performed on numbers.");
+      if (TO_C_DOUBLE(variable[0]) <= TO_C_DOUBLE(variable[1]))
+        JUMP(instruction->a);
+      DISPATCH();
+    }
+    INSTRUCTION(REG_RETURN):
+      return REPORT_NO_ERROR;
+  }
+
+  // This should not be reachable.
+  return REPORT_RUNTIME_ERROR;
+
+  #undef R
+  #undef JUMP
+  #undef FAIL
+  #undef DO_BINARY_OP
+  #undef DO_COMPARE_AND_JUMP
+  #undef TRACE_EXECUTION
+  #undef PROFILE_EXECUTION
+  #undef DECODE_LOOP
+  #undef INSTRUCTION
+  #undef DISPATCH
+}
@@ -0,0 +1,86 @@
+#ifndef CTHUSLY_REGISTER_VM_H
+#define CTHUSLY_REGISTER_VM_H
+
+#include "common.h"
+#include "program.h"
+#include "vm.h"
+
+/// The opcode of a register instruction (see register_vm.c). The operands are
+/// named `a`, `b` and `c` in the order written, e.g. `REG_ADD a, b, c` stores
+/// the sum of registers `b` and `c` in register `a`.
+typedef enum {
+  /// a = b
+  REG_MOVE,
+  /// a = b <operator> c
+  REG_ADD,
+  REG_SUBTRACT,
+  REG_MULTIPLY,
+  REG_DIVIDE,
+  REG_MODULO,
+  REG_EQUALS,
+  REG_NOT_EQUALS,
+  REG_GREATER_THAN,
+  REG_GREATER_THAN_EQUALS,
+  REG_LESS_THAN,
+  REG_LESS_THAN_EQUALS,
+  /// a = <operator> b
+  REG_NEGATE,
+  REG_NOT,
+  /// Print register a.
+  REG_OUT,
+  /// Jump to instruction a (if register b is falsy/truthy for the conditional jumps).
+  REG_JUMP,
+  REG_JUMP_IF_FALSE,
+  REG_JUMP_IF_TRUE,
+  /// Fused comparison and conditional jump: jump to instruction a if (or unless)
+  /// `b <operator> c` (the result of the comparison is not stored).
+  REG_JUMP_IF_GREATER_THAN,
+  REG_JUMP_IF_GREATER_THAN_EQUALS,
+  REG_JUMP_IF_LESS_THAN,
+  REG_JUMP_IF_LESS_THAN_EQUALS,
+  REG_JUMP_UNLESS_EQUALS,
+  REG_JUMP_UNLESS_NOT_EQUALS,
+  REG_JUMP_UNLESS_GREATER_THAN,
+  REG_JUMP_UNLESS_GREATER_THAN_EQUALS,
+  REG_JUMP_UNLESS_LESS_THAN,
+  REG_JUMP_UNLESS_LESS_THAN_EQUALS,
+  /// The step of the loop variable of a `foreach` loop in register b (followed
+  /// by the end and step of the range), and the jump back to instruction a
+  /// unless the end has been passed (see OP_FOREACH_NEXT).
+  REG_FOREACH_NEXT,
+  REG_RETURN,
+} RegisterOpcode;
+
+typedef struct {
+  RegisterOpcode opcode;
+  /// The register written, or the instruction jumped to, or the register
+  /// read by REG_OUT.
+  int a;
+  int b;
+  int c;
+} RegisterInstruction;
+
+/// A program translated into register instructions (see `register_program_translate()`).
+///
+/// The registers are laid out in the VM's stack: The first `constant_base`
+/// registers are the stack slots of the bytecode (so the variables keep their
+/// stack slot, and the rest hold intermediate values), followed by one register
+/// per constant of the constant pool and then the registers holding false,
+/// none and true.
+typedef struct {
+  RegisterInstruction* instructions;
+  /// The offset of the bytecode instruction that each register instruction was
+  /// translated from (for the source line of runtime errors).
+  int* source_offsets;
+  int count;
+  int capacity;
+  /// The index of the register holding the first constant.
+  int constant_base;
+  int register_count;
+} RegisterProgram;
+
+void register_program_translate(Program* program, RegisterProgram* out_program, VMStats* stats);
+void register_program_free(RegisterProgram* program);
+ErrorReport register_vm_execute(RegisterProgram* register_program, VM* vm);
+
+#endif
@@ -4,14 +4,27 @@
 #include "gc_object.h"
 #include "memory.h"
 #include "table.h"
-
-#define TABLE_MAX_LOAD 0.75
-#define ENTRY_EXISTS(entry)   ((entry)->key != NULL)
-#define TABLE_IS_EMPTY(table) ((table)->count == 0)
+#include "table_probe.h"
+
+/// Whether the full and deleted entries may grow by one without exceeding the
+/// maximum load factor.
+#define HAS_ROOM_FOR_ONE_MORE(table) \
+  IS_WITHIN_MAX_LOAD((table)->count + (table)->tombstone_count + 1, (table)->capacity)
+/// Whether so many of the non-empty entries are deleted (at least half) that a
+/// full table should be cleaned up in place rather than grown. (Otherwise the
+/// table is grown so that churn does not lead to frequent cleanups.)
+#define SHOULD_REHASH_IN_PLACE(table) \
+  ((table)->count * 16 <= (table)->capacity * 7)
+
+// ---------------------------------------------------
+// TABLE
+// ---------------------------------------------------
 
 void table_init(Table* table) {
+  table->controls = NULL;
   table->entries = NULL;
   table->count = 0;
+  table->tombstone_count = 0;
   table->capacity = 0;
 }
 
@@ -23,88 +36,177 @@ void table_free(Table* table) {
   #endif
   // ---------------
 
+  FREE_ARRAY(int8_t, table->controls, get_control_count(table->capacity));
   FREE_ARRAY(TableEntry, table->entries, table->capacity);
   table_init(table);
 }
 
-static TextObject* find_interned_text(Table* interned_texts, const char* chars, int length, uint32_t hash_code) {
-  uint32_t index = hash_code % interned_texts->capacity;
+static TableEntry* find_entry(Table* table, TextObject* key) {
+  if (table->capacity == 0)
+    return NULL;
+
+  ProbeSequence probe = probe_start(key->hash_code, table->capacity);
+  prefetch_entries(&table->entries[probe.offset]);
+  int8_t h2 = H2(key->hash_code);
   while (true) {
-    TableEntry* entry = &interned_texts->entries[index];
-    if (!ENTRY_EXISTS(entry)) {
-      bool is_tombstone = IS_BOOLEAN(entry->value);
-      if (!is_tombstone)
-        return NULL;
+    const int8_t* group = table->controls + probe.offset;
+    for (uint32_t matches = group_match(group, h2); matches != 0; matches &= matches - 1) {
+      TableEntry* entry = &table->entries[probe_index(&probe, lowest_bit_index(matches))];
+      // `==` works for texts (strings) since all texts are interned
+      // (each text is unique and points to the same memory location).
+      if (entry->key == key)
+        return entry;
     }
-    else if (
-      entry->key->length == length &&
-      entry->key->hash_code == hash_code &&
-      memcmp(entry->key->chars, chars, length) == 0
-    )
-      return entry->key;
-
-    index = (index + 1) % interned_texts->capacity;
+
+    // A key is never placed beyond a group with an empty entry.
+    if (group_match(group, CONTROL_EMPTY) != 0)
+      return NULL;
+
+    probe_next(&probe);
   }
 }
 
-static TableEntry* find_new_or_existing_entry(TableEntry* entries, int capacity, TextObject* key) {
-  // "Open addressing" using linear probing is used as the collision resolution method.
-  uint32_t index = key->hash_code % capacity;
-  TableEntry* next_available_entry = NULL;
+static TextObject* find_interned_text(Table* interned_texts, const char* chars, int length, uint32_t hash_code) {
+  ProbeSequence probe = probe_start(hash_code, interned_texts->capacity);
+  prefetch_entries(&interned_texts->entries[probe.offset]);
+  int8_t h2 = H2(hash_code);
   while (true) {
-    TableEntry* entry = &entries[index];
-    // `==` works for texts (strings) too since all texts are interned
-    // (each text is unique and points to the same memory location).
-    if (entry->key == key)
-      return entry;
-
-    if (!ENTRY_EXISTS(entry)) {
-      bool is_tombstone = IS_BOOLEAN(entry->value);
-      if (is_tombstone)
-        next_available_entry = next_available_entry ? next_available_entry : entry;
-      else
-        return next_available_entry ? next_available_entry : entry;
+    const int8_t* group = interned_texts->controls + probe.offset;
+    for (uint32_t matches = group_match(group, h2); matches != 0; matches &= matches - 1) {
+      TextObject* key = interned_texts->entries[probe_index(&probe, lowest_bit_index(matches))].key;
+      if (key->length == length && key->hash_code == hash_code && memcmp(key->chars, chars, length) == 0)
+        return key;
     }
 
-    index = (index + 1) % capacity;
-  }
-}
+    if (group_match(group, CONTROL_EMPTY) != 0)
+      return NULL;
 
-static void entries_init(TableEntry* entries, int capacity) {
-  for (int i = 0; i < capacity; i++) {
-    entries[i].key = NULL;
-    entries[i].value = FROM_C_NULL;
+    probe_next(&probe);
   }
 }
 
-static void grow_and_rebuild_table(Table* table, int new_capacity) {
+static void resize(Table* table, int new_capacity) {
+  int new_control_count = get_control_count(new_capacity);
+  int8_t* new_controls = ALLOCATE(int8_t, new_control_count);
+  memset(new_controls, CONTROL_EMPTY, new_control_count);
   TableEntry* new_entries = ALLOCATE(TableEntry, new_capacity);
-  entries_init(new_entries, new_capacity);
 
-  // Reset the count and increment it only if an entry exists in
-  // order to not include tombstones in the count when rebuilding.
-  table->count = 0;
   for (int i = 0; i < table->capacity; i++) {
+    if (!IS_FULL(table->controls[i]))
+      continue;
+
     TableEntry* old_entry = &table->entries[i];
-    if (ENTRY_EXISTS(old_entry)) {
-      TableEntry* new_entry = find_new_or_existing_entry(new_entries, new_capacity, old_entry->key);
-      new_entry->key = old_entry->key;
-      new_entry->value = old_entry->value;
-      table->count++;
-    }
+    uint32_t index = find_free_index(new_controls, new_capacity, old_entry->key->hash_code);
+    set_control(new_controls, new_capacity, index, H2(old_entry->key->hash_code));
+    new_entries[index] = *old_entry;
   }
 
+  FREE_ARRAY(int8_t, table->controls, get_control_count(table->capacity));
   FREE_ARRAY(TableEntry, table->entries, table->capacity);
+  table->controls = new_controls;
   table->entries = new_entries;
   table->capacity = new_capacity;
+  table->tombstone_count = 0;
 }
 
-bool table_get(Table* table, TextObject* key, ThuslyValue* out_value) {
-  if (TABLE_IS_EMPTY(table))
-    return false;
+/// Remove all tombstones without changing the capacity, by moving each entry
+/// to the first free entry of its probe sequence (where it would be inserted
+/// into a table without tombstones). Entries are moved within the table rather
+/// than into newly allocated arrays.
+static void rehash_in_place(Table* table) {
+  int8_t* controls = table->controls;
+  int capacity = table->capacity;
+  uint32_t mask = (uint32_t)capacity - 1;
+
+  // Mark the full entries as deleted (i.e. not yet placed) and the deleted entries as empty.
+  for (int i = 0; i < capacity; i++)
+    controls[i] = IS_FULL(controls[i]) ? CONTROL_DELETED : CONTROL_EMPTY;
+  memcpy(controls + capacity, controls, TABLE_GROUP_SIZE - 1);
+
+  for (uint32_t i = 0; i < (uint32_t)capacity; i++) {
+    if (controls[i] != CONTROL_DELETED)
+      continue;
+
+    TableEntry* entry = &table->entries[i];
+    uint32_t hash_code = entry->key->hash_code;
+    uint32_t start = probe_start(hash_code, capacity).offset;
+    uint32_t new_index = find_free_index(controls, capacity, hash_code);
+
+    // An entry within the same group of its probe sequence is found just as
+    // quickly where it is, so it is left in place.
+    bool is_in_same_group = ((i - start) & mask) / TABLE_GROUP_SIZE == ((new_index - start) & mask) / TABLE_GROUP_SIZE;
+    if (is_in_same_group) {
+      set_control(controls, capacity, i, H2(hash_code));
+      continue;
+    }
+
+    TableEntry* new_entry = &table->entries[new_index];
+    if (controls[new_index] == CONTROL_EMPTY) {
+      set_control(controls, capacity, new_index, H2(hash_code));
+      *new_entry = *entry;
+      set_control(controls, capacity, i, CONTROL_EMPTY);
+    }
+    else {
+      // The entry is swapped with one not yet placed, which is then placed next.
+      set_control(controls, capacity, new_index, H2(hash_code));
+      TableEntry displaced = *new_entry;
+      *new_entry = *entry;
+      *entry = displaced;
+      i--;
+    }
+  }
+
+  table->tombstone_count = 0;
+}
 
-  TableEntry* entry = find_new_or_existing_entry(table->entries, table->capacity, key);
-  bool exists = ENTRY_EXISTS(entry);
+/// Insert a key known not to be in the table.
+static void insert_new_entry(Table* table, TextObject* key, ThuslyValue value) {
+  if (table->capacity == 0)
+    resize(table, TABLE_MIN_CAPACITY);
+
+  uint32_t index = find_free_index(table->controls, table->capacity, key->hash_code);
+  // (Reusing a deleted entry does not increase the load.)
+  bool needs_room = table->controls[index] == CONTROL_EMPTY && !HAS_ROOM_FOR_ONE_MORE(table);
+  if (needs_room) {
+    if (SHOULD_REHASH_IN_PLACE(table))
+      rehash_in_place(table);
+    else
+      resize(table, table->capacity * 2);
+    index = find_free_index(table->controls, table->capacity, key->hash_code);
+  }
+
+  if (table->controls[index] == CONTROL_DELETED)
+    table->tombstone_count--;
+  set_control(table->controls, table->capacity, index, H2(key->hash_code));
+  table->entries[index].key = key;
+  table->entries[index].value = value;
+  table->count++;
+}
+
+/// Remove an entry. It is marked as deleted (a tombstone) unless no lookup
+/// could have passed over it, which is the case if every group containing it
+/// also contains an empty entry (then it is marked as empty right away).
+static void remove_entry(Table* table, TableEntry* entry) {
+  uint32_t mask = (uint32_t)table->capacity - 1;
+  uint32_t index = (uint32_t)(entry - table->entries);
+  uint32_t index_before = (index - TABLE_GROUP_SIZE) & mask;
+  uint32_t empty_after = group_match(table->controls + index, CONTROL_EMPTY);
+  uint32_t empty_before = group_match(table->controls + index_before, CONTROL_EMPTY);
+  bool was_never_full = empty_before != 0 && empty_after != 0
+    && (TABLE_GROUP_SIZE - 1 - highest_bit_index(empty_before)) + lowest_bit_index(empty_after) < TABLE_GROUP_SIZE;
+
+  set_control(table->controls, table->capacity, index, was_never_full ? CONTROL_EMPTY : CONTROL_DELETED);
+  if (!was_never_full)
+    table->tombstone_count++;
+  table->count--;
+
+  entry->key = NULL;
+  entry->value = FROM_C_NULL;
+}
+
+bool table_get(Table* table, TextObject* key, ThuslyValue* out_value) {
+  TableEntry* entry = find_entry(table, key);
+  bool exists = entry != NULL;
   if (exists)
     *out_value = entry->value;
 
@@ -112,46 +214,38 @@ bool table_get(Table* table, TextObject* key, ThuslyValue* out_value) {
 }
 
 TextObject* table_get_interned_text(Table* table, const char* chars, int length, uint32_t hash_code) {
-  if (TABLE_IS_EMPTY(table))
+  if (table->count == 0)
     return NULL;
 
   return find_interned_text(table, chars, length, hash_code);
 }
 
 bool table_set(Table* table, TextObject* key, ThuslyValue value) {
-  bool max_load_reached = table->count + 1 > table->capacity * TABLE_MAX_LOAD;
-  if (max_load_reached)
-    grow_and_rebuild_table(table, GROW_CAPACITY(table->capacity));
-
-  TableEntry* entry = find_new_or_existing_entry(table->entries, table->capacity, key);
-  bool exists = ENTRY_EXISTS(entry);
-  bool is_brand_new = !exists && IS_NONE(entry->value); // Tombstones are not counted as "brand new".
-  if (is_brand_new)
-    table->count++;
-
-  entry->key = key;
-  entry->value = value;
+  TableEntry* entry = find_entry(table, key);
+  bool exists = entry != NULL;
+  if (exists)
+    entry->value = value;
+  else
+    insert_new_entry(table, key, value);
 
   return !exists;
 }
 
-static void place_tombstone(TableEntry* entry) {
-  entry->key = NULL;
-  entry->value = FROM_C_BOOL(true);
-}
-
 bool table_pop(Table* table, TextObject* key) {
-  if (TABLE_IS_EMPTY(table))
-    return false;
-
-  TableEntry* entry = find_new_or_existing_entry(table->entries, table->capacity, key);
-  bool exists = ENTRY_EXISTS(entry);
+  TableEntry* entry = find_entry(table, key);
+  bool exists = entry != NULL;
   if (exists)
-    // Only place the tombstone, don't decrement the count (otherwise
-    // `get_new_or_existing_entry()` can get stuck in an infinite loop
-    // due to an incorrect (too small) load factor, causing the entries
-    // array to not grow when needed).
-    place_tombstone(entry);
+    remove_entry(table, entry);
 
   return exists;
 }
+
+/// Remove the entries whose keys were not marked as reachable by the garbage
+/// collector (used for the intern pool, which only references texts weakly).
+void table_remove_unmarked_keys(Table* table) {
+  for (int i = 0; i < table->capacity; i++) {
+    TableEntry* entry = &table->entries[i];
+    if (IS_FULL(table->controls[i]) && !entry->key->base.is_marked)
+      remove_entry(table, entry);
+  }
+}
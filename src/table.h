@@ -3,17 +3,34 @@
 
 #include "thusly_value.h"
 
+/// The number of control bytes (and thereby entries) examined at once when
+/// probing. (Matches the width of an SSE2 vector.)
+#define TABLE_GROUP_SIZE 16
+
 /// A key-value entry pair in a hash table.
 typedef struct {
-  // Only text types are supported as keys.
+  // Only interned texts are supported as keys (they are compared by identity).
   TextObject* key;
   ThuslyValue value;
 } TableEntry;
 
 /// A hash table for looking up values through names.
+///
+/// The table uses open addressing with a power-of-two capacity. Alongside the
+/// entries is an array of control bytes, one per entry, holding whether the
+/// entry is empty, deleted (a tombstone), or full. A full entry's control byte
+/// holds 7 bits of the key's hash code, so lookups can examine a whole group of
+/// control bytes at once (using SIMD) and only compare the keys whose bits match.
 typedef struct {
+  /// The control bytes (see `table.c`), followed by a copy of the first
+  /// TABLE_GROUP_SIZE - 1 bytes so that a group can be loaded at any index.
+  int8_t* controls;
   TableEntry* entries;
+  /// The number of full entries.
   int count;
+  /// The number of deleted entries (tombstones).
+  int tombstone_count;
+  /// The number of entries (zero or a power of two of at least TABLE_GROUP_SIZE).
   int capacity;
 } Table;
 
@@ -23,5 +40,6 @@ bool table_get(Table* table, TextObject* key, ThuslyValue* out_value);
 bool table_set(Table* table, TextObject* key, ThuslyValue value);
 bool table_pop(Table* table, TextObject* key);
 TextObject* table_get_interned_text(Table* table, const char* chars, int length, uint32_t hash_code);
+void table_remove_unmarked_keys(Table* table);
 
 #endif
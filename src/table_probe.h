@@ -0,0 +1,154 @@
+#ifndef CTHUSLY_TABLE_PROBE_H
+#define CTHUSLY_TABLE_PROBE_H
+
+// The control bytes and probe sequences shared by the hash tables (`Table`
+// and `InternSet`). Only to be included by their implementation files.
+
+#include <stdint.h>
+#include <string.h>
+
+#include "table.h"
+
+/// Whether a group of control bytes is examined using SSE2 instructions
+/// (available on every x86-64 CPU) rather than a loop over the bytes.
+#if defined(__SSE2__)
+#define TABLE_SSE2
+#include <emmintrin.h>
+#endif
+
+// Control bytes:
+//   empty:   1 0000000
+//   deleted: 1 1111110  (a tombstone)
+//   full:    0 <7 bits of the hash code (see `H2()`)>
+// (Only the sign bit is needed to tell full entries from the rest.)
+#define CONTROL_EMPTY      ((int8_t)-128)
+#define CONTROL_DELETED    ((int8_t)-2)
+#define IS_FULL(control)   ((control) >= 0)
+
+/// The position in the table that probing for a hash code starts at (masked by the capacity).
+#define H1(hash_code)      ((hash_code) >> 7)
+/// The bits of a hash code stored in the control byte of a full entry.
+#define H2(hash_code)      ((int8_t)((hash_code) & 0x7f))
+
+#define TABLE_MIN_CAPACITY TABLE_GROUP_SIZE
+/// Whether `count` full (and deleted) entries fit within the maximum load factor (7/8).
+#define IS_WITHIN_MAX_LOAD(count, capacity) ((count) * 8 <= (capacity) * 7)
+
+// ---------------------------------------------------
+// GROUPS
+// ---------------------------------------------------
+// A group is TABLE_GROUP_SIZE consecutive control bytes (starting at any index,
+// see the copied bytes in `Table.controls`). The functions below return a bit
+// mask with a bit set for each matching control byte in the group.
+
+static inline uint32_t group_match(const int8_t* group, int8_t control) {
+  #ifdef TABLE_SSE2
+    __m128i controls = _mm_loadu_si128((const __m128i*)group);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(controls, _mm_set1_epi8(control)));
+  #else
+    uint32_t mask = 0;
+    for (int i = 0; i < TABLE_GROUP_SIZE; i++)
+      mask |= (uint32_t)(group[i] == control) << i;
+    return mask;
+  #endif
+}
+
+static inline uint32_t group_match_empty_or_deleted(const int8_t* group) {
+  #ifdef TABLE_SSE2
+    // (The sign bit of each byte is set exactly for empty and deleted entries.)
+    return (uint32_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)group));
+  #else
+    uint32_t mask = 0;
+    for (int i = 0; i < TABLE_GROUP_SIZE; i++)
+      mask |= (uint32_t)!IS_FULL(group[i]) << i;
+    return mask;
+  #endif
+}
+
+static inline int lowest_bit_index(uint32_t mask) {
+  #ifdef __GNUC__
+    return __builtin_ctz(mask);
+  #else
+    int index = 0;
+    while ((mask & 1) == 0) {
+      mask >>= 1;
+      index++;
+    }
+    return index;
+  #endif
+}
+
+static inline int highest_bit_index(uint32_t mask) {
+  #ifdef __GNUC__
+    return 31 - __builtin_clz(mask);
+  #else
+    int index = 0;
+    while (mask >>= 1)
+      index++;
+    return index;
+  #endif
+}
+
+// ---------------------------------------------------
+// PROBING
+// ---------------------------------------------------
+
+/// The groups visited when looking up a hash code. The offset of each group
+/// grows by one more group than the previous (triangular numbers), which visits
+/// every group of a power-of-two capacity before repeating.
+typedef struct {
+  uint32_t mask;
+  uint32_t offset;
+  uint32_t distance;
+} ProbeSequence;
+
+static inline ProbeSequence probe_start(uint32_t hash_code, int capacity) {
+  uint32_t mask = (uint32_t)capacity - 1;
+  return (ProbeSequence){ .mask = mask, .offset = H1(hash_code) & mask, .distance = 0 };
+}
+
+static inline void probe_next(ProbeSequence* probe) {
+  probe->distance += TABLE_GROUP_SIZE;
+  probe->offset = (probe->offset + probe->distance) & probe->mask;
+}
+
+/// The index of the entry at position `bit` of the current group.
+static inline uint32_t probe_index(ProbeSequence* probe, int bit) {
+  return (probe->offset + bit) & probe->mask;
+}
+
+/// Start loading the entries of the first group while its control bytes are
+/// examined (both are likely cache misses in a large table).
+static inline void prefetch_entries(const void* first_entry) {
+  #ifdef __GNUC__
+    __builtin_prefetch(first_entry);
+  #else
+    (void)first_entry;
+  #endif
+}
+
+/// The number of control bytes allocated for a capacity (including the copied bytes).
+static inline int get_control_count(int capacity) {
+  return capacity == 0 ? 0 : capacity + TABLE_GROUP_SIZE - 1;
+}
+
+/// Set a control byte, as well as its copy if it is among the first bytes.
+static inline void set_control(int8_t* controls, int capacity, uint32_t index, int8_t control) {
+  controls[index] = control;
+  if (index < TABLE_GROUP_SIZE - 1)
+    controls[capacity + index] = control;
+}
+
+/// Find the first empty or deleted entry that a key with the given hash code can be placed in.
+static inline uint32_t find_free_index(const int8_t* controls, int capacity, uint32_t hash_code) {
+  ProbeSequence probe = probe_start(hash_code, capacity);
+  while (true) {
+    uint32_t free_entries = group_match_empty_or_deleted(controls + probe.offset);
+    if (free_entries != 0)
+      return probe_index(&probe, lowest_bit_index(free_entries));
+
+    probe_next(&probe);
+  }
+}
+
+#endif
@@ -0,0 +1,245 @@
+#include <string.h>
+
+#include "text_hash.h"
+
+/// Whether the vectorized implementations (SSE2 and AVX2) are available.
+#if defined(__x86_64__) && defined(__GNUC__) && defined(__SSE2__)
+#define TEXT_HASH_X86
+#include <immintrin.h>
+#endif
+
+#define PRIME_1 ((uint64_t)0x9e3779b185ebca87u)
+#define PRIME_2 ((uint64_t)0xc2b2ae3d27d4eb4fu)
+/// The rotation applied to each lane per block (which makes the order of the
+/// blocks matter, as the lanes would otherwise just be sums).
+#define LANE_ROTATION 29
+
+/// Keys mixed into the words of each lane (also used as the initial lane values).
+static const uint64_t LANE_KEYS[4] = {
+  0x1cad21f72c81017cu,
+  0xdb979083e96dd4deu,
+  0x1f67b3b7a4a44072u,
+  0x78e5c0cc4ee679cbu,
+};
+
+static inline uint64_t load_word(const char* chars) {
+  // (`memcpy()` compiles to a single unaligned load.)
+  uint64_t word;
+  memcpy(&word, chars, sizeof(word));
+
+  return word;
+}
+
+static inline uint64_t rotate_left(uint64_t value, int bits) {
+  return (value << bits) | (value >> (64 - bits));
+}
+
+static inline uint64_t mix_word(uint64_t hash_code, uint64_t word) {
+  return rotate_left((hash_code ^ word) * PRIME_1, 31);
+}
+
+/// Spread the entropy over all bits (the MurmurHash3 finalizer), so that the
+/// low bits used for indexing a table depend on every byte of the text.
+static inline uint32_t finalize(uint64_t hash_code) {
+  hash_code ^= hash_code >> 33;
+  hash_code *= 0xff51afd7ed558ccdu;
+  hash_code ^= hash_code >> 33;
+  hash_code *= 0xc4ceb9fe1a85ec53u;
+  hash_code ^= hash_code >> 33;
+
+  return (uint32_t)hash_code;
+}
+
+// ---------------------------------------------------
+// BLOCK LOOP VARIANTS
+// ---------------------------------------------------
+// Each block is four words, one per lane, and each lane is updated as:
+//   lane = rotate_left(lane, LANE_ROTATION) + word + low32(word ^ key) * high32(word ^ key)
+// The 32x32-bit multiplication is used since it is the widest one available
+// for 64-bit vector lanes on x86-64.
+
+static void accumulate_blocks_portable(uint64_t* lanes, const char* chars, int block_count) {
+  for (int block = 0; block < block_count; block++) {
+    for (int i = 0; i < 4; i++) {
+      uint64_t word = load_word(chars + 8 * i);
+      uint64_t mixed = word ^ LANE_KEYS[i];
+      lanes[i] = rotate_left(lanes[i], LANE_ROTATION) + word + (mixed & 0xffffffffu) * (mixed >> 32);
+    }
+    chars += TEXT_HASH_BLOCK_SIZE;
+  }
+}
+
+#ifdef TEXT_HASH_X86
+
+static void accumulate_blocks_sse2(uint64_t* lanes, const char* chars, int block_count) {
+  __m128i keys[2] = {
+    _mm_loadu_si128((const __m128i*)&LANE_KEYS[0]),
+    _mm_loadu_si128((const __m128i*)&LANE_KEYS[2]),
+  };
+  __m128i accumulators[2] = {
+    _mm_loadu_si128((const __m128i*)&lanes[0]),
+    _mm_loadu_si128((const __m128i*)&lanes[2]),
+  };
+
+  for (int block = 0; block < block_count; block++) {
+    for (int i = 0; i < 2; i++) {
+      __m128i words = _mm_loadu_si128((const __m128i*)(chars + 16 * i));
+      __m128i mixed = _mm_xor_si128(words, keys[i]);
+      __m128i product = _mm_mul_epu32(mixed, _mm_srli_epi64(mixed, 32));
+      __m128i rotated = _mm_or_si128(
+        _mm_slli_epi64(accumulators[i], LANE_ROTATION),
+        _mm_srli_epi64(accumulators[i], 64 - LANE_ROTATION)
+      );
+      accumulators[i] = _mm_add_epi64(_mm_add_epi64(rotated, words), product);
+    }
+    chars += TEXT_HASH_BLOCK_SIZE;
+  }
+
+  _mm_storeu_si128((__m128i*)&lanes[0], accumulators[0]);
+  _mm_storeu_si128((__m128i*)&lanes[2], accumulators[1]);
+}
+
+__attribute__((target("avx2")))
+static void accumulate_blocks_avx2(uint64_t* lanes, const char* chars, int block_count) {
+  __m256i keys = _mm256_loadu_si256((const __m256i*)LANE_KEYS);
+  __m256i accumulator = _mm256_loadu_si256((const __m256i*)lanes);
+
+  for (int block = 0; block < block_count; block++) {
+    __m256i words = _mm256_loadu_si256((const __m256i*)chars);
+    __m256i mixed = _mm256_xor_si256(words, keys);
+    __m256i product = _mm256_mul_epu32(mixed, _mm256_srli_epi64(mixed, 32));
+    __m256i rotated = _mm256_or_si256(
+      _mm256_slli_epi64(accumulator, LANE_ROTATION),
+      _mm256_srli_epi64(accumulator, 64 - LANE_ROTATION)
+    );
+    accumulator = _mm256_add_epi64(_mm256_add_epi64(rotated, words), product);
+    chars += TEXT_HASH_BLOCK_SIZE;
+  }
+
+  _mm256_storeu_si256((__m256i*)lanes, accumulator);
+}
+
+#endif
+
+// ---------------------------------------------------
+// DISPATCH
+// ---------------------------------------------------
+
+typedef void (*AccumulateBlocks)(uint64_t* lanes, const char* chars, int block_count);
+
+static void resolve_accumulate_blocks(uint64_t* lanes, const char* chars, int block_count);
+
+/// The block loop in use. It starts out as a resolver which selects the best
+/// variant supported by the CPU on the first call (and then runs it).
+static AccumulateBlocks accumulate_blocks = resolve_accumulate_blocks;
+static TextHashVariant current_variant = TEXT_HASH_PORTABLE;
+
+bool text_hash_is_supported(TextHashVariant variant) {
+  switch (variant) {
+    case TEXT_HASH_PORTABLE:
+      return true;
+    #ifdef TEXT_HASH_X86
+      case TEXT_HASH_SSE2:
+        return true;
+      case TEXT_HASH_AVX2:
+        return __builtin_cpu_supports("avx2");
+    #endif
+    default:
+      return false;
+  }
+}
+
+/// Use a specific variant of the block loop (e.g. for benchmarking).
+/// Returns `false` (keeping the current variant) if it is not supported.
+bool text_hash_use_variant(TextHashVariant variant) {
+  if (!text_hash_is_supported(variant))
+    return false;
+
+  switch (variant) {
+    case TEXT_HASH_PORTABLE:
+      accumulate_blocks = accumulate_blocks_portable;
+      break;
+    #ifdef TEXT_HASH_X86
+      case TEXT_HASH_SSE2:
+        accumulate_blocks = accumulate_blocks_sse2;
+        break;
+      case TEXT_HASH_AVX2:
+        accumulate_blocks = accumulate_blocks_avx2;
+        break;
+    #endif
+  }
+  current_variant = variant;
+
+  return true;
+}
+
+static void select_best_variant(void) {
+  if (!text_hash_use_variant(TEXT_HASH_AVX2) && !text_hash_use_variant(TEXT_HASH_SSE2))
+    text_hash_use_variant(TEXT_HASH_PORTABLE);
+}
+
+static void resolve_accumulate_blocks(uint64_t* lanes, const char* chars, int block_count) {
+  select_best_variant();
+  accumulate_blocks(lanes, chars, block_count);
+}
+
+TextHashVariant text_hash_get_variant(void) {
+  if (accumulate_blocks == resolve_accumulate_blocks)
+    select_best_variant();
+
+  return current_variant;
+}
+
+const char* text_hash_get_variant_name(TextHashVariant variant) {
+  switch (variant) {
+    case TEXT_HASH_PORTABLE: return "portable";
+    case TEXT_HASH_SSE2:     return "sse2";
+    case TEXT_HASH_AVX2:     return "avx2";
+    default:                 return "unknown";
+  }
+}
+
+// ---------------------------------------------------
+// HASHING
+// ---------------------------------------------------
+
+/// Produce a deterministic fixed-size hash code from the chars of a text.
+///
+/// Texts are consumed in blocks of TEXT_HASH_BLOCK_SIZE bytes (using the
+/// vectorized block loop supported by the CPU) and the rest a word at a time.
+/// (Most texts hashed are shorter than a block, since the shortest texts are
+/// stored inline in a ThuslyValue and never hashed.)
+uint32_t hash_text(const char* chars, int length) {
+  uint64_t hash_code = PRIME_1 ^ ((uint64_t)length * PRIME_2);
+  bool is_long_enough = length >= 8;
+
+  int block_count = length / TEXT_HASH_BLOCK_SIZE;
+  if (block_count > 0) {
+    uint64_t lanes[4] = { LANE_KEYS[0], LANE_KEYS[1], LANE_KEYS[2], LANE_KEYS[3] };
+    accumulate_blocks(lanes, chars, block_count);
+    for (int i = 0; i < 4; i++)
+      hash_code = mix_word(hash_code, lanes[i] * PRIME_2);
+
+    chars += block_count * TEXT_HASH_BLOCK_SIZE;
+    length -= block_count * TEXT_HASH_BLOCK_SIZE;
+  }
+
+  for (; length >= 8; chars += 8, length -= 8)
+    hash_code = mix_word(hash_code, load_word(chars));
+
+  if (length > 0) {
+    // The last partial word is loaded together with the preceding bytes (which
+    // are shifted out) when the text is long enough, rather than byte by byte.
+    // (The length is already part of the hash, so no padding is needed.)
+    uint64_t word = 0;
+    if (is_long_enough)
+      word = load_word(chars + length - 8) >> (8 * (8 - length));
+    else {
+      for (int i = 0; i < length; i++)
+        word |= (uint64_t)(uint8_t)chars[i] << (8 * i);
+    }
+    hash_code = mix_word(hash_code, word);
+  }
+
+  return finalize(hash_code);
+}
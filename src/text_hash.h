@@ -0,0 +1,29 @@
+#ifndef CTHUSLY_TEXT_HASH_H
+#define CTHUSLY_TEXT_HASH_H
+
+#include <stdint.h>
+
+#include "common.h"
+
+/// The number of bytes consumed per step by the block loop of `hash_text()`
+/// (four 64-bit lanes). Shorter texts are hashed a word (8 bytes) at a time.
+#define TEXT_HASH_BLOCK_SIZE 32
+
+/// The implementations of the block loop of `hash_text()`. All of them produce
+/// the same hash codes, so the one used only affects the speed of hashing.
+typedef enum {
+  /// Plain C (used on all platforms).
+  TEXT_HASH_PORTABLE,
+  /// 128-bit vectors (available on every x86-64 CPU).
+  TEXT_HASH_SSE2,
+  /// 256-bit vectors (selected at runtime if the CPU supports it).
+  TEXT_HASH_AVX2,
+} TextHashVariant;
+
+uint32_t hash_text(const char* chars, int length);
+bool text_hash_is_supported(TextHashVariant variant);
+bool text_hash_use_variant(TextHashVariant variant);
+TextHashVariant text_hash_get_variant(void);
+const char* text_hash_get_variant_name(TextHashVariant variant);
+
+#endif
@@ -8,39 +8,58 @@
 ///
 /// Values of different types are never equal.
 /// Primitive types are equal if their values are the same.
-/// Non-primitive types are equal if their memory addresses are the same.
+/// Non-primitive types are equal if their memory addresses are the same, or
+/// for texts that were not interned, if their chars are the same.
+/// (Ropes must have been flattened, see `flatten_text()`.)
 bool values_are_equal(ThuslyValue a, ThuslyValue b) {
-  if (a.type != b.type)
-    return false;
+  #ifdef NAN_BOXING
+    // Numbers are compared as doubles rather than bitwise (e.g. 0 = -0).
+    if (IS_NUMBER(a) && IS_NUMBER(b))
+      return TO_C_DOUBLE(a) == TO_C_DOUBLE(b);
 
-  switch (a.type) {
-    case TYPE_BOOLEAN:
-      return TO_C_BOOL(a) == TO_C_BOOL(b);
-    case TYPE_NONE:
+    // All other values are unique bit patterns (the singletons, short texts
+    // and pointers to interned texts).
+    if (a == b)
       return true;
-    case TYPE_NUMBER:
-      return TO_C_DOUBLE(a) == TO_C_DOUBLE(b);
-    case TYPE_GC_OBJECT:
-      return TO_C_OBJECT_PTR(a) == TO_C_OBJECT_PTR(b);
-    default:
-      // This should not be reachable.
+
+    return IS_GC_OBJECT(a) && IS_GC_OBJECT(b) && gc_objects_are_equal(TO_C_OBJECT_PTR(a), TO_C_OBJECT_PTR(b));
+  #else
+    if (a.type != b.type)
       return false;
-  }
+
+    switch (a.type) {
+      case TYPE_BOOLEAN:
+        return TO_C_BOOL(a) == TO_C_BOOL(b);
+      case TYPE_NONE:
+        return true;
+      case TYPE_NUMBER:
+        return TO_C_DOUBLE(a) == TO_C_DOUBLE(b);
+      case TYPE_GC_OBJECT:
+        return TO_C_OBJECT_PTR(a) == TO_C_OBJECT_PTR(b)
+          || gc_objects_are_equal(TO_C_OBJECT_PTR(a), TO_C_OBJECT_PTR(b));
+      case TYPE_SHORT_TEXT:
+        return TO_SHORT_TEXT_BITS(a) == TO_SHORT_TEXT_BITS(b);
+      default:
+        // This should not be reachable.
+        return false;
+    }
+  #endif
 }
 
 void print_value(ThuslyValue value) {
-  switch (value.type) {
-    case TYPE_BOOLEAN:
-      printf(TO_C_BOOL(value) ? "true" : "false");
-      break;
-    case TYPE_NONE:
-      printf("none");
-      break;
-    case TYPE_NUMBER:
-      printf("%g", TO_C_DOUBLE(value));
-      break;
-    case TYPE_GC_OBJECT:
-      print_object(value);
-      break;
+  // (The type checks are used rather than switching on the type in
+  // order to support both the NaN-boxed and tagged representations.)
+  if (IS_BOOLEAN(value))
+    printf(TO_C_BOOL(value) ? "true" : "false");
+  else if (IS_NONE(value))
+    printf("none");
+  else if (IS_NUMBER(value))
+    printf("%g", TO_C_DOUBLE(value));
+  else if (IS_SHORT_TEXT(value)) {
+    char chars[SHORT_TEXT_MAX_LENGTH + 1];
+    short_text_unpack(value, chars);
+    printf("%s", chars);
   }
+  else if (IS_GC_OBJECT(value))
+    print_object(value);
 }
@@ -6,6 +6,74 @@
 typedef struct GCObject GCObject;
 typedef struct TextObject TextObject;
 
+#ifdef NAN_BOXING
+
+// With NaN boxing, a ThuslyValue is a single 64-bit word. A number is stored
+// as the bits of its IEEE 754 double, while every other type is encoded in the
+// unused payload bits of a quiet NaN (which no arithmetic operation produces):
+//
+//   none:       0 11111111111 11 ... 01
+//   false:      0 11111111111 11 ... 10
+//   true:       0 11111111111 11 ... 11
+//   short text: 0 11111111111 11 .. 1 <6 chars (48 bits)>
+//   GC object:  1 11111111111 11 <48-bit pointer>
+//
+// (The sign bit distinguishes GC object pointers from the singleton values,
+// and bit 48 distinguishes short (inline) texts from the singleton values.)
+
+/// The representation of a value in Thusly.
+typedef uint64_t ThuslyValue;
+
+#define NAN_BOX_SIGN_BIT              ((uint64_t)0x8000000000000000)
+#define NAN_BOX_QUIET_NAN             ((uint64_t)0x7ffc000000000000)
+#define NAN_BOX_TAG_NONE              1
+#define NAN_BOX_TAG_FALSE             2
+#define NAN_BOX_TAG_TRUE              3
+#define NAN_BOX_NONE                  ((ThuslyValue)(NAN_BOX_QUIET_NAN | NAN_BOX_TAG_NONE))
+#define NAN_BOX_FALSE                 ((ThuslyValue)(NAN_BOX_QUIET_NAN | NAN_BOX_TAG_FALSE))
+#define NAN_BOX_TRUE                  ((ThuslyValue)(NAN_BOX_QUIET_NAN | NAN_BOX_TAG_TRUE))
+#define NAN_BOX_SHORT_TEXT_BIT        ((uint64_t)1 << 48)
+#define NAN_BOX_SHORT_TEXT_CHARS      (NAN_BOX_SHORT_TEXT_BIT - 1)
+
+/// The maximum length of a text stored inline in a ThuslyValue (see `short_text_pack()`).
+#define SHORT_TEXT_MAX_LENGTH         6
+
+// (`| 1` maps `false` onto `true` so that both booleans are checked at once.)
+#define IS_BOOLEAN(thusly_value)      (((thusly_value) | 1) == NAN_BOX_TRUE)
+#define IS_NONE(thusly_value)         ((thusly_value) == NAN_BOX_NONE)
+#define IS_NUMBER(thusly_value)       (((thusly_value) & NAN_BOX_QUIET_NAN) != NAN_BOX_QUIET_NAN)
+#define IS_GC_OBJECT(thusly_value)    \
+  (((thusly_value) & (NAN_BOX_QUIET_NAN | NAN_BOX_SIGN_BIT)) == (NAN_BOX_QUIET_NAN | NAN_BOX_SIGN_BIT))
+#define IS_SHORT_TEXT(thusly_value)   \
+  (((thusly_value) & (NAN_BOX_SIGN_BIT | NAN_BOX_QUIET_NAN | NAN_BOX_SHORT_TEXT_BIT)) == (NAN_BOX_QUIET_NAN | NAN_BOX_SHORT_TEXT_BIT))
+
+#define TO_C_BOOL(thusly_value)       ((thusly_value) == NAN_BOX_TRUE)
+#define TO_C_DOUBLE(thusly_value)     nan_box_to_c_double(thusly_value)
+#define TO_C_OBJECT_PTR(thusly_value) \
+  ((GCObject*)(uintptr_t)((thusly_value) & ~(NAN_BOX_SIGN_BIT | NAN_BOX_QUIET_NAN)))
+#define TO_SHORT_TEXT_BITS(thusly_value) ((thusly_value) & NAN_BOX_SHORT_TEXT_CHARS)
+
+#define FROM_C_BOOL(c_value)          ((c_value) ? NAN_BOX_TRUE : NAN_BOX_FALSE)
+#define FROM_C_NULL                   NAN_BOX_NONE
+#define FROM_C_DOUBLE(c_value)        nan_box_from_c_double(c_value)
+#define FROM_SHORT_TEXT_BITS(bits)    ((ThuslyValue)(NAN_BOX_QUIET_NAN | NAN_BOX_SHORT_TEXT_BIT | (bits)))
+#define FROM_C_OBJECT_PTR(c_ptr)      \
+  ((ThuslyValue)(NAN_BOX_SIGN_BIT | NAN_BOX_QUIET_NAN | (uint64_t)(uintptr_t)(c_ptr)))
+
+// Note: A union is used for reinterpreting the bits (rather than casting pointers)
+// in order to not violate strict aliasing. Compilers optimize this into a plain move.
+static inline double nan_box_to_c_double(ThuslyValue value) {
+  union { uint64_t bits; double number; } reinterpreted = { .bits = value };
+  return reinterpreted.number;
+}
+
+static inline ThuslyValue nan_box_from_c_double(double number) {
+  union { uint64_t bits; double number; } reinterpreted = { .number = number };
+  return reinterpreted.bits;
+}
+
+#else
+
 /// Built-in data type for a ThuslyValue.
 typedef enum {
   TYPE_BOOLEAN,
@@ -13,6 +81,8 @@ typedef enum {
   TYPE_NUMBER,
   /// Dynamically (heap) allocated type (e.g. `text` (string)).
   TYPE_GC_OBJECT,
+  /// A `text` short enough to be stored inline (see `short_text_pack()`).
+  TYPE_SHORT_TEXT,
 } DataType;
 
 /// The representation of a value in Thusly.
@@ -23,22 +93,68 @@ typedef struct {
     bool c_bool;
     double c_double;
     GCObject* c_object_ptr;
+    /// The chars of a short text (see `short_text_pack()`).
+    uint64_t c_short_text;
   } to;
 } ThuslyValue;
 
+/// The maximum length of a text stored inline in a ThuslyValue (see `short_text_pack()`).
+#define SHORT_TEXT_MAX_LENGTH         8
+
 #define IS_BOOLEAN(thusly_value)      ((thusly_value).type == TYPE_BOOLEAN)
 #define IS_NONE(thusly_value)         ((thusly_value).type == TYPE_NONE)
 #define IS_NUMBER(thusly_value)       ((thusly_value).type == TYPE_NUMBER)
 #define IS_GC_OBJECT(thusly_value)    ((thusly_value).type == TYPE_GC_OBJECT)
+#define IS_SHORT_TEXT(thusly_value)   ((thusly_value).type == TYPE_SHORT_TEXT)
 
 #define TO_C_BOOL(thusly_value)       ((thusly_value).to.c_bool)
 #define TO_C_DOUBLE(thusly_value)     ((thusly_value).to.c_double)
 #define TO_C_OBJECT_PTR(thusly_value) ((thusly_value).to.c_object_ptr)
+#define TO_SHORT_TEXT_BITS(thusly_value) ((thusly_value).to.c_short_text)
 
 #define FROM_C_BOOL(c_value)          ((ThuslyValue){ TYPE_BOOLEAN, { .c_bool = c_value } })
 #define FROM_C_NULL                   ((ThuslyValue){ TYPE_NONE, { .c_double = 0 } })
 #define FROM_C_DOUBLE(c_value)        ((ThuslyValue){ TYPE_NUMBER, { .c_double = c_value } })
 #define FROM_C_OBJECT_PTR(c_ptr)      ((ThuslyValue){ TYPE_GC_OBJECT, { .c_object_ptr = (GCObject*)c_ptr } })
+#define FROM_SHORT_TEXT_BITS(bits)    ((ThuslyValue){ TYPE_SHORT_TEXT, { .c_short_text = bits } })
+
+#endif
+
+/// Create a short text, i.e. a text stored inline in the ThuslyValue itself
+/// rather than as a heap-allocated TextObject. Every text of at most
+/// SHORT_TEXT_MAX_LENGTH chars is a short text (and every longer text is a
+/// TextObject), so that equal texts always have the same representation.
+///
+/// The chars are packed into the bits in order (zero-padded), so comparing
+/// two short texts is a single word comparison. (Texts never contain null
+/// bytes, which thereby mark the end of a short text.)
+static inline ThuslyValue short_text_pack(const char* chars, int length) {
+  uint64_t bits = 0;
+  for (int i = 0; i < length; i++)
+    bits |= (uint64_t)(uint8_t)chars[i] << (8 * i);
+
+  return FROM_SHORT_TEXT_BITS(bits);
+}
+
+/// Copy the chars of a short text into `out_chars` (which needs room for
+/// SHORT_TEXT_MAX_LENGTH + 1 chars) as a null-terminated string. Returns the length.
+static inline int short_text_unpack(ThuslyValue value, char* out_chars) {
+  uint64_t bits = TO_SHORT_TEXT_BITS(value);
+  int length = 0;
+  while (length < SHORT_TEXT_MAX_LENGTH && (bits & 0xff) != 0) {
+    out_chars[length++] = (char)(bits & 0xff);
+    bits >>= 8;
+  }
+  out_chars[length] = '\0';
+
+  return length;
+}
+
+static inline bool is_truthy(ThuslyValue value) {
+  // At the current stage of implementation, all values, including 0, are considered
+  // truthy except for: none, false.
+  return !(IS_NONE(value) || (IS_BOOLEAN(value) && !TO_C_BOOL(value)));
+}
 
 bool values_are_equal(ThuslyValue a, ThuslyValue b);
 void print_value(ThuslyValue value);
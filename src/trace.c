@@ -0,0 +1,663 @@
+#include <math.h>
+#include <stdio.h>
+
+#include "common.h"
+#include "memory.h"
+#include "trace.h"
+#include "vm.h"
+
+/// The tracing recorder - Loops compiled by the compiler always end with a
+/// backward jump (OP_JUMP_BWD, or OP_FOREACH_NEXT) to the loop header. When a loop header has been
+/// jumped to TRACE_HOT_LOOP_THRESHOLD times, the next iteration of the loop is
+/// recorded instruction by instruction as it executes. Each instruction is
+/// translated into trace operations based on the types of the values observed,
+/// where type checks and branches become guards. The trace is then run by the
+/// trace executor (rather than the interpreter) until a guard fails, at which
+/// point the interpreter resumes at the bytecode instruction that the guard
+/// belongs to.
+///
+/// Guards are always placed before any operation that modifies the stack for
+/// the same bytecode instruction, so that the VM state is consistent with the
+/// bytecode when exiting the trace.
+
+typedef struct {
+  VM* vm;
+  Trace* trace;
+  /// Whether the value at each stack index (including the variable slots) is
+  /// known to be a number at the current point of the trace (from a previous
+  /// guard or operation), in which case no new guard is needed. (As many as
+  /// the stack has room for.)
+  bool* known_numbers;
+} Recorder;
+
+typedef enum {
+  RECORD_CONTINUE,
+  RECORD_ABORT,
+} RecordResult;
+
+void trace_cache_init(TraceCache* cache, Program* program, bool is_enabled) {
+  cache->is_enabled = is_enabled;
+  cache->program = program;
+  cache->hotness = NULL;
+  cache->attempts = NULL;
+  cache->traces = NULL;
+  if (!is_enabled)
+    return;
+
+  cache->hotness = ALLOCATE(int, program->count);
+  cache->attempts = ALLOCATE(byte, program->count);
+  cache->traces = ALLOCATE(Trace*, program->count);
+  for (int i = 0; i < program->count; i++) {
+    cache->hotness[i] = 0;
+    cache->attempts[i] = 0;
+    cache->traces[i] = NULL;
+  }
+}
+
+static void trace_free(Trace* trace) {
+  for (int i = 0; i < trace->count; i++) {
+    if (trace->ops[i].side_trace != NULL)
+      trace_free(trace->ops[i].side_trace);
+  }
+  FREE_ARRAY(TraceOp, trace->ops, trace->capacity);
+  FREE(Trace, trace);
+}
+
+void trace_cache_free(TraceCache* cache) {
+  if (cache->is_enabled) {
+    for (int i = 0; i < cache->program->count; i++) {
+      if (cache->traces[i] != NULL)
+        trace_free(cache->traces[i]);
+    }
+    FREE_ARRAY(int, cache->hotness, cache->program->count);
+    FREE_ARRAY(byte, cache->attempts, cache->program->count);
+    FREE_ARRAY(Trace*, cache->traces, cache->program->count);
+  }
+  trace_cache_init(cache, NULL, false);
+}
+
+// ---------------------------------------------------
+// EXECUTOR
+// ---------------------------------------------------
+
+static bool compare_numbers(TraceOpcode comparison, double a, double b) {
+  switch (comparison) {
+    case TRACE_EQUALS_NUM:          return a == b;
+    case TRACE_NOT_EQUALS_NUM:      return a != b;
+    case TRACE_GREATER_THAN:        return a > b;
+    case TRACE_GREATER_THAN_EQUALS: return a >= b;
+    case TRACE_LESS_THAN:           return a < b;
+    case TRACE_LESS_THAN_EQUALS:    return a <= b;
+    default:                        return false;
+  }
+}
+
+/// Run the operations once in order. Returns the index of the guard that failed,
+/// or -1 if all operations ran.
+static int run_ops(VM* vm, TraceOp* ops, int count) {
+  // The operands of the number operations have already been guarded.
+  #define NUMBER(distance)         TO_C_DOUBLE(top[-1 - (distance)])
+  #define BINARY_OP(from_c_value, operator)                                \
+    do {                                                                   \
+      double b = NUMBER(0);                                                \
+      double a = NUMBER(1);                                                \
+      top--;                                                               \
+      top[-1] = from_c_value(a operator b);                                \
+    } while (false)
+
+  ThuslyValue* top = vm->next_stack_top;
+  ThuslyValue* slots = vm->stack;
+  int failed_index = -1;
+
+  for (int i = 0; i < count; i++) {
+    TraceOp* op = &ops[i];
+    switch (op->opcode) {
+      case TRACE_GUARD_NUMBER:
+        if (!IS_NUMBER(top[-1 - op->a]))
+          failed_index = i;
+        break;
+      case TRACE_GUARD_SLOT_NUMBER:
+        if (!IS_NUMBER(slots[op->a]))
+          failed_index = i;
+        break;
+      case TRACE_GUARD_TRUTHY:
+        if (!is_truthy(top[-1]))
+          failed_index = i;
+        break;
+      case TRACE_GUARD_FALSY:
+        if (is_truthy(top[-1]))
+          failed_index = i;
+        break;
+      case TRACE_GUARD_COMPARISON: {
+        // Fused: <comparison>, TRACE_GUARD_<TRUTHY|FALSY>, TRACE_POPN 1
+        bool result = compare_numbers(op->a, NUMBER(1), NUMBER(0));
+        top -= 2;
+        if (result != (bool)op->b) {
+          // Materialize the result that the exited-to conditional jump expects.
+          *top++ = FROM_C_BOOL(result);
+          failed_index = i;
+        }
+        break;
+      }
+      case TRACE_GUARD_FOREACH_NEXT: {
+        // Fused: the step of the loop variable in slot `a` (followed by the end
+        // and step of the range) and the comparison against the end. The variable
+        // is stepped either way, since the exit resumes after the comparison.
+        double next = TO_C_DOUBLE(slots[op->a]) + TO_C_DOUBLE(slots[op->a + 2]);
+        slots[op->a] = FROM_C_DOUBLE(next);
+        if ((next <= TO_C_DOUBLE(slots[op->a + 1])) != (bool)op->b)
+          failed_index = i;
+        break;
+      }
+      case TRACE_CONSTANT:
+        *top++ = op->constant;
+        break;
+      case TRACE_GET_VAR:
+        *top++ = slots[op->a];
+        break;
+      case TRACE_SET_VAR:
+        slots[op->a] = top[-1];
+        break;
+      case TRACE_SET_VAR_POP:
+        slots[op->a] = *--top;
+        break;
+      case TRACE_POPN:
+        top -= op->a;
+        break;
+      case TRACE_ADD:
+        BINARY_OP(FROM_C_DOUBLE, +);
+        break;
+      case TRACE_SUBTRACT:
+        BINARY_OP(FROM_C_DOUBLE, -);
+        break;
+      case TRACE_MULTIPLY:
+        BINARY_OP(FROM_C_DOUBLE, *);
+        break;
+      case TRACE_DIVIDE:
+        BINARY_OP(FROM_C_DOUBLE, /);
+        break;
+      case TRACE_MODULO: {
+        double b = NUMBER(0);
+        double a = NUMBER(1);
+        top--;
+        top[-1] = FROM_C_DOUBLE(fmod(a, b));
+        break;
+      }
+      case TRACE_NEGATE:
+        top[-1] = FROM_C_DOUBLE(-NUMBER(0));
+        break;
+      case TRACE_EQUALS_NUM:
+        BINARY_OP(FROM_C_BOOL, ==);
+        break;
+      case TRACE_NOT_EQUALS_NUM:
+        BINARY_OP(FROM_C_BOOL, !=);
+        break;
+      case TRACE_GREATER_THAN:
+        BINARY_OP(FROM_C_BOOL, >);
+        break;
+      case TRACE_GREATER_THAN_EQUALS:
+        BINARY_OP(FROM_C_BOOL, >=);
+        break;
+      case TRACE_LESS_THAN:
+        BINARY_OP(FROM_C_BOOL, <);
+        break;
+      case TRACE_LESS_THAN_EQUALS:
+        BINARY_OP(FROM_C_BOOL, <=);
+        break;
+      case TRACE_ADD_VAR_CONSTANT:
+        *top++ = FROM_C_DOUBLE(TO_C_DOUBLE(slots[op->a]) + TO_C_DOUBLE(op->constant));
+        break;
+      case TRACE_LESS_THAN_EQUALS_VARS:
+        *top++ = FROM_C_BOOL(TO_C_DOUBLE(slots[op->a]) <= TO_C_DOUBLE(slots[op->b]));
+        break;
+      case TRACE_EQUALS: {
+        vm->next_stack_top = top;
+        flatten_stack_top(vm, 2);
+        ThuslyValue b = *--top;
+        top[-1] = FROM_C_BOOL(values_are_equal(top[-1], b));
+        break;
+      }
+      case TRACE_NOT_EQUALS: {
+        vm->next_stack_top = top;
+        flatten_stack_top(vm, 2);
+        ThuslyValue b = *--top;
+        top[-1] = FROM_C_BOOL(!values_are_equal(top[-1], b));
+        break;
+      }
+      case TRACE_NOT:
+        top[-1] = FROM_C_BOOL(!is_truthy(top[-1]));
+        break;
+      case TRACE_OUT:
+        vm->next_stack_top = top;
+        flatten_stack_top(vm, 1);
+        print_value(*--top);
+        printf("\n");
+        break;
+    }
+
+    if (failed_index != -1)
+      break;
+  }
+  vm->next_stack_top = top;
+
+  return failed_index;
+
+  #undef NUMBER
+  #undef BINARY_OP
+}
+
+// ---------------------------------------------------
+// RECORDER
+// ---------------------------------------------------
+
+static TraceOp* emit_op(Recorder* recorder, TraceOpcode opcode, int a, int b, int exit_offset) {
+  Trace* trace = recorder->trace;
+  bool max_capacity_reached = trace->count + 1 > trace->capacity;
+  if (max_capacity_reached) {
+    int old_capacity = trace->capacity;
+    trace->capacity = GROW_CAPACITY(old_capacity);
+    trace->ops = GROW_ARRAY(TraceOp, trace->ops, old_capacity, trace->capacity);
+  }
+
+  TraceOp* op = &trace->ops[trace->count++];
+  *op = (TraceOp){ .opcode = opcode, .a = a, .b = b, .exit_offset = exit_offset, .constant = FROM_C_NULL, .side_trace = NULL };
+
+  return op;
+}
+
+/// The stack index of the value at the given distance from the top of the stack.
+static int stack_index(Recorder* recorder, int distance) {
+  return (int)(recorder->vm->next_stack_top - recorder->vm->stack) - 1 - distance;
+}
+
+static ThuslyValue observe(Recorder* recorder, int distance) {
+  return recorder->vm->next_stack_top[-1 - distance];
+}
+
+/// Guard that the value at the given distance is a number (unless already known).
+static void require_number(Recorder* recorder, int distance, int exit_offset) {
+  int index = stack_index(recorder, distance);
+  if (!recorder->known_numbers[index]) {
+    emit_op(recorder, TRACE_GUARD_NUMBER, distance, 0, exit_offset);
+    recorder->known_numbers[index] = true;
+  }
+}
+
+static void require_slot_number(Recorder* recorder, int slot, int exit_offset) {
+  if (!recorder->known_numbers[slot]) {
+    emit_op(recorder, TRACE_GUARD_SLOT_NUMBER, slot, 0, exit_offset);
+    recorder->known_numbers[slot] = true;
+  }
+}
+
+/// Record an operation on the two numbers at the top of the stack (replaced by
+/// a number if `produces_number`, otherwise by a boolean).
+static RecordResult record_binary_number_op(Recorder* recorder, TraceOpcode opcode, bool produces_number, int offset) {
+  if (!IS_NUMBER(observe(recorder, 0)) || !IS_NUMBER(observe(recorder, 1)))
+    return RECORD_ABORT;
+
+  require_number(recorder, 0, offset);
+  require_number(recorder, 1, offset);
+  emit_op(recorder, opcode, 0, 0, offset);
+  recorder->known_numbers[stack_index(recorder, 1)] = produces_number;
+  recorder->known_numbers[stack_index(recorder, 0)] = false;
+
+  return RECORD_CONTINUE;
+}
+
+/// Record an equality comparison (numbers are compared without the generic check).
+static RecordResult record_equality(Recorder* recorder, bool is_equals, int offset) {
+  if (IS_NUMBER(observe(recorder, 0)) && IS_NUMBER(observe(recorder, 1)))
+    return record_binary_number_op(recorder, is_equals ? TRACE_EQUALS_NUM : TRACE_NOT_EQUALS_NUM, false, offset);
+
+  emit_op(recorder, is_equals ? TRACE_EQUALS : TRACE_NOT_EQUALS, 0, 0, offset);
+  recorder->known_numbers[stack_index(recorder, 1)] = false;
+  recorder->known_numbers[stack_index(recorder, 0)] = false;
+
+  return RECORD_CONTINUE;
+}
+
+/// Translate the instruction at `vm->next_instruction` into trace operations and
+/// set `out_next_offset` to the offset of the instruction executed after it.
+static RecordResult record_instruction(Recorder* recorder, int* out_next_offset) {
+  VM* vm = recorder->vm;
+  Program* program = vm->program;
+  int offset = (int)(vm->next_instruction - program->instructions);
+  byte* operands = vm->next_instruction + 1;
+  int depth = (int)(vm->next_stack_top - vm->stack);
+  bool* known_numbers = recorder->known_numbers;
+  *out_next_offset = offset + get_instruction_size(program->instructions[offset]);
+
+  switch (program->instructions[offset]) {
+    case OP_POP:
+      emit_op(recorder, TRACE_POPN, 1, 0, offset);
+      known_numbers[depth - 1] = false;
+      return RECORD_CONTINUE;
+    case OP_POPN: {
+      // See `compiler.discard_scope()` for comments regarding `N + 1`.
+      int count = operands[0] + 1;
+      emit_op(recorder, TRACE_POPN, count, 0, offset);
+      for (int i = 1; i <= count; i++)
+        known_numbers[depth - i] = false;
+      return RECORD_CONTINUE;
+    }
+    case OP_GET_VAR:
+    case OP_GET_VAR_LONG: {
+      int slot = program->instructions[offset] == OP_GET_VAR ? operands[0] : read_long_operand(operands);
+      emit_op(recorder, TRACE_GET_VAR, slot, 0, offset);
+      known_numbers[depth] = known_numbers[slot];
+      return RECORD_CONTINUE;
+    }
+    case OP_SET_VAR:
+    case OP_SET_VAR_LONG: {
+      int slot = program->instructions[offset] == OP_SET_VAR ? operands[0] : read_long_operand(operands);
+      emit_op(recorder, TRACE_SET_VAR, slot, 0, offset);
+      known_numbers[slot] = known_numbers[depth - 1];
+      return RECORD_CONTINUE;
+    }
+    case OP_SET_VAR_POP:
+      emit_op(recorder, TRACE_SET_VAR_POP, operands[0], 0, offset);
+      known_numbers[operands[0]] = known_numbers[depth - 1];
+      known_numbers[depth - 1] = false;
+      return RECORD_CONTINUE;
+    case OP_CONSTANT:
+    case OP_CONSTANT_LONG: {
+      int index = program->instructions[offset] == OP_CONSTANT ? operands[0] : read_long_operand(operands);
+      ThuslyValue constant = program->constant_pool.values[index];
+      emit_op(recorder, TRACE_CONSTANT, 0, 0, offset)->constant = constant;
+      known_numbers[depth] = IS_NUMBER(constant);
+      return RECORD_CONTINUE;
+    }
+    case OP_CONSTANT_FALSE:
+      emit_op(recorder, TRACE_CONSTANT, 0, 0, offset)->constant = FROM_C_BOOL(false);
+      known_numbers[depth] = false;
+      return RECORD_CONTINUE;
+    case OP_CONSTANT_NONE:
+      emit_op(recorder, TRACE_CONSTANT, 0, 0, offset)->constant = FROM_C_NULL;
+      known_numbers[depth] = false;
+      return RECORD_CONTINUE;
+    case OP_CONSTANT_TRUE:
+      emit_op(recorder, TRACE_CONSTANT, 0, 0, offset)->constant = FROM_C_BOOL(true);
+      known_numbers[depth] = false;
+      return RECORD_CONTINUE;
+    // Concatenation (OP_CONCAT_TEXT) is not traced.
+    case OP_ADD:
+    case OP_ADD_NUM:
+      return record_binary_number_op(recorder, TRACE_ADD, true, offset);
+    case OP_SUBTRACT:
+    case OP_SUBTRACT_NUM:
+      return record_binary_number_op(recorder, TRACE_SUBTRACT, true, offset);
+    case OP_MULTIPLY:
+    case OP_MULTIPLY_NUM:
+      return record_binary_number_op(recorder, TRACE_MULTIPLY, true, offset);
+    case OP_DIVIDE:
+    case OP_DIVIDE_NUM:
+      return record_binary_number_op(recorder, TRACE_DIVIDE, true, offset);
+    case OP_MODULO:
+      return record_binary_number_op(recorder, TRACE_MODULO, true, offset);
+    case OP_GREATER_THAN:
+    case OP_GREATER_THAN_NUM:
+      return record_binary_number_op(recorder, TRACE_GREATER_THAN, false, offset);
+    case OP_GREATER_THAN_EQUALS:
+    case OP_GREATER_THAN_EQUALS_NUM:
+      return record_binary_number_op(recorder, TRACE_GREATER_THAN_EQUALS, false, offset);
+    case OP_LESS_THAN:
+    case OP_LESS_THAN_NUM:
+      return record_binary_number_op(recorder, TRACE_LESS_THAN, false, offset);
+    case OP_LESS_THAN_EQUALS:
+    case OP_LESS_THAN_EQUALS_NUM:
+      return record_binary_number_op(recorder, TRACE_LESS_THAN_EQUALS, false, offset);
+    case OP_EQUALS:
+    case OP_EQUALS_NUM:
+      return record_equality(recorder, true, offset);
+    case OP_NOT_EQUALS:
+    case OP_NOT_EQUALS_NUM:
+      return record_equality(recorder, false, offset);
+    case OP_NEGATE:
+      if (!IS_NUMBER(observe(recorder, 0)))
+        return RECORD_ABORT;
+      require_number(recorder, 0, offset);
+      emit_op(recorder, TRACE_NEGATE, 0, 0, offset);
+      return RECORD_CONTINUE;
+    case OP_NOT:
+      emit_op(recorder, TRACE_NOT, 0, 0, offset);
+      known_numbers[depth - 1] = false;
+      return RECORD_CONTINUE;
+    case OP_OUT:
+      emit_op(recorder, TRACE_OUT, 0, 0, offset);
+      known_numbers[depth - 1] = false;
+      return RECORD_CONTINUE;
+    case OP_JUMP_FWD:
+    case OP_JUMP_FWD_LONG:
+      *out_next_offset = get_jump_target(program, offset);
+      return RECORD_CONTINUE;
+    case OP_JUMP_FWD_IF_FALSE:
+    case OP_JUMP_FWD_IF_TRUE:
+    case OP_JUMP_FWD_IF_FALSE_LONG:
+    case OP_JUMP_FWD_IF_TRUE_LONG: {
+      // The branch taken now is the one the trace follows. The other branch
+      // is left to the interpreter by exiting at this instruction.
+      bool is_truthy_now = is_truthy(observe(recorder, 0));
+      emit_op(recorder, is_truthy_now ? TRACE_GUARD_TRUTHY : TRACE_GUARD_FALSY, 0, 0, offset);
+      bool jump_if_truthy = program->instructions[offset] == OP_JUMP_FWD_IF_TRUE
+        || program->instructions[offset] == OP_JUMP_FWD_IF_TRUE_LONG;
+      if (is_truthy_now == jump_if_truthy)
+        *out_next_offset = get_jump_target(program, offset);
+      return RECORD_CONTINUE;
+    }
+    case OP_JUMP_BWD:
+    case OP_JUMP_BWD_LONG: {
+      int target_offset = get_jump_target(program, offset);
+      // An inner loop with a trace of its own is run by that trace instead.
+      bool is_traced_inner_loop = target_offset != recorder->trace->anchor_offset
+        && vm->traces.traces[target_offset] != NULL;
+      if (is_traced_inner_loop)
+        return RECORD_ABORT;
+      *out_next_offset = target_offset;
+      return RECORD_CONTINUE;
+    }
+    case OP_FOREACH_NEXT:
+    case OP_FOREACH_NEXT_LONG: {
+      int slot = get_loop_variable_slot(program, offset);
+      for (int i = 0; i < 3; i++) {
+        if (!IS_NUMBER(vm->stack[slot + i]))
+          return RECORD_ABORT;
+      }
+      int target_offset = get_jump_target(program, offset);
+      bool is_continued_now = TO_C_DOUBLE(vm->stack[slot]) + TO_C_DOUBLE(vm->stack[slot + 2])
+        <= TO_C_DOUBLE(vm->stack[slot + 1]);
+      bool is_traced_inner_loop = is_continued_now && target_offset != recorder->trace->anchor_offset
+        && vm->traces.traces[target_offset] != NULL;
+      if (is_traced_inner_loop)
+        return RECORD_ABORT;
+
+      for (int i = 0; i < 3; i++)
+        require_slot_number(recorder, slot + i, offset);
+      // As with conditional jumps, the trace follows the branch taken now, and the
+      // exit continues where the other branch goes.
+      int exit_offset = is_continued_now ? *out_next_offset : target_offset;
+      emit_op(recorder, TRACE_GUARD_FOREACH_NEXT, slot, is_continued_now, exit_offset);
+      if (is_continued_now)
+        *out_next_offset = target_offset;
+      return RECORD_CONTINUE;
+    }
+    case OP_ADD_VAR_CONSTANT: {
+      // Fused: OP_GET_VAR <slot>, OP_CONSTANT <index>, OP_ADD
+      ThuslyValue constant = program->constant_pool.values[operands[1]];
+      if (!IS_NUMBER(vm->stack[operands[0]]) || !IS_NUMBER(constant))
+        return RECORD_ABORT;
+      require_slot_number(recorder, operands[0], offset);
+      emit_op(recorder, TRACE_ADD_VAR_CONSTANT, operands[0], 0, offset)->constant = constant;
+      known_numbers[depth] = true;
+      return RECORD_CONTINUE;
+    }
+    case OP_LESS_THAN_EQUALS_VARS:
+      // Fused: OP_GET_VAR <slot a>, OP_GET_VAR <slot b>, OP_LESS_THAN_EQUALS
+      if (!IS_NUMBER(vm->stack[operands[0]]) || !IS_NUMBER(vm->stack[operands[1]]))
+        return RECORD_ABORT;
+      require_slot_number(recorder, operands[0], offset);
+      require_slot_number(recorder, operands[1], offset);
+      emit_op(recorder, TRACE_LESS_THAN_EQUALS_VARS, operands[0], operands[1], offset);
+      known_numbers[depth] = false;
+      return RECORD_CONTINUE;
+    default:
+      // E.g. OP_CONCAT_TEXT and OP_RETURN
+      return RECORD_ABORT;
+  }
+}
+
+static bool is_number_comparison(TraceOpcode opcode) {
+  switch (opcode) {
+    case TRACE_EQUALS_NUM:
+    case TRACE_NOT_EQUALS_NUM:
+    case TRACE_GREATER_THAN:
+    case TRACE_GREATER_THAN_EQUALS:
+    case TRACE_LESS_THAN:
+    case TRACE_LESS_THAN_EQUALS:
+      return true;
+    default:
+      return false;
+  }
+}
+
+/// Optimize the recorded trace. A loop condition compiles to a comparison, a
+/// conditional jump, and a pop of the condition. These are fused into a single
+/// guard that does not need to push the boolean result onto the stack.
+static void optimize_trace(Trace* trace) {
+  int write_index = 0;
+  for (int read_index = 0; read_index < trace->count; read_index++) {
+    TraceOp* ops = trace->ops;
+    bool can_fuse = read_index + 2 < trace->count
+      && is_number_comparison(ops[read_index].opcode)
+      && (ops[read_index + 1].opcode == TRACE_GUARD_TRUTHY || ops[read_index + 1].opcode == TRACE_GUARD_FALSY)
+      && ops[read_index + 2].opcode == TRACE_POPN && ops[read_index + 2].a == 1;
+
+    if (can_fuse) {
+      bool expected_result = ops[read_index + 1].opcode == TRACE_GUARD_TRUTHY;
+      ops[write_index] = (TraceOp){
+        .opcode = TRACE_GUARD_COMPARISON,
+        .a = ops[read_index].opcode,
+        .b = expected_result,
+        .exit_offset = ops[read_index + 1].exit_offset,
+        .constant = FROM_C_NULL,
+        .side_trace = NULL,
+      };
+      read_index += 2;
+    }
+    else
+      ops[write_index] = ops[read_index];
+    write_index++;
+  }
+  trace->count = write_index;
+}
+
+/// Record the rest of the current loop iteration, from `vm->next_instruction` until
+/// reaching the loop header at `anchor_offset`. The iteration is executed while being
+/// recorded. Returns `NULL` if the recording was aborted (the VM is then left at the
+/// instruction to continue interpreting at).
+static Trace* record_trace(VM* vm, int anchor_offset) {
+  Trace* trace = ALLOCATE(Trace, 1);
+  trace->anchor_offset = anchor_offset;
+  trace->ops = NULL;
+  trace->count = 0;
+  trace->capacity = 0;
+
+  Recorder recorder = { .vm = vm, .trace = trace, .known_numbers = ALLOCATE(bool, vm->stack_capacity) };
+  for (int i = 0; i < vm->stack_capacity; i++)
+    recorder.known_numbers[i] = false;
+
+  while (true) {
+    int first_op_index = trace->count;
+    int next_offset;
+    bool should_abort = trace->count >= TRACE_MAX_LENGTH
+      || record_instruction(&recorder, &next_offset) == RECORD_ABORT;
+    if (should_abort) {
+      FREE_ARRAY(bool, recorder.known_numbers, vm->stack_capacity);
+      trace_free(trace);
+      return NULL;
+    }
+
+    // Execute the instruction just recorded (its guards hold since they were
+    // derived from the values observed).
+    run_ops(vm, &trace->ops[first_op_index], trace->count - first_op_index);
+    vm->next_instruction = vm->program->instructions + next_offset;
+
+    bool is_back_at_loop_header = next_offset == trace->anchor_offset;
+    if (is_back_at_loop_header)
+      break;
+  }
+  FREE_ARRAY(bool, recorder.known_numbers, vm->stack_capacity);
+  optimize_trace(trace);
+
+  return trace;
+}
+
+// ---------------------------------------------------
+// EXECUTOR (LOOP)
+// ---------------------------------------------------
+
+/// Run the root trace repeatedly until a guard without a side trace fails, then
+/// leave the VM at the bytecode instruction to resume at. A failing guard with a
+/// side trace continues in the side trace, which completes the iteration.
+static void execute_trace(VM* vm, Trace* root_trace) {
+  vm->stats.trace_entries++;
+  Trace* trace = root_trace;
+  while (true) {
+    int failed_index = run_ops(vm, trace->ops, trace->count);
+    if (failed_index == -1) {
+      vm->stats.trace_iterations++;
+      trace = root_trace;
+      continue;
+    }
+
+    TraceOp* guard = &trace->ops[failed_index];
+    vm->next_instruction = vm->program->instructions + guard->exit_offset;
+    if (guard->side_trace != NULL) {
+      trace = guard->side_trace;
+      continue;
+    }
+
+    bool is_hot_exit = ++guard->exit_count >= TRACE_HOT_EXIT_THRESHOLD
+      && guard->side_trace_attempts < TRACE_MAX_ATTEMPTS;
+    if (!is_hot_exit)
+      return;
+
+    guard->exit_count = 0;
+    Trace* side_trace = record_trace(vm, root_trace->anchor_offset);
+    if (side_trace == NULL) {
+      guard->side_trace_attempts++;
+      vm->stats.trace_aborts++;
+      return;
+    }
+    guard->side_trace = side_trace;
+    vm->stats.side_traces_recorded++;
+    vm->stats.trace_iterations++;
+    trace = root_trace;
+  }
+}
+
+/// Count the arrival at the loop header at `vm->next_instruction` (via a backward
+/// jump), record a trace if the loop became hot, and run its trace if it has one.
+/// When returning, the interpreter continues at `vm->next_instruction`.
+void trace_on_backward_jump(VM* vm) {
+  TraceCache* cache = &vm->traces;
+  int anchor_offset = (int)(vm->next_instruction - cache->program->instructions);
+  Trace* trace = cache->traces[anchor_offset];
+  if (trace == NULL) {
+    bool is_blacklisted = cache->attempts[anchor_offset] >= TRACE_MAX_ATTEMPTS;
+    if (is_blacklisted || ++cache->hotness[anchor_offset] < TRACE_HOT_LOOP_THRESHOLD)
+      return;
+
+    cache->hotness[anchor_offset] = 0;
+    trace = record_trace(vm, anchor_offset);
+    if (trace == NULL) {
+      cache->attempts[anchor_offset]++;
+      vm->stats.trace_aborts++;
+      return;
+    }
+    cache->traces[anchor_offset] = trace;
+    vm->stats.traces_recorded++;
+  }
+
+  execute_trace(vm, trace);
+}
@@ -0,0 +1,105 @@
+#ifndef CTHUSLY_TRACE_H
+#define CTHUSLY_TRACE_H
+
+#include "common.h"
+#include "program.h"
+#include "thusly_value.h"
+
+/// The number of times a backward jump must land on a loop header before
+/// one iteration of the loop is recorded as a trace.
+#define TRACE_HOT_LOOP_THRESHOLD 50
+/// The number of times a guard must fail before the path taken from it is
+/// recorded as a side trace (which continues to the end of the iteration).
+#define TRACE_HOT_EXIT_THRESHOLD 20
+/// The number of failed recordings after which a loop (or a guard) is no longer traced.
+#define TRACE_MAX_ATTEMPTS 3
+/// The maximum number of operations in a trace (longer recordings are aborted).
+#define TRACE_MAX_LENGTH 512
+
+struct VM;
+
+/// The operations of a trace. Unlike the bytecode, the operations assume the
+/// types of their operands (numbers) which are instead checked by explicit
+/// guards, and the control flow is linear (branches are replaced by guards).
+typedef enum {
+  // Guards (exit the trace if the check fails)
+  TRACE_GUARD_NUMBER,
+  TRACE_GUARD_SLOT_NUMBER,
+  TRACE_GUARD_TRUTHY,
+  TRACE_GUARD_FALSY,
+  TRACE_GUARD_COMPARISON,
+  TRACE_GUARD_FOREACH_NEXT,
+  // Stack and variables
+  TRACE_CONSTANT,
+  TRACE_GET_VAR,
+  TRACE_SET_VAR,
+  TRACE_SET_VAR_POP,
+  TRACE_POPN,
+  // Number operations
+  TRACE_ADD,
+  TRACE_SUBTRACT,
+  TRACE_MULTIPLY,
+  TRACE_DIVIDE,
+  TRACE_MODULO,
+  TRACE_NEGATE,
+  TRACE_EQUALS_NUM,
+  TRACE_NOT_EQUALS_NUM,
+  TRACE_GREATER_THAN,
+  TRACE_GREATER_THAN_EQUALS,
+  TRACE_LESS_THAN,
+  TRACE_LESS_THAN_EQUALS,
+  TRACE_ADD_VAR_CONSTANT,
+  TRACE_LESS_THAN_EQUALS_VARS,
+  // Operations on values of any type
+  TRACE_EQUALS,
+  TRACE_NOT_EQUALS,
+  TRACE_NOT,
+  TRACE_OUT,
+} TraceOpcode;
+
+typedef struct {
+  TraceOpcode opcode;
+  /// The first operand (a variable slot, a stack distance, a count, or for
+  /// TRACE_GUARD_COMPARISON, the comparison opcode).
+  int a;
+  /// The second operand (a variable slot, or for TRACE_GUARD_COMPARISON and
+  /// TRACE_GUARD_FOREACH_NEXT, the expected result of the comparison).
+  int b;
+  /// The offset of the bytecode instruction to resume at in the interpreter if
+  /// a guard fails. The VM stack is then as it was before that instruction.
+  int exit_offset;
+  /// The constant used by TRACE_CONSTANT and TRACE_ADD_VAR_CONSTANT.
+  ThuslyValue constant;
+  /// (Guards) The trace to continue with when the guard fails, if recorded.
+  struct Trace* side_trace;
+  /// (Guards) The number of times the guard failed without a side trace.
+  int exit_count;
+  /// (Guards) The number of failed recordings of a side trace.
+  byte side_trace_attempts;
+} TraceOp;
+
+/// A linear recording of one iteration of a loop, ending at the loop header
+/// (the target of the backward jump). A root trace also starts at the loop
+/// header, while a side trace starts where a guard of another trace failed.
+typedef struct Trace {
+  int anchor_offset;
+  TraceOp* ops;
+  int count;
+  int capacity;
+} Trace;
+
+/// The traces and hotness counters of the loops in the program being run.
+/// (All arrays are indexed by the bytecode offset of a loop header.)
+typedef struct {
+  bool is_enabled;
+  Program* program;
+  int* hotness;
+  byte* attempts;
+  Trace** traces;
+} TraceCache;
+
+void trace_cache_init(TraceCache* cache, Program* program, bool is_enabled);
+void trace_cache_free(TraceCache* cache);
+void trace_on_backward_jump(struct VM* vm);
+
+#endif
@@ -3,23 +3,49 @@
 #include <stdio.h>
 #include <string.h>
 
+#include "bytecode_file.h"
 #include "common.h"
 #include "compiler.h"
 #include "debug.h"
 #include "gc_object.h"
+#include "jit.h"
 #include "memory.h"
+#include "profiler.h"
+#include "register_vm.h"
 #include "vm.h"
 
 static void reset_stack(VM* vm) {
   vm->next_stack_top = vm->stack;
 }
 
+/// Make room for the given number of values on the stack.
+static void reserve_stack(VM* vm, int capacity) {
+  if (capacity <= vm->stack_capacity)
+    return;
+
+  int depth = (int)(vm->next_stack_top - vm->stack);
+  vm->stack = GROW_ARRAY(ThuslyValue, vm->stack, vm->stack_capacity, capacity);
+  vm->stack_capacity = capacity;
+  vm->next_stack_top = vm->stack + depth;
+}
+
 void vm_init(VM* vm) {
+  vm->stack = NULL;
+  vm->stack_capacity = 0;
   reset_stack(vm);
   vm->environment.vm = vm;
   vm->environment.gc_objects = NULL;
+  arena_init(&vm->environment.arena);
+  vm->environment.bytes_allocated = 0;
+  vm->environment.next_gc = GC_INITIAL_HEAP_BUDGET;
+  vm->environment.gray_stack = NULL;
+  vm->environment.gray_count = 0;
+  vm->environment.gray_capacity = 0;
+  vm->environment.gc_stats = (GCStats){ 0 };
   vm->program = NULL;
-  table_init(&vm->environment.texts);
+  vm->stats = (VMStats){ 0 };
+  trace_cache_init(&vm->traces, NULL, false);
+  intern_set_init(&vm->environment.texts);
 }
 
 void vm_free(VM* vm) {
@@ -31,34 +57,101 @@ void vm_free(VM* vm) {
   // ---------------
 
   vm->program = NULL;
-  table_free(&vm->environment.texts);
+  FREE_ARRAY(ThuslyValue, vm->stack, vm->stack_capacity);
+  vm->stack = NULL;
+  vm->stack_capacity = 0;
+  reset_stack(vm);
+  intern_set_free(&vm->environment.texts);
   free_objects(&vm->environment);
 }
 
-static void error(VM* vm, const char* message, ...) {
-  // The instructions and source_lines array indexes mirror each other.
-  size_t instruction_index = vm->next_instruction - vm->program->instructions - 1;
-  int source_line = vm->program->source_lines[instruction_index];
+void vm_print_stats(VM* vm, FILE* fout) {
+  VMStats* stats = &vm->stats;
+  uint64_t specialized_executions = stats->specialization_hits + stats->specialization_misses;
+  double hit_rate = specialized_executions == 0 ? 0 : 100.0 * stats->specialization_hits / specialized_executions;
+
+  fprintf(fout, "\n================ VM Stats ================\n\n");
+  fprintf(fout, "Specialized instructions:\n");
+  fprintf(fout, "    Rewrites (generic -> specialized):  %llu\n", (unsigned long long)stats->specializations);
+  fprintf(fout, "    Hits (type guard held):             %llu\n", (unsigned long long)stats->specialization_hits);
+  fprintf(fout, "    Misses (reverted to generic):       %llu\n", (unsigned long long)stats->specialization_misses);
+  fprintf(fout, "    Hit rate:                           %.2f%%\n", hit_rate);
+  fprintf(fout, "Constant pool:\n");
+  fprintf(fout, "    Literals compiled:                  %llu\n", (unsigned long long)stats->constant_literals);
+  fprintf(fout, "    Constants (distinct literals):      %llu\n", (unsigned long long)stats->constants);
+  fprintf(fout, "Program:\n");
+  fprintf(fout, "    Bytecode (bytes):                   %llu\n", (unsigned long long)stats->bytecode_size);
+  fprintf(fout, "    Line table (bytes):                 %llu\n", (unsigned long long)stats->line_table_size);
+  fprintf(fout, "    Instructions removed by folding:    %llu\n", (unsigned long long)stats->folded_instructions);
+  fprintf(fout, "    Dead branches removed:              %llu\n", (unsigned long long)stats->dead_branches);
+  fprintf(fout, "    Instructions removed by peephole:   %llu\n", (unsigned long long)stats->peephole_removals);
+  fprintf(fout, "    Jumps threaded:                     %llu\n", (unsigned long long)stats->threaded_jumps);
+  if (flag_optimization_level >= 2) {
+    fprintf(fout, "Mid-end (-O2):\n");
+    fprintf(fout, "    Loop invariants hoisted:            %llu\n", (unsigned long long)stats->hoisted_expressions);
+    fprintf(fout, "    Common subexpressions eliminated:   %llu\n", (unsigned long long)stats->eliminated_subexpressions);
+    fprintf(fout, "    Dead stores removed:                %llu\n", (unsigned long long)stats->removed_stores);
+    fprintf(fout, "    Unused variables removed:           %llu\n", (unsigned long long)stats->removed_variables);
+  }
+  #ifdef PROFILE_DISPATCH
+    fprintf(fout, "    Instructions executed:              %llu\n", (unsigned long long)stats->executed_instructions);
+  #endif
+  if (flag_register_engine) {
+    fprintf(fout, "Register engine (--engine=reg):\n");
+    fprintf(fout, "    Bytecode instructions translated:   %llu\n", (unsigned long long)stats->translated_instructions);
+    fprintf(fout, "    Register instructions:              %llu\n", (unsigned long long)stats->register_instructions);
+  }
+  if (flag_jit) {
+    fprintf(fout, "JIT:\n");
+    fprintf(fout, "    Programs compiled:                  %llu\n", (unsigned long long)stats->jit_compilations);
+    fprintf(fout, "    Programs interpreted (unsupported): %llu\n", (unsigned long long)stats->jit_rejections);
+    fprintf(fout, "    Exits to the interpreter:           %llu\n", (unsigned long long)stats->jit_fallbacks);
+  }
+  if (flag_tracing) {
+    fprintf(fout, "Loop traces:\n");
+    fprintf(fout, "    Recorded:                           %llu\n", (unsigned long long)stats->traces_recorded);
+    fprintf(fout, "    Side traces recorded:               %llu\n", (unsigned long long)stats->side_traces_recorded);
+    fprintf(fout, "    Aborted recordings:                 %llu\n", (unsigned long long)stats->trace_aborts);
+    fprintf(fout, "    Entries (= exits):                  %llu\n", (unsigned long long)stats->trace_entries);
+    fprintf(fout, "    Iterations run by traces:           %llu\n", (unsigned long long)stats->trace_iterations);
+  }
+}
+
+static void report_error(VM* vm, int instruction_offset, const char* message, va_list args) {
+  int source_line = program_get_source_line(vm->program, instruction_offset);
 
   fprintf(stderr, "\n---------");
   fprintf(stderr, "\n| error |");
   fprintf(stderr, "\n---------");
   fprintf(stderr, "\n\t> Line:\n\t\t%d", source_line);
   fprintf(stderr, "\n\t> What's wrong:\n\t\t");
-  va_list args;
-  va_start(args, message);
   vfprintf(stderr, message, args);
-  va_end(args);
   fputs("\n", stderr);
 
   reset_stack(vm);
 }
 
+static void error(VM* vm, const char* message, ...) {
+  int instruction_index = (int)(vm->next_instruction - vm->program->instructions - 1);
+  va_list args;
+  va_start(args, message);
+  report_error(vm, instruction_index, message, args);
+  va_end(args);
+}
+
+/// Report a runtime error of the instruction at the given offset of the VM's
+/// program (used by the engines that do not run the bytecode itself).
+void vm_runtime_error(VM* vm, int instruction_offset, const char* message, ...) {
+  va_list args;
+  va_start(args, message);
+  report_error(vm, instruction_offset, message, args);
+  va_end(args);
+}
+
 static void push(VM* vm, ThuslyValue value) {
+  // (There is always room, see `reserve_stack()` in `interpret()`.)
   *vm->next_stack_top = value;
   vm->next_stack_top++;
-
-  // TODO: Check size before pushing to prevent stack overflow
 }
 
 static ThuslyValue pop(VM* vm) {
@@ -81,24 +174,47 @@ static ThuslyValue peek(VM* vm, int offset) {
   return vm->next_stack_top[-1 - offset];
 }
 
-static bool is_truthy(ThuslyValue value) {
-  // At the current stage of implementation, all values, including 0, are considered
-  // truthy except for: none, false.
-  return !(IS_NONE(value) || (IS_BOOLEAN(value) && !TO_C_BOOL(value)));
+/// Flatten the ropes among the `count` values at the top of the stack (in place).
+/// This is done before operations needing the chars or identity of a text
+/// (equality and output), since ropes are compared by their flattened text.
+void flatten_stack_top(VM* vm, int count) {
+  for (ThuslyValue* slot = vm->next_stack_top - count; slot < vm->next_stack_top; slot++)
+    *slot = flatten_text(&vm->environment, *slot);
+}
+
+/// Concatenate the two texts at the top of the stack. Returns `false` (after
+/// reporting a runtime error) if the result would be too long.
+static bool concatenate(VM* vm) {
+  // The operands are peeked at rather than popped so that they stay reachable
+  // (rooted on the stack) in case the allocation triggers a collection.
+  ThuslyValue result;
+  if (!concatenate_texts(&vm->environment, peek(vm, 1), peek(vm, 0), &result)) {
+    error(vm, "The concatenated text would be longer than the maximum length (%d).", TEXT_MAX_LENGTH);
+    return false;
+  }
+  pop_n(vm, 2);
+  push(vm, result);
+
+  return true;
 }
 
-static void concatenate(VM* vm) {
-  TextObject* b = TO_TEXT(pop(vm));
-  TextObject* a = TO_TEXT(pop(vm));
-  int length = a->length + b->length;
-  // Allocate +1 for the terminating null byte.
-  char* chars_concatenated = ALLOCATE(char, length + 1);
-  memcpy(chars_concatenated, a->chars, a->length);
-  memcpy(chars_concatenated + a->length, b->chars, b->length);
-  chars_concatenated[length] = '\0';
-
-  TextObject* result = claim_c_string(&vm->environment, chars_concatenated, length);
-  push(vm, FROM_C_OBJECT_PTR(result));
+/// Add or concatenate the two values at the top of the stack. Returns `false`
+/// (after reporting a runtime error) if the operands are of unsupported types
+/// or the concatenated text would be too long.
+static bool add(VM* vm) {
+  if (IS_NUMBER(peek(vm, 0)) && IS_NUMBER(peek(vm, 1))) {
+    double b = TO_C_DOUBLE(pop(vm));
+    double a = TO_C_DOUBLE(pop(vm));
+    push(vm, FROM_C_DOUBLE(a + b));
+  }
+  else if (IS_TEXT(peek(vm, 0)) && IS_TEXT(peek(vm, 1)))
+    return concatenate(vm);
+  else {
+    error(vm, "Addition/concatenation (+) can only be performed on either numbers or texts.");
+    return false;
+  }
+
+  return true;
 }
 
 static ErrorReport decode_and_execute(VM* vm) {
@@ -106,211 +222,636 @@ static ErrorReport decode_and_execute(VM* vm) {
   // Moves the instruction pointer past the jump operand (2 bytes) and returns it as unsigned.
   #define READ_SHORT()    (vm->next_instruction += 2, (uint16_t)((vm->next_instruction[-2] << 8) | vm->next_instruction[-1]))
   #define READ_CONSTANT() (vm->program->constant_pool.values[READ_BYTE()])
+  // Moves the instruction pointer past a long operand (3 bytes) and returns it.
+  #define READ_LONG()     (vm->next_instruction += 3, read_long_operand(vm->next_instruction - 3))
+  // Moves the instruction pointer past a long jump operand (4 bytes) and returns it as unsigned.
+  #define READ_WORD()                                                                                   \
+    (vm->next_instruction += 4,                                                                         \
+     ((uint32_t)vm->next_instruction[-4] << 24) | ((uint32_t)vm->next_instruction[-3] << 16) |         \
+     ((uint32_t)vm->next_instruction[-2] << 8) | (uint32_t)vm->next_instruction[-1])
+  #define READ_CONSTANT_LONG() (vm->program->constant_pool.values[READ_LONG()])
 
   // This macro uses a do-while loop to both allow these statements to
   // be executed in the same block and to allow a terminating semicolon
   // after calling the macro (e.g. DO_BINARY_OP();) without a C syntax error.
-  #define DO_BINARY_OP(from_c_value, operator, operator_string)                             \
+  #define DO_BINARY_OP(from_c_value, operator, operator_string, specialized_opcode)        \
     do {                                                                                    \
       if (!IS_NUMBER(peek(vm, 0)) || !IS_NUMBER(peek(vm, 1))) {                             \
         error(vm, "The operation (%s) can only be performed on numbers.", operator_string); \
         return REPORT_RUNTIME_ERROR;                                                        \
       }                                                                                     \
+      SPECIALIZE(specialized_opcode);                                                       \
+      double b = TO_C_DOUBLE(pop(vm));                                                      \
+      double a = TO_C_DOUBLE(pop(vm));                                                      \
+      push(vm, from_c_value(a operator b));                                                 \
+    } while (false)
+
+  // Rewrite the current (operand-less) instruction in place into its type-specialized
+  // form, so that the next execution of it can skip the generic type checks.
+  #define SPECIALIZE(specialized_opcode)                                                    \
+    do {                                                                                    \
+      vm->next_instruction[-1] = (specialized_opcode);                                      \
+      vm->stats.specializations++;                                                          \
+    } while (false)
+
+  // Revert the current (operand-less) type-specialized instruction to its generic
+  // form when its type guard fails, and re-execute it as the generic instruction.
+  #define DESPECIALIZE_AND_RETRY(generic_opcode)                                            \
+    do {                                                                                    \
+      vm->next_instruction--;                                                               \
+      *vm->next_instruction = (generic_opcode);                                             \
+      vm->stats.specialization_misses++;                                                    \
+      DISPATCH();                                                                           \
+    } while (false)
+
+  // The type-specialized form of DO_BINARY_OP (guarded by the operands being numbers).
+  #define DO_SPECIALIZED_BINARY_OP(from_c_value, operator, generic_opcode)                  \
+    do {                                                                                    \
+      if (!IS_NUMBER(peek(vm, 0)) || !IS_NUMBER(peek(vm, 1)))                               \
+        DESPECIALIZE_AND_RETRY(generic_opcode);                                             \
+      vm->stats.specialization_hits++;                                                      \
       double b = TO_C_DOUBLE(pop(vm));                                                      \
       double a = TO_C_DOUBLE(pop(vm));                                                      \
       push(vm, from_c_value(a operator b));                                                 \
     } while (false)
 
+  // Fused: the step of the loop variable of a `foreach` loop (at the given stack slot,
+  // followed by the end and step of the range), the comparison against the end, and
+  // the backward jump to the start of the loop body unless the end has been passed.
+  // Numbers are handled directly, while the generic path reports the same errors as
+  // OP_ADD and OP_LESS_THAN_EQUALS (and concatenates texts like OP_ADD).
+  #define DO_FOREACH_NEXT(slot, jump_size)                                                  \
+    do {                                                                                    \
+      ThuslyValue* variable = &vm->stack[(slot)];                                           \
+      bool is_continued;                                                                    \
+      if (IS_NUMBER(variable[0]) && IS_NUMBER(variable[1]) && IS_NUMBER(variable[2])) {     \
+        double next = TO_C_DOUBLE(variable[0]) + TO_C_DOUBLE(variable[2]);                  \
+        variable[0] = FROM_C_DOUBLE(next);                                                  \
+        is_continued = next <= TO_C_DOUBLE(variable[1]);                                    \
+      }                                                                                     \
+      else {                                                                                \
+        push(vm, variable[0]);                                                              \
+        push(vm, variable[2]);                                                              \
+        if (!add(vm))                                                                       \
+          return REPORT_RUNTIME_ERROR;                                                      \
+        variable[0] = pop(vm);                                                              \
+        if (!IS_NUMBER(variable[0]) || !IS_NUMBER(variable[1])) {                           \
+          error(vm, "The operation (<=) can only be performed on numbers.");               \
+          return REPORT_RUNTIME_ERROR;                                                      \
+        }                                                                                   \
+        is_continued = TO_C_DOUBLE(variable[0]) <= TO_C_DOUBLE(variable[1]);                \
+      }                                                                                     \
+      if (is_continued) {                                                                   \
+        vm->next_instruction -= (jump_size);                                                \
+        if (vm->traces.is_enabled)                                                          \
+          trace_on_backward_jump(vm);                                                       \
+      }                                                                                     \
+    } while (false)
+
+  #ifdef DEBUG_MODE
+    #define TRACE_EXECUTION()                                                       \
+      do {                                                                          \
+        if (flag_debug_execution) {                                                 \
+          disassemble_stack(vm);                                                    \
+          int offset = (int)(vm->next_instruction - vm->program->instructions);     \
+          disassemble_instruction(vm->program, offset);                             \
+        }                                                                           \
+      } while (false)
+  #else
+    #define TRACE_EXECUTION() do {} while (false)
+  #endif
+
+  // The instrumentation for `--profile` and `--stats` (see PROFILE_DISPATCH).
+  #ifdef PROFILE_DISPATCH
+    #define PROFILE_EXECUTION()                                                     \
+      do {                                                                          \
+        if (flag_profile_opcodes) {                                                 \
+          int offset = (int)(vm->next_instruction - vm->program->instructions);     \
+          profiler_record_instruction(vm->program, offset);                         \
+        }                                                                           \
+        if (flag_show_stats)                                                        \
+          vm->stats.executed_instructions++;                                        \
+      } while (false)
+  #else
+    #define PROFILE_EXECUTION() do {} while (false)
+  #endif
+
+  // With computed gotos, every handler ends by jumping directly to the handler of
+  // the next instruction via the dispatch table. This gives each handler its own
+  // indirect branch (which the CPU can predict separately) rather than having all
+  // instructions share the single branch at the top of a `switch`.
+  #ifdef COMPUTED_GOTO
+    static void* dispatch_table[] = {
+      [OP_ADD]                      = &&LABEL_OP_ADD,
+      [OP_CONSTANT]                 = &&LABEL_OP_CONSTANT,
+      [OP_CONSTANT_FALSE]           = &&LABEL_OP_CONSTANT_FALSE,
+      [OP_CONSTANT_NONE]            = &&LABEL_OP_CONSTANT_NONE,
+      [OP_CONSTANT_TRUE]            = &&LABEL_OP_CONSTANT_TRUE,
+      [OP_DIVIDE]                   = &&LABEL_OP_DIVIDE,
+      [OP_EQUALS]                   = &&LABEL_OP_EQUALS,
+      [OP_GET_VAR]                  = &&LABEL_OP_GET_VAR,
+      [OP_GREATER_THAN]             = &&LABEL_OP_GREATER_THAN,
+      [OP_GREATER_THAN_EQUALS]      = &&LABEL_OP_GREATER_THAN_EQUALS,
+      [OP_JUMP_BWD]                 = &&LABEL_OP_JUMP_BWD,
+      [OP_JUMP_FWD]                 = &&LABEL_OP_JUMP_FWD,
+      [OP_JUMP_FWD_IF_FALSE]        = &&LABEL_OP_JUMP_FWD_IF_FALSE,
+      [OP_JUMP_FWD_IF_TRUE]         = &&LABEL_OP_JUMP_FWD_IF_TRUE,
+      [OP_LESS_THAN]                = &&LABEL_OP_LESS_THAN,
+      [OP_LESS_THAN_EQUALS]         = &&LABEL_OP_LESS_THAN_EQUALS,
+      [OP_MODULO]                   = &&LABEL_OP_MODULO,
+      [OP_MULTIPLY]                 = &&LABEL_OP_MULTIPLY,
+      [OP_NEGATE]                   = &&LABEL_OP_NEGATE,
+      [OP_NOT]                      = &&LABEL_OP_NOT,
+      [OP_NOT_EQUALS]               = &&LABEL_OP_NOT_EQUALS,
+      [OP_OUT]                      = &&LABEL_OP_OUT,
+      [OP_POP]                      = &&LABEL_OP_POP,
+      [OP_POPN]                     = &&LABEL_OP_POPN,
+      [OP_RETURN]                   = &&LABEL_OP_RETURN,
+      [OP_SET_VAR]                  = &&LABEL_OP_SET_VAR,
+      [OP_SUBTRACT]                 = &&LABEL_OP_SUBTRACT,
+      [OP_ADD_VAR_CONSTANT]         = &&LABEL_OP_ADD_VAR_CONSTANT,
+      [OP_FOREACH_NEXT]             = &&LABEL_OP_FOREACH_NEXT,
+      [OP_LESS_THAN_EQUALS_VARS]    = &&LABEL_OP_LESS_THAN_EQUALS_VARS,
+      [OP_SET_VAR_POP]              = &&LABEL_OP_SET_VAR_POP,
+      [OP_CONSTANT_LONG]            = &&LABEL_OP_CONSTANT_LONG,
+      [OP_FOREACH_NEXT_LONG]        = &&LABEL_OP_FOREACH_NEXT_LONG,
+      [OP_GET_VAR_LONG]             = &&LABEL_OP_GET_VAR_LONG,
+      [OP_JUMP_BWD_LONG]            = &&LABEL_OP_JUMP_BWD_LONG,
+      [OP_JUMP_FWD_LONG]            = &&LABEL_OP_JUMP_FWD_LONG,
+      [OP_JUMP_FWD_IF_FALSE_LONG]   = &&LABEL_OP_JUMP_FWD_IF_FALSE_LONG,
+      [OP_JUMP_FWD_IF_TRUE_LONG]    = &&LABEL_OP_JUMP_FWD_IF_TRUE_LONG,
+      [OP_SET_VAR_LONG]             = &&LABEL_OP_SET_VAR_LONG,
+      [OP_ADD_NUM]                  = &&LABEL_OP_ADD_NUM,
+      [OP_CONCAT_TEXT]              = &&LABEL_OP_CONCAT_TEXT,
+      [OP_DIVIDE_NUM]               = &&LABEL_OP_DIVIDE_NUM,
+      [OP_EQUALS_NUM]               = &&LABEL_OP_EQUALS_NUM,
+      [OP_GREATER_THAN_NUM]         = &&LABEL_OP_GREATER_THAN_NUM,
+      [OP_GREATER_THAN_EQUALS_NUM]  = &&LABEL_OP_GREATER_THAN_EQUALS_NUM,
+      [OP_LESS_THAN_NUM]            = &&LABEL_OP_LESS_THAN_NUM,
+      [OP_LESS_THAN_EQUALS_NUM]     = &&LABEL_OP_LESS_THAN_EQUALS_NUM,
+      [OP_MULTIPLY_NUM]             = &&LABEL_OP_MULTIPLY_NUM,
+      [OP_NOT_EQUALS_NUM]           = &&LABEL_OP_NOT_EQUALS_NUM,
+      [OP_SUBTRACT_NUM]             = &&LABEL_OP_SUBTRACT_NUM,
+    };
+
+    #define DECODE_LOOP          DISPATCH();
+    #define INSTRUCTION(opcode)  LABEL_##opcode
+    #define DISPATCH()                                        \
+      do {                                                    \
+        TRACE_EXECUTION();                                    \
+        PROFILE_EXECUTION();                                  \
+        goto *dispatch_table[READ_BYTE()];                    \
+      } while (false)
+  #else
+    #define DECODE_LOOP          decode: TRACE_EXECUTION(); PROFILE_EXECUTION(); switch (READ_BYTE())
+    #define INSTRUCTION(opcode)  case opcode
+    #define DISPATCH()           goto decode
+  #endif
+
   #ifdef DEBUG_MODE
     if (flag_debug_execution)
       disassembler_print_headings("Execution");
   #endif
 
-  while (true) {
-    #ifdef DEBUG_MODE
-      if (flag_debug_execution) {
-        disassemble_stack(vm);
-        int offset = (int)(vm->next_instruction - vm->program->instructions);
-        disassemble_instruction(vm->program, offset);
-      }
-    #endif
-
-    byte instruction = READ_BYTE();
-    switch (instruction) {
-      case OP_POP:
-        pop(vm);
-        break;
-      case OP_POPN: {
-        byte n = READ_BYTE();
-        // `N` in `POPN` is treated as "the number to pop minus 1" in order to allow
-        // popping the maximum number of variables supported on the stack (UINT8_MAX + 1,
-        // i.e. 256). Therefore, it is incremented by 1 here.
-        pop_n(vm, n + 1);
-        break;
-      }
-      case OP_GET_VAR: {
-        byte slot = READ_BYTE();
-        // Since this is a stack-based VM, instructions will rely on values
-        // being at the top of stack. Therefore, the value at the given slot
-        // is also pushed to the top.
-        push(vm, vm->stack[slot]);
-        break;
-      }
-      case OP_SET_VAR: {
-        byte slot = READ_BYTE();
-        // An assignment expression evaluates to the assigned value.
-        // Therefore, the value is not popped from the stack.
-        vm->stack[slot] = peek(vm, 0);
-        break;
-      }
-      case OP_CONSTANT: {
-        ThuslyValue constant = READ_CONSTANT();
-        push(vm, constant);
-        break;
-      }
-      case OP_CONSTANT_FALSE:
-        push(vm, FROM_C_BOOL(false));
-        break;
-      case OP_CONSTANT_NONE:
-        push(vm, FROM_C_NULL);
-        break;
-      case OP_CONSTANT_TRUE:
-        push(vm, FROM_C_BOOL(true));
-        break;
-      case OP_EQUALS: {
-        ThuslyValue b = pop(vm);
-        ThuslyValue a = pop(vm);
-        push(vm, FROM_C_BOOL(values_are_equal(a, b)));
-        break;
-      }
-      case OP_NOT_EQUALS: {
-        ThuslyValue b = pop(vm);
-        ThuslyValue a = pop(vm);
-        push(vm, FROM_C_BOOL(!values_are_equal(a, b)));
-        break;
-      }
-      case OP_GREATER_THAN:
-        DO_BINARY_OP(FROM_C_BOOL, >, ">");
-        break;
-      case OP_GREATER_THAN_EQUALS:
-        DO_BINARY_OP(FROM_C_BOOL, >=, ">=");
-        break;
-      case OP_LESS_THAN:
-        DO_BINARY_OP(FROM_C_BOOL, <, "<");
-        break;
-      case OP_LESS_THAN_EQUALS:
-        DO_BINARY_OP(FROM_C_BOOL, <=, "<=");
-        break;
-      case OP_ADD: {
-        if (IS_TEXT(peek(vm, 0)) && IS_TEXT(peek(vm, 1)))
-          concatenate(vm);
-        else if (IS_NUMBER(peek(vm, 0)) && IS_NUMBER(peek(vm, 1))) {
-          double b = TO_C_DOUBLE(pop(vm));
-          double a = TO_C_DOUBLE(pop(vm));
-          push(vm, FROM_C_DOUBLE(a + b));
-        }
-        else {
-          error(vm, "Addition/concatenation (+) can only be performed on either numbers or texts.");
-          return REPORT_RUNTIME_ERROR;
-        }
-        break;
+  DECODE_LOOP
+  {
+    INSTRUCTION(OP_POP):
+      pop(vm);
+      DISPATCH();
+    INSTRUCTION(OP_POPN): {
+      byte n = READ_BYTE();
+      // `N` in `POPN` is treated as "the number to pop minus 1" in order to allow
+      // popping the maximum number of variables supported on the stack (UINT8_MAX + 1,
+      // i.e. 256). Therefore, it is incremented by 1 here.
+      pop_n(vm, n + 1);
+      DISPATCH();
+    }
+    INSTRUCTION(OP_GET_VAR): {
+      byte slot = READ_BYTE();
+      // Since this is a stack-based VM, instructions will rely on values
+      // being at the top of stack. Therefore, the value at the given slot
+      // is also pushed to the top.
+      push(vm, vm->stack[slot]);
+      DISPATCH();
+    }
+    INSTRUCTION(OP_SET_VAR): {
+      byte slot = READ_BYTE();
+      // An assignment expression evaluates to the assigned value.
+      // Therefore, the value is not popped from the stack.
+      vm->stack[slot] = peek(vm, 0);
+      DISPATCH();
+    }
+    INSTRUCTION(OP_CONSTANT): {
+      ThuslyValue constant = READ_CONSTANT();
+      push(vm, constant);
+      DISPATCH();
+    }
+    INSTRUCTION(OP_CONSTANT_FALSE):
+      push(vm, FROM_C_BOOL(false));
+      DISPATCH();
+    INSTRUCTION(OP_CONSTANT_NONE):
+      push(vm, FROM_C_NULL);
+      DISPATCH();
+    INSTRUCTION(OP_CONSTANT_TRUE):
+      push(vm, FROM_C_BOOL(true));
+      DISPATCH();
+    INSTRUCTION(OP_EQUALS): {
+      if (IS_NUMBER(peek(vm, 0)) && IS_NUMBER(peek(vm, 1)))
+        SPECIALIZE(OP_EQUALS_NUM);
+      flatten_stack_top(vm, 2);
+      ThuslyValue b = pop(vm);
+      ThuslyValue a = pop(vm);
+      push(vm, FROM_C_BOOL(values_are_equal(a, b)));
+      DISPATCH();
+    }
+    INSTRUCTION(OP_NOT_EQUALS): {
+      if (IS_NUMBER(peek(vm, 0)) && IS_NUMBER(peek(vm, 1)))
+        SPECIALIZE(OP_NOT_EQUALS_NUM);
+      flatten_stack_top(vm, 2);
+      ThuslyValue b = pop(vm);
+      ThuslyValue a = pop(vm);
+      push(vm, FROM_C_BOOL(!values_are_equal(a, b)));
+      DISPATCH();
+    }
+    INSTRUCTION(OP_GREATER_THAN):
+      DO_BINARY_OP(FROM_C_BOOL, >, ">", OP_GREATER_THAN_NUM);
+      DISPATCH();
+    INSTRUCTION(OP_GREATER_THAN_EQUALS):
+      DO_BINARY_OP(FROM_C_BOOL, >=, ">=", OP_GREATER_THAN_EQUALS_NUM);
+      DISPATCH();
+    INSTRUCTION(OP_LESS_THAN):
+      DO_BINARY_OP(FROM_C_BOOL, <, "<", OP_LESS_THAN_NUM);
+      DISPATCH();
+    INSTRUCTION(OP_LESS_THAN_EQUALS):
+      DO_BINARY_OP(FROM_C_BOOL, <=, "<=", OP_LESS_THAN_EQUALS_NUM);
+      DISPATCH();
+    INSTRUCTION(OP_ADD):
+      if (IS_NUMBER(peek(vm, 0)) && IS_NUMBER(peek(vm, 1)))
+        SPECIALIZE(OP_ADD_NUM);
+      else if (IS_TEXT(peek(vm, 0)) && IS_TEXT(peek(vm, 1)))
+        SPECIALIZE(OP_CONCAT_TEXT);
+      if (!add(vm))
+        return REPORT_RUNTIME_ERROR;
+      DISPATCH();
+    INSTRUCTION(OP_SUBTRACT):
+      DO_BINARY_OP(FROM_C_DOUBLE, -, "-", OP_SUBTRACT_NUM);
+      DISPATCH();
+    INSTRUCTION(OP_MULTIPLY):
+      DO_BINARY_OP(FROM_C_DOUBLE, *, "*", OP_MULTIPLY_NUM);
+      DISPATCH();
+    INSTRUCTION(OP_DIVIDE):
+      // TODO: Handle division by 0
+      DO_BINARY_OP(FROM_C_DOUBLE, /, "/", OP_DIVIDE_NUM);
+      DISPATCH();
+    INSTRUCTION(OP_MODULO): {
+      // TODO: Handle division by 0
+      if (!IS_NUMBER(peek(vm, 0)) || !IS_NUMBER(peek(vm, 1))) {
+        error(vm, "Modulo (mod) can only be performed on numbers.");
+        return REPORT_RUNTIME_ERROR;
       }
-      case OP_SUBTRACT:
-        DO_BINARY_OP(FROM_C_DOUBLE, -, "-");
-        break;
-      case OP_MULTIPLY:
-        DO_BINARY_OP(FROM_C_DOUBLE, *, "*");
-        break;
-      case OP_DIVIDE:
-        // TODO: Handle division by 0
-        DO_BINARY_OP(FROM_C_DOUBLE, /, "/");
-        break;
-      case OP_MODULO: {
-        // TODO: Handle division by 0
-        if (!IS_NUMBER(peek(vm, 0)) || !IS_NUMBER(peek(vm, 1))) {
-          error(vm, "Modulo (mod) can only be performed on numbers.");
-          return REPORT_RUNTIME_ERROR;
-        }
-        double b = TO_C_DOUBLE(pop(vm));
-        double a = TO_C_DOUBLE(pop(vm));
-        push(vm, FROM_C_DOUBLE(fmod(a, b)));
-        break;
+      double b = TO_C_DOUBLE(pop(vm));
+      double a = TO_C_DOUBLE(pop(vm));
+      push(vm, FROM_C_DOUBLE(fmod(a, b)));
+      DISPATCH();
+    }
+    INSTRUCTION(OP_NEGATE):
+      // Peek at the stack rather than pop here in case there is garbage
+      // collection before the value is pushed onto the stack again.
+      if (!IS_NUMBER(peek(vm, 0))) {
+        error(vm, "Negation (-) can only be performed on numbers.");
+        return REPORT_RUNTIME_ERROR;
       }
-      case OP_NEGATE:
-        // Peek at the stack rather than pop here in case there is garbage
-        // collection before the value is pushed onto the stack again.
-        if (!IS_NUMBER(peek(vm, 0))) {
-          error(vm, "Negation (-) can only be performed on numbers.");
-          return REPORT_RUNTIME_ERROR;
+      // TODO: Consider negating the value in place without popping and
+      // pushing, in order to circumvent unnecessarily incrementing and
+      // decrementing the stack pointer (as the stack size is unchanged).
+      push(vm, FROM_C_DOUBLE(-TO_C_DOUBLE(pop(vm))));
+      DISPATCH();
+    INSTRUCTION(OP_NOT):
+      push(vm, FROM_C_BOOL(!is_truthy(pop(vm))));
+      DISPATCH();
+    INSTRUCTION(OP_OUT):
+      #ifdef DEBUG_MODE
+        if (flag_debug_execution) {
+          disassembler_indent_to_last_column();
+          printf("output: ");
         }
-        // TODO: Consider negating the value in place without popping and
-        // pushing, in order to circumvent unnecessarily incrementing and
-        // decrementing the stack pointer (as the stack size is unchanged).
-        push(vm, FROM_C_DOUBLE(-TO_C_DOUBLE(pop(vm))));
-        break;
-      case OP_NOT:
-        push(vm, FROM_C_BOOL(!is_truthy(pop(vm))));
-        break;
-      case OP_OUT:
-        #ifdef DEBUG_MODE
-          if (flag_debug_execution) {
-            disassembler_indent_to_last_column();
-            printf("output: ");
-          }
-        #endif
-        print_value(pop(vm));
-        printf("\n");
-        break;
-      case OP_JUMP_FWD: {
-        uint16_t offset = READ_SHORT();
+      #endif
+      flatten_stack_top(vm, 1);
+      print_value(pop(vm));
+      printf("\n");
+      DISPATCH();
+    INSTRUCTION(OP_JUMP_FWD): {
+      uint16_t offset = READ_SHORT();
+      vm->next_instruction += offset;
+      DISPATCH();
+    }
+    INSTRUCTION(OP_JUMP_FWD_IF_FALSE): {
+      uint16_t offset = READ_SHORT();
+      if (!is_truthy(peek(vm, 0)))
         vm->next_instruction += offset;
-        break;
-      }
-      case OP_JUMP_FWD_IF_FALSE: {
-        uint16_t offset = READ_SHORT();
-        if (!is_truthy(peek(vm, 0)))
-          vm->next_instruction += offset;
-        break;
-      }
-      case OP_JUMP_FWD_IF_TRUE: {
-        uint16_t offset = READ_SHORT();
-        if (is_truthy(peek(vm, 0)))
-          vm->next_instruction += offset;
-        break;
-      }
-      case OP_JUMP_BWD: {
-        uint16_t offset = READ_SHORT();
-        vm->next_instruction -= offset;
-        break;
+      DISPATCH();
+    }
+    INSTRUCTION(OP_JUMP_FWD_IF_TRUE): {
+      uint16_t offset = READ_SHORT();
+      if (is_truthy(peek(vm, 0)))
+        vm->next_instruction += offset;
+      DISPATCH();
+    }
+    INSTRUCTION(OP_JUMP_BWD): {
+      uint16_t offset = READ_SHORT();
+      vm->next_instruction -= offset;
+      if (vm->traces.is_enabled)
+        trace_on_backward_jump(vm);
+      DISPATCH();
+    }
+    INSTRUCTION(OP_ADD_VAR_CONSTANT): {
+      // Fused: OP_GET_VAR <slot>, OP_CONSTANT <index>, OP_ADD
+      ThuslyValue a = vm->stack[READ_BYTE()];
+      ThuslyValue b = READ_CONSTANT();
+      if (IS_NUMBER(a) && IS_NUMBER(b)) {
+        push(vm, FROM_C_DOUBLE(TO_C_DOUBLE(a) + TO_C_DOUBLE(b)));
+        DISPATCH();
       }
-      case OP_RETURN: {
-        return REPORT_NO_ERROR;
+      push(vm, a);
+      push(vm, b);
+      if (!add(vm))
+        return REPORT_RUNTIME_ERROR;
+      DISPATCH();
+    }
+    INSTRUCTION(OP_FOREACH_NEXT): {
+      byte slot = READ_BYTE();
+      uint16_t offset = READ_SHORT();
+      DO_FOREACH_NEXT(slot, offset);
+      DISPATCH();
+    }
+    INSTRUCTION(OP_LESS_THAN_EQUALS_VARS): {
+      // Fused: OP_GET_VAR <slot a>, OP_GET_VAR <slot b>, OP_LESS_THAN_EQUALS
+      ThuslyValue a = vm->stack[READ_BYTE()];
+      ThuslyValue b = vm->stack[READ_BYTE()];
+      if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+        error(vm, "The operation (<=) can only be performed on numbers.");
+        return REPORT_RUNTIME_ERROR;
       }
+      push(vm, FROM_C_BOOL(TO_C_DOUBLE(a) <= TO_C_DOUBLE(b)));
+      DISPATCH();
+    }
+    INSTRUCTION(OP_SET_VAR_POP): {
+      // Fused: OP_SET_VAR <slot>, OP_POP
+      byte slot = READ_BYTE();
+      vm->stack[slot] = pop(vm);
+      DISPATCH();
+    }
+    INSTRUCTION(OP_CONSTANT_LONG): {
+      ThuslyValue constant = READ_CONSTANT_LONG();
+      push(vm, constant);
+      DISPATCH();
+    }
+    INSTRUCTION(OP_FOREACH_NEXT_LONG): {
+      int slot = READ_LONG();
+      uint32_t offset = READ_WORD();
+      DO_FOREACH_NEXT(slot, offset);
+      DISPATCH();
+    }
+    INSTRUCTION(OP_GET_VAR_LONG): {
+      int slot = READ_LONG();
+      push(vm, vm->stack[slot]);
+      DISPATCH();
+    }
+    INSTRUCTION(OP_SET_VAR_LONG): {
+      int slot = READ_LONG();
+      vm->stack[slot] = peek(vm, 0);
+      DISPATCH();
+    }
+    INSTRUCTION(OP_JUMP_FWD_LONG): {
+      uint32_t offset = READ_WORD();
+      vm->next_instruction += offset;
+      DISPATCH();
+    }
+    INSTRUCTION(OP_JUMP_FWD_IF_FALSE_LONG): {
+      uint32_t offset = READ_WORD();
+      if (!is_truthy(peek(vm, 0)))
+        vm->next_instruction += offset;
+      DISPATCH();
+    }
+    INSTRUCTION(OP_JUMP_FWD_IF_TRUE_LONG): {
+      uint32_t offset = READ_WORD();
+      if (is_truthy(peek(vm, 0)))
+        vm->next_instruction += offset;
+      DISPATCH();
+    }
+    INSTRUCTION(OP_JUMP_BWD_LONG): {
+      uint32_t offset = READ_WORD();
+      vm->next_instruction -= offset;
+      if (vm->traces.is_enabled)
+        trace_on_backward_jump(vm);
+      DISPATCH();
+    }
+    INSTRUCTION(OP_ADD_NUM):
+      DO_SPECIALIZED_BINARY_OP(FROM_C_DOUBLE, +, OP_ADD);
+      DISPATCH();
+    INSTRUCTION(OP_CONCAT_TEXT):
+      if (!IS_TEXT(peek(vm, 0)) || !IS_TEXT(peek(vm, 1)))
+        DESPECIALIZE_AND_RETRY(OP_ADD);
+      vm->stats.specialization_hits++;
+      if (!concatenate(vm))
+        return REPORT_RUNTIME_ERROR;
+      DISPATCH();
+    INSTRUCTION(OP_DIVIDE_NUM):
+      DO_SPECIALIZED_BINARY_OP(FROM_C_DOUBLE, /, OP_DIVIDE);
+      DISPATCH();
+    INSTRUCTION(OP_EQUALS_NUM):
+      DO_SPECIALIZED_BINARY_OP(FROM_C_BOOL, ==, OP_EQUALS);
+      DISPATCH();
+    INSTRUCTION(OP_GREATER_THAN_NUM):
+      DO_SPECIALIZED_BINARY_OP(FROM_C_BOOL, >, OP_GREATER_THAN);
+      DISPATCH();
+    INSTRUCTION(OP_GREATER_THAN_EQUALS_NUM):
+      DO_SPECIALIZED_BINARY_OP(FROM_C_BOOL, >=, OP_GREATER_THAN_EQUALS);
+      DISPATCH();
+    INSTRUCTION(OP_LESS_THAN_NUM):
+      DO_SPECIALIZED_BINARY_OP(FROM_C_BOOL, <, OP_LESS_THAN);
+      DISPATCH();
+    INSTRUCTION(OP_LESS_THAN_EQUALS_NUM):
+      DO_SPECIALIZED_BINARY_OP(FROM_C_BOOL, <=, OP_LESS_THAN_EQUALS);
+      DISPATCH();
+    INSTRUCTION(OP_MULTIPLY_NUM):
+      DO_SPECIALIZED_BINARY_OP(FROM_C_DOUBLE, *, OP_MULTIPLY);
+      DISPATCH();
+    INSTRUCTION(OP_NOT_EQUALS_NUM):
+      DO_SPECIALIZED_BINARY_OP(FROM_C_BOOL, !=, OP_NOT_EQUALS);
+      DISPATCH();
+    INSTRUCTION(OP_SUBTRACT_NUM):
+      DO_SPECIALIZED_BINARY_OP(FROM_C_DOUBLE, -, OP_SUBTRACT);
+      DISPATCH();
+    INSTRUCTION(OP_RETURN): {
+      return REPORT_NO_ERROR;
     }
   }
 
+  // This should not be reachable.
+  return REPORT_RUNTIME_ERROR;
+
   #undef READ_BYTE
   #undef READ_SHORT
   #undef READ_CONSTANT
+  #undef READ_LONG
+  #undef READ_WORD
+  #undef READ_CONSTANT_LONG
   #undef DO_BINARY_OP
+  #undef SPECIALIZE
+  #undef DESPECIALIZE_AND_RETRY
+  #undef DO_SPECIALIZED_BINARY_OP
+  #undef DO_FOREACH_NEXT
+  #undef TRACE_EXECUTION
+  #undef PROFILE_EXECUTION
+  #undef DECODE_LOOP
+  #undef INSTRUCTION
+  #undef DISPATCH
+}
+
+#ifdef JIT_SUPPORTED
+/// Execute the program as native code compiled by the JIT. If a type guard fails
+/// (or the program cannot be compiled), execution continues in the interpreter.
+static ErrorReport execute_jit(VM* vm) {
+  JitCode code;
+  if (!jit_compile(vm->program, &code)) {
+    vm->stats.jit_rejections++;
+    return decode_and_execute(vm);
+  }
+  vm->stats.jit_compilations++;
+
+  JitExit jit_exit = jit_execute(&code, vm);
+  jit_free(&code);
+  if (jit_exit == JIT_EXIT_RETURN)
+    return REPORT_NO_ERROR;
+
+  // The rest of the program is interpreted, starting at the instruction whose
+  // guard failed (`vm->next_instruction` was set by the JIT-compiled code).
+  vm->stats.jit_fallbacks++;
+  return decode_and_execute(vm);
+}
+#endif
+
+/// Execute the program with the register-based engine (`--engine=reg`), which
+/// runs the program translated into register instructions (see register_vm.c).
+static ErrorReport execute_registers(VM* vm) {
+  RegisterProgram register_program;
+  register_program_translate(vm->program, &register_program, &vm->stats);
+  #ifdef DEBUG_MODE
+    if (flag_debug_compilation)
+      disassemble_register_program(&register_program, vm->program);
+  #endif
+
+  // The registers are laid out in the stack (see `RegisterProgram`).
+  reserve_stack(vm, register_program.register_count);
+  ErrorReport report = register_vm_execute(&register_program, vm);
+  register_program_free(&register_program);
+  reset_stack(vm);
+
+  return report;
+}
+
+static ErrorReport execute(VM* vm) {
+  // (The profiler hooks into the stack-based interpreter loop.)
+  bool use_registers = flag_register_engine;
+  #ifdef PROFILE_DISPATCH
+    use_registers = use_registers && !flag_profile_opcodes;
+  #endif
+  if (use_registers)
+    return execute_registers(vm);
+
+  #ifdef JIT_SUPPORTED
+    // The execution trace and profiler hook into the interpreter loop.
+    bool use_jit = flag_jit;
+    #ifdef DEBUG_MODE
+      use_jit = use_jit && !flag_debug_execution;
+    #endif
+    #ifdef PROFILE_DISPATCH
+      use_jit = use_jit && !flag_profile_opcodes;
+    #endif
+    if (use_jit)
+      return execute_jit(vm);
+  #endif
+
+  return decode_and_execute(vm);
+}
+
+/// Run the compiled program (which is the VM's program).
+static ErrorReport run(VM* vm, Program* program) {
+  vm->next_instruction = program->instructions;
+  // The stack slots of the variables are numbered from the bottom of the stack.
+  reset_stack(vm);
+  reserve_stack(vm, program->max_stack_depth);
+  // The execution trace and profiler hook into the interpreter loop, so the
+  // loop traces (which bypass it) are not used when either is enabled.
+  bool use_tracing = flag_tracing;
+  #ifdef DEBUG_MODE
+    use_tracing = use_tracing && !flag_debug_execution;
+  #endif
+  #ifdef PROFILE_DISPATCH
+    if (flag_profile_opcodes)
+      profiler_start_program();
+    use_tracing = use_tracing && !flag_profile_opcodes;
+  #endif
+  trace_cache_init(&vm->traces, program, use_tracing);
+  ErrorReport report = execute(vm);
+  trace_cache_free(&vm->traces);
+
+  return report;
 }
 
 ErrorReport interpret(VM* vm, const char* source) {
   Program program;
   program_init(&program);
 
+  // The program is set before compiling so that the texts in its constant
+  // pool are reachable if the garbage collector runs during compilation.
+  vm->program = &program;
   bool saw_error = !compile(&vm->environment, source, &program);
   if (saw_error) {
+    vm->program = NULL;
     program_free(&program);
     return REPORT_COMPILE_ERROR;
   }
 
-  vm->program = &program;
-  vm->next_instruction = program.instructions;
-  ErrorReport report = decode_and_execute(vm);
+  ErrorReport report = run(vm, &program);
 
   // TODO: Since instructions of the program are freed after each
   //       `interpret`, variables used in the REPL will not be usable.
+  vm->program = NULL;
+  program_free(&program);
+
+  return report;
+}
+
+/// Run the program of a bytecode file (see `bytecode_file_map()`), which is
+/// to remain mapped until the VM has been freed (its texts refer to the file).
+ErrorReport interpret_bytecode_file(VM* vm, BytecodeFile* file) {
+  Program program;
+  program_init(&program);
+
+  // (The program is set before loading, as when compiling.)
+  vm->program = &program;
+  bool is_loaded = bytecode_file_load(file, &vm->environment, &program);
+  ErrorReport report = is_loaded ? run(vm, &program) : REPORT_COMPILE_ERROR;
+
+  vm->program = NULL;
+  program_free(&program);
+
+  return report;
+}
+
+/// Compile the source into a bytecode file at the given path rather than running it.
+ErrorReport compile_to_bytecode_file(VM* vm, const char* source, const char* path) {
+  Program program;
+  program_init(&program);
+
+  vm->program = &program;
+  ErrorReport report = REPORT_COMPILE_ERROR;
+  if (compile(&vm->environment, source, &program))
+    report = bytecode_file_write(&program, path) ? REPORT_NO_ERROR : REPORT_IO_ERROR;
+
+  vm->program = NULL;
   program_free(&program);
 
   return report;
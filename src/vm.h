@@ -1,25 +1,115 @@
 #ifndef CTHUSLY_VM_H
 #define CTHUSLY_VM_H
 
+#include <stdio.h>
+
+#include "arena.h"
+#include "intern_set.h"
 #include "program.h"
-#include "table.h"
 #include "thusly_value.h"
-
-#define STACK_MAX (UINT8_MAX + 1)
+#include "trace.h"
 
 struct VM;
+struct BytecodeFile;
+
+/// Garbage collection counters (shown with the `--gc-stats` flag).
+typedef struct {
+  uint64_t collections;
+  uint64_t objects_reclaimed;
+  uint64_t bytes_reclaimed;
+  /// The largest heap size (in bytes) reached.
+  size_t peak_bytes_allocated;
+  double total_pause_ms;
+  double max_pause_ms;
+} GCStats;
 
 /// Heap data used by the VM.
 typedef struct {
   struct VM* vm;
   /// Heap-allocated objects (points to the head).
   GCObject* gc_objects;
+  /// The memory region that all gc objects are allocated from.
+  Arena arena;
   /// The text (string) intern pool. All texts created are interned
-  /// and added to this pool. (Only the keys in this table are used,
-  /// so the values will all be `none` ThuslyValues.)
-  Table texts;
+  /// and added to this pool. The pool does not keep its texts alive,
+  /// unreachable texts are removed when collected.
+  InternSet texts;
+  /// The number of bytes currently allocated for gc objects (including
+  /// the memory they own, such as the chars of a text).
+  size_t bytes_allocated;
+  /// The heap size (in bytes) at which the next garbage collection runs.
+  size_t next_gc;
+  /// The objects marked during a collection whose references are yet to be traced.
+  GCObject** gray_stack;
+  int gray_count;
+  int gray_capacity;
+  GCStats gc_stats;
 } Environment;
 
+/// Runtime counters of the VM (shown with the `--stats` flag).
+typedef struct {
+  /// The number of generic instructions rewritten into a type-specialized form.
+  uint64_t specializations;
+  /// The number of executed type-specialized instructions whose type guard held.
+  uint64_t specialization_hits;
+  /// The number of executed type-specialized instructions whose type guard failed
+  /// (reverting the instruction to its generic form).
+  uint64_t specialization_misses;
+  /// The number of programs compiled into native code by the JIT (`--jit`).
+  uint64_t jit_compilations;
+  /// The number of programs the JIT could not compile (they were interpreted).
+  uint64_t jit_rejections;
+  /// The number of times JIT-compiled code exited to the interpreter due to a
+  /// failed type guard.
+  uint64_t jit_fallbacks;
+  /// The number of loop traces recorded (`--tracing`).
+  uint64_t traces_recorded;
+  /// The number of side traces recorded (continuing from a frequently failing guard).
+  uint64_t side_traces_recorded;
+  /// The number of trace recordings aborted (e.g. due to an unsupported instruction).
+  uint64_t trace_aborts;
+  /// The number of times a trace was entered.
+  uint64_t trace_entries;
+  /// The number of complete loop iterations run by traces.
+  uint64_t trace_iterations;
+  /// The number of literals compiled (each referring to a constant).
+  uint64_t constant_literals;
+  /// The number of constants added to the constant pool (equal literals share a constant).
+  uint64_t constants;
+  /// The number of instructions removed by constant folding (i.e. by evaluating
+  /// operations on constants at compile time).
+  uint64_t folded_instructions;
+  /// The number of blocks not compiled since their condition is a constant that
+  /// never runs them (e.g. `if false`). Their instructions count as folded.
+  uint64_t dead_branches;
+  /// The number of instructions removed by the peephole optimizer.
+  uint64_t peephole_removals;
+  /// The number of jumps threaded by the peephole optimizer (i.e. retargeted from a
+  /// jump to where that jump goes).
+  uint64_t threaded_jumps;
+  /// The number of loop-invariant expressions hoisted out of loops (`-O2`).
+  uint64_t hoisted_expressions;
+  /// The number of expressions replaced by an equal expression evaluated earlier (`-O2`).
+  uint64_t eliminated_subexpressions;
+  /// The number of assignments removed since the value assigned is never read (`-O2`).
+  uint64_t removed_stores;
+  /// The number of variables removed since they are never read (`-O2`).
+  uint64_t removed_variables;
+  /// The number of bytecode instructions translated into register instructions
+  /// (`--engine=reg`).
+  uint64_t translated_instructions;
+  /// The number of register instructions translated from the bytecode.
+  uint64_t register_instructions;
+  /// The number of instructions executed by the interpreter loop of either engine
+  /// (only counted with `--stats` when PROFILE_DISPATCH is defined, and not including
+  /// the instructions run by the JIT or by loop traces).
+  uint64_t executed_instructions;
+  /// The number of bytes of bytecode compiled.
+  uint64_t bytecode_size;
+  /// The number of bytes used by the line tables of the compiled bytecode.
+  uint64_t line_table_size;
+} VMStats;
+
 /// The virtual machine - Interprets and executes the instructions
 /// in the compiled program in a sequential order.
 typedef struct VM {
@@ -29,10 +119,17 @@ typedef struct VM {
   byte* next_instruction;
   /// The last-in-first-out (LIFO) operand stack used for the operands of the
   /// operators used, as well as for the result of an evaluated expression.
-  ThuslyValue stack[STACK_MAX];
+  /// It is grown before a program runs to fit the program's largest depth, and
+  /// never while it runs (so pointers into the stack stay valid while running).
+  ThuslyValue* stack;
+  /// The number of values the stack has room for.
+  int stack_capacity;
   /// The next slot for the top of the stack.
   /// (When pointing to the zeroth element, the stack is empty.)
   ThuslyValue* next_stack_top;
+  /// The hot loop traces of the program being run.
+  TraceCache traces;
+  VMStats stats;
 } VM;
 
 /// The error report from interpreting the source file, used
@@ -41,10 +138,17 @@ typedef enum {
   REPORT_NO_ERROR,
   REPORT_COMPILE_ERROR,
   REPORT_RUNTIME_ERROR,
+  /// A file could not be written (e.g. a bytecode file).
+  REPORT_IO_ERROR,
 } ErrorReport;
 
 void vm_init(VM* vm);
 void vm_free(VM* vm);
+void vm_print_stats(VM* vm, FILE* fout);
+void vm_runtime_error(VM* vm, int instruction_offset, const char* message, ...);
+void flatten_stack_top(VM* vm, int count);
 ErrorReport interpret(VM* vm, const char* source);
+ErrorReport interpret_bytecode_file(VM* vm, struct BytecodeFile* file);
+ErrorReport compile_to_bytecode_file(VM* vm, const char* source, const char* path);
 
 #endif